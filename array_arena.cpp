@@ -0,0 +1,319 @@
+#include "array_arena.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+// kernels are also built for AVX-512 and AVX2, and the version
+// for the processor is picked when program is loaded
+#if defined(__x86_64__) && defined(__GNUC__)
+#define KERNEL_TARGETS __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define KERNEL_TARGETS
+#endif
+
+// Elements are aligned to vector size, so whole vectors are loaded
+// and stored in place; elements of the tail go one by one
+#define BINARY_KERNEL(name, T, V, op)                                 \
+  KERNEL_TARGETS void name(T* dst, const T* a, const T* b, int64_t n) { \
+    int64_t i = 0;                                                    \
+    for (; i + VECTOR_LENGTH <= n; i += VECTOR_LENGTH) {              \
+      *(V*) (dst + i) = *(const V*) (a + i) op *(const V*) (b + i);   \
+    }                                                                 \
+    for (; i < n; ++i) {                                              \
+      dst[i] = a[i] op b[i];                                          \
+    }                                                                 \
+  }
+
+#define SCALE_KERNEL(name, T, V)                                      \
+  KERNEL_TARGETS void name(T* dst, const T* a, T k, int64_t n) {      \
+    V factor = V() + k;                                               \
+    int64_t i = 0;                                                    \
+    for (; i + VECTOR_LENGTH <= n; i += VECTOR_LENGTH) {              \
+      *(V*) (dst + i) = *(const V*) (a + i) * factor;                 \
+    }                                                                 \
+    for (; i < n; ++i) {                                              \
+      dst[i] = a[i] * k;                                              \
+    }                                                                 \
+  }
+
+// Lanes keep partial sums, which are added up at the end,
+// so double sum may differ from sequential one in the last bits
+#define SUM_KERNEL(name, T, V)                                        \
+  KERNEL_TARGETS T name(const T* a, int64_t n) {                      \
+    V sums = V();                                                     \
+    int64_t i = 0;                                                    \
+    for (; i + VECTOR_LENGTH <= n; i += VECTOR_LENGTH) {              \
+      sums += *(const V*) (a + i);                                    \
+    }                                                                 \
+    T sum = 0;                                                        \
+    for (int64_t lane = 0; lane < VECTOR_LENGTH; ++lane) {            \
+      sum += sums[lane];                                              \
+    }                                                                 \
+    for (; i < n; ++i) {                                              \
+      sum += a[i];                                                    \
+    }                                                                 \
+    return sum;                                                       \
+  }
+
+#define DOT_KERNEL(name, T, V)                                        \
+  KERNEL_TARGETS T name(const T* a, const T* b, int64_t n) {          \
+    V sums = V();                                                     \
+    int64_t i = 0;                                                    \
+    for (; i + VECTOR_LENGTH <= n; i += VECTOR_LENGTH) {              \
+      sums += *(const V*) (a + i) * *(const V*) (b + i);              \
+    }                                                                 \
+    T sum = 0;                                                        \
+    for (int64_t lane = 0; lane < VECTOR_LENGTH; ++lane) {            \
+      sum += sums[lane];                                              \
+    }                                                                 \
+    for (; i < n; ++i) {                                              \
+      sum += a[i] * b[i];                                             \
+    }                                                                 \
+    return sum;                                                       \
+  }
+
+// Array must not be empty
+#define SELECT_KERNEL(name, T, V, op)                                 \
+  KERNEL_TARGETS T name(const T* a, int64_t n) {                      \
+    T best = a[0];                                                    \
+    int64_t i = 0;                                                    \
+    if (n >= VECTOR_LENGTH) {                                         \
+      V bests = *(const V*) a;                                        \
+      for (i = VECTOR_LENGTH; i + VECTOR_LENGTH <= n; i += VECTOR_LENGTH) { \
+        V x = *(const V*) (a + i);                                    \
+        bests = x op bests ? x : bests;                               \
+      }                                                               \
+      for (int64_t lane = 0; lane < VECTOR_LENGTH; ++lane) {          \
+        best = bests[lane] op best ? bests[lane] : best;              \
+      }                                                               \
+    }                                                                 \
+    for (; i < n; ++i) {                                              \
+      best = a[i] op best ? a[i] : best;                              \
+    }                                                                 \
+    return best;                                                      \
+  }
+
+namespace mathvm {
+
+namespace {
+
+const int64_t VECTOR_LENGTH = constants::ARRAY_ALIGNMENT / sizeof(int64_t);
+
+typedef int64_t IntVector __attribute__((vector_size(constants::ARRAY_ALIGNMENT)));
+typedef double DoubleVector __attribute__((vector_size(constants::ARRAY_ALIGNMENT)));
+
+BINARY_KERNEL(addInts, int64_t, IntVector, +)
+BINARY_KERNEL(subInts, int64_t, IntVector, -)
+BINARY_KERNEL(mulInts, int64_t, IntVector, *)
+BINARY_KERNEL(addDoubles, double, DoubleVector, +)
+BINARY_KERNEL(subDoubles, double, DoubleVector, -)
+BINARY_KERNEL(mulDoubles, double, DoubleVector, *)
+SCALE_KERNEL(scaleInts, int64_t, IntVector)
+SCALE_KERNEL(scaleDoubles, double, DoubleVector)
+SUM_KERNEL(sumInts, int64_t, IntVector)
+SUM_KERNEL(sumDoubles, double, DoubleVector)
+DOT_KERNEL(dotInts, int64_t, IntVector)
+DOT_KERNEL(dotDoubles, double, DoubleVector)
+SELECT_KERNEL(minInts, int64_t, IntVector, <)
+SELECT_KERNEL(minDoubles, double, DoubleVector, <)
+SELECT_KERNEL(maxInts, int64_t, IntVector, >)
+SELECT_KERNEL(maxDoubles, double, DoubleVector, >)
+
+template<typename T>
+uint64_t word(T value) {
+  uint64_t result;
+  memcpy(&result, &value, sizeof(result));
+  return result;
+}
+
+void checkSameShape(const Array& a, const Array& b) {
+  if (a.type != b.type) {
+    throw InterpreterException("Arrays are %s and %s", typeToName(a.type), typeToName(b.type));
+  }
+
+  if (a.length != b.length) {
+    throw InterpreterException("Arrays have %ld and %ld elements",
+                               (long) a.length, (long) b.length);
+  }
+}
+
+} // namespace
+
+ArrayArena::~ArrayArena() {
+  for (size_t i = 0; i < blocks_.size(); ++i) {
+    free(blocks_[i]);
+  }
+}
+
+int64_t ArrayArena::allocate(VarType type, int64_t length) {
+  if (length < 0) {
+    throw InterpreterException("Array length %ld is negative", (long) length);
+  }
+
+  if (static_cast<uint64_t>(length) > (SIZE_MAX - constants::ARRAY_ALIGNMENT) / sizeof(int64_t)) {
+    throw InterpreterException("Array of %ld elements is too big", (long) length);
+  }
+
+  size_t size = (length * sizeof(int64_t) + constants::ARRAY_ALIGNMENT - 1)
+                & ~(constants::ARRAY_ALIGNMENT - 1);
+  void* data;
+
+  if (size > constants::MAX_CHUNKED_ARRAY_SIZE) {
+    data = allocateBlock(size);
+  } else {
+    if (size > left_) {
+      free_ = static_cast<char*>(allocateBlock(constants::ARENA_CHUNK_SIZE));
+      left_ = constants::ARENA_CHUNK_SIZE;
+    }
+
+    data = free_;
+    free_ += size;
+    left_ -= size;
+  }
+
+  memset(data, 0, size);
+  Array array = { data, length, type };
+  arrays_.push_back(array);
+  return arrays_.size();
+}
+
+void* ArrayArena::allocateBlock(size_t size) {
+  void* memory = 0;
+
+  if (posix_memalign(&memory, constants::ARRAY_ALIGNMENT, std::max<size_t>(size, 1)) != 0) {
+    throw InterpreterException("Could not allocate %lu bytes for array", (unsigned long) size);
+  }
+
+  blocks_.push_back(memory);
+  return memory;
+}
+
+uint16_t ArrayArena::argumentsNumber(ArrayOp op) {
+  switch (op) {
+    case AOP_IDOT: case AOP_DDOT:
+      return 2;
+    default:
+      return op < AOP_ISUM ? 3 : 1;
+  }
+}
+
+bool ArrayArena::hasResult(ArrayOp op) {
+  return op >= AOP_ISUM;
+}
+
+// Operation goes over elements of its first source array
+uint64_t ArrayArena::elementsNumber(ArrayOp op, const uint64_t* args) const {
+  return array(args[op < AOP_ISUM ? 1 : 0]).length;
+}
+
+uint64_t ArrayArena::run(ArrayOp op, const uint64_t* args, uint64_t* result) const {
+  const Array& a = array(args[op < AOP_ISUM ? 1 : 0]);
+
+  switch (op) {
+    case AOP_ADD:
+    case AOP_SUB:
+    case AOP_MUL: {
+      const Array& dst = array(args[0]);
+      const Array& b = array(args[2]);
+      checkSameShape(dst, a);
+      checkSameShape(dst, b);
+
+      if (dst.type == VT_INT) {
+        int64_t* d = static_cast<int64_t*>(dst.data);
+        const int64_t* x = static_cast<const int64_t*>(a.data);
+        const int64_t* y = static_cast<const int64_t*>(b.data);
+        switch (op) {
+          case AOP_ADD: addInts(d, x, y, a.length); break;
+          case AOP_SUB: subInts(d, x, y, a.length); break;
+          default:      mulInts(d, x, y, a.length); break;
+        }
+      } else {
+        double* d = static_cast<double*>(dst.data);
+        const double* x = static_cast<const double*>(a.data);
+        const double* y = static_cast<const double*>(b.data);
+        switch (op) {
+          case AOP_ADD: addDoubles(d, x, y, a.length); break;
+          case AOP_SUB: subDoubles(d, x, y, a.length); break;
+          default:      mulDoubles(d, x, y, a.length); break;
+        }
+      }
+      break;
+    }
+
+    case AOP_ISCALE:
+    case AOP_DSCALE: {
+      const Array& dst = array(args[0]);
+      checkSameShape(dst, a);
+
+      int64_t intFactor;
+      double doubleFactor;
+      memcpy(&intFactor, &args[2], sizeof(intFactor));
+      memcpy(&doubleFactor, &args[2], sizeof(doubleFactor));
+
+      if (op == AOP_ISCALE && a.type == VT_INT) {
+        scaleInts(static_cast<int64_t*>(dst.data), static_cast<const int64_t*>(a.data),
+                  intFactor, a.length);
+      } else {
+        checkType(a, VT_DOUBLE);
+        scaleDoubles(static_cast<double*>(dst.data), static_cast<const double*>(a.data),
+                     op == AOP_ISCALE ? intFactor : doubleFactor, a.length);
+      }
+      break;
+    }
+
+    case AOP_ISUM:
+      checkType(a, VT_INT);
+      *result = word(sumInts(static_cast<const int64_t*>(a.data), a.length));
+      break;
+    case AOP_DSUM:
+      checkType(a, VT_DOUBLE);
+      *result = word(sumDoubles(static_cast<const double*>(a.data), a.length));
+      break;
+
+    case AOP_IDOT:
+    case AOP_DDOT: {
+      const Array& b = array(args[1]);
+      checkType(a, op == AOP_IDOT ? VT_INT : VT_DOUBLE);
+      checkSameShape(a, b);
+
+      if (op == AOP_IDOT) {
+        *result = word(dotInts(static_cast<const int64_t*>(a.data),
+                               static_cast<const int64_t*>(b.data), a.length));
+      } else {
+        *result = word(dotDoubles(static_cast<const double*>(a.data),
+                                  static_cast<const double*>(b.data), a.length));
+      }
+      break;
+    }
+
+    case AOP_IMIN:
+    case AOP_IMAX:
+    case AOP_DMIN:
+    case AOP_DMAX: {
+      bool isInt = op == AOP_IMIN || op == AOP_IMAX;
+      bool isMin = op == AOP_IMIN || op == AOP_DMIN;
+      checkType(a, isInt ? VT_INT : VT_DOUBLE);
+
+      if (a.length == 0) {
+        throw InterpreterException(isMin ? "Minimum of empty array" : "Maximum of empty array");
+      }
+
+      if (isInt) {
+        const int64_t* x = static_cast<const int64_t*>(a.data);
+        *result = word(isMin ? minInts(x, a.length) : maxInts(x, a.length));
+      } else {
+        const double* x = static_cast<const double*>(a.data);
+        *result = word(isMin ? minDoubles(x, a.length) : maxDoubles(x, a.length));
+      }
+      break;
+    }
+
+    default:
+      throw InterpreterException("Unknown array operation %d", (int) op);
+  }
+
+  return a.length;
+}
+
+} // namespace mathvm
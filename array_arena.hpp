@@ -0,0 +1,130 @@
+#ifndef ARRAY_ARENA_HPP
+#define ARRAY_ARENA_HPP
+
+#include "mathvm.h"
+#include "errors.hpp"
+
+#include <vector>
+
+#include <stdint.h>
+
+namespace mathvm {
+
+namespace constants {
+  // small arrays are carved out of chunks, bigger ones get their own block
+  const size_t ARENA_CHUNK_SIZE = 1 << 20;
+  const size_t MAX_CHUNKED_ARRAY_SIZE = ARENA_CHUNK_SIZE / 4;
+  // elements start at cache line, so vector loads never split lines
+  const size_t ARRAY_ALIGNMENT = 64;
+}
+
+/*
+ * Bulk operations of BC_ARRAYOP (its immediate). Arguments are
+ * handles of arrays in order of builtin's parameters, destination
+ * first; elementwise operations need arrays of the same type and
+ * length and may write to one of their operands.
+ */
+enum ArrayOp {
+  AOP_ADD,    // (dst, a, b): dst[i] = a[i] + b[i]
+  AOP_SUB,    // (dst, a, b): dst[i] = a[i] - b[i]
+  AOP_MUL,    // (dst, a, b): dst[i] = a[i] * b[i]
+  AOP_ISCALE, // (dst, a, int k): dst[i] = a[i] * k
+  AOP_DSCALE, // (dst, a, double k): dst[i] = a[i] * k, doubles only
+  AOP_ISUM,   // (a): int sum
+  AOP_DSUM,   // (a): double sum
+  AOP_IMIN,   // (a): least int, array must not be empty
+  AOP_DMIN,
+  AOP_IMAX,
+  AOP_DMAX,
+  AOP_IDOT,   // (a, b): int sum of a[i] * b[i]
+  AOP_DDOT,
+  AOP_LAST
+};
+
+struct Array {
+  void* data;     // ARRAY_ALIGNMENT aligned
+  int64_t length;
+  VarType type;   // of elements, VT_INT or VT_DOUBLE
+};
+
+template<typename T> VarType elementType();
+template<> inline VarType elementType<int64_t>() { return VT_INT; }
+template<> inline VarType elementType<double>() { return VT_DOUBLE; }
+
+/*
+ * Arrays of program run by one interpreter. Program refers to array
+ * by int handle: index in table + 1, so 0 (value of variable never
+ * assigned) is not an array. Elements are zeroed when array is made.
+ * Arrays are never freed one by one: they all go with the arena,
+ * i.e. with interpreter.
+ * Bulk operations run over 8 elements at once and are built
+ * for AVX-512, AVX2 and baseline x86-64 (see array_arena.cpp).
+ */
+class ArrayArena {
+  std::vector<Array> arrays_;
+  std::vector<void*> blocks_;
+  char* free_;   // rest of the last chunk
+  size_t left_;
+
+public:
+  ArrayArena() : free_(0), left_(0) {}
+  ~ArrayArena();
+
+  // Returns handle of new array
+  int64_t allocate(VarType type, int64_t length);
+
+  // Throws InterpreterException unless handle is of array
+  const Array& array(int64_t handle) const {
+    if (static_cast<uint64_t>(handle - 1) >= arrays_.size()) {
+      throw InterpreterException("%ld is not an array", (long) handle);
+    }
+
+    return arrays_[handle - 1];
+  }
+
+  template<typename T>
+  T* element(int64_t handle, int64_t index) const {
+    const Array& a = array(handle);
+    checkType(a, elementType<T>());
+
+    if (static_cast<uint64_t>(index) >= static_cast<uint64_t>(a.length)) {
+      throw InterpreterException("Index %ld is out of bounds of array of %ld elements",
+                                 (long) index, (long) a.length);
+    }
+
+    return static_cast<T*>(a.data) + index;
+  }
+
+  // Handle and index are known to be valid
+  template<typename T>
+  T* elementInBounds(int64_t handle, int64_t index) const {
+    const Array& a = arrays_[handle - 1];
+    checkType(a, elementType<T>());
+    return static_cast<T*>(a.data) + index;
+  }
+
+  // args are words of arguments; returns number of elements
+  // processed, *result gets word of result if operation has one
+  uint64_t run(ArrayOp op, const uint64_t* args, uint64_t* result) const;
+  // Number of elements run would process, known before it runs
+  uint64_t elementsNumber(ArrayOp op, const uint64_t* args) const;
+
+  static uint16_t argumentsNumber(ArrayOp op);
+  static bool hasResult(ArrayOp op);
+
+private:
+  ArrayArena(const ArrayArena&);
+  ArrayArena& operator=(const ArrayArena&);
+
+  void* allocateBlock(size_t size);
+
+  static void checkType(const Array& a, VarType type) {
+    if (a.type != type) {
+      throw InterpreterException("Array is %s, not %s", typeToName(a.type), typeToName(type));
+    }
+  }
+};
+
+} // namespace mathvm
+
+#endif
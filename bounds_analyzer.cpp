@@ -0,0 +1,85 @@
+#include "bounds_analyzer.hpp"
+#include "builtins.hpp"
+
+namespace mathvm {
+
+BoundsAnalyzer::BoundsAnalyzer(ForNode* node, Scope* scope)
+  : index_(node->var()),
+    array_(0),
+    scope_(scope),
+    isProven_(false)
+{
+  AstNode* inExpr = node->inExpr();
+
+  if (!inExpr->isBinaryOpNode() || inExpr->asBinaryOpNode()->kind() != tRANGE) {
+    return;
+  }
+
+  BinaryOpNode* range = inExpr->asBinaryOpNode();
+  AstNode* first = range->left();
+
+  if (!first->isIntLiteralNode() || first->asIntLiteralNode()->literal() < 0) {
+    return;
+  }
+
+  array_ = boundedArray(range->right());
+  isProven_ = array_ != 0 && array_ != index_;
+
+  if (isProven_) {
+    node->body()->visit(this);
+  }
+}
+
+// Array a if limit is length(a) - k, k >= 1
+const AstVar* BoundsAnalyzer::boundedArray(AstNode* limit) {
+  if (!limit->isBinaryOpNode() || limit->asBinaryOpNode()->kind() != tSUB) {
+    return 0;
+  }
+
+  AstNode* length = limit->asBinaryOpNode()->left();
+  AstNode* k = limit->asBinaryOpNode()->right();
+
+  if (!k->isIntLiteralNode() || k->asIntLiteralNode()->literal() < 1 
+      || !length->isCallNode()) {
+    return 0;
+  }
+
+  CallNode* call = length->asCallNode();
+  const Builtin* builtin = findBuiltin(call->name(), scope_);
+
+  if (!builtin || builtin->insn != BC_ALENGTH || call->parametersNumber() != 1
+      || !call->parameterAt(0)->isLoadNode()) {
+    return 0;
+  }
+
+  return call->parameterAt(0)->asLoadNode()->var();
+}
+
+// Function declared in body could hide builtin
+void BoundsAnalyzer::check(BlockNode* node) {
+  if (node->scope()->functionsCount() != 0) {
+    isProven_ = false;
+  }
+}
+
+void BoundsAnalyzer::check(StoreNode* node) {
+  checkAssigned(node->var());
+}
+
+void BoundsAnalyzer::check(ForNode* node) {
+  checkAssigned(node->var());
+}
+
+void BoundsAnalyzer::check(CallNode* node) {
+  if (!findBuiltin(node->name(), scope_)) {
+    isProven_ = false;
+  }
+}
+
+void BoundsAnalyzer::checkAssigned(const AstVar* var) {
+  if (var == index_ || var == array_) {
+    isProven_ = false;
+  }
+}
+
+} // namespace mathvm
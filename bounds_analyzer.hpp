@@ -0,0 +1,54 @@
+#ifndef BOUNDS_ANALYZER_HPP
+#define BOUNDS_ANALYZER_HPP
+
+#include "ast.h"
+#include "mathvm.h"
+#include "visitors.h"
+
+namespace mathvm {
+
+/*
+ * Proves that loop variable of for loop is an index of array
+ * all the time body runs. Loop must be 
+ *   for (i in c..length(a) - k), c >= 0, k >= 1,
+ * and its body must neither assign i or a nor call functions 
+ * other than array builtins (nothing else could assign them).
+ * Array can't change length, so then getInt(a, i) and the like
+ * in body need no bounds check.
+ */
+class BoundsAnalyzer : public AstVisitor {
+  const AstVar* index_;
+  const AstVar* array_;
+  Scope* scope_;
+  bool isProven_;
+
+public:
+  // scope is where loop is
+  BoundsAnalyzer(ForNode* node, Scope* scope);
+
+  const AstVar* index() const { return index_; }
+  // 0 if loop is not proven to stay within array
+  const AstVar* array() const { return isProven_ ? array_ : 0; }
+
+#define VISITOR_FUNCTION(type, name)     \
+  virtual void visit##type(type* node) { \
+    check(node);                         \
+    node->visitChildren(this);           \
+  }
+
+  FOR_NODES(VISITOR_FUNCTION)
+#undef VISITOR_FUNCTION
+
+private:
+  void check(AstNode* node) {}
+  void check(BlockNode* node);
+  void check(StoreNode* node);
+  void check(ForNode* node);
+  void check(CallNode* node);
+  void checkAssigned(const AstVar* var);
+  const AstVar* boundedArray(AstNode* limit);
+};
+
+} // namespace mathvm
+
+#endif
@@ -0,0 +1,55 @@
+#include "builtins.hpp"
+#include "array_arena.hpp"
+
+namespace mathvm {
+
+static const Builtin BUILTINS[] = {
+  { "intArray", BC_NEWARRAY, BC_INVALID, VT_INT, VT_INT, 1, { VT_INT }, BC_INVALID },
+  { "doubleArray", BC_NEWARRAY, BC_INVALID, VT_DOUBLE, VT_INT, 1, { VT_INT }, BC_INVALID },
+  { "length", BC_ALENGTH, BC_INVALID, 0, VT_INT, 1, { VT_INT }, BC_INVALID },
+  { "getInt", BC_AILOAD, BC_AILOADNC, 0, VT_INT, 2, { VT_INT, VT_INT }, BC_INVALID },
+  { "getDouble", BC_ADLOAD, BC_ADLOADNC, 0, VT_DOUBLE, 2, { VT_INT, VT_INT }, BC_INVALID },
+  { "setInt", BC_AISTORE, BC_AISTORENC, 0, VT_VOID, 3, { VT_INT, VT_INT, VT_INT }, BC_INVALID },
+  { "setDouble", BC_ADSTORE, BC_ADSTORENC, 0, VT_VOID, 3, { VT_INT, VT_INT, VT_DOUBLE }, BC_INVALID },
+  { "addArrays", BC_ARRAYOP, BC_INVALID, AOP_ADD, VT_VOID, 3, { VT_INT, VT_INT, VT_INT }, BC_INVALID },
+  { "subArrays", BC_ARRAYOP, BC_INVALID, AOP_SUB, VT_VOID, 3, { VT_INT, VT_INT, VT_INT }, BC_INVALID },
+  { "mulArrays", BC_ARRAYOP, BC_INVALID, AOP_MUL, VT_VOID, 3, { VT_INT, VT_INT, VT_INT }, BC_INVALID },
+  { "scaleArray", BC_ARRAYOP, BC_INVALID, AOP_ISCALE, VT_VOID, 3, { VT_INT, VT_INT, VT_INVALID }, BC_INVALID },
+  { "sumInt", BC_ARRAYOP, BC_INVALID, AOP_ISUM, VT_INT, 1, { VT_INT }, BC_INVALID },
+  { "sumDouble", BC_ARRAYOP, BC_INVALID, AOP_DSUM, VT_DOUBLE, 1, { VT_INT }, BC_INVALID },
+  { "minInt", BC_ARRAYOP, BC_INVALID, AOP_IMIN, VT_INT, 1, { VT_INT }, BC_INVALID },
+  { "minDouble", BC_ARRAYOP, BC_INVALID, AOP_DMIN, VT_DOUBLE, 1, { VT_INT }, BC_INVALID },
+  { "maxInt", BC_ARRAYOP, BC_INVALID, AOP_IMAX, VT_INT, 1, { VT_INT }, BC_INVALID },
+  { "maxDouble", BC_ARRAYOP, BC_INVALID, AOP_DMAX, VT_DOUBLE, 1, { VT_INT }, BC_INVALID },
+  { "dotInt", BC_ARRAYOP, BC_INVALID, AOP_IDOT, VT_INT, 2, { VT_INT, VT_INT }, BC_INVALID },
+  { "dotDouble", BC_ARRAYOP, BC_INVALID, AOP_DDOT, VT_DOUBLE, 2, { VT_INT, VT_INT }, BC_INVALID },
+  { "readInt", BC_READ, BC_INVALID, VT_INT, VT_INT, 0, { }, BC_INVALID },
+  { "readDouble", BC_READ, BC_INVALID, VT_DOUBLE, VT_DOUBLE, 0, { }, BC_INVALID },
+  { "hasInput", BC_HASINPUT, BC_INVALID, 0, VT_INT, 0, { }, BC_INVALID },
+  { "readArray", BC_READARRAY, BC_INVALID, 0, VT_INT, 1, { VT_INT }, BC_INVALID },
+  { "inputInt", BC_INPUTAT, BC_INVALID, VT_INT, VT_INT, 1, { VT_INT }, BC_INVALID },
+  { "inputDouble", BC_INPUTAT, BC_INVALID, VT_DOUBLE, VT_DOUBLE, 1, { VT_INT }, BC_INVALID },
+  { "inputLength", BC_INPUTLENGTH, BC_INVALID, 0, VT_INT, 0, { }, BC_INVALID },
+  { "sqrt", BC_DSQRT, BC_INVALID, 0, VT_DOUBLE, 1, { VT_DOUBLE }, BC_INVALID },
+  { "sin", BC_DSIN, BC_INVALID, 0, VT_DOUBLE, 1, { VT_DOUBLE }, BC_INVALID },
+  { "cos", BC_DCOS, BC_INVALID, 0, VT_DOUBLE, 1, { VT_DOUBLE }, BC_INVALID },
+  { "exp", BC_DEXP, BC_INVALID, 0, VT_DOUBLE, 1, { VT_DOUBLE }, BC_INVALID },
+  { "log", BC_DLOG, BC_INVALID, 0, VT_DOUBLE, 1, { VT_DOUBLE }, BC_INVALID },
+  { "floor", BC_DFLOOR, BC_INVALID, 0, VT_DOUBLE, 1, { VT_DOUBLE }, BC_INVALID },
+  { "pow", BC_DPOW, BC_INVALID, 0, VT_DOUBLE, 2, { VT_DOUBLE, VT_DOUBLE }, BC_INVALID },
+  { "abs", BC_IABS, BC_INVALID, 0, VT_INT, 1, { VT_INVALID }, BC_DABS },
+  { "min", BC_IMIN, BC_INVALID, 0, VT_INT, 2, { VT_INVALID, VT_INVALID }, BC_DMIN },
+  { "max", BC_IMAX, BC_INVALID, 0, VT_INT, 2, { VT_INVALID, VT_INVALID }, BC_DMAX }
+};
+
+const Builtin* findBuiltin(const std::string& name, Scope* scope) {
+  for (size_t i = 0; i < sizeof(BUILTINS) / sizeof(BUILTINS[0]); ++i) {
+    if (name == BUILTINS[i].name) {
+      return scope->lookupFunction(name) ? 0 : &BUILTINS[i];
+    }
+  }
+
+  return 0;
+}
+
+} // namespace mathvm
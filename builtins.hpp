@@ -0,0 +1,59 @@
+#ifndef BUILTINS_HPP
+#define BUILTINS_HPP
+
+#include "ast.h"
+#include "mathvm.h"
+#include "instructions.hpp"
+
+#include <string>
+
+#include <stdint.h>
+
+namespace mathvm {
+
+/*
+ * Functions which programs call without declaring them, each is
+ * one instruction. Function of program with the same name hides builtin.
+ * Array is int handle (see ArrayArena), so arrays fit types 
+ * of the language:
+ *   int intArray(int length), int doubleArray(int length)
+ *   int length(int a)
+ *   int getInt(int a, int i), double getDouble(int a, int i)
+ *   void setInt(int a, int i, int value), void setDouble(int a, int i, double value)
+ *   void addArrays(int dst, int a, int b), subArrays, mulArrays: elementwise
+ *   void scaleArray(int dst, int a, k): k is int or double
+ *   int sumInt(int a), double sumDouble(int a), minInt, minDouble, maxInt, maxDouble
+ *   int dotInt(int a, int b), double dotDouble(int a, int b)
+ * Input of interpreter (see InputStream) is read with:
+ *   int readInt(), double readDouble(): next value
+ *   int hasInput(): 1 if there's next value
+ *   int readArray(int a): fills array with next values, returns their number
+ *   int inputInt(int i), double inputDouble(int i), int inputLength():
+ *     values of binary input by index
+ * Math functions work right on operand stack, so optimizer
+ * folds them as arithmetic:
+ *   double sqrt(double x), sin, cos, exp, log, floor
+ *   double pow(double x, double y)
+ *   abs(x), min(x, y), max(x, y): int if arguments are int, double otherwise
+ */
+struct Builtin {
+  const char* name;
+  Instruction insn;
+  // BC_INVALID unless builtin accesses element a[i], 
+  // a and i are its first parameters
+  Instruction inBoundsInsn;
+  uint16_t immediate;  // of instruction which has one
+  VarType returnType;
+  uint16_t parametersNumber;
+  VarType parameterTypes[3]; // VT_INVALID - int or double, not cast
+  // BC_INVALID unless builtin takes ints or doubles alike: insn and
+  // returnType are then for ints, and this is instruction for doubles
+  Instruction doubleInsn;
+};
+
+// 0 if there's no such builtin or function visible in scope hides it
+const Builtin* findBuiltin(const std::string& name, Scope* scope);
+
+} // namespace mathvm
+
+#endif
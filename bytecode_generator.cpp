@@ -1,34 +1,291 @@
 #include "bytecode_generator.hpp"
+#include "array_arena.hpp"
+#include "bounds_analyzer.hpp"
 #include "errors.hpp"
 #include "info.hpp"
+#include "inline_analyzer.hpp"
+#include "type_analyzer.hpp"
 #include "translation_utils.hpp"
 #include "utils.hpp"
 
+#include <algorithm>
 #include <iostream>
+#include <map>
 #include <utility>
 
 #include <cstdlib>
 #include <cassert>
 
+#include <pthread.h>
+#include <unistd.h>
+
 namespace mathvm {
 
+GeneratorOptions& GeneratorOptions::global() {
+  static GeneratorOptions options;
+  return options;
+}
+
+BytecodeGenerator::BytecodeGenerator(Parser* parser, 
+                                     InterpreterCodeImpl* code, 
+                                     const GeneratorOptions& options)
+  : parser_(parser),
+    top_(parser->top()), 
+    code_(code),
+    constants_(new ConstantPool(code)),
+    context_(code),
+    options_(options),
+    inlineDepth_(0) {} 
+
+BytecodeGenerator::BytecodeGenerator(const BytecodeGenerator* owner)
+  : parser_(0),
+    top_(owner->top_), 
+    code_(owner->code_),
+    constants_(owner->constants_),
+    context_(owner->code_),
+    options_(owner->options_),
+    inlineDepth_(0),
+    asts_(owner->asts_),
+    parents_(owner->parents_) {} 
+
+BytecodeGenerator::~BytecodeGenerator() {
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    delete workers_[i];
+  }
+
+  if (parser_) {
+    delete constants_;
+    delete parser_;
+  }
+}
+
 Status* BytecodeGenerator::generate() {
-  ctx()->addFunction(top_);
+  ctx()->addFunction(top_, 0);
+  asts_.push_back(top_);
+  parents_.push_back(0);
+  declare(top_->node()->body()->scope(), 0);
+
   visit(top_);
   return Status::Ok();
 }
 
+void BytecodeGenerator::generate(uint16_t id) {
+  if (ctx()->functionById(id)->isGenerated()) {
+    return;
+  }
+
+  generate(parents_[id]);
+  visit(asts_[id]);
+}
+
+namespace {
+
+/*
+ * Bodies left for worker generators, ordered by deepness, so enclosing
+ * function is always taken before nested one. Worker taking nested 
+ * function waits until enclosing one is generated.
+ */
+struct BodyQueue {
+  std::vector<uint16_t> ids;
+  const std::vector<uint16_t>* parents;
+  std::vector<bool> isGenerated; // by function id
+  size_t next;
+  TranslationException* translationError;
+  InternalException* internalError;
+  pthread_mutex_t lock;
+  pthread_cond_t generated;
+
+  explicit BodyQueue(const std::vector<uint16_t>* parents)
+    : parents(parents),
+      next(0),
+      translationError(0),
+      internalError(0) {
+    pthread_mutex_init(&lock, 0);
+    pthread_cond_init(&generated, 0);
+  }
+
+  ~BodyQueue() {
+    delete translationError;
+    delete internalError;
+    pthread_cond_destroy(&generated);
+    pthread_mutex_destroy(&lock);
+  }
+
+  bool isFailed() const {
+    return translationError || internalError;
+  }
+};
+
+struct Worker {
+  BodyGenerator* generator;
+  BodyQueue* queue;
+  pthread_t thread;
+};
+
+// First error stops all workers
+void* generateBodies(void* argument) {
+  Worker* worker = static_cast<Worker*>(argument);
+  BodyQueue* queue = worker->queue;
+  pthread_mutex_lock(&queue->lock);
+
+  while (!queue->isFailed() && queue->next < queue->ids.size()) {
+    uint16_t id = queue->ids[queue->next++];
+    uint16_t parent = (*queue->parents)[id];
+
+    while (!queue->isGenerated[parent] && !queue->isFailed()) {
+      pthread_cond_wait(&queue->generated, &queue->lock);
+    }
+    if (queue->isFailed()) {
+      break;
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+    TranslationException* translationError = 0;
+    InternalException* internalError = 0;
+
+    try {
+      worker->generator->generate(id);
+    } catch (TranslationException& e) {
+      translationError = new TranslationException(e);
+    } catch (InternalException& e) {
+      internalError = new InternalException(e);
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    queue->isGenerated[id] = true;
+    if (!queue->isFailed()) {
+      queue->translationError = translationError;
+      queue->internalError = internalError;
+    } else {
+      delete translationError;
+      delete internalError;
+    }
+    pthread_cond_broadcast(&queue->generated);
+  }
+
+  pthread_mutex_unlock(&queue->lock);
+  return 0;
+}
+
+} // namespace
+
+/*
+ * Inline sizes and types of nodes are computed here, so workers only 
+ * read shared ast. Bodies generated before (top level and what it 
+ * inlines) are typed already. The calling thread is a worker too,
+ * so bodies are generated even if no thread starts.
+ */
+void BytecodeGenerator::generateAll() {
+  BodyQueue queue(&parents_);
+  std::vector<std::vector<uint16_t> > byDeepness;
+
+  for (uint16_t id = 0; id < asts_.size(); ++id) {
+    InterpreterFunction* function = ctx()->functionById(id);
+    queue.isGenerated.push_back(function->isGenerated());
+
+    if (!function->isGenerated()) {
+      byDeepness.resize(std::max<size_t>(byDeepness.size(), function->deepness() + 1));
+      byDeepness[function->deepness()].push_back(id);
+    }
+
+    if (!function->isGenerated()) {
+      TypeAnalyzer analyzer(asts_[id]);
+    }
+
+    FunctionInfo* info = getInfo<FunctionInfo>(asts_[id]);
+    if ((options_.inlineThreshold > 0 || options_.profile) && !info->hasInlineSize()) {
+      info->setInlineSize(InlineAnalyzer(asts_[id]).inlineSize());
+    }
+  }
+
+  for (size_t i = 0; i < byDeepness.size(); ++i) {
+    queue.ids.insert(queue.ids.end(), byDeepness[i].begin(), byDeepness[i].end());
+  }
+
+  long processors = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t threadsNumber = options_.threadsNumber > 0 ? options_.threadsNumber 
+                         : static_cast<size_t>(std::max(processors, 1L));
+  threadsNumber = std::max<size_t>(std::min(threadsNumber, queue.ids.size()), 1);
+
+  std::vector<Worker> workers(threadsNumber);
+  std::vector<bool> isStarted(threadsNumber, false);
+
+  for (size_t i = 0; i < threadsNumber; ++i) {
+    workers_.push_back(new BytecodeGenerator(this));
+    workers[i].generator = workers_.back();
+    workers[i].queue = &queue;
+
+    if (i > 0) {
+      isStarted[i] = pthread_create(&workers[i].thread, 0, generateBodies, &workers[i]) == 0;
+    }
+  }
+
+  generateBodies(&workers[0]);
+
+  for (size_t i = 1; i < threadsNumber; ++i) {
+    if (isStarted[i]) {
+      pthread_join(workers[i].thread, 0);
+    }
+  }
+
+  if (queue.translationError) {
+    throw TranslationException(*queue.translationError);
+  }
+  if (queue.internalError) {
+    throw InternalException(*queue.internalError);
+  }
+}
+
+/*
+ * Adds functions declared in scope and all scopes nested into it.
+ * Parameters scope of function is child of scope function is declared in,
+ * so children are either blocks of parent function or nested functions.
+ */
+void BytecodeGenerator::declare(Scope* scope, uint16_t parentId) {
+  uint16_t deepness = ctx()->functionById(parentId)->deepness() + 1;
+  std::map<Scope*, uint16_t> functionScopes;
+
+  Scope::FunctionIterator it(scope);
+  while (it.hasNext()) {
+    AstFunction* function = it.next();
+    ctx()->addFunction(function, deepness);
+    functionScopes[function->scope()] = ctx()->getId(function);
+    asts_.push_back(function);
+    parents_.push_back(parentId);
+    assert(asts_.size() == ctx()->getId(function) + 1u);
+  }
+
+  for (uint32_t i = 0; i < scope->childScopeNumber(); ++i) {
+    Scope* child = scope->childScopeAt(i);
+    std::map<Scope*, uint16_t>::const_iterator function = functionScopes.find(child);
+    declare(child, function == functionScopes.end() ? parentId : function->second);
+  }
+}
+
 void BytecodeGenerator::visit(AstFunction* function) {
   ctx()->enterFunction(function);
+  functions_.push_back(FunctionFrame(function, 0));
+  // left by function which failed to generate
+  pending_.clear();
   
   if (!isTopLevel(function)) { 
     parameters(function);
   } 
 
   visit(function->node());
+
+  if (!isTopLevel(function)) { 
+    ctx()->exitScope();
+  }
+
+  assert(pending_.empty());
+  ctx()->currentFunction()->setGenerated();
+  functions_.pop_back();
   ctx()->exitFunction();
 }
 
+// Parameters scope is left entered: parameters must live 
+// as long as function body, so caller exits it after body
 void BytecodeGenerator::parameters(AstFunction* function) {
   Scope* scope = function->scope();
   ctx()->enterScope(scope);
@@ -40,41 +297,22 @@ void BytecodeGenerator::parameters(AstFunction* function) {
   for (int64_t i = parametersNumber - 1; i >= 0; --i) {
     const std::string& name = function->parameterName(i);
     AstVar* param = findVariable(name, scope, node);
-    VarInfo* info = getInfo<VarInfo>(param);
+    VarInfo* info = ctx()->varInfo(param);
     
-    Instruction insn;
-    switch (param->type()) {
-      case VT_INT:    insn = BC_STOREIVAR; break;
-      case VT_DOUBLE: insn = BC_STOREDVAR; break;
-      default:
-        throw TranslationException(node, "Function %s has parameter with Illegal type: %s", 
-                                   function->name().c_str(), typeToName(param->type()));
+    if (!isNumeric(param->type())) {
+      throw TranslationException(node, "Function %s has parameter with Illegal type: %s", 
+                                 function->name().c_str(), typeToName(param->type()));
     }
 
-    bc()->addInsn(insn);
-    bc()->addUInt16(info->localId());
+    storeVar(param->type(), info->localId(), 0, tASSIGN, bc());
   }
-
-  ctx()->exitScope();
 }
 
 void BytecodeGenerator::visit(Scope* scope) {
   Scope::VarIterator varIt(scope);
   while (varIt.hasNext()) {
     AstVar* var = varIt.next();
-    ctx()->declare(var);
-  }
-
-  // Functions can call other functions defined
-  // later in same scope, so add them before visit
-  Scope::FunctionIterator addFunIt(scope);
-  while (addFunIt.hasNext()) {
-    ctx()->addFunction(addFunIt.next()); 
-  }
-
-  Scope::FunctionIterator funIt(scope);
-  while (funIt.hasNext()) {
-    visit(funIt.next()); 
+    ctx()->declare(var, inlineDepth_ > 0);
   }
 }
 
@@ -98,13 +336,107 @@ void BytecodeGenerator::visit(BlockNode* block) {
     if (hasNonEmptyStack(statement)) {
       bc()->addInsn(BC_POP);
     } 
+
+    addIslands();
   }
 
   ctx()->exitScope();
 }
 
+/*
+ * Bytecode::addBranch only has two-byte offsets, so branches 
+ * are added here. Backward branch takes the form its offset needs.
+ * Forward branch takes short form and is patched when its label
+ * is bound; until then it is pending, and one getting out of reach
+ * of int16_t offset is given a jump island.
+ */
+void BytecodeGenerator::addBranch(Instruction insn, Label& target) {
+  uint32_t position = bc()->current();
+
+  if (!target.isBound()) {
+    bc()->addInsn(insn);
+    bc()->addInt16(0);
+    pending_.push_back(PendingBranch(position, &target, false));
+    return;
+  }
+
+  int32_t offset = target.offsetOf(position + 1);
+
+  if (offset == static_cast<int16_t>(offset)) {
+    bc()->addInsn(insn);
+    bc()->addInt16(static_cast<int16_t>(offset));
+  } else {
+    bc()->addInsn(longBranch(insn));
+    bc()->addInt32(offset);
+  }
+}
+
+void BytecodeGenerator::bind(Label& label) {
+  bc()->bind(label);
+
+  for (size_t i = 0; i < pending_.size(); ) {
+    const PendingBranch& branch = pending_[i];
+
+    if (branch.target != &label) {
+      ++i;
+      continue;
+    }
+
+    int32_t offset = label.offsetOf(branch.position + 1);
+
+    if (branch.isLong) {
+      bc()->setInt32(branch.position + 1, offset);
+    } else if (offset == static_cast<int16_t>(offset)) {
+      bc()->setInt16(branch.position + 1, static_cast<int16_t>(offset));
+    } else {
+      throw InternalException("Function %s has statement too long to branch over", 
+                              ctx()->currentFunction()->name().c_str());
+    }
+
+    pending_.erase(pending_.begin() + i);
+  }
+}
+
+/*
+ * Island is a long jump to target of short forward branch,
+ * which is redirected to it. Islands are placed between statements,
+ * with a jump over them, when branch is ISLAND_DISTANCE behind, 
+ * so short offsets reach them unless statement is longer than
+ * INT16_MAX - ISLAND_DISTANCE bytes.
+ */
+void BytecodeGenerator::addIslands() {
+  std::vector<size_t> far;
+
+  for (size_t i = 0; i < pending_.size(); ++i) {
+    uint32_t distance = bc()->current() - pending_[i].position;
+
+    if (!pending_[i].isLong && distance > constants::ISLAND_DISTANCE) {
+      far.push_back(i);
+    }
+  }
+
+  if (far.empty()) {
+    return;
+  }
+
+  Label skip(bc());
+  addBranch(BC_JA, skip);
+
+  for (size_t i = 0; i < far.size(); ++i) {
+    PendingBranch& branch = pending_[far[i]];
+    uint32_t island = bc()->current();
+    bc()->setInt16(branch.position + 1, static_cast<int16_t>(island - (branch.position + 1)));
+    bc()->addInsn(BC_LJA);
+    bc()->addInt32(0);
+    branch.position = island;
+    branch.isLong = true;
+  }
+
+  bind(skip);
+}
+
 void BytecodeGenerator::visit(NativeCallNode* node) { 
-  uint16_t id = ctx()->addNativeFunction(node->nativeName(), node->nativeSignature(), 0);
+  uint16_t id = constants_->makeNativeFunction(node->nativeName(), node->nativeSignature(), 0);
   bc()->addInsn(BC_CALLNATIVE);
   bc()->addUInt16(id);
 }
@@ -134,56 +466,120 @@ void BytecodeGenerator::visit(ForNode* node) {
   uint16_t varId;
   uint16_t varContext;
   uint16_t endId = ctx()->declareTemporary();
-  Label begin(bc());
-  Label end(bc());
+  BoundsAnalyzer bounds(node, ctx()->currentScope());
 
   readVarInfo(var, varId, varContext, ctx());
   storeInt(range->left(), varId, varContext);
-  storeInt(range->right(), endId, 0);
-  
-  bc()->bind(begin);
-  loadVar(VT_INT, varId, varContext, bc());
-  loadVar(VT_INT, endId, 0, bc());
-  bc()->addBranch(BC_IFICMPL, end);
-  node->body()->visit(this);
 
-  bc()->addInsn(BC_ILOAD1);
-  loadVar(VT_INT, varId, varContext, bc());
-  storeVar(VT_INT, varId, varContext, tINCRSET, bc());
-  bc()->addBranch(BC_JA, begin);
-  bc()->bind(end);
+  if (bounds.array()) {
+    inBounds_.push_back(std::make_pair(bounds.index(), bounds.array()));
+  }
+
+  if (varContext == 0) {
+    countingLoop(node, varId, endId);
+  } else {
+    Label begin(bc());
+    Label end(bc());
+    storeInt(range->right(), endId, 0);
+    
+    bind(begin);
+    loadVar(VT_INT, varId, varContext, bc());
+    loadVar(VT_INT, endId, 0, bc());
+    addBranch(BC_IFICMPL, end);
+    node->body()->visit(this);
+
+    bc()->addInsn(BC_ILOAD1);
+    loadVar(VT_INT, varId, varContext, bc());
+    storeVar(VT_INT, varId, varContext, tINCRSET, bc());
+    addBranch(BC_JA, begin);
+    bind(end);
+  }
+
+  if (bounds.array()) {
+    inBounds_.pop_back();
+  }
+
+  ctx()->releaseTemporary(endId);
+}
+
+/*
+ * For loop over local variable: increment, 
+ * compare with limit and jump back are done by one instruction. 
+ * Counter is loop variable itself, so body can still change it.
+ */
+void BytecodeGenerator::countingLoop(ForNode* node, uint16_t varId, uint16_t endId) {
+  BinaryOpNode* range = static_cast<BinaryOpNode*>(node->inExpr());
+  Label body(bc());
+  Label end(bc());
+
+  range->right()->visit(this);
+  cast(range->right(), VT_INT, bc());
+  addBranch(BC_IFORPREP, end);
+  bc()->addUInt16(varId);
+  bc()->addUInt16(endId);
+
+  bind(body);
+  node->body()->visit(this);
+  addBranch(BC_IFORLOOP, body);
+  bc()->addUInt16(varId);
+  bc()->addUInt16(endId);
+  bind(end);
 }
 
 void BytecodeGenerator::visit(IfNode* node) { 
   Label otherwise(bc());
   Label end(bc());
 
-  node->ifExpr()->visit(this);
-  bc()->addInsn(BC_ILOAD0);
-  bc()->addBranch(BC_IFICMPE, otherwise);
+  jumpIfFalse(node->ifExpr(), otherwise);
   node->thenBlock()->visit(this);
-  bc()->addBranch(BC_JA, end);
+  addBranch(BC_JA, end);
   
-  bc()->bind(otherwise);
+  bind(otherwise);
   if (node->elseBlock()) {
     node->elseBlock()->visit(this);
   }
   
-  bc()->bind(end);
+  bind(end);
 }
 
 void BytecodeGenerator::visit(WhileNode* node) { 
   Label begin(bc());
   Label end(bc());
-  bc()->bind(begin);
-  node->whileExpr()->visit(this);
-
-  bc()->addInsn(BC_ILOAD0);
-  bc()->addBranch(BC_IFICMPE, end);
+  bind(begin);
+  jumpIfFalse(node->whileExpr(), end);
   node->loopBlock()->visit(this);
 
-  bc()->addBranch(BC_JA, begin);
-  bc()->bind(end);
+  addBranch(BC_JA, begin);
+  bind(end);
+}
+
+/*
+ * Comparison jumps on its operands right away, without making 0 or 1
+ * of them. Double comparison is false if operand is NaN, and so is 
+ * inverted one, so it jumps over the jump to target instead.
+ */
+void BytecodeGenerator::jumpIfFalse(AstNode* condition, Label& target) {
+  if (!isComparison(condition)) {
+    condition->visit(this);
+    bc()->addInsn(BC_ILOAD0);
+    addBranch(BC_IFICMPE, target);
+    return;
+  }
+
+  BinaryOpNode* op = condition->asBinaryOpNode();
+  op->visitChildren(this);
+  VarType operandsCommonType = castOperandsNumeric(op);
+  setType(op, VT_INT);
+
+  if (operandsCommonType == VT_INT) {
+    addBranch(comparisonBranch(op, operandsCommonType, true), target);
+    return;
+  }
+
+  Label isTrue(bc());
+  addBranch(comparisonBranch(op, operandsCommonType, false), isTrue);
+  addBranch(BC_JA, target);
+  bind(isTrue);
 }
 
 void BytecodeGenerator::visit(LoadNode* node) { 
@@ -232,9 +628,22 @@ void BytecodeGenerator::visit(PrintNode* node) {
 
 void BytecodeGenerator::visit(ReturnNode* node) { 
   AstNode* returnExpr = node->returnExpr();
+
+  if (functions_.back().inlineEnd) {
+    inlineReturn(node);
+    return;
+  }
   
-  if (returnExpr) {
+  if (returnExpr && returnExpr->isCallNode()) {
+    if (call(returnExpr->asCallNode(), true)) {
+      // called function returns directly to our caller
+      return;
+    }
+  } else if (returnExpr) {
     returnExpr->visit(this);
+  }
+
+  if (returnExpr) {
     cast(returnExpr, ctx()->currentFunction()->returnType(), bc());
   } else {
     bc()->addInsn(BC_ILOAD0);
@@ -243,7 +652,42 @@ void BytecodeGenerator::visit(ReturnNode* node) {
   bc()->addInsn(BC_RETURN); 
 }
 
+// Result of inlined function is left on stack and
+// execution continues after its body
+void BytecodeGenerator::inlineReturn(ReturnNode* node) {
+  AstNode* returnExpr = node->returnExpr();
+  FunctionFrame frame = functions_.back();
+
+  if (returnExpr) {
+    returnExpr->visit(this);
+    cast(returnExpr, frame.function->returnType(), bc());
+  } else {
+    bc()->addInsn(BC_ILOAD0);
+  }
+
+  addBranch(BC_JA, *frame.inlineEnd);
+}
+
 void BytecodeGenerator::visit(CallNode* node) { 
+  call(node, false);
+}
+
+/*
+ * Returns true if called function returns directly to caller 
+ * of current function, so no return is needed after call.
+ * Tail call replaces frame of current function, so it is only 
+ * possible when called function doesn't use that frame as its 
+ * parent frame (i.e. it is not nested into current function, 
+ * parentHops > 0) and result doesn't need a cast.
+ */
+bool BytecodeGenerator::call(CallNode* node, bool inTailPosition) {
+  const Builtin* builtin = findBuiltin(node->name(), ctx()->currentScope());
+
+  if (builtin) {
+    builtinCall(node, builtin);
+    return false;
+  }
+
   AstFunction* function = findFunction(node->name(), ctx()->currentScope(), node);
   
   if (node->parametersNumber() != function->parametersNumber()) {
@@ -256,15 +700,194 @@ void BytecodeGenerator::visit(CallNode* node) {
     cast(argument, function->parameterType(i), bc());
   }  
 
-  uint16_t calledFunctionId = ctx()->getId(function);
-  int32_t currentContext = ctx()->currentFunction()->deepness();
-  int32_t targetContext = ctx()->functionById(calledFunctionId)->deepness();
-  bc()->addInsn(BC_ILOAD);
-  bc()->addInt64(currentContext - targetContext);
-
-  bc()->addInsn(BC_CALL);
-  bc()->addUInt16(calledFunctionId);
+  FunctionInfo* called = getInfo<FunctionInfo>(function);
+  InterpreterFunction* current = ctx()->currentFunction();
   setType(node, function->returnType());
+
+  if (canInline(function)) {
+    bool returnsFromCurrent = inTailPosition && current->returnType() == function->returnType();
+    inlineCall(function, returnsFromCurrent);
+    return returnsFromCurrent;
+  }
+
+  // called function deepness is at most current deepness + 1
+  uint16_t parentHops = current->deepness() - called->deepness() + 1;
+  bool isTailCall = inTailPosition
+                    && !isTopLevel(current)
+                    && parentHops > 0
+                    && current->returnType() == function->returnType();
+
+  if (!isTailCall && isHotCall(function)) {
+    uint32_t offset = bc()->length();
+    inlineCall(function, false);
+    options_.profile->addInlinedCall(current->id(), offset, bc()->length() - offset);
+    return false;
+  }
+
+  bc()->addInsn(isTailCall ? BC_TAILCALL : BC_CALLCTX);
+  bc()->addUInt16(called->functionId());
+  bc()->addUInt16(parentHops);
+  return isTailCall;
+}
+
+/*
+ * Builtin is one instruction. Like any call, it leaves value 
+ * on stack, 0 if builtin is void.
+ */
+void BytecodeGenerator::builtinCall(CallNode* node, const Builtin* builtin) {
+  if (node->parametersNumber() != builtin->parametersNumber) {
+    throw TranslationException(node, "Invocation has wrong argument number");
+  }
+
+  uint16_t immediate = builtin->immediate;
+  bool hasDoubleArgument = false;
+
+  for (uint32_t i = 0; i < node->parametersNumber(); ++i) {
+    AstNode* argument = node->parameterAt(i);
+    argument->visit(this);
+
+    if (builtin->parameterTypes[i] != VT_INVALID) {
+      cast(argument, builtin->parameterTypes[i], bc());
+    } else if (!isNumeric(typeOf(argument))) {
+      throw TranslationException(argument, "Argument of %s must be int or double", 
+                                 builtin->name);
+    } else if (typeOf(argument) == VT_DOUBLE) {
+      hasDoubleArgument = true;
+      if (immediate == AOP_ISCALE) {
+        immediate = AOP_DSCALE;
+      }
+    }
+  }
+
+  Instruction insn = builtin->insn;
+  VarType returnType = builtin->returnType;
+
+  if (builtin->inBoundsInsn != BC_INVALID 
+      && isInBounds(node->parameterAt(0), node->parameterAt(1))) {
+    insn = builtin->inBoundsInsn;
+  }
+
+  // int arguments are cast as operands of arithmetic are,
+  // such builtins have at most two parameters
+  if (builtin->doubleInsn != BC_INVALID && hasDoubleArgument) {
+    for (uint32_t i = 0; i < node->parametersNumber(); ++i) {
+      if (typeOf(node->parameterAt(i)) != VT_INT) {
+        continue;
+      }
+
+      if (i + 1 < node->parametersNumber()) {
+        bc()->addInsn(BC_SWAP);
+        bc()->addInsn(BC_I2D);
+        bc()->addInsn(BC_SWAP);
+      } else {
+        bc()->addInsn(BC_I2D);
+      }
+    }
+
+    insn = builtin->doubleInsn;
+    returnType = VT_DOUBLE;
+  }
+
+  bc()->addInsn(insn);
+  if (instructionLength(insn) > 1) {
+    bc()->addUInt16(immediate);
+  }
+
+  if (returnType == VT_VOID) {
+    bc()->addInsn(BC_ILOAD0);
+  }
+
+  setType(node, returnType);
+}
+
+bool BytecodeGenerator::isInBounds(AstNode* array, AstNode* index) {
+  if (!array->isLoadNode() || !index->isLoadNode()) {
+    return false;
+  }
+
+  for (size_t i = 0; i < inBounds_.size(); ++i) {
+    if (inBounds_[i].first == index->asLoadNode()->var() 
+        && inBounds_[i].second == array->asLoadNode()->var()) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool BytecodeGenerator::canInline(AstFunction* function) {
+  if (options_.inlineThreshold == 0 || inlineDepth_ >= constants::MAX_INLINE_DEPTH) {
+    return false;
+  }
+
+  return isInlinable(function, options_.inlineThreshold);
+}
+
+/*
+ * Calls which make big share of all calls of recorded profile are 
+ * inlined even if function is bigger than inline threshold. 
+ * Only calls of function itself are, not those in inlined bodies,
+ * so the rest of its code is the same as when profile was recorded,
+ * and offsets of generated code map back to recorded ones.
+ */
+bool BytecodeGenerator::isHotCall(AstFunction* function) {
+  Profile* profile = options_.profile;
+
+  if (!profile || inlineDepth_ > 0 
+      || !isInlinable(function, constants::HOT_INLINE_THRESHOLD)) {
+    return false;
+  }
+
+  uint16_t id = ctx()->currentFunctionId();
+  return profile->isHotCall(id, profile->baselineOffset(id, bc()->length()), 
+                            getInfo<FunctionInfo>(function)->functionId());
+}
+
+bool BytecodeGenerator::isInlinable(AstFunction* function, uint32_t threshold) {
+  FunctionInfo* info = getInfo<FunctionInfo>(function);
+
+  if (!info->hasInlineSize()) {
+    info->setInlineSize(InlineAnalyzer(function).inlineSize());
+  }
+
+  uint32_t size = info->inlineSize();
+  if (size == 0 || size > threshold) {
+    return false;
+  }
+
+  for (size_t i = 0; i < functions_.size(); ++i) {
+    if (functions_[i].function == function) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/*
+ * Arguments are already on stack, so inlined function stores them
+ * to its parameters just like when called. All its variables are declared 
+ * in current function and every return jumps to end of inlined body.
+ * If inlined call is in tail position, its returns are returns
+ * of current function, so calls in them stay tail calls.
+ * Inlined body is recorded, so call stack still has the call.
+ */
+void BytecodeGenerator::inlineCall(AstFunction* function, bool returnsFromCurrent) {
+  uint32_t start = bc()->length();
+  Label end(bc());
+  functions_.push_back(FunctionFrame(function, returnsFromCurrent ? 0 : &end));
+  ++inlineDepth_;
+
+  parameters(function);
+  function->node()->body()->visit(this);
+  ctx()->exitScope();
+
+  --inlineDepth_;
+  functions_.pop_back();
+  bind(end);
+
+  uint16_t id = getInfo<FunctionInfo>(function)->functionId();
+  ctx()->currentFunction()->addInlined(InlinedBody(start, bc()->length(), id));
 }
 
 void BytecodeGenerator::visit(BinaryOpNode* op) { 
@@ -320,13 +943,12 @@ void BytecodeGenerator::visit(DoubleLiteralNode* floating) {
 }
 
 void BytecodeGenerator::visit(IntLiteralNode* integer) {
-  bc()->addInsn(BC_ILOAD);
-  bc()->addInt64(integer->literal());
+  loadInt(integer->literal(), bc());
   setType(integer, VT_INT);
 }
 
 void BytecodeGenerator::visit(StringLiteralNode* string) {
-  uint16_t id = ctx()->makeStringConstant(string->literal());
+  uint16_t id = constants_->makeStringConstant(string->literal());
   bc()->addInsn(BC_SLOAD);
   bc()->addUInt16(id);
   setType(string, VT_STRING);
@@ -356,12 +978,12 @@ void BytecodeGenerator::notOp(UnaryOpNode* op) {
   Label end(bc());
 
   bc()->addInsn(BC_ILOAD0);
-  bc()->addBranch(BC_IFICMPNE, setFalse);
+  addBranch(BC_IFICMPNE, setFalse);
   bc()->addInsn(BC_ILOAD1);
-  bc()->addBranch(BC_JA, end);
-  bc()->bind(setFalse);
+  addBranch(BC_JA, end);
+  bind(setFalse);
   bc()->addInsn(BC_ILOAD0);
-  bc()->bind(end);
+  bind(end);
   setType(op, VT_INT);
 }
 
@@ -380,14 +1002,14 @@ TokenKind token = op->kind();
   
   bc()->addInsn(BC_ILOAD0);
   if (isAnd) {
-    bc()->addBranch(BC_IFICMPNE, evaluateRight);
+    addBranch(BC_IFICMPNE, evaluateRight);
     bc()->addInsn(BC_ILOAD0);
-    bc()->addBranch(BC_JA, end);
+    addBranch(BC_JA, end);
   } else {
-    bc()->addBranch(BC_IFICMPNE, setTrue);
+    addBranch(BC_IFICMPNE, setTrue);
   }
 
-  bc()->bind(evaluateRight);
+  bind(evaluateRight);
   op->right()->visit(this);
     
   if (typeOf(op->left()) != VT_INT || typeOf(op->right()) != VT_INT) {
@@ -399,13 +1021,13 @@ TokenKind token = op->kind();
   // 2. false OR right
   // so if right is true, whole is true
   bc()->addInsn(BC_ILOAD0);
-  bc()->addBranch(BC_IFICMPNE, setTrue);
+  addBranch(BC_IFICMPNE, setTrue);
   bc()->addInsn(BC_ILOAD0);
-  bc()->addBranch(BC_JA, end);
+  addBranch(BC_JA, end);
 
-  bc()->bind(setTrue);
+  bind(setTrue);
   bc()->addInsn(BC_ILOAD1);
-  bc()->bind(end);
+  bind(end);
 
   setType(op, VT_INT);
 }
@@ -438,30 +1060,15 @@ void BytecodeGenerator::comparisonOp(BinaryOpNode* op) {
   op->visitChildren(this);
   
   VarType operandsCommonType = castOperandsNumeric(op);
-  
-  Instruction cmpi;
-  switch (op->kind()) {
-    case tEQ:  cmpi = BC_IFICMPE;  break;
-    case tNEQ: cmpi = BC_IFICMPNE; break;
-    case tGT:  cmpi = BC_IFICMPG;  break;
-    case tGE:  cmpi = BC_IFICMPGE; break;
-    case tLT:  cmpi = BC_IFICMPL;  break;
-    case tLE:  cmpi = BC_IFICMPLE; break;
-    default:
-      throw TranslationException(op, "Unknown comparison operator");
-  }
-
   Label setTrue(bc());
   Label end(bc());
 
-  bc()->addInsn(operandsCommonType == VT_INT ? BC_ICMP : BC_DCMP);
-  bc()->addInsn(BC_ILOAD0);
-  bc()->addBranch(cmpi, setTrue);
+  addBranch(comparisonBranch(op, operandsCommonType, false), setTrue);
   bc()->addInsn(BC_ILOAD0);
-  bc()->addBranch(BC_JA, end);
-  bc()->bind(setTrue);
+  addBranch(BC_JA, end);
+  bind(setTrue);
   bc()->addInsn(BC_ILOAD1);
-  bc()->bind(end);
+  bind(end);
 
   setType(op, VT_INT);
 }
@@ -498,6 +1105,41 @@ void BytecodeGenerator::arithmeticOp(BinaryOpNode* op) {
   setType(op, operandsCommonType);
 }
 
+/*
+ * Branch taken if comparison of operands on stack holds, or doesn't 
+ * if isNegated (ints only). Right operand is the upper one, so branch
+ * compares them the other way round.
+ */
+Instruction BytecodeGenerator::comparisonBranch(BinaryOpNode* op, VarType type, bool isNegated) {
+  bool isInt = type == VT_INT;
+  TokenKind kind = op->kind();
+
+  assert(isInt || !isNegated);
+
+  if (isNegated) {
+    switch (kind) {
+      case tEQ:  kind = tNEQ; break;
+      case tNEQ: kind = tEQ;  break;
+      case tGT:  kind = tLE;  break;
+      case tGE:  kind = tLT;  break;
+      case tLT:  kind = tGE;  break;
+      case tLE:  kind = tGT;  break;
+      default:   break;
+    }
+  }
+
+  switch (kind) {
+    case tEQ:  return isInt ? BC_IFICMPE  : BC_IFDCMPE;
+    case tNEQ: return isInt ? BC_IFICMPNE : BC_IFDCMPNE;
+    case tGT:  return isInt ? BC_IFICMPL  : BC_IFDCMPL;
+    case tGE:  return isInt ? BC_IFICMPLE : BC_IFDCMPLE;
+    case tLT:  return isInt ? BC_IFICMPG  : BC_IFDCMPG;
+    case tLE:  return isInt ? BC_IFICMPGE : BC_IFDCMPGE;
+    default:
+      throw TranslationException(op, "Unknown comparison operator");
+  }
+}
+
 VarType BytecodeGenerator::castOperandsNumeric(BinaryOpNode* op) {
   VarType tLower = typeOf(op->left());
   VarType tUpper = typeOf(op->right());
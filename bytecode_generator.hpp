@@ -3,26 +3,112 @@
 
 #include "ast.h"
 #include "mathvm.h"
+#include "parser.h"
 #include "visitors.h"
 #include "interpreter_code.hpp"
+#include "instructions.hpp"
+#include "builtins.hpp"
 #include "context.hpp"
+#include "profile.hpp"
 
 #include <map>
 #include <stack>
 #include <string>
+#include <utility>
+#include <vector>
 
 namespace mathvm {
 
-  class BytecodeGenerator : public AstVisitor {
+  namespace constants {
+    const uint32_t DEFAULT_INLINE_THRESHOLD = 24;
+    const uint32_t MAX_INLINE_DEPTH = 4;
+    // forward branch this many bytes behind gets a jump island
+    const uint32_t ISLAND_DISTANCE = 16 << 10;
+  }
+
+  struct GeneratorOptions {
+    // Max number of ast nodes in body of inlined function, 0 disables inlining
+    uint32_t inlineThreshold;
+    // 0 - no optimization, 1 - BytecodeOptimizer runs on generated code,
+    // 2 - it also optimizes loops
+    uint32_t optimizationLevel;
+    // Threads generating bodies when all of them are needed at once,
+    // 0 - one per processor
+    uint32_t threadsNumber;
+    // Hot calls of recorded profile are inlined, 0 - no profile
+    Profile* profile;
+
+    GeneratorOptions()
+      : inlineThreshold(constants::DEFAULT_INLINE_THRESHOLD),
+        optimizationLevel(0),
+        threadsNumber(0),
+        profile(0) {}
+
+    // Options BytecodeTranslatorImpl generates code with
+    static GeneratorOptions& global();
+  };
+
+  /*
+   * Generates bytecode of top function right away and bodies
+   * of other functions on demand: all functions get their ids
+   * (and InterpreterFunction) up front, so calls can refer to them,
+   * but body is generated when InterpreterCodeImpl is asked for it,
+   * i.e. on first call. Body of nested function needs ids of variables
+   * of enclosing functions, so they are generated before it.
+   * When all bodies are needed, they are generated in parallel
+   * by worker generators with their own contexts (see generateAll).
+   */
+  class BytecodeGenerator : public AstVisitor, public BodyGenerator {
+    // Function which body is being generated.
+    // Returns of inlined function jump to inlineEnd
+    // (it is 0 if they return from current function)
+    struct FunctionFrame {
+      AstFunction* function;
+      Label* inlineEnd;
+
+      FunctionFrame(AstFunction* function, Label* inlineEnd)
+        : function(function), 
+          inlineEnd(inlineEnd) {}
+    };
+
+    // Forward branch waiting for its label to be bound
+    struct PendingBranch {
+      uint32_t position;  // of branch instruction
+      Label* target;
+      bool isLong;
+
+      PendingBranch(uint32_t position, Label* target, bool isLong)
+        : position(position),
+          target(target),
+          isLong(isLong) {}
+    };
+
+    Parser* parser_; // owns ast, which deferred bodies are generated from
     AstFunction* top_;
+    InterpreterCodeImpl* code_;
+    ConstantPool* constants_;
     Context context_;
+    GeneratorOptions options_;
+    std::vector<FunctionFrame> functions_;
+    uint32_t inlineDepth_;
+    std::vector<AstFunction*> asts_;  // by function id
+    std::vector<uint16_t> parents_;   // id of enclosing function by function id
+    // Their contexts own infos of variables generated bodies refer to
+    std::vector<BytecodeGenerator*> workers_;
+    // Index and array variables of enclosing for loops which
+    // stay within array (see BoundsAnalyzer)
+    std::vector<std::pair<const AstVar*, const AstVar*> > inBounds_;
+    std::vector<PendingBranch> pending_;
 
   public:
-    BytecodeGenerator(AstFunction* top, InterpreterCodeImpl* code)
-     : top_(top), 
-       context_(code) {} 
+    // Takes ownership of parser
+    BytecodeGenerator(Parser* parser, InterpreterCodeImpl* code, 
+                      const GeneratorOptions& options = GeneratorOptions());
+    virtual ~BytecodeGenerator();
 
     Status* generate();
+    virtual void generate(uint16_t id);
+    virtual void generateAll();
 
   #define VISITOR_FUNCTION(type, name)     \
     void visit(type* node);                \
@@ -34,6 +120,10 @@ namespace mathvm {
   #undef VISITOR_FUNCTION
 
   private:
+    // Worker sharing ast, functions and constants of owner
+    explicit BytecodeGenerator(const BytecodeGenerator* owner);
+
+    void declare(Scope* scope, uint16_t parentId);
     void visit(Scope* scope);
     void visit(AstFunction* function);
     void negOp(UnaryOpNode* op);
@@ -43,8 +133,22 @@ namespace mathvm {
     void comparisonOp(BinaryOpNode* op);
     void arithmeticOp(BinaryOpNode* op);
     VarType castOperandsNumeric(BinaryOpNode* op);
+    Instruction comparisonBranch(BinaryOpNode* op, VarType type, bool isNegated);
+    void jumpIfFalse(AstNode* condition, Label& target);
     void parameters(AstFunction* function);
+    bool call(CallNode* node, bool inTailPosition);
+    void builtinCall(CallNode* node, const Builtin* builtin);
+    bool isInBounds(AstNode* array, AstNode* index);
+    bool canInline(AstFunction* function);
+    bool isHotCall(AstFunction* function);
+    bool isInlinable(AstFunction* function, uint32_t threshold);
+    void inlineCall(AstFunction* function, bool returnsFromCurrent);
+    void inlineReturn(ReturnNode* node);
     void storeInt(AstNode* expr, uint16_t localId, uint16_t localContext);
+    void countingLoop(ForNode* node, uint16_t varId, uint16_t endId);
+    void addBranch(Instruction insn, Label& target);
+    void bind(Label& label);
+    void addIslands();
 
     Bytecode* bc() {
       uint16_t id = ctx()->currentFunctionId();
@@ -1,72 +1,428 @@
 #include "bytecode_interpreter.hpp"
 #include "errors.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
 #include <iostream>
 
-#define BIN_OP(type, op) {    \
-  type upper = pop<type>();   \
-  type lower = pop<type>();   \
-  push<type>(upper op lower); \
+#include <sys/mman.h>
+#include <time.h>
+
+/*
+ * Inside run value on top of operand stack is kept in local tos
+ * and values under it in memory below sp, so stack and frame 
+ * pointers and top value stay in registers. SPILL gives the stack
+ * back to members before calls, returns and anything else that 
+ * goes through them; RELOAD takes it again.
+ */
+#define SLOT(depth) (*reinterpret_cast<uint64_t*>(sp - (depth) * constants::VAL_SIZE))
+
+#define SPILL() {                 \
+  SLOT(1) = tos;                  \
+  stackPointer_ = sp - stack_;    \
 }
 
-#define CMP(type) {                         \
-  type upper = pop<type>();                 \
-  type lower = pop<type>();                 \
-  if (upper == lower) push<int64_t>(0);     \
-  else if (upper < lower) push<int64_t>(-1);\
-  else push<int64_t>(1);                    \
+#define RELOAD() {                \
+  sp = stack_ + stackPointer_;    \
+  tos = SLOT(1);                  \
+  locals = findVar<uint64_t>(0, 0); \
 }
 
-#define CMP_OP(op, ip, off_t) {     \
-  int64_t upper = pop<int64_t>();   \
-  int64_t lower = pop<int64_t>();   \
-  if (upper op lower) {             \
-    ip += readFromBc<off_t>();      \
-  } else {                          \
-    ip += sizeof(off_t);            \
-  }                                 \
+#define TOP(type) fromWord<type>(tos)
+#define SET_TOP(type, value) tos = toWord<type>(value)
+
+#define PUSH(type, value) {       \
+  uint64_t pushed = toWord<type>(value); \
+  SLOT(1) = tos;                  \
+  sp += constants::VAL_SIZE;      \
+  tos = pushed;                   \
+}
+
+#define DROP() {                  \
+  sp -= constants::VAL_SIZE;      \
+  tos = SLOT(1);                  \
+}
+
+#define BIN_OP(type, op) {        \
+  type upper = TOP(type);         \
+  DROP();                         \
+  SET_TOP(type, upper op TOP(type)); \
+}
+
+// idiv faults on zero divisor and INT64_MIN / -1
+#define DIV_OP(op) {              \
+  int64_t upper = TOP(int64_t);   \
+  DROP();                         \
+  int64_t lower = TOP(int64_t);   \
+  if (lower == 0 || (lower == -1 && upper == INT64_MIN)) { \
+    throw withCallStack(InterpreterException(lower == 0 ? "Division by zero" \
+                                                        : "Division overflow")); \
+  }                               \
+  SET_TOP(int64_t, upper op lower); \
+}
+
+#define CMP(type) {                     \
+  type upper = TOP(type);               \
+  DROP();                               \
+  type lower = TOP(type);               \
+  SET_TOP(int64_t, upper == lower ? 0 : upper < lower ? -1 : 1); \
+}
+
+#define CMP_OP(type, op, ip, off_t) {   \
+  type upper = TOP(type);               \
+  DROP();                               \
+  type lower = TOP(type);               \
+  DROP();                               \
+  bool isTaken = upper op lower;        \
+  count(ip - 1, isTaken);               \
+  if (isTaken) {                        \
+    off_t offset = readFromBc<off_t>(); \
+    ip += offset;                       \
+    if (offset < 0) CHARGE(-offset);    \
+  } else {                              \
+    ip += sizeof(off_t);                \
+  }                                     \
 }                                
 
+#define LOAD_ELEMENT(type, isChecked) { \
+  int64_t index = TOP(int64_t);         \
+  DROP();                               \
+  SET_TOP(type, *element<type>(TOP(int64_t), index, isChecked)); \
+}
+
+#define STORE_ELEMENT(type, isChecked) { \
+  type value = TOP(type);               \
+  DROP();                               \
+  int64_t index = TOP(int64_t);         \
+  DROP();                               \
+  int64_t handle = TOP(int64_t);        \
+  DROP();                               \
+  *element<type>(handle, index, isChecked) = value; \
+}
+
+// Returns from run when budget is spent; 
+// charge past its end is taken right from fuel
+#define CHARGE(units) {             \
+  uint64_t charge = (units);        \
+  if (left <= charge) {             \
+    fuel_ -= std::min(charge - left, fuel_ - slice); \
+    SPILL();                        \
+    *budget = 0;                    \
+    return false;                   \
+  }                                 \
+  left -= charge;                   \
+}
+
+// Fuel left with rest of the slice
+#define FUEL() (fuel_ - slice + left)
+
 namespace mathvm {
 
-BytecodeInterpreter::BytecodeInterpreter(Code* code)
-  : instructionPointer_(0), 
-    stackPointer_(0), 
-    stackFramePointer_(constants::MAX_STACK_SIZE)
+template<typename T>
+static T* allocAligned(size_t count) {
+  void* memory = 0;
+  size_t size = std::max<size_t>(count * sizeof(T), 1);
+
+  if (posix_memalign(&memory, constants::CACHE_LINE_SIZE, size) != 0) {
+    throw InterpreterException("Could not allocate %lu bytes", (unsigned long) size);
+  }
+
+  return static_cast<T*>(memory);
+}
+
+// Operand stack word of value, zero-extended if value is shorter
+template<typename T>
+static uint64_t toWord(T value) {
+  uint64_t word = 0;
+  memcpy(&word, &value, sizeof(value));
+  return word;
+}
+
+template<typename T>
+static T fromWord(uint64_t word) {
+  T value;
+  memcpy(&value, &word, sizeof(value));
+  return value;
+}
+
+BytecodeInterpreter::BytecodeInterpreter(Code* code, const InterpreterOptions& options)
+  : stackSize_(options.stackSize),
+    out_(options.out ? options.out : &std::cout),
+    functions_(0),
+    functionsNumber_(0),
+    bytecodes_(0),
+    jit_(0),
+    jitThreshold_(options.fuel > 0 || options.timeLimit > 0 ? 0 : options.jitThreshold),
+    isPreemptive_(false),
+    isProfiling_(options.isProfiling),
+    fuel_(options.fuel > 0 ? options.fuel : constants::UNLIMITED_FUEL),
+    deadline_(options.timeLimit > 0 ? now() + options.timeLimit * 1000000ULL : 0),
+    input_(0),
+    instructionPointer_(0), 
+    stackPointer_(constants::VAL_SIZE), 
+    stackFramePointer_(options.stackSize)
 {
-  stack_ = new char[constants::MAX_STACK_SIZE];
+  if (options.input) {
+    input_ = new InputStream(options.input);
+  }
+
+  // pages are committed on first touch, so many interpreters
+  // with shallow stacks are cheap
+  void* stack = mmap(0, stackSize_, PROT_READ | PROT_WRITE, 
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (stack == MAP_FAILED) {
+    throw InterpreterException("Could not allocate stack of %d bytes", stackSize_);
+  }
+  stack_ = static_cast<char*>(stack);
+
   code_ = dynamic_cast<InterpreterCodeImpl*>(code);
   assert(code_ != NULL);
-  function_ = code_->functionById(0);
-  allocFrame(0, function_->localsNumber(), -1);
+
+  if (jitThreshold_ > 0 && JitCompiler::isSupported()) {
+    jit_ = new JitCompiler(code_, stackSize_);
+  }
+
+  // purity is known only when all bodies are
+  if (options.memoCapacity > 0) {
+    code_->generateAll();
+  }
+
+  loadFunctions();
+
+  if (options.memoCapacity > 0) {
+    memoize(options.memoCapacity);
+  }
+
+  function_ = functions_;
+  bytecode_ = function_->bytecode;
+  allocFrame(function_->localsNumber, 0);
 }
 
 BytecodeInterpreter::~BytecodeInterpreter() {
-  delete [] stack_;
+  delete jit_;
+  delete input_;
+  free(bytecodes_);
+
+  for (size_t i = 0; i < generated_.size(); ++i) {
+    free(generated_[i]);
+  }
+
+  for (uint32_t i = 0; i < functionsNumber_; ++i) {
+    free(functions_[i].counters);
+    delete functions_[i].memo;
+  }
+
+  free(functions_);
+  munmap(stack_, stackSize_);
+}
+
+/*
+ * Copies bytecode of all functions into one contiguous buffer
+ * and fills function table, so call/return don't have to go
+ * through Code (virtual calls, vector of TranslatedFunction*).
+ * Functions which bodies are not generated yet get stub body
+ * and no locals: see generateFunction.
+ * Code must not be changed after interpreter is created,
+ * except for generation of deferred bodies.
+ */
+void BytecodeInterpreter::loadFunctions() {
+  uint32_t functionsNumber = 0;
+  size_t bytecodeSize = 0;
+
+  Code::FunctionIterator countIt(code_);
+  while (countIt.hasNext()) {
+    BytecodeFunction* function = static_cast<BytecodeFunction*>(countIt.next());
+    functionsNumber = std::max<uint32_t>(functionsNumber, function->id() + 1);
+    bytecodeSize += function->bytecode()->length();
+  }
+
+  functions_ = allocAligned<FunctionRecord>(functionsNumber);
+  functionsNumber_ = functionsNumber;
+  bytecodes_ = allocAligned<uint8_t>(bytecodeSize);
+  uint8_t* bytecode = bytecodes_;
+
+  Code::FunctionIterator it(code_);
+  while (it.hasNext()) {
+    InterpreterFunction* function = static_cast<InterpreterFunction*>(it.next());
+    FunctionRecord& record = functions_[function->id()];
+
+    if (function->isGenerated()) {
+      loadFunction(function, &record, bytecode);
+      bytecode += function->bytecode()->length();
+    } else {
+      loadFunction(function, &record, 0);
+    }
+  }
+}
+
+void BytecodeInterpreter::loadFunction(InterpreterFunction* function, 
+                                       FunctionRecord* record, 
+                                       uint8_t* bytecode) {
+  static const uint8_t STUB[] = { BCX_GENERATE };
+  Bytecode* source = function->bytecode();
+
+  if (bytecode) {
+    for (uint32_t i = 0; i < source->length(); ++i) {
+      bytecode[i] = source->get(i);
+    }
+  }
+
+  record->bytecode = bytecode ? bytecode : STUB;
+  record->native = 0;
+  record->localsNumber = bytecode ? function->localsNumber() : 0;
+  record->calls = 0;
+  record->charge = bytecode ? source->length() : 1;
+  record->counters = 0;
+  record->memo = 0;
+
+  if (bytecode && isProfiling_) {
+    record->counters = allocAligned<uint64_t>(2 * source->length());
+    memset(record->counters, 0, 2 * source->length() * sizeof(uint64_t));
+  }
+  record->deepness = function->deepness();
+  record->id = function->id();
+  record->parametersNumber = function->parametersNumber();
+}
+
+/*
+ * Body of stub: called function has frame without locals 
+ * and arguments on operand stack. Frame is the lowest one,
+ * so it is extended down for locals of generated body.
+ */
+void BytecodeInterpreter::generateFunction() {
+  uint16_t id = function_->id;
+  InterpreterFunction* function = code_->functionById(id);
+  code_->generate(id);
+
+  uint8_t* bytecode = allocAligned<uint8_t>(function->bytecode()->length());
+  generated_.push_back(bytecode);
+  loadFunction(function, functions_ + id, bytecode);
+
+  StackFrame frame = *stackFrame();
+  growFrames(constants::VAL_SIZE * functions_[id].localsNumber);
+  *stackFrame() = frame;
+  enterFunction(functions_ + id, 0);
 }
 
 void BytecodeInterpreter::execute() {
+  while (!execute(constants::UNLIMITED_QUANTUM)) {}
+}
+
+/*
+ * Program runs in slices, between which fuel and deadline are checked.
+ */
+bool BytecodeInterpreter::execute(uint64_t quantum) {
+  isPreemptive_ = quantum != constants::UNLIMITED_QUANTUM;
+
+  while (quantum > 0) {
+    uint64_t slice = std::min(std::min(quantum, fuel_), constants::SLICE_FUEL);
+    if (slice == 0) {
+      throw withCallStack(InterpreterException("Fuel is exhausted"), true);
+    }
+
+    uint64_t left = slice;
+    bool isStopped = run(&left);
+    quantum -= slice - left;
+    fuel_ -= slice - left;
+
+    if (isStopped) {
+      return true;
+    }
+
+    if (deadline_ > 0 && now() >= deadline_) {
+      throw withCallStack(InterpreterException("Time limit is exceeded"), true);
+    }
+  }
+
+  return false;
+}
+
+/*
+ * Function is called as if from STOP of top function, where stopped
+ * program is, so its return gets back to STOP and the program stops
+ * again. Frame of top function stays, so function sees globals.
+ * Failed call leaves interpreter as it was before the call.
+ */
+uint64_t BytecodeInterpreter::call(uint16_t id, const uint64_t* args) {
+  if (function_ != functions_ || bytecode_[instructionPointer_] != BC_STOP) {
+    throw InterpreterException("Program must stop before its functions are called");
+  }
+
+  if (id >= functionsNumber_ || functions_[id].deepness != 1) {
+    throw InterpreterException("Function %d is not declared at top level", (int) id);
+  }
+
+  mem_t stackPointer = stackPointer_;
+  mem_t stackFramePointer = stackFramePointer_;
+  uint32_t instructionPointer = instructionPointer_;
+  size_t pendingCalls = pendingStarts_.size();
+
+  try {
+    for (uint16_t i = 0; i < functions_[id].parametersNumber; ++i) {
+      push(args[i]);
+    }
+
+    callFunction(id, 0);
+    execute();
+
+    if (stackFramePointer_ != stackFramePointer) {
+      throw withCallStack(InterpreterException("Program stopped in function %s",
+                                               code_->functionById(id)->name().c_str()));
+    }
+
+    return pop<uint64_t>();
+  } catch (...) {
+    if (pendingCalls < pendingStarts_.size()) {
+      pendingWords_.resize(pendingStarts_[pendingCalls]);
+      pendingStarts_.resize(pendingCalls);
+    }
+
+    stackPointer_ = stackPointer;
+    stackFramePointer_ = stackFramePointer;
+    enterFunction(functions_, instructionPointer);
+    throw;
+  }
+}
+
+/*
+ * Fuel is charged only at back edges, by distance jumped back, and
+ * at calls, by length of called function. That bounds the bytes 
+ * of bytecode run in between, so fuel approximates bytes of bytecode
+ * executed, and other instructions don't pay for counting.
+ */
+bool BytecodeInterpreter::run(uint64_t* budget) {
+  uint64_t slice = *budget;
+  uint64_t left = slice;
+  char* sp;
+  uint64_t tos;
+  uint64_t* locals;
+  RELOAD();
+
   while (true) {
-    Instruction bci = bc()->getInsn(instructionPointer_++);
+    Instruction bci = readInsn();
 
-    switch (bci) {
+    // extended instructions are out of Instruction enum
+    switch (static_cast<uint8_t>(bci)) {
       case BC_INVALID: 
         throw InterpreterException("Not implemented bytecode: %s", bytecodeName(bci, 0));
       
-      case BC_ILOAD0: push<int64_t>(0); break;      
-      case BC_ILOAD1: push<int64_t>(1); break;      
-      case BC_ILOADM1: push<int64_t>(-1); break;      
-      case BC_DLOAD0: push<double>(0); break;      
-      case BC_DLOAD1: push<double>(1); break;      
-      case BC_DLOADM1: push<double>(-1); break;      
-
-      case BC_ILOAD: load<int64_t>(); break;
-      case BC_DLOAD: load<double>(); break;
-      case BC_SLOAD: load<uint16_t>(); break;
+      case BC_ILOAD0: PUSH(int64_t, 0); break;      
+      case BC_ILOAD1: PUSH(int64_t, 1); break;      
+      case BC_ILOADM1: PUSH(int64_t, -1); break;      
+      case BC_DLOAD0: PUSH(double, 0); break;      
+      case BC_DLOAD1: PUSH(double, 1); break;      
+      case BC_DLOADM1: PUSH(double, -1); break;      
+
+      case BC_ILOAD: PUSH(int64_t, readFromBcAndShift<int64_t>()); break;
+      case BC_ILOAD8: PUSH(int64_t, readFromBcAndShift<int8_t>()); break;
+      case BC_ILOAD16: PUSH(int64_t, readFromBcAndShift<int16_t>()); break;
+      case BC_DLOAD: PUSH(double, readFromBcAndShift<double>()); break;
+      case BC_SLOAD: PUSH(uint16_t, readFromBcAndShift<uint16_t>()); break;
       
-      case BC_IPRINT: std::cout << pop<int64_t>(); break;
-      case BC_DPRINT: std::cout << pop<double>(); break;
-      case BC_SPRINT: std::cout << code_->constantById(pop<uint16_t>()); break;
+      case BC_IPRINT: *out_ << TOP(int64_t); DROP(); break;
+      case BC_DPRINT: *out_ << TOP(double); DROP(); break;
+      case BC_SPRINT: *out_ << code_->constantById(TOP(uint16_t)); DROP(); break;
 
       case BC_DADD: BIN_OP(double, +); break;
       case BC_DSUB: BIN_OP(double, -); break;
@@ -76,8 +432,8 @@ void BytecodeInterpreter::execute() {
       case BC_IADD: BIN_OP(int64_t, +); break;
       case BC_ISUB: BIN_OP(int64_t, -); break;
       case BC_IMUL: BIN_OP(int64_t, *); break;
-      case BC_IDIV: BIN_OP(int64_t, /); break;
-      case BC_IMOD: BIN_OP(int64_t, %); break;
+      case BC_IDIV: DIV_OP(/); break;
+      case BC_IMOD: DIV_OP(%); break;
       case BC_IAOR: BIN_OP(int64_t, |); break;
       case BC_IAAND: BIN_OP(int64_t, &); break;
       case BC_IAXOR: BIN_OP(int64_t, ^); break;
@@ -85,65 +441,541 @@ void BytecodeInterpreter::execute() {
       case BC_DCMP: CMP(double); break;
       case BC_ICMP: CMP(int64_t); break;
 
-      case BC_I2D: push((double)  pop<int64_t>()); break;
-      case BC_D2I: push((int64_t) pop<double>()); break;
+      case BC_I2D: SET_TOP(double, (double) TOP(int64_t)); break;
+      case BC_D2I: SET_TOP(int64_t, (int64_t) TOP(double)); break;
 
-      case BC_DNEG: push(-pop<double>()); break;
-      case BC_INEG: push(-pop<int64_t>()); break;
+      case BC_DNEG: SET_TOP(double, -TOP(double)); break;
+      case BC_INEG: SET_TOP(int64_t, -TOP(int64_t)); break;
 
-      case BC_JA: instructionPointer_ += readFromBc<int16_t>(); break;
-      case BC_IFICMPNE: CMP_OP(!=, instructionPointer_, int16_t); break;
-      case BC_IFICMPE:  CMP_OP(==, instructionPointer_, int16_t); break;
-      case BC_IFICMPG:  CMP_OP(>,  instructionPointer_, int16_t); break;
-      case BC_IFICMPGE: CMP_OP(>=, instructionPointer_, int16_t); break;
-      case BC_IFICMPL:  CMP_OP(<,  instructionPointer_, int16_t); break;
-      case BC_IFICMPLE: CMP_OP(<=, instructionPointer_, int16_t); break;
+      case BC_DSQRT: SET_TOP(double, std::sqrt(TOP(double))); break;
+      case BC_DSIN: SET_TOP(double, std::sin(TOP(double))); break;
+      case BC_DCOS: SET_TOP(double, std::cos(TOP(double))); break;
+      case BC_DEXP: SET_TOP(double, std::exp(TOP(double))); break;
+      case BC_DLOG: SET_TOP(double, std::log(TOP(double))); break;
+      case BC_DFLOOR: SET_TOP(double, std::floor(TOP(double))); break;
+      case BC_DABS: SET_TOP(double, std::fabs(TOP(double))); break;
+      case BC_DPOW: {
+        double exponent = TOP(double);
+        DROP();
+        SET_TOP(double, std::pow(TOP(double), exponent));
+        break;
+      }
+      case BC_IABS: {
+        int64_t value = TOP(int64_t);
+        SET_TOP(int64_t, value < 0 ? -value : value);
+        break;
+      }
+      case BC_IMIN: {
+        int64_t upper = TOP(int64_t);
+        DROP();
+        SET_TOP(int64_t, std::min(upper, TOP(int64_t)));
+        break;
+      }
+      case BC_IMAX: {
+        int64_t upper = TOP(int64_t);
+        DROP();
+        SET_TOP(int64_t, std::max(upper, TOP(int64_t)));
+        break;
+      }
+      case BC_DMIN: {
+        double upper = TOP(double);
+        DROP();
+        SET_TOP(double, std::fmin(upper, TOP(double)));
+        break;
+      }
+      case BC_DMAX: {
+        double upper = TOP(double);
+        DROP();
+        SET_TOP(double, std::fmax(upper, TOP(double)));
+        break;
+      }
 
-      case BC_LOADIVAR: 
-        loadVar<int64_t>(readFromBcAndShift<uint16_t>(), 0); 
+      case BC_JA: {
+        int16_t offset = readFromBc<int16_t>();
+        instructionPointer_ += offset;
+        if (offset < 0) CHARGE(-offset);
         break;
+      }
+      case BC_IFICMPNE: CMP_OP(int64_t, !=, instructionPointer_, int16_t); break;
+      case BC_IFICMPE:  CMP_OP(int64_t, ==, instructionPointer_, int16_t); break;
+      case BC_IFICMPG:  CMP_OP(int64_t, >,  instructionPointer_, int16_t); break;
+      case BC_IFICMPGE: CMP_OP(int64_t, >=, instructionPointer_, int16_t); break;
+      case BC_IFICMPL:  CMP_OP(int64_t, <,  instructionPointer_, int16_t); break;
+      case BC_IFICMPLE: CMP_OP(int64_t, <=, instructionPointer_, int16_t); break;
+      // comparisons with NaN are false, except !=
+      case BC_IFDCMPNE: CMP_OP(double, !=, instructionPointer_, int16_t); break;
+      case BC_IFDCMPE:  CMP_OP(double, ==, instructionPointer_, int16_t); break;
+      case BC_IFDCMPG:  CMP_OP(double, >,  instructionPointer_, int16_t); break;
+      case BC_IFDCMPGE: CMP_OP(double, >=, instructionPointer_, int16_t); break;
+      case BC_IFDCMPL:  CMP_OP(double, <,  instructionPointer_, int16_t); break;
+      case BC_IFDCMPLE: CMP_OP(double, <=, instructionPointer_, int16_t); break;
+
+      case BC_LJA: {
+        int32_t offset = readFromBc<int32_t>();
+        instructionPointer_ += offset;
+        if (offset < 0) CHARGE(-offset);
+        break;
+      }
+      case BC_LIFICMPNE: CMP_OP(int64_t, !=, instructionPointer_, int32_t); break;
+      case BC_LIFICMPE:  CMP_OP(int64_t, ==, instructionPointer_, int32_t); break;
+      case BC_LIFICMPG:  CMP_OP(int64_t, >,  instructionPointer_, int32_t); break;
+      case BC_LIFICMPGE: CMP_OP(int64_t, >=, instructionPointer_, int32_t); break;
+      case BC_LIFICMPL:  CMP_OP(int64_t, <,  instructionPointer_, int32_t); break;
+      case BC_LIFICMPLE: CMP_OP(int64_t, <=, instructionPointer_, int32_t); break;
+      case BC_LIFDCMPNE: CMP_OP(double, !=, instructionPointer_, int32_t); break;
+      case BC_LIFDCMPE:  CMP_OP(double, ==, instructionPointer_, int32_t); break;
+      case BC_LIFDCMPG:  CMP_OP(double, >,  instructionPointer_, int32_t); break;
+      case BC_LIFDCMPGE: CMP_OP(double, >=, instructionPointer_, int32_t); break;
+      case BC_LIFDCMPL:  CMP_OP(double, <,  instructionPointer_, int32_t); break;
+      case BC_LIFDCMPLE: CMP_OP(double, <=, instructionPointer_, int32_t); break;
+
+      // variables are words, whatever their type
+      case BC_LOADIVAR: 
       case BC_LOADDVAR: 
-        loadVar<double>(readFromBcAndShift<uint16_t>(), 0); 
+        PUSH(uint64_t, locals[readFromBcAndShift<uint16_t>()]); 
         break;
+      case BC_LOADIVAR0: case BC_LOADDVAR0: PUSH(uint64_t, locals[0]); break;
+      case BC_LOADIVAR1: case BC_LOADDVAR1: PUSH(uint64_t, locals[1]); break;
+      case BC_LOADIVAR2: case BC_LOADDVAR2: PUSH(uint64_t, locals[2]); break;
+      case BC_LOADIVAR3: case BC_LOADDVAR3: PUSH(uint64_t, locals[3]); break;
       case BC_LOADCTXIVAR: 
-        loadVar<int64_t>(readFromBcAndShift<uint16_t>(), readFromBcAndShift<uint16_t>()); 
-        break;
-      case BC_LOADCTXDVAR: 
-        loadVar<double>(readFromBcAndShift<uint16_t>(), readFromBcAndShift<uint16_t>()); 
+      case BC_LOADCTXDVAR: {
+        uint16_t context = readFromBcAndShift<uint16_t>();
+        PUSH(uint64_t, *findVar<uint64_t>(readFromBcAndShift<uint16_t>(), context)); 
         break;
+      }
 
       case BC_STOREIVAR: 
-        storeVar<int64_t>(readFromBcAndShift<uint16_t>(), 0, pop<int64_t>()); 
-        break;
       case BC_STOREDVAR: 
-        storeVar<double>(readFromBcAndShift<uint16_t>(), 0, pop<double>()); 
+        locals[readFromBcAndShift<uint16_t>()] = tos;
+        DROP();
         break;
+      case BC_STOREIVAR0: case BC_STOREDVAR0: locals[0] = tos; DROP(); break;
+      case BC_STOREIVAR1: case BC_STOREDVAR1: locals[1] = tos; DROP(); break;
+      case BC_STOREIVAR2: case BC_STOREDVAR2: locals[2] = tos; DROP(); break;
+      case BC_STOREIVAR3: case BC_STOREDVAR3: locals[3] = tos; DROP(); break;
       case BC_STORECTXIVAR: 
-        storeVar<int64_t>(readFromBcAndShift<uint16_t>(), readFromBcAndShift<uint16_t>(), pop<int64_t>()); 
+      case BC_STORECTXDVAR: {
+        uint16_t context = readFromBcAndShift<uint16_t>();
+        *findVar<uint64_t>(readFromBcAndShift<uint16_t>(), context) = tos;
+        DROP();
+        break;
+      }
+
+      case BC_IFORPREP: {
+        int64_t limit = TOP(int64_t);
+        DROP();
+        forPrep<int16_t>(limit);
         break;
-      case BC_STORECTXDVAR: 
-        storeVar<double>(readFromBcAndShift<uint16_t>(), readFromBcAndShift<uint16_t>(), pop<double>()); 
+      }
+      case BC_IFORLOOP: CHARGE(forLoop<int16_t>()); break;
+      case BC_LIFORPREP: {
+        int64_t limit = TOP(int64_t);
+        DROP();
+        forPrep<int32_t>(limit);
         break;
+      }
+      case BC_LIFORLOOP: CHARGE(forLoop<int32_t>()); break;
+      case BC_IDIVPOW2: 
+        SET_TOP(int64_t, divideByPowerOfTwo(TOP(int64_t), readFromBcAndShift<uint16_t>())); 
+        break;
+      case BC_IMODPOW2: 
+        SET_TOP(int64_t, modByPowerOfTwo(TOP(int64_t), readFromBcAndShift<uint16_t>())); 
+        break;
+      case BC_GENERATE: SPILL(); generateFunction(); RELOAD(); break;
 
-      case BC_CALL: callFunction(readFromBcAndShift<uint16_t>()); break;
-      case BC_RETURN: returnFunction(); break;
-      case BC_SWAP: swap(); break;
-      case BC_POP: remove(); break;
-      case BC_STOP: return;
+      case BC_NEWARRAY: {
+        SPILL();
+        uint64_t cost = newArray(FUEL());
+        RELOAD();
+        CHARGE(cost);
+        break;
+      }
+      case BC_ALENGTH: SET_TOP(int64_t, arrayLength(TOP(int64_t))); break;
+      case BC_AILOAD: LOAD_ELEMENT(int64_t, true); break;
+      case BC_ADLOAD: LOAD_ELEMENT(double, true); break;
+      case BC_AISTORE: STORE_ELEMENT(int64_t, true); break;
+      case BC_ADSTORE: STORE_ELEMENT(double, true); break;
+      case BC_AILOADNC: LOAD_ELEMENT(int64_t, false); break;
+      case BC_ADLOADNC: LOAD_ELEMENT(double, false); break;
+      case BC_AISTORENC: STORE_ELEMENT(int64_t, false); break;
+      case BC_ADSTORENC: STORE_ELEMENT(double, false); break;
+      case BC_ARRAYOP: {
+        SPILL();
+        uint64_t cost = arrayOp(FUEL());
+        RELOAD();
+        CHARGE(cost);
+        break;
+      }
+      case BC_READ:
+      case BC_HASINPUT:
+      case BC_READARRAY:
+      case BC_INPUTAT:
+      case BC_INPUTLENGTH: {
+        SPILL();
+        uint64_t cost = inputOp(bci, FUEL());
+        RELOAD();
+        CHARGE(cost);
+        break;
+      }
+
+      case BC_CALLCTX: {
+        count(instructionPointer_ - 1);
+        uint16_t id = readFromBcAndShift<uint16_t>();
+        SPILL();
+        callFunction(id, readFromBcAndShift<uint16_t>()); 
+        RELOAD();
+        CHARGE(functions_[id].charge);
+        break;
+      }
+      case BC_TAILCALL: {
+        count(instructionPointer_ - 1);
+        uint16_t id = readFromBcAndShift<uint16_t>();
+        SPILL();
+        tailCallFunction(id, readFromBcAndShift<uint16_t>()); 
+        RELOAD();
+        CHARGE(functions_[id].charge);
+        break;
+      }
+      case BC_RETURN: SPILL(); returnFunction(); RELOAD(); break;
+      case BC_SWAP: {
+        uint64_t upper = tos;
+        tos = SLOT(2);
+        SLOT(2) = upper;
+        break;
+      }
+      case BC_POP: DROP(); break;
+      // stays at STOP, so stopped program doesn't run on
+      case BC_STOP: 
+        --instructionPointer_; 
+        SPILL();
+        *budget = left; 
+        return true;
       
       default: throw InterpreterException("Not implemented instruction");
     }
   } // while
-} // execute
+} // run
+
+
+/*
+ * Counters of conditional branches and calls become profile
+ * records, which are keyed by offsets of bytecode just as counters.
+ */
+void BytecodeInterpreter::collectProfile(Profile* profile) const {
+  for (uint32_t id = 0; id < functionsNumber_; ++id) {
+    const FunctionRecord& function = functions_[id];
+    if (!function.counters) {
+      continue;
+    }
+
+    uint32_t length = code_->functionById(id)->bytecode()->length();
+    profile->addFunction(id, length);
+
+    for (uint32_t offset = 0; offset < length; ) {
+      Instruction insn = static_cast<Instruction>(function.bytecode[offset]);
+      uint64_t taken = function.counters[2 * offset];
+      uint64_t notTaken = function.counters[2 * offset + 1];
+
+      switch (static_cast<uint8_t>(insn)) {
+        case BC_IFICMPNE: case BC_IFICMPE: 
+        case BC_IFICMPG: case BC_IFICMPGE: 
+        case BC_IFICMPL: case BC_IFICMPLE:
+        case BC_IFDCMPNE: case BC_IFDCMPE: 
+        case BC_IFDCMPG: case BC_IFDCMPGE: 
+        case BC_IFDCMPL: case BC_IFDCMPLE:
+        case BC_IFORPREP: case BC_IFORLOOP:
+        case BC_LIFICMPNE: case BC_LIFICMPE: 
+        case BC_LIFICMPG: case BC_LIFICMPGE: 
+        case BC_LIFICMPL: case BC_LIFICMPLE:
+        case BC_LIFDCMPNE: case BC_LIFDCMPE: 
+        case BC_LIFDCMPG: case BC_LIFDCMPGE: 
+        case BC_LIFDCMPL: case BC_LIFDCMPLE:
+        case BC_LIFORPREP: case BC_LIFORLOOP:
+          if (taken + notTaken > 0) {
+            profile->addBranch(id, offset, BranchCounts(taken, notTaken));
+          }
+          break;
+
+        case BC_CALLCTX: 
+        case BC_TAILCALL: {
+          uint16_t callee;
+          memcpy(&callee, function.bytecode + offset + 1, sizeof(callee));
+          if (taken > 0) {
+            profile->addCall(id, offset, CallCounts(callee, taken));
+          }
+          break;
+        }
+
+        default:
+          break;
+      }
+
+      offset += instructionLength(insn);
+    }
+  }
+}
+
+// Offset is int16_t or int32_t, of short or long form
+template<typename Offset>
+void BytecodeInterpreter::forPrep(int64_t limitValue) {
+  uint32_t offsetPosition = instructionPointer_;
+  Offset offset = readFromBcAndShift<Offset>();
+  int64_t* counter = findVar<int64_t>(readFromBcAndShift<uint16_t>(), 0);
+  int64_t* limit = findVar<int64_t>(readFromBcAndShift<uint16_t>(), 0);
+  *limit = limitValue;
+  count(offsetPosition - 1, *counter > *limit);
+
+  if (*counter > *limit) {
+    instructionPointer_ = offsetPosition + offset;
+  }
+}
+
+// Returns distance jumped back, 0 if loop is over
+template<typename Offset>
+uint32_t BytecodeInterpreter::forLoop() {
+  uint32_t offsetPosition = instructionPointer_;
+  Offset offset = readFromBcAndShift<Offset>();
+  int64_t* counter = findVar<int64_t>(readFromBcAndShift<uint16_t>(), 0);
+  int64_t* limit = findVar<int64_t>(readFromBcAndShift<uint16_t>(), 0);
 
+  bool isTaken = ++*counter <= *limit;
+  count(offsetPosition - 1, isTaken);
+
+  if (isTaken) {
+    instructionPointer_ = offsetPosition + offset;
+    return offset < 0 ? -offset : 0;
+  }
+
+  return 0;
+}
+
+/*
+ * Signed division and remainder by 2^k with shifts and masks:
+ * negative dividend is biased by 2^k - 1 to round toward zero, 
+ * and nonzero remainder of negative one gets sign bits.
+ */
+int64_t BytecodeInterpreter::divideByPowerOfTwo(int64_t value, uint16_t shift) {
+  int64_t mask = (static_cast<int64_t>(1) << shift) - 1;
+  return (value + ((value >> 63) & mask)) >> shift;
+}
+
+int64_t BytecodeInterpreter::modByPowerOfTwo(int64_t value, uint16_t shift) {
+  int64_t mask = (static_cast<int64_t>(1) << shift) - 1;
+  int64_t remainder = value & mask;
+  return value < 0 && remainder != 0 ? remainder | ~mask : remainder;
+}
+
+/*
+ * Making array and bulk operations cost fuel by number of elements,
+ * so program can't run long on little fuel by making big arrays.
+ * Cost is checked against fuel left before the work is done.
+ */
+uint64_t BytecodeInterpreter::newArray(uint64_t fuel) {
+  VarType type = static_cast<VarType>(readFromBcAndShift<uint16_t>());
+  int64_t length = pop<int64_t>();
+
+  try {
+    if (length > 0) {
+      checkFuel(1 + length, fuel);
+    }
+    push(arrays_.allocate(type, length));
+  } catch (const InterpreterException& e) {
+    throw withCallStack(e);
+  }
+
+  return 1 + length;
+}
+
+int64_t BytecodeInterpreter::arrayLength(int64_t handle) {
+  try {
+    return arrays_.array(handle).length;
+  } catch (const InterpreterException& e) {
+    throw withCallStack(e);
+  }
+}
+
+uint64_t BytecodeInterpreter::arrayOp(uint64_t fuel) {
+  ArrayOp op = static_cast<ArrayOp>(readFromBcAndShift<uint16_t>());
+  uint16_t argumentsNumber = ArrayArena::argumentsNumber(op);
+  stackPointer_ -= argumentsNumber * constants::VAL_SIZE;
+  uint64_t result;
+  uint64_t processed;
+
+  try {
+    checkFuel(1 + arrays_.elementsNumber(op, operand<uint64_t>()), fuel);
+    processed = arrays_.run(op, operand<uint64_t>(), &result);
+  } catch (const InterpreterException& e) {
+    throw withCallStack(e);
+  }
+
+  if (ArrayArena::hasResult(op)) {
+    push(result);
+  }
+
+  return 1 + processed;
+}
+
+/*
+ * Instructions of input share one function and its handling 
+ * of errors. Filling array costs fuel by number of values read.
+ */
+uint64_t BytecodeInterpreter::inputOp(Instruction insn, uint64_t fuel) {
+  uint64_t charge = 1;
+
+  try {
+    if (!input_) {
+      throw InterpreterException("Program has no input");
+    }
+
+    switch (static_cast<uint8_t>(insn)) {
+      case BC_READ:
+        if (readFromBcAndShift<uint16_t>() == VT_INT) {
+          push(input_->nextInt());
+        } else {
+          push(input_->nextDouble());
+        }
+        break;
+
+      case BC_HASINPUT:
+        push<int64_t>(input_->hasNext() ? 1 : 0);
+        break;
+
+      case BC_READARRAY: {
+        const Array& a = arrays_.array(pop<int64_t>());
+        int64_t read = 0;
+
+        for (; read < a.length && input_->hasNext(); ++read) {
+          checkFuel(charge + read + 1, fuel);
+          if (a.type == VT_INT) {
+            static_cast<int64_t*>(a.data)[read] = input_->nextInt();
+          } else {
+            static_cast<double*>(a.data)[read] = input_->nextDouble();
+          }
+        }
+
+        push(read);
+        charge += read;
+        break;
+      }
+
+      case BC_INPUTAT: {
+        bool isInt = readFromBcAndShift<uint16_t>() == VT_INT;
+        int64_t index = pop<int64_t>();
+
+        if (isInt) {
+          push(input_->intAt(index));
+        } else {
+          push(input_->doubleAt(index));
+        }
+        break;
+      }
+
+      case BC_INPUTLENGTH:
+        push(input_->length());
+        break;
+    }
+  } catch (const InterpreterException& e) {
+    throw withCallStack(e);
+  }
+
+  return charge;
+}
+
+void BytecodeInterpreter::checkFuel(uint64_t cost, uint64_t fuel) {
+  if (cost > fuel) {
+    throw InterpreterException("Fuel is exhausted");
+  }
+}
+
+// Monotonic time in nanoseconds
+uint64_t BytecodeInterpreter::now() {
+  timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec * 1000000000ULL + time.tv_nsec;
+}
+
+/*
+ * Names of functions on the stack, innermost first: every frame
+ * keeps function to return to, the top level frame returns nowhere.
+ * Frame returns right after its call instruction.
+ */
+InterpreterException BytecodeInterpreter::withCallStack(InterpreterException e, 
+                                                         bool isBetweenInstructions) const {
+  std::vector<std::string> callStack;
+  addCalls(function_->id, instructionPointer_ - (isBetweenInstructions ? 0 : 1), callStack);
+  mem_t frame = stackFramePointer_;
+
+  for (; frameAt(frame)->returnFrame() != stackSize_; frame = frameAt(frame)->returnFrame()) {
+    if (callStack.size() > constants::MAX_CALL_STACK_SHOWN) {
+      break;
+    }
+    addCalls(frameAt(frame)->function(), frameAt(frame)->instruction() - 1, callStack);
+  }
+
+  if (callStack.size() > constants::MAX_CALL_STACK_SHOWN) {
+    callStack.resize(constants::MAX_CALL_STACK_SHOWN);
+    callStack.push_back("...");
+  }
+
+  e.setCallStack(callStack);
+  return e;
+}
+
+static bool isShorter(const InlinedBody* body, const InlinedBody* other) {
+  return body->end - body->start < other->end - other->start;
+}
+
+/*
+ * Calls inlined at offset come before the function, innermost first:
+ * nested body is shorter than the enclosing one or recorded before it.
+ */
+void BytecodeInterpreter::addCalls(uint16_t id, uint32_t offset, 
+                                   std::vector<std::string>& callStack) const {
+  InterpreterFunction* function = code_->functionById(id);
+  std::vector<const InlinedBody*> bodies;
+
+  for (size_t i = 0; i < function->inlined().size(); ++i) {
+    const InlinedBody& body = function->inlined()[i];
+
+    if (body.start <= offset && offset < body.end) {
+      bodies.push_back(&body);
+    }
+  }
+
+  std::stable_sort(bodies.begin(), bodies.end(), isShorter);
+
+  for (size_t i = 0; i < bodies.size(); ++i) {
+    callStack.push_back(code_->functionById(bodies[i]->function)->name());
+  }
+  callStack.push_back(function->name());
+}
+
+/*
+ * Frames grow down from the end of stack, operand stack grows up 
+ * from its beginning; operand stack of a function is small,
+ * so reserve between them is checked only when frames grow.
+ */
+void BytecodeInterpreter::growFrames(mem_t size) {
+  if (stackFramePointer_ - size < stackPointer_ + constants::STACK_RESERVE) {
+    throw withCallStack(InterpreterException("Stack overflow"));
+  }
+
+  stackFramePointer_ -= size;
+}
 
 StackFrame* BytecodeInterpreter::stackFrame() { 
-  return reinterpret_cast<StackFrame*>(stack_ + stackFramePointer_); 
+  return frameAt(stackFramePointer_);
+}
+
+StackFrame* BytecodeInterpreter::frameAt(mem_t frame) const { 
+  return reinterpret_cast<StackFrame*>(stack_ + frame); 
 }
 
 /*
- * functionContext is difference between
- * current function deepness and called function deepness
+ * parentHops is number of parent links to follow 
+ * from current frame to reach parent frame of called function, 
+ * i.e. current function deepness - called function deepness + 1.
  * 
  * For example: 
  *   function void f() {
@@ -153,47 +985,224 @@ StackFrame* BytecodeInterpreter::stackFrame() {
  *
  *     g();
  *   }
- * For call g() from f context is -1;
- * for call f() from g context is 1.
+ * For call g() from f parentHops is 0 (f's frame is parent of g);
+ * for call f() from g parentHops is 2.
+ */
+mem_t BytecodeInterpreter::parentFrame(uint16_t parentHops) {
+  mem_t frame = stackFramePointer_;
+
+  for (; parentHops > 0; --parentHops) {
+    frame = frameAt(frame)->parentFrame();
+  }
+
+  return frame;
+}
+
+void BytecodeInterpreter::allocFrame(uint32_t localsNumber, uint16_t parentHops, bool isMemoized) {
+  mem_t parent = parentFrame(parentHops);
+  mem_t returnFrame = stackFramePointer_;
+  growFrames(sizeof(StackFrame) + constants::VAL_SIZE * localsNumber);
+  *stackFrame() = StackFrame(function_->id, 
+                             instructionPointer_, 
+                             parent,
+                             returnFrame,
+                             isMemoized);
+}
+
+void BytecodeInterpreter::enterFunction(const FunctionRecord* function, uint32_t instruction) {
+  function_ = function;
+  bytecode_ = function->bytecode;
+  instructionPointer_ = instruction;
+}
+
+/*
+ * Call counts are the profile: function called jitThreshold times
+ * is compiled together with functions it calls. Compiled functions 
+ * run on stack of JitCompiler and take arguments right from operand stack.
+ */
+bool BytecodeInterpreter::isNative(FunctionRecord* function) {
+  if (!jit_ || isPreemptive_) {
+    return false;
+  }
+
+  if (function->native) {
+    return true;
+  }
+
+  if (++function->calls != jitThreshold_ || !jit_->compile(function->id)) {
+    return false;
+  }
+
+  for (uint32_t id = 0; id < functionsNumber_; ++id) {
+    functions_[id].native = jit_->entry(id);
+  }
+  return true;
+}
+
+void BytecodeInterpreter::callNative(const FunctionRecord* function) {
+  stackPointer_ -= constants::VAL_SIZE * function->parametersNumber;
+  int64_t result = 0;
+
+  const char* fault = 0;
+
+  switch (jit_->run(function->id, operand<const int64_t>(), &result)) {
+    case NF_NONE: 
+      push(result);
+      return;
+    case NF_STACK_OVERFLOW: fault = "Stack overflow"; break;
+    case NF_DIVISION_BY_ZERO: fault = "Division by zero"; break;
+    case NF_DIVISION_OVERFLOW: fault = "Division overflow"; break;
+  }
+
+  // native frames aren't known, but called function is
+  InterpreterException e = withCallStack(InterpreterException("%s", fault));
+  std::vector<std::string> callStack(1, code_->functionById(function->id)->name());
+  callStack.insert(callStack.end(), e.callStack().begin(), e.callStack().end());
+  e.setCallStack(callStack);
+  throw e;
+}
+
+/*
+ * Pure functions get cache of results by arguments. Call which 
+ * misses it is pending until its frame returns: frame has only 
+ * a flag, since pending calls are nested like frames. Tail call
+ * from memoized frame returns the same result, so it completes 
+ * the same pending call.
  */
-void BytecodeInterpreter::allocFrame(uint16_t functionId, uint32_t localsNumber, int64_t context) {
-  mem_t parentFrame;
-  assert(context >= -1);
+void BytecodeInterpreter::memoize(uint32_t capacity) {
+  PureFunctions pure(code_);
+
+  for (uint32_t id = 0; id < functionsNumber_; ++id) {
+    if (pure.isMemoizable(id)) {
+      functions_[id].memo = new MemoCache(functions_[id].parametersNumber, capacity);
+    }
+  }
+}
 
-  if (context == -1) {
-    parentFrame = stackFramePointer_;
-  } else {
-    mem_t sf = stackFramePointer_;
+void BytecodeInterpreter::printMemoStats(std::ostream& out) const {
+  for (uint32_t id = 0; id < functionsNumber_; ++id) {
+    const MemoCache* memo = functions_[id].memo;
 
-    for (int64_t i = 0; i < context; ++i) {
-      stackFramePointer_ = stackFrame()->parentFrame();
+    if (memo) {
+      out << code_->functionById(id)->name() << ": " 
+          << memo->hits() << " hits, " << memo->misses() << " misses" << std::endl;
     }
+  }
+}
+
+const uint64_t* BytecodeInterpreter::arguments(const FunctionRecord* function) {
+  mem_t args = stackPointer_ - constants::VAL_SIZE * function->parametersNumber;
+  return reinterpret_cast<const uint64_t*>(stack_ + args);
+}
+
+bool BytecodeInterpreter::findMemoized(const FunctionRecord* function) {
+  uint64_t result = 0;
 
-    parentFrame = stackFrame()->parentFrame();
-    stackFramePointer_ = sf;
+  if (!function->memo->find(arguments(function), &result)) {
+    return false;
   }
 
-  mem_t returnFrame = stackFramePointer_;
-  stackFramePointer_ -= (sizeof(StackFrame) + constants::VAL_SIZE * localsNumber);
-  *stackFrame() = StackFrame(function_->id(), 
-                             instructionPointer_, 
-                             parentFrame,
-                             returnFrame);
+  stackPointer_ -= constants::VAL_SIZE * function->parametersNumber;
+  push(result);
+  return true;
 }
 
-void BytecodeInterpreter::callFunction(uint16_t id) {
-  BytecodeFunction* called = code_->functionById(id);
-  allocFrame(called->id(), called->localsNumber(), pop<int64_t>());
-  function_ = called;
-  instructionPointer_ = 0;
+void BytecodeInterpreter::beginMemoized(const FunctionRecord* function) {
+  const uint64_t* args = arguments(function);
+  pendingStarts_.push_back(pendingWords_.size());
+  pendingWords_.push_back(function->id);
+  pendingWords_.insert(pendingWords_.end(), args, args + function->parametersNumber);
+}
+
+void BytecodeInterpreter::endMemoized(uint64_t result) {
+  size_t start = pendingStarts_.back();
+  functions_[pendingWords_[start]].memo->insert(&pendingWords_[start + 1], result);
+  pendingWords_.resize(start);
+  pendingStarts_.pop_back();
+}
+
+void BytecodeInterpreter::callFunction(uint16_t id, uint16_t parentHops) {
+  FunctionRecord* called = functions_ + id;
+  bool isMemoized = called->memo != 0;
+
+  if (isMemoized) {
+    if (findMemoized(called)) {
+      return;
+    }
+    beginMemoized(called);
+  }
+
+  if (isNative(called)) {
+    callNative(called);
+
+    if (isMemoized) {
+      uint64_t result = pop<uint64_t>();
+      push(result);
+      endMemoized(result);
+    }
+    return;
+  }
+
+  allocFrame(called->localsNumber, parentHops, isMemoized);
+  enterFunction(called, 0);
 } 
 
+/*
+ * Current frame is dropped and frame of called function is 
+ * allocated at the same place, so called function returns 
+ * directly to the caller of current function. 
+ * parentHops is never 0 here (see BytecodeGenerator::call), 
+ * so parent frame is always above current frame.
+ */
+void BytecodeInterpreter::tailCallFunction(uint16_t id, uint16_t parentHops) {
+  FunctionRecord* called = functions_ + id;
+  StackFrame current = *stackFrame();
+  bool isMemoized = current.isMemoized();
+  assert(parentHops > 0);
+
+  if (called->memo) {
+    if (findMemoized(called)) {
+      returnFunction();
+      return;
+    }
+
+    if (!isMemoized) {
+      beginMemoized(called);
+      isMemoized = true;
+      *stackFrame() = StackFrame(current.function(), 
+                                 current.instruction(), 
+                                 current.parentFrame(), 
+                                 current.returnFrame(),
+                                 isMemoized);
+    }
+  }
+
+  if (isNative(called)) {
+    callNative(called);
+    returnFunction();
+    return;
+  }
+
+  mem_t parent = parentFrame(parentHops);
+  stackFramePointer_ = current.returnFrame();
+  growFrames(sizeof(StackFrame) + constants::VAL_SIZE * called->localsNumber);
+  *stackFrame() = StackFrame(current.function(), 
+                             current.instruction(), 
+                             parent, 
+                             current.returnFrame(),
+                             isMemoized);
+  enterFunction(called, 0);
+}
+
 void BytecodeInterpreter::returnFunction() {
   uint64_t returnValue = pop<uint64_t>();
   StackFrame* frame = stackFrame();
-  instructionPointer_ = frame->instruction();
+
+  if (frame->isMemoized()) {
+    endMemoized(returnValue);
+  }
   stackFramePointer_  = frame->returnFrame();
-  function_ = code_->functionById(frame->function());
+  enterFunction(functions_ + frame->function(), frame->instruction());
   push(returnValue);
 }
 
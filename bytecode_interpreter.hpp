@@ -2,14 +2,24 @@
 #define BYTECODE_INTERPRETER_HPP
 
 #include "mathvm.h"
+#include "array_arena.hpp"
+#include "errors.hpp"
+#include "input_stream.hpp"
+#include "instructions.hpp"
 #include "interpreter_code.hpp"
+#include "jit_compiler.hpp"
+#include "memoization.hpp"
+#include "profile.hpp"
 #include "utils.hpp"
 
 #include <stdint.h>
 #include <cassert>
 #include <cstddef>
+#include <cstring>
 
 #include <algorithm>
+#include <ostream>
+#include <vector>
 
 namespace mathvm {
 
@@ -17,30 +27,92 @@ typedef int32_t mem_t;
 
 namespace constants {
   const mem_t MAX_STACK_SIZE = 128*1024*1024;
+  // stack kept free for operand stack of current function
+  const mem_t STACK_RESERVE = 64*1024;
+  const uint64_t UNLIMITED_QUANTUM = UINT64_MAX;
+  const uint64_t UNLIMITED_FUEL = UINT64_MAX;
+  // fuel run between checks of deadline
+  const uint64_t SLICE_FUEL = 1 << 20;
+  const size_t MAX_CALL_STACK_SHOWN = 16;
   const mem_t VAL_SIZE = std::max(sizeof(int64_t), sizeof(double));
+  const size_t CACHE_LINE_SIZE = 64;
 }
 
+struct InterpreterOptions {
+  // Number of calls after which function is compiled 
+  // to native code, 0 disables compilation. Native code isn't
+  // metered, so nothing is compiled if fuel or time is limited
+  uint32_t jitThreshold;
+  // Count branches and calls for collectProfile
+  bool isProfiling;
+  // Entries of result cache of every pure function, 0 disables memoization
+  uint32_t memoCapacity;
+  // Bytes of address space for stack, memory is committed as it is used
+  mem_t stackSize;
+  // Where program prints, 0 - std::cout
+  std::ostream* out;
+  // Fuel (about bytes of bytecode executed) program may spend, 0 - unlimited
+  uint64_t fuel;
+  // Milliseconds program may run since interpreter is created, 0 - unlimited
+  uint32_t timeLimit;
+  // File program reads with readInt and the like (see InputStream), 0 - none
+  const char* input;
+
+  InterpreterOptions() 
+    : jitThreshold(0),
+      isProfiling(false),
+      memoCapacity(0),
+      stackSize(constants::MAX_STACK_SIZE),
+      out(0),
+      fuel(0),
+      timeLimit(0),
+      input(0) {}
+};
+
+/*
+ * Everything call/return needs to know about a function,
+ * copied out of InterpreterCodeImpl once at load time.
+ * Indexed by function id.
+ */
+struct FunctionRecord {
+  const uint8_t* bytecode;
+  NativeFunction native; // 0 until function is compiled
+  uint32_t localsNumber;
+  uint32_t calls;        // counted only while JIT is on
+  uint32_t charge;       // fuel charged for call: length of body
+  uint64_t* counters;    // two per bytecode offset while profiling, 0 otherwise
+  MemoCache* memo;       // 0 if function is not memoized
+  uint16_t deepness;
+  uint16_t id;
+  uint16_t parametersNumber;
+};
+
 class StackFrame {
   uint16_t function_;
+  bool isMemoized_; // return completes the last pending memoized call
   uint32_t instruction_;
   mem_t parentFrame_;
   mem_t returnFrame_;
 
 public:
-  StackFrame(uint16_t function, uint32_t instruction, mem_t parentFrame, mem_t returnFrame)
+  StackFrame(uint16_t function, uint32_t instruction, mem_t parentFrame, mem_t returnFrame,
+             bool isMemoized = false)
     : function_(function),
+      isMemoized_(isMemoized),
       instruction_(instruction),
       parentFrame_(parentFrame),
       returnFrame_(returnFrame) {}
 
   StackFrame(const StackFrame& other) 
     : function_(other.function_),
+      isMemoized_(other.isMemoized_),
       instruction_(other.instruction_),
       parentFrame_(other.parentFrame_),
       returnFrame_(other.returnFrame_) {}
 
   StackFrame& operator=(const StackFrame& other) {
     function_ = other.function_;
+    isMemoized_ = other.isMemoized_;
     instruction_ = other.instruction_;
     parentFrame_ = other.parentFrame_;
     returnFrame_ = other.returnFrame_;
@@ -48,6 +120,7 @@ public:
   }
 
   uint16_t function() const { return function_; }
+  bool isMemoized() const { return isMemoized_; }
   uint32_t instruction() const { return instruction_; }
   mem_t parentFrame() const { return parentFrame_; }
   mem_t returnFrame() const { return returnFrame_; }
@@ -55,22 +128,103 @@ public:
 
 class BytecodeInterpreter {
   char* stack_;
+  mem_t stackSize_;
+  std::ostream* out_;
   InterpreterCodeImpl* code_;
-  BytecodeFunction* function_;
+  FunctionRecord* functions_;
+  uint32_t functionsNumber_;
+  uint8_t* bytecodes_;
+  std::vector<uint8_t*> generated_; // bodies generated while running
+  // memoized calls waiting for their result: function id and arguments,
+  // calls are nested like frames
+  std::vector<uint64_t> pendingWords_;
+  std::vector<size_t> pendingStarts_;
+  JitCompiler* jit_;
+  uint32_t jitThreshold_;
+  bool isPreemptive_;    // execute runs for limited quantum
+  bool isProfiling_;
+  uint64_t fuel_;
+  uint64_t deadline_;    // nanoseconds of monotonic clock, 0 - none
+  ArrayArena arrays_;
+  InputStream* input_;   // 0 if program has no input
+  const FunctionRecord* function_;
+  const uint8_t* bytecode_;
   uint32_t instructionPointer_;
+  // operand stack starts past one word, where run keeps
+  // cached top of empty stack
   mem_t stackPointer_;
   mem_t stackFramePointer_;
 
 public:
-  BytecodeInterpreter(Code* code);
+  BytecodeInterpreter(Code* code, const InterpreterOptions& options = InterpreterOptions());
   ~BytecodeInterpreter();
   void execute();
+  // Spends at most quantum of fuel, true if program has stopped.
+  // Interpreter keeps its state, so the next call goes on from there.
+  // Throws InterpreterException with call stack when fuel 
+  // or time limit runs out. Native code of JIT runs to completion,
+  // so it isn't called while quantum is limited
+  bool execute(uint64_t quantum);
+  // Calls function declared at top level of stopped program with
+  // words of its arguments and returns word of its result
+  uint64_t call(uint16_t id, const uint64_t* args);
+  // Branch and call counts of executed code, if profiling
+  void collectProfile(Profile* profile) const;
+  // Cache hits and misses of memoized functions
+  void printMemoStats(std::ostream& out) const;
 
 private:
+  bool run(uint64_t* budget);
+  static uint64_t now();
+  // Error is in instruction before instructionPointer_, unless it is between instructions
+  InterpreterException withCallStack(InterpreterException e, bool isBetweenInstructions = false) const;
+  void addCalls(uint16_t id, uint32_t offset, std::vector<std::string>& callStack) const;
+  void loadFunctions();
+  void loadFunction(InterpreterFunction* function, FunctionRecord* record, uint8_t* bytecode);
+  void generateFunction();
+  void enterFunction(const FunctionRecord* function, uint32_t instruction);
+  void growFrames(mem_t size);
   StackFrame* stackFrame();
-  void allocFrame(uint16_t functionId, uint32_t localsNumber, int64_t context);
-  void callFunction(uint16_t id);
+  StackFrame* frameAt(mem_t frame) const;
+  mem_t parentFrame(uint16_t parentHops);
+  void allocFrame(uint32_t localsNumber, uint16_t parentHops, bool isMemoized = false);
+  bool isNative(FunctionRecord* function);
+  void callNative(const FunctionRecord* function);
+  void memoize(uint32_t capacity);
+  const uint64_t* arguments(const FunctionRecord* function);
+  bool findMemoized(const FunctionRecord* function);
+  void beginMemoized(const FunctionRecord* function);
+  void endMemoized(uint64_t result);
+  void callFunction(uint16_t id, uint16_t parentHops);
+  void tailCallFunction(uint16_t id, uint16_t parentHops);
   void returnFunction();
+  template<typename Offset> void forPrep(int64_t limit);
+  template<typename Offset> uint32_t forLoop();
+  static int64_t divideByPowerOfTwo(int64_t value, uint16_t shift);
+  static int64_t modByPowerOfTwo(int64_t value, uint16_t shift);
+  uint64_t newArray(uint64_t fuel);
+  int64_t arrayLength(int64_t handle);
+  uint64_t arrayOp(uint64_t fuel);
+  uint64_t inputOp(Instruction insn, uint64_t fuel);
+  void checkFuel(uint64_t cost, uint64_t fuel);
+
+  template<typename T>
+  T* element(int64_t handle, int64_t index, bool isChecked) {
+    try {
+      return isChecked ? arrays_.element<T>(handle, index) 
+                       : arrays_.elementInBounds<T>(handle, index);
+    } catch (const InterpreterException& e) {
+      throw withCallStack(e);
+    }
+  }
+
+  // Taken branches are counted at offset of instruction, others
+  // right after it; calls are counted at offset
+  void count(uint32_t offset, bool isTaken = true) {
+    if (function_->counters) {
+      ++function_->counters[2 * offset + (isTaken ? 0 : 1)];
+    }
+  }
 
   template<typename T>
   T* findVar(uint16_t id, uint16_t context) {
@@ -86,21 +240,6 @@ private:
     return t;
   }
 
-  template<typename T>
-  void loadVar(uint16_t id, uint16_t context) {
-    push(*findVar<T>(id, context));
-  }
-
-  template<typename T>
-  void storeVar(uint16_t id, uint16_t context, T val) {
-    *findVar<T>(id, context) = val;
-  }
-
-
-  void remove() {
-    stackPointer_ -= constants::VAL_SIZE;
-  }
-
   template<typename T>
   T* operand() {
     return reinterpret_cast<T*> (stack_ + stackPointer_);
@@ -118,34 +257,20 @@ private:
     stackPointer_ += constants::VAL_SIZE;
   }
 
-  template<typename T>
-  void load() {
-    T val = readFromBc<T>();
-    instructionPointer_ += sizeof(T);
-    push<T>(val);
-  }
-
-  void swap() {
-    int64_t upper = pop<int64_t>();
-    int64_t lower = pop<int64_t>();
-    push(upper);
-    push(lower);
-  }
-
-
-  Bytecode* bc() {
-    return function_->bytecode();
+  Instruction readInsn() {
+    return static_cast<Instruction>(bytecode_[instructionPointer_++]);
   }
 
   template<typename T>
   T readFromBc() {
-    T val = bc()->getTyped<T>(instructionPointer_);
+    T val;
+    memcpy(&val, bytecode_ + instructionPointer_, sizeof(T));
     return val;
   }
 
   template<typename T>
   T readFromBcAndShift() {
-    T val = bc()->getTyped<T>(instructionPointer_);
+    T val = readFromBc<T>();
     instructionPointer_ += sizeof(T);
     return val;
   }
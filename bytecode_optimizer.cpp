@@ -0,0 +1,1510 @@
+#include "bytecode_optimizer.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+namespace mathvm {
+
+namespace {
+
+// First instruction of expression computing each operand stack value
+// of block, -1 for values computed before block
+class ExpressionStarts {
+  std::vector<int64_t> starts_;
+
+public:
+  explicit ExpressionStarts(uint32_t depth) : starts_(depth, -1) {}
+
+  int64_t top(size_t index = 0) const {
+    return starts_[starts_.size() - 1 - index];
+  }
+
+  void execute(uint32_t index, Instruction insn, uint32_t popped, uint32_t pushed) {
+    if (insn == BC_SWAP) {
+      std::swap(starts_[starts_.size() - 1], starts_[starts_.size() - 2]);
+      return;
+    }
+
+    int64_t start = index;
+
+    for (uint32_t i = 0; i < popped; ++i) {
+      start = std::min(start, starts_.back());
+      starts_.pop_back();
+    }
+
+    for (uint32_t i = 0; i < pushed; ++i) {
+      starts_.push_back(start);
+    }
+  }
+};
+
+// Instructions [start, end] are replaced with insn
+// or removed if isRemoval
+struct Replacement {
+  int64_t start;
+  uint32_t end;
+  Insn insn;
+  bool isRemoval;
+
+  Replacement(int64_t start, uint32_t end, const Insn& insn, bool isRemoval = false)
+    : start(start), 
+      end(end), 
+      insn(insn), 
+      isRemoval(isRemoval) {}
+};
+
+// Expressions are either nested or disjoint, 
+// outer one cancels inner ones
+template<typename T>
+void addNested(std::vector<T>& expressions, const T& expression) {
+  while (!expressions.empty() && expressions.back().start >= expression.start) {
+    expressions.pop_back();
+  }
+
+  expressions.push_back(expression);
+}
+
+bool isBranchTaken(Instruction insn, int64_t upper, int64_t lower) {
+  switch (insn) {
+    case BC_IFICMPNE: return upper != lower;
+    case BC_IFICMPE:  return upper == lower;
+    case BC_IFICMPG:  return upper > lower;
+    case BC_IFICMPGE: return upper >= lower;
+    case BC_IFICMPL:  return upper < lower;
+    case BC_IFICMPLE: return upper <= lower;
+    default:
+      assert(false);
+      return false;
+  }
+}
+
+bool isBranchTaken(Instruction insn, double upper, double lower) {
+  switch (static_cast<uint8_t>(insn)) {
+    case BC_IFDCMPNE: return upper != lower;
+    case BC_IFDCMPE:  return upper == lower;
+    case BC_IFDCMPG:  return upper > lower;
+    case BC_IFDCMPGE: return upper >= lower;
+    case BC_IFDCMPL:  return upper < lower;
+    case BC_IFDCMPLE: return upper <= lower;
+    default:
+      assert(false);
+      return false;
+  }
+}
+
+bool isDoubleCompareBranch(Instruction insn) {
+  switch (static_cast<uint8_t>(insn)) {
+    case BC_IFDCMPNE: case BC_IFDCMPE: case BC_IFDCMPG:
+    case BC_IFDCMPGE: case BC_IFDCMPL: case BC_IFDCMPLE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Double comparisons are not, as they can't be inverted: 
+// both one and inverted one are false for NaN
+bool isIntCompareBranch(Instruction insn) {
+  return isConditionalBranch(insn) 
+         && insn != BC_IFORPREP && insn != BC_IFORLOOP 
+         && !isDoubleCompareBranch(insn);
+}
+
+// Branch taken iff insn is not taken
+Instruction invertedBranch(Instruction insn) {
+  switch (insn) {
+    case BC_IFICMPNE: return BC_IFICMPE;
+    case BC_IFICMPE:  return BC_IFICMPNE;
+    case BC_IFICMPG:  return BC_IFICMPLE;
+    case BC_IFICMPGE: return BC_IFICMPL;
+    case BC_IFICMPL:  return BC_IFICMPGE;
+    case BC_IFICMPLE: return BC_IFICMPG;
+    default:
+      assert(false);
+      return insn;
+  }
+}
+
+// Branch comparing the same operands swapped
+Instruction mirroredBranch(Instruction insn) {
+  switch (insn) {
+    case BC_IFICMPG:  return BC_IFICMPL;
+    case BC_IFICMPGE: return BC_IFICMPLE;
+    case BC_IFICMPL:  return BC_IFICMPG;
+    case BC_IFICMPLE: return BC_IFICMPGE;
+    default:          return insn;
+  }
+}
+
+bool isIntConstantLoad(Instruction insn) {
+  switch (insn) {
+    case BC_ILOAD: case BC_ILOAD0: case BC_ILOAD1: case BC_ILOADM1:
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool isLocalLoad(Instruction insn) {
+  return insn == BC_LOADIVAR || insn == BC_LOADDVAR;
+}
+
+Insn localLoad(VarType type, uint16_t id) {
+  Insn insn(type == VT_INT ? BC_LOADIVAR : BC_LOADDVAR);
+  insn.id = id;
+  return insn;
+}
+
+Insn localStore(VarType type, uint16_t id) {
+  Insn insn(type == VT_INT ? BC_STOREIVAR : BC_STOREDVAR);
+  insn.id = id;
+  return insn;
+}
+
+// Division by constant which can't trap
+bool isSafeDivisor(SsaValue* value) {
+  return value->isConstant() 
+         && value->type == VT_INT 
+         && value->intValue != 0 
+         && value->intValue != -1;
+}
+
+// k if value is 2^k, k > 0, otherwise 0
+uint16_t powerOfTwo(int64_t value) {
+  uint16_t power = 0;
+
+  if (value <= 1 || (value & (value - 1)) != 0) {
+    return 0;
+  }
+
+  while (value > 1) {
+    value >>= 1;
+    ++power;
+  }
+
+  return power;
+}
+
+bool isClaimed(const std::vector<bool>& claimed, int64_t start, uint32_t end) {
+  for (uint32_t i = start; i <= end; ++i) {
+    if (claimed[i]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+} // namespace
+
+void BytecodeOptimizer::optimize() {
+  Code::FunctionIterator it(code_);
+
+  while (it.hasNext()) {
+    optimize(static_cast<InterpreterFunction*>(it.next()));
+  }
+}
+
+void BytecodeOptimizer::optimize(InterpreterFunction* function) {
+  function_ = function;
+  std::vector<uint32_t> offsets;
+
+  if (!decode(function->bytecode(), insns_, &offsets)) {
+    return;
+  }
+  markInlined(insns_, offsets, function->inlined());
+
+  if (profile_) {
+    ControlFlowGraph cfg(insns_, function_, code_);
+    if (!cfg.isConsistent()) {
+      return;
+    }
+    layOutBlocks(cfg, offsets);
+  }
+
+  for (uint32_t round = 0; round < constants::MAX_OPTIMIZATION_ROUNDS; ++round) {
+    bool isChanged = false;
+
+    {
+      ControlFlowGraph cfg(insns_, function_, code_);
+      if (!cfg.isConsistent()) {
+        return;
+      }
+      isChanged = eliminateUnreachableCode(cfg) || isChanged;
+      compact(insns_);
+    }
+
+    {
+      ControlFlowGraph cfg(insns_, function_, code_);
+      SsaFunction ssa(insns_, cfg, frames_, function_, code_);
+      isChanged = propagateValues(cfg, ssa) || isChanged;
+      compact(insns_);
+    }
+
+    {
+      ControlFlowGraph cfg(insns_, function_, code_);
+      if (!cfg.isConsistent()) {
+        return;
+      }
+      isChanged = eliminateDeadStores(cfg) || isChanged;
+    }
+
+    {
+      ControlFlowGraph cfg(insns_, function_, code_);
+      isChanged = eliminateDeadValues(cfg) || isChanged;
+      compact(insns_);
+    }
+
+    {
+      ControlFlowGraph cfg(insns_, function_, code_);
+      isChanged = eliminateSwaps(cfg) || isChanged;
+    }
+
+    // loops are optimized after the code is cleaned up
+    if (level_ >= 2 && !isChanged) {
+      {
+        ControlFlowGraph cfg(insns_, function_, code_);
+        SsaFunction ssa(insns_, cfg, frames_, function_, code_);
+        isChanged = hoistInvariants(cfg, ssa) || isChanged;
+        compact(insns_);
+      }
+
+      {
+        ControlFlowGraph cfg(insns_, function_, code_);
+        SsaFunction ssa(insns_, cfg, frames_, function_, code_);
+        isChanged = reduceInductionVariables(cfg, ssa) || isChanged;
+        compact(insns_);
+      }
+
+      {
+        ControlFlowGraph cfg(insns_, function_, code_);
+        isChanged = reduceDivisions(cfg) || isChanged;
+        compact(insns_);
+      }
+    }
+
+    {
+      ControlFlowGraph cfg(insns_, function_, code_);
+      isChanged = threadJumps(cfg) || isChanged;
+      compact(insns_);
+    }
+
+    isChanged = simplifyJumps() || isChanged;
+    compact(insns_);
+
+    if (!isChanged) {
+      break;
+    }
+  }
+
+  Bytecode bytecode;
+  encode(insns_, &bytecode, &offsets);
+  *function->bytecode() = bytecode;
+  function->setInlined(inlinedBodies(insns_, offsets, function->inlined()));
+}
+
+/*
+ * Blocks are chained greedily: chain goes on to the successor 
+ * control goes to more often according to profile (to the next 
+ * block if branch wasn't recorded), until it reaches placed block.
+ * Chains start at blocks in their original order, so cold blocks
+ * sink below hot paths. Branch to the block placed next is inverted
+ * to fall through, and jump is added where fall-through is broken.
+ * Runs on decoded instructions, which are in bytecode order,
+ * at offsets profile is keyed by.
+ */
+bool BytecodeOptimizer::layOutBlocks(const ControlFlowGraph& cfg, 
+                                     const std::vector<uint32_t>& offsets) {
+  uint16_t id = function_->id();
+
+  if (!profile_->isApplicable(id, function_->bytecode()->length())) {
+    return false;
+  }
+
+  std::vector<const BranchCounts*> counts(cfg.size(), 0);
+
+  for (uint32_t i = 0; i < insns_.size(); ++i) {
+    uint32_t baseline = 0;
+    if (isConditionalBranch(insns_[i].insn) && profile_->baselineOffset(id, offsets[i], baseline)) {
+      counts[cfg.blockOf(i)] = profile_->branch(id, baseline);
+    }
+  }
+
+  std::vector<bool> isPlaced(cfg.size(), false);
+  std::vector<uint32_t> order;
+
+  for (uint32_t head = 0; head < cfg.size(); ++head) {
+    for (uint32_t block = head; block < cfg.size() && !isPlaced[block]; 
+         block = hotSuccessor(cfg, block, counts)) {
+      isPlaced[block] = true;
+      order.push_back(block);
+    }
+  }
+
+  bool isChanged = false;
+  for (uint32_t i = 0; i < order.size(); ++i) {
+    isChanged = isChanged || order[i] != i;
+  }
+
+  if (!isChanged) {
+    return false;
+  }
+
+  InsnList insns;
+  std::vector<uint32_t> indexByBlock(cfg.size());
+  // branches of new list by block they go to
+  std::vector<std::pair<uint32_t, uint32_t> > branches;
+
+  for (uint32_t i = 0; i < order.size(); ++i) {
+    const BasicBlock& block = cfg.block(order[i]);
+    uint32_t next = i + 1 < order.size() ? order[i + 1] : cfg.size();
+    uint32_t fallThrough = order[i] + 1;
+    indexByBlock[order[i]] = insns.size();
+
+    for (uint32_t j = block.begin; j < block.end; ++j) {
+      if (isBranch(insns_[j].insn)) {
+        branches.push_back(std::make_pair(insns.size(), cfg.blockOf(insns_[j].target)));
+      }
+      insns.push_back(insns_[j]);
+    }
+
+    Instruction last = insns.back().insn;
+    if (fallThrough >= cfg.size() || fallThrough == next || isTerminator(last)) {
+      continue;
+    }
+
+    if (isIntCompareBranch(last) && branches.back().second == next) {
+      insns.back().insn = invertedBranch(last);
+      branches.back().second = fallThrough;
+      continue;
+    }
+
+    branches.push_back(std::make_pair(insns.size(), fallThrough));
+    insns.push_back(Insn(BC_JA));
+  }
+
+  for (size_t i = 0; i < branches.size(); ++i) {
+    insns[branches[i].first].target = indexByBlock[branches[i].second];
+  }
+
+  insns_.swap(insns);
+  return true;
+}
+
+// Index of block, cfg.size() if control doesn't go anywhere
+uint32_t BytecodeOptimizer::hotSuccessor(const ControlFlowGraph& cfg, uint32_t block,
+                                         const std::vector<const BranchCounts*>& counts) const {
+  const Insn& last = insns_[cfg.block(block).end - 1];
+
+  if (last.insn == BC_JA) {
+    return cfg.blockOf(last.target);
+  }
+
+  if (isTerminator(last.insn)) {
+    return cfg.size();
+  }
+
+  if (isConditionalBranch(last.insn) 
+      && counts[block] 
+      && counts[block]->taken > counts[block]->notTaken) {
+    return cfg.blockOf(last.target);
+  }
+
+  return block + 1;
+}
+
+bool BytecodeOptimizer::eliminateUnreachableCode(const ControlFlowGraph& cfg) {
+  bool isChanged = false;
+
+  for (size_t i = 0; i < cfg.size(); ++i) {
+    const BasicBlock& block = cfg.block(i);
+
+    if (block.isReachable) {
+      continue;
+    }
+
+    for (uint32_t j = block.begin; j < block.end; ++j) {
+      insns_[j].removed = true;
+    }
+
+    isChanged = true;
+  }
+
+  return isChanged;
+}
+
+/*
+ * Owner of value is local variable it is stored to first 
+ * (or local variable of phi). Copy propagation replaces loads 
+ * of other variables holding the value with loads of owner,
+ * so stores to copies become dead.
+ */
+void BytecodeOptimizer::computeOwners(const ControlFlowGraph& cfg, const SsaFunction& ssa, 
+                                      std::map<SsaValue*, uint16_t>& owners) const {
+  for (size_t i = 0; i < cfg.size(); ++i) {
+    const BasicBlock& block = cfg.block(i);
+
+    if (!block.isReachable) {
+      continue;
+    }
+
+    for (uint16_t id = 0; id < function_->localsNumber(); ++id) {
+      SsaValue* value = ssa.localOnEntry(i, id);
+
+      if (value->kind == SsaValue::PHI && value->block == i) {
+        owners.insert(std::make_pair(value, id));
+      }
+    }
+
+    for (uint32_t j = block.begin; j < block.end; ++j) {
+      const InsnEffect& effect = ssa.effect(j);
+
+      for (size_t k = 0; k < effect.defined.size(); ++k) {
+        SsaValue* value = SsaFunction::resolve(effect.defined[k].second);
+        owners.insert(std::make_pair(value, effect.defined[k].first));
+      }
+    }
+  }
+}
+
+bool BytecodeOptimizer::propagateValues(const ControlFlowGraph& cfg, const SsaFunction& ssa) {
+  std::map<SsaValue*, uint16_t> owners;
+  bool isChanged = false;
+
+  computeOwners(cfg, ssa, owners);
+
+  for (size_t b = 0; b < cfg.size(); ++b) {
+    const BasicBlock& block = cfg.block(b);
+
+    if (!block.isReachable) {
+      continue;
+    }
+
+    std::vector<uint32_t> depths;
+    std::vector<SsaValue*> locals(function_->localsNumber());
+    std::vector<Replacement> replacements;
+    ExpressionStarts starts(block.stackDepth);
+
+    computeDepths(block, depths);
+
+    for (uint16_t id = 0; id < locals.size(); ++id) {
+      locals[id] = ssa.localOnEntry(b, id);
+    }
+
+    for (uint32_t i = block.begin; i < block.end; ++i) {
+      const Insn& insn = insns_[i];
+      const InsnEffect& effect = ssa.effect(i);
+      uint32_t popped;
+      uint32_t pushed;
+
+      stackEffect(insn, code_, popped, pushed);
+
+      if (isIntCompareBranch(insn.insn) || isDoubleCompareBranch(insn.insn)) {
+        SsaValue* upper = SsaFunction::resolve(effect.popped[0]);
+        SsaValue* lower = SsaFunction::resolve(effect.popped[1]);
+        int64_t start = std::min(starts.top(0), starts.top(1));
+        VarType type = isDoubleCompareBranch(insn.insn) ? VT_DOUBLE : VT_INT;
+
+        if (upper->isConstant() && upper->type == type
+            && lower->isConstant() && lower->type == type
+            && isExpression(block, depths, start, i, 2)) {
+          Insn jump(BC_JA);
+          jump.target = insn.target;
+          bool isTaken = type == VT_INT 
+                         ? isBranchTaken(insn.insn, upper->intValue, lower->intValue)
+                         : isBranchTaken(insn.insn, upper->doubleValue, lower->doubleValue);
+          addNested(replacements, Replacement(start, i, jump, !isTaken));
+        }
+      }
+
+      starts.execute(i, insn.insn, popped, pushed);
+
+      for (size_t k = 0; k < effect.defined.size(); ++k) {
+        locals[effect.defined[k].first] = SsaFunction::resolve(effect.defined[k].second);
+      }
+
+      VarType type = resultType(insn.insn);
+
+      if (!effect.pushed || (type != VT_INT && type != VT_DOUBLE)) {
+        continue;
+      }
+
+      SsaValue* value = SsaFunction::resolve(effect.pushed);
+      int64_t start = starts.top();
+      bool isSingle = start == i;
+
+      if (value->type != type || !isExpression(block, depths, start, i + 1, 1)) {
+        continue;
+      }
+
+      if (value->isConstant()) {
+        Insn constant = type == VT_INT 
+                        ? intConstant(value->intValue) 
+                        : doubleConstant(value->doubleValue);
+
+        // constant load is replaced only with shorter one
+        if (!isSingle || constant.insn != insn.insn) {
+          addNested(replacements, Replacement(start, i, constant));
+        }
+        continue;
+      }
+
+      std::map<SsaValue*, uint16_t>::const_iterator owner = owners.find(value);
+      int32_t holder = -1;
+
+      if (owner != owners.end() && locals[owner->second] == value) {
+        holder = owner->second;
+      } else if (!isSingle) {
+        for (uint16_t id = 0; id < locals.size() && holder < 0; ++id) {
+          if (locals[id] == value) {
+            holder = id;
+          }
+        }
+      }
+
+      if (holder < 0 || (isSingle && (!isLocalLoad(insn.insn) || insn.id == holder))) {
+        continue;
+      }
+
+      addNested(replacements, Replacement(start, i, localLoad(type, holder)));
+    }
+
+    for (size_t i = 0; i < replacements.size(); ++i) {
+      const Replacement& replacement = replacements[i];
+
+      for (uint32_t j = replacement.start; j < replacement.end; ++j) {
+        insns_[j].removed = true;
+      }
+
+      if (replacement.isRemoval) {
+        insns_[replacement.end].removed = true;
+      } else {
+        replace(insns_, replacement.end, replacement.insn);
+      }
+
+      isChanged = true;
+    }
+  }
+
+  return isChanged;
+}
+
+/*
+ * Store to local variable, which is not read before next store 
+ * or function exit, is replaced with pop. Nested functions
+ * may read any local variable of caller (see FrameAccess).
+ */
+bool BytecodeOptimizer::eliminateDeadStores(const ControlFlowGraph& cfg) {
+  const std::vector<uint32_t>& order = cfg.order();
+  std::vector<Liveness> liveIn(cfg.size(), Liveness(function_->localsNumber(), false));
+  bool isLivenessChanged = true;
+  bool isChanged = false;
+
+  while (isLivenessChanged) {
+    isLivenessChanged = false;
+
+    for (size_t i = order.size(); i > 0; --i) {
+      Liveness live;
+      liveOut(cfg.block(order[i - 1]), liveIn, live);
+      computeLiveness(cfg.block(order[i - 1]), live, false);
+
+      if (live != liveIn[order[i - 1]]) {
+        liveIn[order[i - 1]].swap(live);
+        isLivenessChanged = true;
+      }
+    }
+  }
+
+  for (size_t i = 0; i < order.size(); ++i) {
+    Liveness live;
+    liveOut(cfg.block(order[i]), liveIn, live);
+    isChanged = computeLiveness(cfg.block(order[i]), live, true) || isChanged;
+  }
+
+  return isChanged;
+}
+
+void BytecodeOptimizer::liveOut(const BasicBlock& block, 
+                                const std::vector<Liveness>& liveIn, 
+                                Liveness& live) const {
+  live.assign(function_->localsNumber(), false);
+
+  for (size_t i = 0; i < block.succs.size(); ++i) {
+    const Liveness& succLive = liveIn[block.succs[i]];
+
+    for (size_t id = 0; id < live.size(); ++id) {
+      live[id] = live[id] || succLive[id];
+    }
+  }
+}
+
+/*
+ * Turns liveness on block exit into liveness on block entry.
+ * Returns true if some dead store was removed.
+ */
+bool BytecodeOptimizer::computeLiveness(const BasicBlock& block, 
+                                        Liveness& live, 
+                                        bool removeDeadStores) {
+  bool isChanged = false;
+
+  for (uint32_t i = block.end; i > block.begin; --i) {
+    Insn& insn = insns_[i - 1];
+
+    switch (static_cast<uint8_t>(insn.insn)) {
+      case BC_STOREIVAR:
+      case BC_STOREDVAR:
+        if (removeDeadStores && !live[insn.id]) {
+          insn.insn = BC_POP;
+          isChanged = true;
+        }
+        live[insn.id] = false;
+        break;
+
+      case BC_LOADIVAR:
+      case BC_LOADDVAR:
+        live[insn.id] = true;
+        break;
+
+      case BC_IFORPREP:
+        live[insn.limitId] = false;
+        live[insn.id] = true;
+        break;
+
+      case BC_IFORLOOP:
+        live[insn.id] = true;
+        live[insn.limitId] = true;
+        break;
+
+      case BC_CALLCTX:
+        if (frames_.isCallerAccessed(insn)) {
+          live.assign(live.size(), true);
+        }
+        break;
+
+      default:
+        break;
+    }
+  }
+
+  return isChanged;
+}
+
+/*
+ * Expression which value is popped right away is removed, 
+ * unless it may trap on division by zero.
+ */
+bool BytecodeOptimizer::eliminateDeadValues(const ControlFlowGraph& cfg) {
+  bool isChanged = false;
+
+  for (size_t b = 0; b < cfg.size(); ++b) {
+    const BasicBlock& block = cfg.block(b);
+
+    if (!block.isReachable) {
+      continue;
+    }
+
+    std::vector<uint32_t> depths;
+    ExpressionStarts starts(block.stackDepth);
+
+    computeDepths(block, depths);
+
+    for (uint32_t i = block.begin; i < block.end; ++i) {
+      const Insn& insn = insns_[i];
+      uint32_t popped;
+      uint32_t pushed;
+
+      stackEffect(insn, code_, popped, pushed);
+
+      if (insn.insn == BC_POP && isExpression(block, depths, starts.top(), i, 1)) {
+        bool mayTrap = false;
+
+        for (uint32_t j = starts.top(); j < i; ++j) {
+          mayTrap = mayTrap || insns_[j].insn == BC_IDIV || insns_[j].insn == BC_IMOD;
+        }
+
+        if (!mayTrap) {
+          for (uint32_t j = starts.top(); j <= i; ++j) {
+            insns_[j].removed = true;
+          }
+          isChanged = true;
+        }
+      }
+
+      starts.execute(i, insn.insn, popped, pushed);
+    }
+  }
+
+  return isChanged;
+}
+
+/*
+ * Two side effect free expressions followed by SWAP 
+ * are reordered, and SWAP is removed.
+ */
+bool BytecodeOptimizer::eliminateSwaps(const ControlFlowGraph& cfg) {
+  bool isChanged = false;
+
+  for (size_t b = 0; b < cfg.size(); ++b) {
+    const BasicBlock& block = cfg.block(b);
+
+    if (!block.isReachable) {
+      continue;
+    }
+
+    std::vector<uint32_t> depths;
+    ExpressionStarts starts(block.stackDepth);
+
+    computeDepths(block, depths);
+
+    for (uint32_t i = block.begin; i < block.end; ++i) {
+      const Insn& insn = insns_[i];
+      uint32_t popped;
+      uint32_t pushed;
+
+      if (insn.insn == BC_SWAP) {
+        int64_t lower = starts.top(1);
+        int64_t upper = starts.top(0);
+
+        if (isExpression(block, depths, lower, upper, 1) 
+            && isExpression(block, depths, upper, i, 1)) {
+          std::rotate(insns_.begin() + lower, insns_.begin() + upper, insns_.begin() + i);
+          insns_[i].removed = true;
+          isChanged = true;
+          // expression starts are stale now
+          break;
+        }
+      }
+
+      stackEffect(insn, code_, popped, pushed);
+      starts.execute(i, insn.insn, popped, pushed);
+    }
+  }
+
+  return isChanged;
+}
+
+/*
+ * Block which compares value on top of the stack with constant 
+ * (this is how conditions on booleans computed by comparisons 
+ * and logical operators look) is skipped by predecessors 
+ * pushing constant: they jump to known destination directly.
+ */
+bool BytecodeOptimizer::threadJumps(const ControlFlowGraph& cfg) {
+  bool isChanged = false;
+
+  for (size_t b = 0; b < cfg.size(); ++b) {
+    const BasicBlock& block = cfg.block(b);
+
+    if (!block.isReachable 
+        || block.end - block.begin != 2
+        || !isIntConstantLoad(insns_[block.begin].insn)
+        || !isIntCompareBranch(insns_[block.begin + 1].insn)
+        || block.end == insns_.size()) {
+      continue;
+    }
+
+    const Insn& branch = insns_[block.begin + 1];
+
+    for (size_t i = 0; i < block.preds.size(); ++i) {
+      const BasicBlock& pred = cfg.block(block.preds[i]);
+      Insn& last = insns_[pred.end - 1];
+      uint32_t constant;
+
+      if (last.insn == BC_JA && pred.end - pred.begin >= 2) {
+        constant = pred.end - 2;
+      } else if (pred.end == block.begin && !isBranch(last.insn)) {
+        constant = pred.end - 1;
+      } else {
+        continue;
+      }
+
+      if (!isIntConstantLoad(insns_[constant].insn) || insns_[constant].removed) {
+        continue;
+      }
+
+      bool isTaken = isBranchTaken(branch.insn, 
+                                   insns_[block.begin].intValue, 
+                                   insns_[constant].intValue);
+      Insn jump(BC_JA);
+      jump.target = isTaken ? branch.target : block.end;
+
+      // constant is either removed or replaced with jump
+      insns_[constant].removed = true;
+      last = jump;
+      isChanged = true;
+    }
+  }
+
+  return isChanged;
+}
+
+/*
+ * Jumps to unconditional jumps go directly to their destination,
+ * conditional jumps over unconditional ones are inverted, 
+ * unconditional jumps to next instruction are removed,
+ * and ICMP result compared with 0 is replaced with direct comparison.
+ */
+bool BytecodeOptimizer::simplifyJumps() {
+  std::vector<bool> isTarget(insns_.size() + 1, false);
+  bool isChanged = false;
+
+  for (size_t i = 0; i < insns_.size(); ++i) {
+    Insn& insn = insns_[i];
+
+    if (!isBranch(insn.insn)) {
+      continue;
+    }
+
+    uint32_t target = insn.target;
+
+    // hop limit guards against jump cycles
+    for (uint32_t hops = 0; hops < insns_.size() && insns_[target].insn == BC_JA; ++hops) {
+      target = insns_[target].target;
+    }
+
+    if (target != insn.target && insns_[target].insn != BC_JA) {
+      insn.target = target;
+      isChanged = true;
+    }
+
+    isTarget[insn.target] = true;
+  }
+
+  for (size_t i = 0; i + 2 < insns_.size(); ++i) {
+    Insn& insn = insns_[i];
+    Insn& next = insns_[i + 1];
+
+    if (isIntCompareBranch(insn.insn) 
+        && next.insn == BC_JA 
+        && insn.target == i + 2 
+        && !isTarget[i + 1]) {
+      insn.insn = invertedBranch(insn.insn);
+      insn.target = next.target;
+      next.removed = true;
+      isChanged = true;
+    }
+
+    if (insn.insn == BC_ICMP 
+        && isIntConstantLoad(next.insn) && next.intValue == 0
+        && isIntCompareBranch(insns_[i + 2].insn)
+        && !isTarget[i + 1] && !isTarget[i + 2]) {
+      insn.removed = true;
+      next.removed = true;
+      insns_[i + 2].insn = mirroredBranch(insns_[i + 2].insn);
+      isChanged = true;
+    }
+  }
+
+  uint32_t next = insns_.size();
+
+  for (size_t i = insns_.size(); i > 0; --i) {
+    Insn& insn = insns_[i - 1];
+
+    if (insn.removed) {
+      continue;
+    }
+
+    if (insn.insn == BC_JA && insn.target == next) {
+      insn.removed = true;
+      isChanged = true;
+    } else {
+      next = i - 1;
+    }
+  }
+
+  return isChanged;
+}
+
+/*
+ * Loop invariant expression, which value can be computed 
+ * before the loop, is computed in loop preheader and stored 
+ * to new local variable; expression is replaced with its load.
+ * Division is hoisted only if it can't trap, since loop 
+ * may not execute it at all.
+ */
+bool BytecodeOptimizer::hoistInvariants(const ControlFlowGraph& cfg, const SsaFunction& ssa) {
+  std::vector<Loop> loops;
+  std::vector<Insertion> insertions;
+  std::vector<bool> claimed(insns_.size(), false);
+  // ssa form doesn't know about new local variables
+  uint16_t localsNumber = function_->localsNumber();
+
+  cfg.findLoops(loops);
+
+  for (size_t l = 0; l < loops.size(); ++l) {
+    const Loop& loop = loops[l];
+    uint32_t preheader;
+
+    if (!findPreheader(cfg, loop, preheader)) {
+      continue;
+    }
+
+    std::vector<SsaValue*> locals(localsNumber);
+    std::vector<LoopValue> values;
+    std::vector<LoopValue> invariants;
+    std::map<SsaValue*, uint16_t> temporaries;
+    Insertion insertion(cfg.block(loop.header).begin);
+
+    for (uint16_t id = 0; id < locals.size(); ++id) {
+      locals[id] = ssa.localOnExit(preheader, id);
+    }
+
+    collectLoopValues(cfg, ssa, loop, values);
+
+    for (size_t i = 0; i < values.size(); ++i) {
+      InsnList code;
+
+      if (materialize(values[i].value, locals, Substitution(), code)) {
+        addNested(invariants, values[i]);
+      }
+    }
+
+    for (size_t i = 0; i < invariants.size(); ++i) {
+      const LoopValue& invariant = invariants[i];
+      VarType type = invariant.value->type;
+
+      if (isClaimed(claimed, invariant.start, invariant.end)) {
+        continue;
+      }
+
+      std::map<SsaValue*, uint16_t>::const_iterator it = temporaries.find(invariant.value);
+
+      if (it == temporaries.end()) {
+        int32_t id = newLocal();
+
+        if (id < 0) {
+          break;
+        }
+
+        materialize(invariant.value, locals, Substitution(), insertion.code);
+        insertion.code.push_back(localStore(type, id));
+        it = temporaries.insert(std::make_pair(invariant.value, id)).first;
+      }
+
+      for (uint32_t j = invariant.start; j < invariant.end; ++j) {
+        insns_[j].removed = true;
+        claimed[j] = true;
+      }
+
+      replace(insns_, invariant.end, localLoad(type, it->second));
+      claimed[invariant.end] = true;
+    }
+
+    if (!insertion.code.empty()) {
+      insertion.bypassing.push_back(cfg.block(loop.latch).end - 1);
+      insertions.push_back(insertion);
+    }
+  }
+
+  insert(insns_, insertions);
+  return !insertions.empty();
+}
+
+/*
+ * Basic induction variable is local variable incremented by constant
+ * step once per iteration, by the last definition of it in loop latch.
+ * Expression which is affine function of induction variable with loop
+ * invariant coefficients gets new local variable, which is computed 
+ * in preheader and incremented by its own step in place of induction 
+ * variable increment. Both are in int arithmetic, which wraps around,
+ * so results are exact. This is done only if update executes less 
+ * instructions than expressions replaced with loads of new variable.
+ */
+bool BytecodeOptimizer::reduceInductionVariables(const ControlFlowGraph& cfg, 
+                                                 const SsaFunction& ssa) {
+  std::vector<Loop> loops;
+  std::vector<Insertion> insertions;
+  std::vector<bool> claimed(insns_.size(), false);
+  // ssa form doesn't know about new local variables
+  uint16_t localsNumber = function_->localsNumber();
+
+  cfg.findLoops(loops);
+
+  for (size_t l = 0; l < loops.size(); ++l) {
+    const Loop& loop = loops[l];
+    const BasicBlock& header = cfg.block(loop.header);
+    const BasicBlock& latch = cfg.block(loop.latch);
+    uint32_t preheader;
+
+    if (!findPreheader(cfg, loop, preheader)) {
+      continue;
+    }
+
+    std::vector<SsaValue*> locals(localsNumber);
+    std::vector<LoopValue> values;
+    Insertion initialization(header.begin);
+    size_t entry = std::find(header.preds.begin(), header.preds.end(), preheader) 
+                   - header.preds.begin();
+    size_t back = std::find(header.preds.begin(), header.preds.end(), loop.latch) 
+                  - header.preds.begin();
+
+    for (uint16_t id = 0; id < locals.size(); ++id) {
+      locals[id] = ssa.localOnExit(preheader, id);
+    }
+
+    collectLoopValues(cfg, ssa, loop, values);
+
+    for (uint16_t id = 0; id < locals.size(); ++id) {
+      SsaValue* variable = ssa.localOnEntry(loop.header, id);
+
+      if (variable->kind != SsaValue::PHI 
+          || variable->block != loop.header 
+          || variable->type != VT_INT) {
+        continue;
+      }
+
+      SsaValue* initial = SsaFunction::resolve(variable->operands[entry]);
+      SsaValue* next = SsaFunction::resolve(variable->operands[back]);
+
+      if (next->kind != SsaValue::OPERATION || next->op != BC_IADD) {
+        continue;
+      }
+
+      SsaValue* step = SsaFunction::resolve(next->operands[0]);
+
+      if (step == variable) {
+        step = SsaFunction::resolve(next->operands[1]);
+      } else if (SsaFunction::resolve(next->operands[1]) != variable) {
+        continue;
+      }
+
+      if (!step->isConstant() || step->type != VT_INT) {
+        continue;
+      }
+
+      int64_t increment = -1;
+
+      for (uint32_t i = latch.begin; i < latch.end; ++i) {
+        const InsnEffect& effect = ssa.effect(i);
+
+        for (size_t k = 0; k < effect.defined.size(); ++k) {
+          if (effect.defined[k].first == id) {
+            increment = SsaFunction::resolve(effect.defined[k].second) == next ? i : -1;
+          }
+        }
+      }
+
+      // update goes right after increment, before IFORLOOP checks the limit
+      uint32_t update;
+
+      if (increment < 0) {
+        continue;
+      } else if (insns_[increment].insn == BC_STOREIVAR) {
+        update = increment + 1;
+      } else if (insns_[increment].insn == BC_IFORLOOP) {
+        update = increment;
+      } else {
+        continue;
+      }
+
+      std::vector<LoopValue> reduced;
+      std::map<SsaValue*, uint32_t> savings;
+
+      for (size_t i = 0; i < values.size(); ++i) {
+        const LoopValue& value = values[i];
+
+        // new variable is already incremented there
+        if (cfg.blockOf(value.end) == loop.latch && value.end >= increment) {
+          continue;
+        }
+
+        if (value.value->type == VT_INT 
+            && value.value != variable 
+            && isAffine(value.value, variable, locals)) {
+          addNested(reduced, value);
+        }
+      }
+
+      for (size_t i = 0; i < reduced.size(); ++i) {
+        if (!isClaimed(claimed, reduced[i].start, reduced[i].end)) {
+          savings[reduced[i].value] += reduced[i].end - reduced[i].start;
+        }
+      }
+
+      Substitution initialSubstitution;
+      Substitution nextSubstitution;
+      InsnList& initialCode = initialSubstitution[variable];
+      InsnList& nextCode = nextSubstitution[variable];
+      std::map<SsaValue*, uint16_t> temporaries;
+      Insertion updating(update);
+
+      if (!materialize(initial, locals, Substitution(), initialCode)) {
+        continue;
+      }
+
+      nextCode = initialCode;
+      nextCode.push_back(intConstant(step->intValue));
+      nextCode.push_back(Insn(BC_IADD));
+
+      for (size_t i = 0; i < reduced.size(); ++i) {
+        const LoopValue& value = reduced[i];
+
+        if (isClaimed(claimed, value.start, value.end)
+            || savings[value.value] <= constants::INDUCTION_UPDATE_SIZE) {
+          continue;
+        }
+
+        std::map<SsaValue*, uint16_t>::const_iterator it = temporaries.find(value.value);
+
+        if (it == temporaries.end()) {
+          InsnList code;
+
+          // value on the first iteration and its change per iteration
+          if (!materialize(value.value, locals, initialSubstitution, code) 
+              || !materialize(value.value, locals, nextSubstitution, code)
+              || function_->localsNumber() > UINT16_MAX - 2) {
+            continue;
+          }
+
+          uint16_t reducedId = newLocal();
+          uint16_t stepId = newLocal();
+          code.clear();
+
+          materialize(value.value, locals, initialSubstitution, code);
+          code.push_back(localStore(VT_INT, reducedId));
+          code.push_back(localLoad(VT_INT, reducedId));
+          materialize(value.value, locals, nextSubstitution, code);
+          code.push_back(Insn(BC_ISUB));
+          code.push_back(localStore(VT_INT, stepId));
+          initialization.code.insert(initialization.code.end(), code.begin(), code.end());
+
+          updating.code.push_back(localLoad(VT_INT, reducedId));
+          updating.code.push_back(localLoad(VT_INT, stepId));
+          updating.code.push_back(Insn(BC_IADD));
+          updating.code.push_back(localStore(VT_INT, reducedId));
+
+          it = temporaries.insert(std::make_pair(value.value, reducedId)).first;
+        }
+
+        for (uint32_t j = value.start; j < value.end; ++j) {
+          insns_[j].removed = true;
+          claimed[j] = true;
+        }
+
+        replace(insns_, value.end, localLoad(VT_INT, it->second));
+        claimed[value.end] = true;
+      }
+
+      if (!updating.code.empty()) {
+        insertions.push_back(updating);
+      }
+    }
+
+    if (!initialization.code.empty()) {
+      initialization.bypassing.push_back(latch.end - 1);
+      insertions.push_back(initialization);
+    }
+  }
+
+  insert(insns_, insertions);
+  return !insertions.empty();
+}
+
+/*
+ * Division and remainder of int by constant 2^k, which is pushed
+ * right before dividend, are replaced with IDIVPOW2 and IMODPOW2.
+ */
+bool BytecodeOptimizer::reduceDivisions(const ControlFlowGraph& cfg) {
+  bool isChanged = false;
+
+  for (size_t b = 0; b < cfg.size(); ++b) {
+    const BasicBlock& block = cfg.block(b);
+
+    if (!block.isReachable) {
+      continue;
+    }
+
+    std::vector<uint32_t> depths;
+    ExpressionStarts starts(block.stackDepth);
+
+    computeDepths(block, depths);
+
+    for (uint32_t i = block.begin; i < block.end; ++i) {
+      Insn& insn = insns_[i];
+      // depths are not updated, so starts follow the old code
+      Instruction executed = insn.insn;
+      uint32_t popped;
+      uint32_t pushed;
+
+      stackEffect(insn, code_, popped, pushed);
+
+      if (insn.insn == BC_IDIV || insn.insn == BC_IMOD) {
+        int64_t divisor = starts.top(1);
+        int64_t dividend = starts.top(0);
+        uint16_t power = 0;
+
+        if (divisor >= block.begin 
+            && dividend == divisor + 1 
+            && isIntConstantLoad(insns_[divisor].insn)) {
+          power = powerOfTwo(insns_[divisor].intValue);
+        }
+
+        if (power > 0 && isStackContained(block, depths, dividend, i, 1)) {
+          Insn reduced(insn.insn == BC_IDIV ? BC_IDIVPOW2 : BC_IMODPOW2);
+          reduced.id = power;
+          insns_[divisor].removed = true;
+          insn = reduced;
+          isChanged = true;
+        }
+      }
+
+      starts.execute(i, executed, popped, pushed);
+    }
+  }
+
+  return isChanged;
+}
+
+bool BytecodeOptimizer::findPreheader(const ControlFlowGraph& cfg, 
+                                      const Loop& loop, 
+                                      uint32_t& preheader) const {
+  const BasicBlock& header = cfg.block(loop.header);
+  const BasicBlock& latch = cfg.block(loop.latch);
+  const Insn& back = insns_[latch.end - 1];
+  size_t entries = 0;
+
+  // only jump can bypass code inserted before header
+  if (loop.header == 0 
+      || !isBranch(back.insn) 
+      || back.target != header.begin
+      || (latch.end == header.begin && !isTerminator(back.insn))) {
+    return false;
+  }
+
+  for (size_t i = 0; i < header.preds.size(); ++i) {
+    if (!loop.body[header.preds[i]]) {
+      preheader = header.preds[i];
+      ++entries;
+    }
+  }
+
+  return entries == 1;
+}
+
+// Expressions of loop body computing int and double values 
+// (not constants), which are longer than one instruction
+void BytecodeOptimizer::collectLoopValues(const ControlFlowGraph& cfg, 
+                                          const SsaFunction& ssa,
+                                          const Loop& loop, 
+                                          std::vector<LoopValue>& values) const {
+  for (size_t b = 0; b < cfg.size(); ++b) {
+    if (!loop.body[b]) {
+      continue;
+    }
+
+    const BasicBlock& block = cfg.block(b);
+    std::vector<uint32_t> depths;
+    ExpressionStarts starts(block.stackDepth);
+
+    computeDepths(block, depths);
+
+    for (uint32_t i = block.begin; i < block.end; ++i) {
+      const Insn& insn = insns_[i];
+      const InsnEffect& effect = ssa.effect(i);
+      VarType type = resultType(insn.insn);
+      uint32_t popped;
+      uint32_t pushed;
+
+      stackEffect(insn, code_, popped, pushed);
+      starts.execute(i, insn.insn, popped, pushed);
+
+      if (!effect.pushed || (type != VT_INT && type != VT_DOUBLE)) {
+        continue;
+      }
+
+      SsaValue* value = SsaFunction::resolve(effect.pushed);
+      int64_t start = starts.top();
+
+      if (start != i 
+          && value->type == type 
+          && !value->isConstant() 
+          && isExpression(block, depths, start, i + 1, 1)) {
+        values.push_back(LoopValue(start, i, value));
+      }
+    }
+  }
+}
+
+bool BytecodeOptimizer::materialize(SsaValue* value, 
+                                    const std::vector<SsaValue*>& locals,
+                                    const Substitution& substitution, 
+                                    InsnList& code) const {
+  uint32_t budget = constants::MAX_MATERIALIZED_SIZE;
+  return materialize(value, locals, substitution, code, budget);
+}
+
+/*
+ * Appends code computing value from constants and values 
+ * of local variables to code. Returns false if value 
+ * can't be computed so or the code is too long.
+ */
+bool BytecodeOptimizer::materialize(SsaValue* value, 
+                                    const std::vector<SsaValue*>& locals,
+                                    const Substitution& substitution, 
+                                    InsnList& code, 
+                                    uint32_t& budget) const {
+  value = SsaFunction::resolve(value);
+
+  if (budget == 0) {
+    return false;
+  }
+  --budget;
+
+  Substitution::const_iterator it = substitution.find(value);
+
+  if (it != substitution.end()) {
+    code.insert(code.end(), it->second.begin(), it->second.end());
+    return true;
+  }
+
+  if (value->type != VT_INT && value->type != VT_DOUBLE) {
+    return false;
+  }
+
+  if (value->isConstant()) {
+    code.push_back(value->type == VT_INT 
+                   ? intConstant(value->intValue) 
+                   : doubleConstant(value->doubleValue));
+    return true;
+  }
+
+  for (uint16_t id = 0; id < locals.size(); ++id) {
+    if (locals[id] == value) {
+      code.push_back(localLoad(value->type, id));
+      return true;
+    }
+  }
+
+  if (value->kind != SsaValue::OPERATION) {
+    return false;
+  }
+
+  if ((value->op == BC_IDIV || value->op == BC_IMOD) 
+      && !isSafeDivisor(SsaFunction::resolve(value->operands[1]))) {
+    return false;
+  }
+
+  // lower operand is pushed first
+  for (size_t i = value->operands.size(); i > 0; --i) {
+    if (!materialize(value->operands[i - 1], locals, substitution, code, budget)) {
+      return false;
+    }
+  }
+
+  code.push_back(Insn(value->op));
+  return true;
+}
+
+/*
+ * Value is a * variable + b, where a and b are computable 
+ * from constants and local variables.
+ */
+bool BytecodeOptimizer::isAffine(SsaValue* value, SsaValue* variable, 
+                                 const std::vector<SsaValue*>& locals) const {
+  value = SsaFunction::resolve(value);
+
+  if (value == variable) {
+    return true;
+  }
+
+  if (value->kind != SsaValue::OPERATION || value->type != VT_INT) {
+    return false;
+  }
+
+  InsnList code;
+
+  switch (value->op) {
+    case BC_INEG:
+      return isAffine(value->operands[0], variable, locals);
+
+    case BC_IADD:
+    case BC_ISUB:
+    case BC_IMUL:
+      if (materialize(value->operands[0], locals, Substitution(), code)) {
+        return isAffine(value->operands[1], variable, locals);
+      }
+      return materialize(value->operands[1], locals, Substitution(), code)
+             && isAffine(value->operands[0], variable, locals);
+
+    default:
+      return false;
+  }
+}
+
+// New local variable for temporary value, -1 if there are too many
+int32_t BytecodeOptimizer::newLocal() {
+  uint16_t id = function_->localsNumber();
+
+  if (id == UINT16_MAX) {
+    return -1;
+  }
+
+  function_->setLocalsNumber(id + 1);
+  return id;
+}
+
+void BytecodeOptimizer::computeDepths(const BasicBlock& block, std::vector<uint32_t>& depths) const {
+  depths.resize(block.end - block.begin + 1);
+  depths[0] = block.stackDepth;
+
+  for (uint32_t i = block.begin; i < block.end; ++i) {
+    uint32_t popped;
+    uint32_t pushed;
+    stackEffect(insns_[i], code_, popped, pushed);
+    depths[i - block.begin + 1] = depths[i - block.begin] - popped + pushed;
+  }
+}
+
+/*
+ * Instructions [start, end) are side effect free, push 
+ * values values and don't touch the stack below.
+ */
+bool BytecodeOptimizer::isExpression(const BasicBlock& block, 
+                                     const std::vector<uint32_t>& depths,
+                                     int64_t start, uint32_t end, uint32_t values) const {
+  if (!isStackContained(block, depths, start, end, values)) {
+    return false;
+  }
+
+  for (uint32_t i = start; i < end; ++i) {
+    if (!isSideEffectFree(insns_[i].insn)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/*
+ * Instructions [start, end) push values values 
+ * and don't touch the stack below.
+ */
+bool BytecodeOptimizer::isStackContained(const BasicBlock& block, 
+                                         const std::vector<uint32_t>& depths,
+                                         int64_t start, uint32_t end, uint32_t values) const {
+  if (start < block.begin || start >= end) {
+    return false;
+  }
+
+  uint32_t base = depths[start - block.begin];
+
+  if (depths[end - block.begin] != base + values) {
+    return false;
+  }
+
+  for (uint32_t i = start; i < end; ++i) {
+    if (depths[i - block.begin] < base + popped(i)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+uint32_t BytecodeOptimizer::popped(uint32_t insn) const {
+  uint32_t popped;
+  uint32_t pushed;
+  stackEffect(insns_[insn], code_, popped, pushed);
+  return popped;
+}
+
+} // namespace mathvm
@@ -0,0 +1,130 @@
+#ifndef BYTECODE_OPTIMIZER_HPP
+#define BYTECODE_OPTIMIZER_HPP
+
+#include "mathvm.h"
+#include "interpreter_code.hpp"
+#include "insn_list.hpp"
+#include "control_flow.hpp"
+#include "ssa.hpp"
+#include "frame_access.hpp"
+#include "profile.hpp"
+
+#include <map>
+#include <vector>
+
+#include <stdint.h>
+
+namespace mathvm {
+
+namespace constants {
+  const uint32_t MAX_OPTIMIZATION_ROUNDS = 16;
+  // instructions in value computed in loop preheader
+  const uint32_t MAX_MATERIALIZED_SIZE = 16;
+  // instructions executed to update reduced induction variable
+  const uint32_t INDUCTION_UPDATE_SIZE = 4;
+}
+
+/*
+ * Middle end working on generated bytecode. Every function 
+ * is decoded to instruction list, then rounds of
+ *   - unreachable code elimination,
+ *   - value propagation: constant and copy propagation, 
+ *     common subexpression elimination and folding of constant 
+ *     branches, driven by value numbers of ssa form,
+ *   - dead store and dead value elimination,
+ *   - reordering of expressions swapped by SWAP,
+ *   - jump threading and simplification,
+ * and on level 2
+ *   - loop invariant code motion,
+ *   - strength reduction of induction variables and
+ *     of division by powers of two
+ * are run until nothing changes, and bytecode is encoded back.
+ * With profile, blocks are laid out along hot paths first.
+ *
+ * Apart from layout, instructions are never moved: expression (side effect free
+ * instructions computing single stack value) is replaced 
+ * with constant or with load of local variable holding the 
+ * same value, and dead expressions are removed. Loop optimizations
+ * recompute values in loop preheader from ssa form instead.
+ * Function is left as is if its bytecode can't be decoded.
+ */
+// Expression [start, end] of loop computing int or double value
+struct LoopValue {
+  int64_t start;
+  uint32_t end;
+  SsaValue* value;
+
+  LoopValue(int64_t start, uint32_t end, SsaValue* value)
+    : start(start), 
+      end(end), 
+      value(value) {}
+};
+
+class BytecodeOptimizer {
+  typedef std::vector<bool> Liveness;
+  // values computed by given code instead of their ssa form
+  typedef std::map<SsaValue*, InsnList> Substitution;
+
+  InterpreterCodeImpl* code_;
+  FrameAccess frames_;
+  uint32_t level_;
+  const Profile* profile_;
+  InterpreterFunction* function_;
+  InsnList insns_;
+
+public:
+  BytecodeOptimizer(InterpreterCodeImpl* code, uint32_t level, const Profile* profile = 0)
+    : code_(code), 
+      frames_(code),
+      level_(level),
+      profile_(profile),
+      function_(0) {}
+
+  void optimize();
+
+private:
+  void optimize(InterpreterFunction* function);
+  bool layOutBlocks(const ControlFlowGraph& cfg, const std::vector<uint32_t>& offsets);
+  uint32_t hotSuccessor(const ControlFlowGraph& cfg, uint32_t block, 
+                        const std::vector<const BranchCounts*>& counts) const;
+  bool eliminateUnreachableCode(const ControlFlowGraph& cfg);
+  bool propagateValues(const ControlFlowGraph& cfg, const SsaFunction& ssa);
+  bool eliminateDeadStores(const ControlFlowGraph& cfg);
+  bool eliminateDeadValues(const ControlFlowGraph& cfg);
+  bool eliminateSwaps(const ControlFlowGraph& cfg);
+  bool threadJumps(const ControlFlowGraph& cfg);
+  bool simplifyJumps();
+  bool hoistInvariants(const ControlFlowGraph& cfg, const SsaFunction& ssa);
+  bool reduceInductionVariables(const ControlFlowGraph& cfg, const SsaFunction& ssa);
+  bool reduceDivisions(const ControlFlowGraph& cfg);
+
+  void liveOut(const BasicBlock& block, 
+               const std::vector<Liveness>& liveIn, 
+               Liveness& live) const;
+  bool computeLiveness(const BasicBlock& block, Liveness& live, bool removeDeadStores);
+
+  void computeOwners(const ControlFlowGraph& cfg, const SsaFunction& ssa, 
+                     std::map<SsaValue*, uint16_t>& owners) const;
+  void computeDepths(const BasicBlock& block, std::vector<uint32_t>& depths) const;
+  bool isExpression(const BasicBlock& block, const std::vector<uint32_t>& depths,
+                    int64_t start, uint32_t end, uint32_t values) const;
+  bool isStackContained(const BasicBlock& block, const std::vector<uint32_t>& depths,
+                        int64_t start, uint32_t end, uint32_t values) const;
+
+  bool findPreheader(const ControlFlowGraph& cfg, const Loop& loop, uint32_t& preheader) const;
+  void collectLoopValues(const ControlFlowGraph& cfg, const SsaFunction& ssa, 
+                         const Loop& loop, std::vector<LoopValue>& values) const;
+  bool materialize(SsaValue* value, const std::vector<SsaValue*>& locals,
+                   const Substitution& substitution, InsnList& code) const;
+  bool materialize(SsaValue* value, const std::vector<SsaValue*>& locals,
+                   const Substitution& substitution, InsnList& code, 
+                   uint32_t& budget) const;
+  bool isAffine(SsaValue* value, SsaValue* variable, 
+                const std::vector<SsaValue*>& locals) const;
+  int32_t newLocal();
+  uint32_t popped(uint32_t insn) const;
+};
+
+} // namespace mathvm
+
+#endif
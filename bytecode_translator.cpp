@@ -2,6 +2,7 @@
 #include "parser.h"
 #include "interpreter_code.hpp"
 #include "bytecode_generator.hpp"
+#include "bytecode_optimizer.hpp"
 #include "utils.hpp"
 
 #include <cstdlib>
@@ -34,15 +35,27 @@ Status* BytecodeTranslatorImpl::translateBytecode(
   InterpreterCodeImpl** result
 ) {
   InterpreterCodeImpl* code = 0;
-  Parser parser;
+  Parser* parser = new Parser();
 
-  Status* status = parser.parseProgram(program);
+  Status* status = parser->parseProgram(program);
   
   if (status->isOk()) {
     delete status;
     code = new InterpreterCodeImpl();
-    BytecodeGenerator codegen(parser.top(), code);
-    status = codegen.generate();
+    // code keeps generator with ast to generate other bodies on first call
+    BytecodeGenerator* codegen = new BytecodeGenerator(parser, code, GeneratorOptions::global());
+    code->setGenerator(codegen);
+    status = codegen->generate();
+  } else {
+    delete parser;
+  }
+
+  const GeneratorOptions& options = GeneratorOptions::global();
+
+  if (status->isOk() && options.optimizationLevel > 0) {
+    code->generateAll();
+    BytecodeOptimizer optimizer(code, options.optimizationLevel, options.profile);
+    optimizer.optimize();
   }
 
   if (status->isError()) {
@@ -0,0 +1,603 @@
+#include "c_generator.hpp"
+#include "control_flow.hpp"
+#include "errors.hpp"
+#include "instructions.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#include <unistd.h>
+
+namespace mathvm {
+
+namespace constants {
+  // Native stack of compiled program: deeper than interpreter stack
+  // can hold, as C frames are not smaller than interpreter ones
+  const size_t NATIVE_STACK_SIZE = 1024*1024*1024;
+  // Stack left below deepest checked frame for frame itself and C library
+  const size_t NATIVE_STACK_RESERVE = 1024*1024;
+  // Stack of main thread without limit, if thread could not be created
+  const size_t DEFAULT_STACK_SIZE = 8*1024*1024;
+}
+
+static const char* const PRELUDE =
+  "#include <inttypes.h>\n"
+  "#include <math.h>\n"
+  "#include <pthread.h>\n"
+  "#include <setjmp.h>\n"
+  "#include <stdint.h>\n"
+  "#include <stdio.h>\n"
+  "#include <sys/resource.h>\n"
+  "\n"
+  "typedef union { int64_t i; double d; } Value;\n"
+  "typedef struct Frame { struct Frame* parent; Value v[]; } Frame;\n"
+  "typedef struct { const char* text; size_t length; } String;\n"
+  "\n"
+  "static jmp_buf stop;\n"
+  "static int status;\n"
+  "static char* stackLimit;\n"
+  "\n"
+  "/* ends program with error, as interpreter does on exception */\n"
+  "static void fail(const char* message) {\n"
+  "  fflush(stdout);\n"
+  "  fprintf(stderr, \"%s\\n\", message);\n"
+  "  status = 1;\n"
+  "  longjmp(stop, 1);\n"
+  "}\n"
+  "\n";
+
+static const char* const ENTRY =
+  "static void* run(void* stackSize) {\n"
+  "  stackLimit = (char*) __builtin_frame_address(0) - (size_t) stackSize + %lu;\n"
+  "  if (!setjmp(stop)) {\n"
+  "    f0(0);\n"
+  "  }\n"
+  "  fflush(stdout);\n"
+  "  return 0;\n"
+  "}\n"
+  "\n"
+  "int mvm_main(void) {\n"
+  "  pthread_attr_t attributes;\n"
+  "  pthread_t thread;\n"
+  "  struct rlimit limit;\n"
+  "  pthread_attr_init(&attributes);\n"
+  "  pthread_attr_setstacksize(&attributes, %lu);\n"
+  "  if (pthread_create(&thread, &attributes, run, (void*) %lu) != 0) {\n"
+  "    getrlimit(RLIMIT_STACK, &limit);\n"
+  "    run((void*) (limit.rlim_cur == RLIM_INFINITY ? %lu : limit.rlim_cur));\n"
+  "  } else {\n"
+  "    pthread_join(thread, 0);\n"
+  "  }\n"
+  "  return status;\n"
+  "}\n";
+
+// C string literal, every byte except printable ASCII escaped
+static std::string literal(const std::string& text) {
+  std::string result = "\"";
+
+  for (size_t i = 0; i < text.size(); ++i) {
+    unsigned char c = text[i];
+
+    if (c >= ' ' && c < 127 && c != '"' && c != '\\' && c != '?') {
+      result += c;
+    } else {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\%03o", c);
+      result += escaped;
+    }
+  }
+
+  return result + "\"";
+}
+
+static std::string quote(const std::string& argument) {
+  std::string result = "'";
+
+  for (size_t i = 0; i < argument.size(); ++i) {
+    if (argument[i] == '\'') {
+      result += "'\\''";
+    } else {
+      result += argument[i];
+    }
+  }
+
+  return result + "'";
+}
+
+static bool endsWith(const std::string& text, const char* suffix) {
+  size_t length = strlen(suffix);
+  return text.size() >= length && text.compare(text.size() - length, length, suffix) == 0;
+}
+
+// Builtins of instruction C generator has no runtime for, 0 if it has
+static const char* unsupportedBuiltins(Instruction insn) {
+  switch (static_cast<uint8_t>(insn)) {
+    case BC_NEWARRAY: case BC_ALENGTH:
+    case BC_AILOAD: case BC_ADLOAD: case BC_AISTORE: case BC_ADSTORE:
+    case BC_AILOADNC: case BC_ADLOADNC: case BC_AISTORENC: case BC_ADSTORENC:
+    case BC_ARRAYOP:
+      return "array";
+    case BC_READ: case BC_HASINPUT: case BC_READARRAY:
+    case BC_INPUTAT: case BC_INPUTLENGTH:
+      return "input";
+    default:
+      return 0;
+  }
+}
+
+// C library function of double math instruction
+static const char* mathFunction(Instruction insn) {
+  switch (static_cast<uint8_t>(insn)) {
+    case BC_DSQRT:  return "sqrt";
+    case BC_DSIN:   return "sin";
+    case BC_DCOS:   return "cos";
+    case BC_DEXP:   return "exp";
+    case BC_DLOG:   return "log";
+    case BC_DFLOOR: return "floor";
+    case BC_DABS:   return "fabs";
+    case BC_DPOW:   return "pow";
+    case BC_DMIN:   return "fmin";
+    case BC_DMAX:   return "fmax";
+    default:
+      assert(false);
+      return 0;
+  }
+}
+
+// C operator of conditional branch
+static const char* comparison(Instruction insn) {
+  switch (static_cast<uint8_t>(insn)) {
+    case BC_IFICMPNE: return "!=";
+    case BC_IFICMPE:  return "==";
+    case BC_IFICMPG:  return ">";
+    case BC_IFICMPGE: return ">=";
+    case BC_IFICMPL:  return "<";
+    case BC_IFICMPLE: return "<=";
+    case BC_IFDCMPNE: return "!=";
+    case BC_IFDCMPE:  return "==";
+    case BC_IFDCMPG:  return ">";
+    case BC_IFDCMPGE: return ">=";
+    case BC_IFDCMPL:  return "<";
+    case BC_IFDCMPLE: return "<=";
+    default:
+      assert(false);
+      return 0;
+  }
+}
+
+CGenerator::CGenerator(InterpreterCodeImpl* code, std::ostream& out)
+  : code_(code),
+    frames_(code),
+    out_(out) {}
+
+void CGenerator::generate(bool isLibrary) {
+  std::vector<InterpreterFunction*> functions;
+  std::vector<InsnList> bodies;
+  Code::FunctionIterator it(code_);
+
+  while (it.hasNext()) {
+    InterpreterFunction* function = static_cast<InterpreterFunction*>(it.next());
+    InsnList insns;
+
+    if (!decode(function->bytecode(), insns)) {
+      checkSupported(function);
+      throw InternalException("Function %s has instructions unknown to C generator",
+                              function->name().c_str());
+    }
+
+    for (size_t i = 0; i < insns.size(); ++i) {
+      if (insns[i].insn == BC_SLOAD) {
+        strings_[insns[i].id] = code_->constantById(insns[i].id);
+      }
+    }
+
+    functions.push_back(function);
+    bodies.push_back(insns);
+  }
+
+  out_ << PRELUDE;
+
+  uint32_t stringsNumber = strings_.empty() ? 1 : strings_.rbegin()->first + 1;
+  out_ << "static const String strings[" << stringsNumber << "] = {\n";
+  for (std::map<uint16_t, std::string>::const_iterator s = strings_.begin();
+       s != strings_.end(); ++s) {
+    out_ << "  [" << s->first << "] = { " << literal(s->second)
+         << ", " << s->second.size() << " },\n";
+  }
+  out_ << "};\n\n";
+
+  for (size_t i = 0; i < functions.size(); ++i) {
+    declare(functions[i]);
+    out_ << ";\n";
+  }
+  out_ << "\n";
+
+  for (size_t i = 0; i < functions.size(); ++i) {
+    define(functions[i], bodies[i]);
+  }
+
+  char entry[1024];
+  snprintf(entry, sizeof(entry), ENTRY, (unsigned long) constants::NATIVE_STACK_RESERVE,
+           (unsigned long) constants::NATIVE_STACK_SIZE,
+           (unsigned long) constants::NATIVE_STACK_SIZE,
+           (unsigned long) constants::DEFAULT_STACK_SIZE);
+  out_ << entry;
+
+  if (!isLibrary) {
+    out_ << "\nint main(void) {\n  return mvm_main();\n}\n";
+  }
+}
+
+// Program which needs runtime of interpreter can't be compiled
+void CGenerator::checkSupported(InterpreterFunction* function) {
+  Bytecode* bytecode = function->bytecode();
+
+  for (uint32_t bci = 0; bci < bytecode->length();
+       bci += instructionLength(bytecode->getInsn(bci))) {
+    const char* builtins = unsupportedBuiltins(bytecode->getInsn(bci));
+    if (builtins) {
+      throw InternalException("Function %s calls %s builtins, which -aot does not support",
+                              function->name().c_str(), builtins);
+    }
+  }
+}
+
+void CGenerator::declare(TranslatedFunction* function) {
+  out_ << "static Value f" << function->id() << "(Frame* parent";
+  for (uint16_t i = 0; i < function->parametersNumber(); ++i) {
+    out_ << ", Value a" << i;
+  }
+  out_ << ")";
+}
+
+void CGenerator::define(InterpreterFunction* function, const InsnList& insns) {
+  ControlFlowGraph cfg(insns, function, code_);
+
+  if (!cfg.isConsistent()) {
+    throw InternalException("Function %s has inconsistent operand stack",
+                            function->name().c_str());
+  }
+
+  std::vector<bool> isTarget(insns.size(), false);
+  uint32_t maxDepth = 0;
+
+  for (size_t i = 0; i < cfg.size(); ++i) {
+    const BasicBlock& block = cfg.block(i);
+    uint32_t depth = block.stackDepth;
+    if (!block.isReachable) continue;
+
+    for (uint32_t j = block.begin; j < block.end; ++j) {
+      uint32_t popped;
+      uint32_t pushed;
+      stackEffect(insns[j], code_, popped, pushed);
+      maxDepth = std::max(maxDepth, depth + pushed);
+      depth += pushed - popped;
+
+      if (isBranch(insns[j].insn)) {
+        isTarget[insns[j].target] = true;
+      }
+    }
+  }
+
+  out_ << "/* " << function->name() << " */\n";
+  declare(function);
+  out_ << " {\n";
+  out_ << "  struct { Frame* parent; Value v["
+       << std::max<uint32_t>(function->localsNumber(), 1) << "]; } f = { parent };\n";
+  // frame address, unlike address of f, leaves f in registers
+  out_ << "  if ((char*) __builtin_frame_address(0) < stackLimit) fail(\"Stack overflow\");\n";
+
+  for (uint32_t i = 0; i < maxDepth; ++i) {
+    out_ << (i == 0 ? "  Value " : ", ") << "s" << i;
+  }
+  if (maxDepth > 0) {
+    out_ << ";\n";
+  }
+
+  for (uint16_t i = 0; i < function->parametersNumber(); ++i) {
+    out_ << "  s" << i << " = a" << i << ";\n";
+  }
+
+  for (size_t i = 0; i < cfg.size(); ++i) {
+    const BasicBlock& block = cfg.block(i);
+    uint32_t depth = block.stackDepth;
+    if (!block.isReachable) continue;
+
+    for (uint32_t j = block.begin; j < block.end; ++j) {
+      uint32_t popped;
+      uint32_t pushed;
+
+      if (isTarget[j]) {
+        out_ << "L" << j << ":\n";
+      }
+
+      insn(insns[j], depth);
+      stackEffect(insns[j], code_, popped, pushed);
+      depth += pushed - popped;
+    }
+  }
+
+  out_ << "}\n\n";
+}
+
+/*
+ * Frame of function hops parent links up from current one,
+ * 0 if called function never looks at it.
+ */
+std::string CGenerator::parent(uint16_t hops, bool isAccessed) const {
+  if (hops == 0) {
+    return isAccessed ? "(Frame*) &f" : "0";
+  }
+
+  std::string frame = "parent";
+  for (; hops > 1; --hops) {
+    frame += "->parent";
+  }
+  return frame;
+}
+
+std::string CGenerator::variable(uint16_t id, uint16_t context) const {
+  char index[32];
+  snprintf(index, sizeof(index), "v[%u]", (unsigned) id);
+
+  if (context == 0) {
+    return std::string("f.") + index;
+  }
+  return parent(context, true) + "->" + index;
+}
+
+// Operands are s<depth - 1> (upper) and s<depth - 2> (lower);
+// result goes where the lowest popped value was
+void CGenerator::insn(const Insn& insn, uint32_t depth) {
+  uint32_t upper = depth - 1;
+  uint32_t lower = depth - 2;
+  const char* op = 0;
+
+  switch (static_cast<uint8_t>(insn.insn)) {
+    case BC_ILOAD: case BC_ILOAD0: case BC_ILOAD1: case BC_ILOADM1: {
+      int64_t value = insn.insn == BC_ILOAD ? insn.intValue
+                      : insn.insn == BC_ILOAD0 ? 0
+                      : insn.insn == BC_ILOAD1 ? 1 : -1;
+      out_ << "  s" << depth << ".i = ";
+      if (value == static_cast<int64_t>(0x8000000000000000ULL)) {
+        out_ << "INT64_MIN;\n";
+      } else {
+        out_ << value << "LL;\n";
+      }
+      return;
+    }
+
+    // exact bits: no rounding, infinities and NaN signs survive
+    case BC_DLOAD: case BC_DLOAD0: case BC_DLOAD1: case BC_DLOADM1: {
+      double value = insn.insn == BC_DLOAD ? insn.doubleValue
+                     : insn.insn == BC_DLOAD0 ? 0.0
+                     : insn.insn == BC_DLOAD1 ? 1.0 : -1.0;
+      uint64_t bits;
+      memcpy(&bits, &value, sizeof(bits));
+      char literal[32];
+      snprintf(literal, sizeof(literal), "0x%016llxULL", (unsigned long long) bits);
+      out_ << "  s" << depth << ".i = (int64_t) " << literal << ";\n";
+      return;
+    }
+
+    case BC_SLOAD:
+      out_ << "  s" << depth << ".i = " << insn.id << ";\n";
+      return;
+
+    case BC_IPRINT:
+      out_ << "  printf(\"%\" PRId64, s" << upper << ".i);\n";
+      return;
+    case BC_DPRINT:
+      out_ << "  printf(\"%g\", s" << upper << ".d);\n";
+      return;
+    case BC_SPRINT:
+      out_ << "  fwrite(strings[(uint16_t) s" << upper << ".i].text, 1, "
+           << "strings[(uint16_t) s" << upper << ".i].length, stdout);\n";
+      return;
+
+    case BC_DADD: op = "+"; break;
+    case BC_DSUB: op = "-"; break;
+    case BC_DMUL: op = "*"; break;
+    case BC_DDIV: op = "/"; break;
+    case BC_IADD: op = "+"; break;
+    case BC_ISUB: op = "-"; break;
+    case BC_IMUL: op = "*"; break;
+    case BC_IDIV: op = "/"; break;
+    case BC_IMOD: op = "%"; break;
+    case BC_IAOR: op = "|"; break;
+    case BC_IAAND: op = "&"; break;
+    case BC_IAXOR: op = "^"; break;
+
+    case BC_DCMP: case BC_ICMP: {
+      const char* field = insn.insn == BC_DCMP ? ".d" : ".i";
+      out_ << "  s" << lower << ".i = s" << upper << field << " == s" << lower << field
+           << " ? 0 : s" << upper << field << " < s" << lower << field << " ? -1 : 1;\n";
+      return;
+    }
+
+    case BC_I2D: out_ << "  s" << upper << ".d = (double) s" << upper << ".i;\n"; return;
+    case BC_D2I: out_ << "  s" << upper << ".i = (int64_t) s" << upper << ".d;\n"; return;
+    case BC_DNEG: out_ << "  s" << upper << ".d = -s" << upper << ".d;\n"; return;
+    case BC_INEG: out_ << "  s" << upper << ".i = -s" << upper << ".i;\n"; return;
+
+    case BC_DSQRT: case BC_DSIN: case BC_DCOS: case BC_DEXP: case BC_DLOG:
+    case BC_DFLOOR: case BC_DABS:
+      out_ << "  s" << upper << ".d = " << mathFunction(insn.insn) << "(s" << upper << ".d);\n";
+      return;
+
+    // base is lower, exponent is upper
+    case BC_DPOW:
+      out_ << "  s" << lower << ".d = pow(s" << lower << ".d, s" << upper << ".d);\n";
+      return;
+
+    case BC_DMIN: case BC_DMAX:
+      out_ << "  s" << lower << ".d = " << mathFunction(insn.insn) << "(s" << upper
+           << ".d, s" << lower << ".d);\n";
+      return;
+
+    case BC_IABS:
+      out_ << "  if (s" << upper << ".i < 0) s" << upper << ".i = -s" << upper << ".i;\n";
+      return;
+
+    case BC_IMIN: case BC_IMAX:
+      out_ << "  if (s" << upper << ".i " << (insn.insn == BC_IMIN ? "<" : ">") << " s" << lower
+           << ".i) s" << lower << ".i = s" << upper << ".i;\n";
+      return;
+
+    case BC_JA:
+      out_ << "  goto L" << insn.target << ";\n";
+      return;
+
+    case BC_IFICMPNE: case BC_IFICMPE: case BC_IFICMPG:
+    case BC_IFICMPGE: case BC_IFICMPL: case BC_IFICMPLE:
+      out_ << "  if (s" << upper << ".i " << comparison(insn.insn) << " s" << lower
+           << ".i) goto L" << insn.target << ";\n";
+      return;
+
+    // C comparisons of doubles are IEEE ones too
+    case BC_IFDCMPNE: case BC_IFDCMPE: case BC_IFDCMPG:
+    case BC_IFDCMPGE: case BC_IFDCMPL: case BC_IFDCMPLE:
+      out_ << "  if (s" << upper << ".d " << comparison(insn.insn) << " s" << lower
+           << ".d) goto L" << insn.target << ";\n";
+      return;
+
+    case BC_LOADIVAR: case BC_LOADDVAR:
+    case BC_LOADCTXIVAR: case BC_LOADCTXDVAR:
+      out_ << "  s" << depth << " = " << variable(insn.id, insn.context) << ";\n";
+      return;
+
+    case BC_STOREIVAR: case BC_STOREDVAR:
+    case BC_STORECTXIVAR: case BC_STORECTXDVAR:
+      out_ << "  " << variable(insn.id, insn.context) << " = s" << upper << ";\n";
+      return;
+
+    case BC_IFORPREP:
+      out_ << "  " << variable(insn.limitId, 0) << " = s" << upper << ";\n"
+           << "  if (" << variable(insn.id, 0) << ".i > " << variable(insn.limitId, 0)
+           << ".i) goto L" << insn.target << ";\n";
+      return;
+
+    case BC_IFORLOOP:
+      out_ << "  if (++" << variable(insn.id, 0) << ".i <= " << variable(insn.limitId, 0)
+           << ".i) goto L" << insn.target << ";\n";
+      return;
+
+    // same shifts and masks as BytecodeInterpreter::divideByPowerOfTwo
+    case BC_IDIVPOW2:
+      out_ << "  s" << upper << ".i = (s" << upper << ".i + ((s" << upper
+           << ".i >> 63) & (((int64_t) 1 << " << insn.id << ") - 1))) >> " << insn.id << ";\n";
+      return;
+
+    case BC_IMODPOW2:
+      out_ << "  {\n"
+           << "    int64_t mask = ((int64_t) 1 << " << insn.id << ") - 1;\n"
+           << "    int64_t r = s" << upper << ".i & mask;\n"
+           << "    s" << upper << ".i = s" << upper << ".i < 0 && r != 0 ? r | ~mask : r;\n"
+           << "  }\n";
+      return;
+
+    case BC_CALLCTX:
+    case BC_TAILCALL:
+      call(insn, depth);
+      return;
+
+    case BC_RETURN:
+      out_ << "  return s" << upper << ";\n";
+      return;
+
+    case BC_SWAP:
+      out_ << "  { Value t = s" << upper << "; s" << upper << " = s" << lower
+           << "; s" << lower << " = t; }\n";
+      return;
+
+    case BC_POP:
+      return;
+
+    // ends whole program, even in function without return
+    case BC_STOP:
+      out_ << "  longjmp(stop, 1);\n";
+      return;
+
+    default:
+      throw InternalException("C generator doesn't support %s", instructionName(insn.insn));
+  }
+
+  // divisor is lower, as in interpreter
+  if (insn.insn == BC_IDIV || insn.insn == BC_IMOD) {
+    out_ << "  if (s" << lower << ".i == 0) fail(\"Division by zero\");\n"
+         << "  if (s" << lower << ".i == -1 && s" << upper
+         << ".i == INT64_MIN) fail(\"Division overflow\");\n";
+  }
+
+  const char* field = ".i";
+  switch (static_cast<uint8_t>(insn.insn)) {
+    case BC_DADD: case BC_DSUB: case BC_DMUL: case BC_DDIV:
+      field = ".d";
+      break;
+  }
+
+  out_ << "  s" << lower << field << " = s" << upper << field << " " << op
+       << " s" << lower << field << ";\n";
+}
+
+void CGenerator::call(const Insn& insn, uint32_t depth) {
+  TranslatedFunction* callee = code_->functionById(insn.id);
+  uint32_t first = depth - callee->parametersNumber();
+
+  out_ << "  ";
+  if (insn.insn == BC_TAILCALL) {
+    out_ << "return ";
+  } else {
+    out_ << "s" << first << " = ";
+  }
+
+  out_ << "f" << insn.id << "(" << parent(insn.context, frames_.isCallerAccessed(insn));
+  for (uint32_t i = first; i < depth; ++i) {
+    out_ << ", s" << i;
+  }
+  out_ << ");\n";
+}
+
+void compileToNative(InterpreterCodeImpl* code, const std::string& path) {
+  bool isLibrary = endsWith(path, ".so");
+  code->generateAll();
+
+  if (endsWith(path, ".c")) {
+    std::ofstream out(path.c_str());
+    CGenerator(code, out).generate(false);
+    if (!out) {
+      throw InternalException("Could not write %s", path.c_str());
+    }
+    return;
+  }
+
+  char source[] = "/tmp/mvmXXXXXX.c";
+  int fd = mkstemps(source, 2);
+  if (fd < 0) {
+    throw InternalException("Could not create temporary C source");
+  }
+  close(fd);
+
+  std::ofstream out(source);
+  CGenerator(code, out).generate(isLibrary);
+  out.close();
+
+  const char* compiler = getenv("CC");
+  std::string command = std::string(compiler ? compiler : "cc")
+                        + " -O2 -fwrapv -fno-strict-aliasing -pthread"
+                        + (isLibrary ? " -shared -fPIC" : "")
+                        + " -o " + quote(path) + " " + quote(source) + " -lm";
+  int status = system(command.c_str());
+  unlink(source);
+
+  if (status != 0) {
+    throw InternalException("C compiler failed: %s", command.c_str());
+  }
+}
+
+} // namespace mathvm
@@ -0,0 +1,63 @@
+#ifndef C_GENERATOR_HPP
+#define C_GENERATOR_HPP
+
+#include "mathvm.h"
+#include "interpreter_code.hpp"
+#include "frame_access.hpp"
+#include "insn_list.hpp"
+
+#include <map>
+#include <ostream>
+#include <string>
+
+#include <stdint.h>
+
+namespace mathvm {
+
+/*
+ * Translates bytecode of program to C, one C function per
+ * InterpreterFunction. Operand stack positions become C variables,
+ * since stack depth is known at every instruction; locals live
+ * in frame struct linked to frame of parent function (static link),
+ * which nested functions reach with parent hops as interpreter does.
+ * Frame address is passed to called function only if it reads
+ * caller's variables, so C compiler keeps other frames in registers
+ * and turns tail calls into jumps.
+ * Arrays and input have no C runtime, so programs using them
+ * are rejected.
+ */
+class CGenerator {
+  InterpreterCodeImpl* code_;
+  FrameAccess frames_;
+  std::ostream& out_;
+  std::map<uint16_t, std::string> strings_; // used string constants
+
+public:
+  CGenerator(InterpreterCodeImpl* code, std::ostream& out);
+
+  // Library exports int mvm_main(void), executable has main
+  void generate(bool isLibrary);
+
+private:
+  void checkSupported(InterpreterFunction* function);
+  void declare(TranslatedFunction* function);
+  void define(InterpreterFunction* function, const InsnList& insns);
+  void insn(const Insn& insn, uint32_t depth);
+  void call(const Insn& insn, uint32_t depth);
+  std::string parent(uint16_t hops, bool isAccessed) const;
+  std::string variable(uint16_t id, uint16_t context) const;
+};
+
+/*
+ * Writes C source of program and compiles it with C compiler from
+ * CC environment variable (cc by default): to shared object if path
+ * ends with .so, to executable otherwise. For path ending with .c
+ * only source is written. Generates deferred function bodies first,
+ * so it may throw TranslationException; InternalException on failure
+ * or if program calls builtins C generator does not support.
+ */
+void compileToNative(InterpreterCodeImpl* code, const std::string& path);
+
+} // namespace mathvm
+
+#endif
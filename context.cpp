@@ -2,35 +2,61 @@
 
 namespace mathvm {
 
+ConstantPool::ConstantPool(InterpreterCodeImpl* code) : code_(code) {
+  pthread_mutex_init(&lock_, 0);
+}
+
+ConstantPool::~ConstantPool() {
+  pthread_mutex_destroy(&lock_);
+}
+
+uint16_t ConstantPool::makeStringConstant(const std::string& string) {
+  pthread_mutex_lock(&lock_);
+  uint16_t id = code_->makeStringConstant(string);
+  pthread_mutex_unlock(&lock_);
+  return id;
+}
+
+uint16_t ConstantPool::makeNativeFunction(const string& name, const Signature& signature, const void* address) {
+  pthread_mutex_lock(&lock_);
+  uint16_t id = code_->makeNativeFunction(name, signature, address);
+  pthread_mutex_unlock(&lock_);
+  return id;
+}
+
 Context::~Context() {
   for (size_t i = 0; i < varInfos_.size(); ++i) {
     delete varInfos_[i];
   }
-}
 
-void Context::addFunction(AstFunction* function) {
-  uint16_t deepness = static_cast<uint16_t>(functionIds_.size());
-  uint16_t id = code_->addFunction(new InterpreterFunction(function, deepness));
-  idByFunction_.insert(std::make_pair(function, id));
+  for (size_t i = 0; i < functionInfos_.size(); ++i) {
+    delete functionInfos_[i];
+  }
 }
 
-uint16_t Context::addNativeFunction(const string& name, const Signature& signature, const void* address) {
-  return code_->makeNativeFunction(name, signature, address);
+void Context::addFunction(AstFunction* function, uint16_t deepness) {
+  uint16_t id = code_->addFunction(new InterpreterFunction(function, deepness));
+  // Resolved once here, so call sites don't have to look it up again
+  FunctionInfo* info = new FunctionInfo(id, deepness);
+  function->setInfo(info);
+  functionInfos_.push_back(info);
 }
 
 void Context::enterFunction(AstFunction* function) {
   functionIds_.push(getId(function));
+  freeLocals_.push(0);
 }
 
 void Context::exitFunction() {
   assert(!functionIds_.empty());
   functionIds_.pop();
+  freeLocals_.pop();
 }
 
 uint16_t Context::getId(AstFunction* function) {
-  IdByFunctionMap::iterator it = idByFunction_.find(function);
-  assert(it != idByFunction_.end());
-  return it->second;
+  FunctionInfo* info = getInfo<FunctionInfo>(function);
+  assert(info != 0);
+  return info->functionId();
 }
 
 uint16_t Context::currentFunctionId() const {
@@ -40,11 +66,19 @@ uint16_t Context::currentFunctionId() const {
 
 void Context::enterScope(Scope* scope) {
   scopes_.push(scope);
+  scopeFreeLocals_.push(freeLocals_.top());
 }
 
+/*
+ * Locals of exited scope are free for reuse.
+ * Functions nested into scope can only be called 
+ * while it is not exited, so they never see reused locals.
+ */
 void Context::exitScope() {
   assert(!scopes_.empty());
   scopes_.pop();
+  freeLocals_.top() = scopeFreeLocals_.top();
+  scopeFreeLocals_.pop();
 }
 
 Scope* Context::currentScope() const {
@@ -65,25 +99,41 @@ InterpreterFunction* Context::functionById(uint16_t id) const {
   return code_->functionById(id);
 }
 
-uint16_t Context::makeStringConstant(const std::string& string) {
-  return code_->makeStringConstant(string);
-}
-
+// Locals are allocated as stack: they are freed 
+// in reverse order on scope exit or by releaseTemporary
 uint16_t Context::declareTemporary() {
   InterpreterFunction* function = currentFunction();
-  uint16_t localsNumber = static_cast<uint16_t>(function->localsNumber());
-  function->setLocalsNumber(localsNumber + 1);
-  return localsNumber;
+  uint16_t id = freeLocals_.top()++;
+
+  if (id >= function->localsNumber()) {
+    function->setLocalsNumber(id + 1);
+  }
+
+  return id;
 }
 
-void Context::declare(AstVar* var) {
-  InterpreterFunction* function = currentFunction();
-  uint16_t functionId = function->id();
-  uint16_t localsNumber = static_cast<uint16_t>(function->localsNumber());
-  VarInfo* info = new VarInfo(functionId, localsNumber++);
-  function->setLocalsNumber(localsNumber);
-  var->setInfo(info);
+void Context::releaseTemporary(uint16_t id) {
+  assert(id + 1 == freeLocals_.top());
+  freeLocals_.top() = id;
+}
+
+void Context::declare(AstVar* var, bool isInlined) {
+  uint16_t functionId = currentFunctionId();
+  VarInfo* info = new VarInfo(functionId, declareTemporary());
   varInfos_.push_back(info);
+
+  if (isInlined) {
+    inlinedVars_[var] = info;
+  } else {
+    // function inlined before is generated on its own now
+    inlinedVars_.erase(var);
+    var->setInfo(info);
+  }
+}
+
+VarInfo* Context::varInfo(const AstVar* var) const {
+  std::map<const AstVar*, VarInfo*>::const_iterator it = inlinedVars_.find(var);
+  return it != inlinedVars_.end() ? it->second : getInfo<VarInfo>(var);
 }
 
 } // namespace mathvm
\ No newline at end of file
@@ -13,16 +13,39 @@
 #include <vector>
 #include <utility>
 
+#include <pthread.h>
+
 namespace mathvm {
 
-class Context {
-  typedef std::map<AstFunction*, uint16_t> IdByFunctionMap;
+/*
+ * Constants of code shared by contexts 
+ * generating functions in parallel.
+ */
+class ConstantPool {
+  InterpreterCodeImpl* code_;
+  pthread_mutex_t lock_;
+
+public:
+  explicit ConstantPool(InterpreterCodeImpl* code);
+  ~ConstantPool();
 
+  uint16_t makeStringConstant(const std::string& string);
+  uint16_t makeNativeFunction(const string& name, const Signature& signature, const void* address);
+};
+
+class Context {
   InterpreterCodeImpl* code_;
   std::stack<uint16_t> functionIds_;
   std::stack<Scope*> scopes_;
+  // first free local of each function being generated
+  std::stack<uint16_t> freeLocals_;
+  // first free local of current function when scope was entered
+  std::stack<uint16_t> scopeFreeLocals_;
   std::vector<VarInfo*> varInfos_; 
-  IdByFunctionMap idByFunction_;
+  std::vector<FunctionInfo*> functionInfos_;
+  // Variables of inlined functions: the same function may be
+  // inlined by other contexts at the same time, so its ast isn't touched
+  std::map<const AstVar*, VarInfo*> inlinedVars_;
 
 public:
   Context(InterpreterCodeImpl* code)
@@ -30,8 +53,7 @@ public:
 
   ~Context();
 
-  void addFunction(AstFunction* function);
-  uint16_t addNativeFunction(const string& name, const Signature& signature, const void* address);
+  void addFunction(AstFunction* function, uint16_t deepness);
   void enterFunction(AstFunction* function);
   void exitFunction();
   uint16_t currentFunctionId() const;
@@ -45,9 +67,10 @@ public:
   void exitScope();
   Scope* currentScope() const;
 
-  uint16_t makeStringConstant(const std::string& string);
   uint16_t declareTemporary();
-  void declare(AstVar* var);
+  void releaseTemporary(uint16_t id);
+  void declare(AstVar* var, bool isInlined);
+  VarInfo* varInfo(const AstVar* var) const;
 };
 
 } // namespace mathvm
@@ -0,0 +1,268 @@
+#include "control_flow.hpp"
+
+#include <algorithm>
+#include <utility>
+
+namespace mathvm {
+
+ControlFlowGraph::ControlFlowGraph(const InsnList& insns, 
+                                   InterpreterFunction* function, 
+                                   InterpreterCodeImpl* code)
+  : isConsistent_(true) {
+  split(insns);
+  computeStackDepths(insns, function, code);
+
+  if (isConsistent_) {
+    link(insns);
+    computeOrder();
+    computeDominators();
+  }
+}
+
+void ControlFlowGraph::split(const InsnList& insns) {
+  std::vector<bool> isLeader(insns.size() + 1, false);
+  isLeader[0] = true;
+
+  for (size_t i = 0; i < insns.size(); ++i) {
+    Instruction insn = insns[i].insn;
+
+    if (isBranch(insn)) {
+      isLeader[insns[i].target] = true;
+    }
+
+    if (isBranch(insn) || isTerminator(insn)) {
+      isLeader[i + 1] = true;
+    }
+  }
+
+  blockByInsn_.resize(insns.size());
+
+  for (size_t i = 0; i < insns.size(); ++i) {
+    if (isLeader[i]) {
+      blocks_.push_back(BasicBlock(i, i + 1));
+    } else {
+      blocks_.back().end = i + 1;
+    }
+
+    blockByInsn_[i] = blocks_.size() - 1;
+  }
+}
+
+void ControlFlowGraph::computeStackDepths(const InsnList& insns, 
+                                          InterpreterFunction* function, 
+                                          InterpreterCodeImpl* code) {
+  std::vector<uint32_t> worklist;
+
+  if (blocks_.empty()) {
+    isConsistent_ = false;
+    return;
+  }
+
+  // arguments are on the stack on function entry
+  blocks_[0].stackDepth = function->parametersNumber();
+  blocks_[0].isReachable = true;
+  worklist.push_back(0);
+
+  while (!worklist.empty() && isConsistent_) {
+    BasicBlock& block = blocks_[worklist.back()];
+    uint32_t depth = block.stackDepth;
+    worklist.pop_back();
+
+    for (uint32_t i = block.begin; i < block.end; ++i) {
+      uint32_t popped;
+      uint32_t pushed;
+      stackEffect(insns[i], code, popped, pushed);
+
+      if (depth < popped) {
+        isConsistent_ = false;
+        return;
+      }
+
+      depth += pushed - popped;
+    }
+
+    const Insn& last = insns[block.end - 1];
+    uint32_t succs[2];
+    size_t succsNumber = 0;
+
+    if (isBranch(last.insn)) {
+      succs[succsNumber++] = blockOf(last.target);
+    }
+
+    if (!isTerminator(last.insn)) {
+      if (block.end == insns.size()) {
+        isConsistent_ = false;
+        return;
+      }
+      succs[succsNumber++] = blockOf(block.end);
+    }
+
+    for (size_t i = 0; i < succsNumber; ++i) {
+      BasicBlock& succ = blocks_[succs[i]];
+
+      if (!succ.isReachable) {
+        succ.isReachable = true;
+        succ.stackDepth = depth;
+        worklist.push_back(succs[i]);
+      } else if (succ.stackDepth != depth) {
+        isConsistent_ = false;
+      }
+    }
+  }
+}
+
+void ControlFlowGraph::link(const InsnList& insns) {
+  for (size_t i = 0; i < blocks_.size(); ++i) {
+    if (!blocks_[i].isReachable) {
+      continue;
+    }
+
+    const Insn& last = insns[blocks_[i].end - 1];
+    std::vector<uint32_t>& succs = blocks_[i].succs;
+
+    if (!isTerminator(last.insn)) {
+      succs.push_back(blockOf(blocks_[i].end));
+    }
+
+    if (isBranch(last.insn) 
+        && (succs.empty() || succs[0] != blockOf(last.target))) {
+      succs.push_back(blockOf(last.target));
+    }
+
+    for (size_t j = 0; j < succs.size(); ++j) {
+      blocks_[succs[j]].preds.push_back(i);
+    }
+  }
+}
+
+void ControlFlowGraph::computeOrder() {
+  std::vector<bool> isVisited(blocks_.size(), false);
+  // block and index of next successor to visit
+  std::vector<std::pair<uint32_t, uint32_t> > path;
+
+  path.push_back(std::make_pair(0, 0));
+  isVisited[0] = true;
+
+  while (!path.empty()) {
+    std::pair<uint32_t, uint32_t>& top = path.back();
+    const BasicBlock& block = blocks_[top.first];
+
+    if (top.second == block.succs.size()) {
+      order_.push_back(top.first);
+      path.pop_back();
+      continue;
+    }
+
+    uint32_t succ = block.succs[top.second++];
+
+    if (!isVisited[succ]) {
+      isVisited[succ] = true;
+      path.push_back(std::make_pair(succ, 0));
+    }
+  }
+
+  std::reverse(order_.begin(), order_.end());
+}
+
+/*
+ * Immediate dominators by Cooper, Harvey and Kennedy, 
+ * "A Simple, Fast Dominance Algorithm": idoms are intersected 
+ * over processed predecessors until nothing changes.
+ */
+void ControlFlowGraph::computeDominators() {
+  std::vector<uint32_t> number(blocks_.size(), UINT32_MAX);
+  bool isChanged = true;
+
+  for (size_t i = 0; i < order_.size(); ++i) {
+    number[order_[i]] = i;
+  }
+
+  idoms_.assign(blocks_.size(), UINT32_MAX);
+  idoms_[0] = 0;
+
+  while (isChanged) {
+    isChanged = false;
+
+    for (size_t i = 1; i < order_.size(); ++i) {
+      const std::vector<uint32_t>& preds = blocks_[order_[i]].preds;
+      uint32_t idom = UINT32_MAX;
+
+      for (size_t j = 0; j < preds.size(); ++j) {
+        uint32_t pred = preds[j];
+
+        if (idoms_[pred] == UINT32_MAX) {
+          continue;
+        }
+
+        if (idom == UINT32_MAX) {
+          idom = pred;
+          continue;
+        }
+
+        while (idom != pred) {
+          while (number[pred] > number[idom]) {
+            pred = idoms_[pred];
+          }
+          while (number[idom] > number[pred]) {
+            idom = idoms_[idom];
+          }
+        }
+      }
+
+      if (idoms_[order_[i]] != idom) {
+        idoms_[order_[i]] = idom;
+        isChanged = true;
+      }
+    }
+  }
+}
+
+bool ControlFlowGraph::dominates(uint32_t dominator, uint32_t block) const {
+  while (block != dominator && block != 0) {
+    block = idoms_[block];
+  }
+  return block == dominator;
+}
+
+void ControlFlowGraph::findLoops(std::vector<Loop>& loops) const {
+  std::vector<uint32_t> latches(blocks_.size(), UINT32_MAX);
+
+  for (size_t i = 0; i < order_.size(); ++i) {
+    const std::vector<uint32_t>& succs = blocks_[order_[i]].succs;
+
+    for (size_t j = 0; j < succs.size(); ++j) {
+      if (!dominates(succs[j], order_[i])) {
+        continue;
+      }
+
+      // second back edge marks header as unsuitable
+      latches[succs[j]] = latches[succs[j]] == UINT32_MAX ? order_[i] : UINT32_MAX - 1;
+    }
+  }
+
+  for (size_t header = 0; header < blocks_.size(); ++header) {
+    if (latches[header] >= UINT32_MAX - 1) {
+      continue;
+    }
+
+    Loop loop(header, latches[header], blocks_.size());
+    std::vector<uint32_t> worklist(1, loop.latch);
+    loop.body[header] = true;
+
+    while (!worklist.empty()) {
+      uint32_t block = worklist.back();
+      worklist.pop_back();
+
+      if (loop.body[block]) {
+        continue;
+      }
+
+      loop.body[block] = true;
+      worklist.insert(worklist.end(), blocks_[block].preds.begin(), blocks_[block].preds.end());
+    }
+
+    loops.push_back(loop);
+  }
+}
+
+} // namespace mathvm
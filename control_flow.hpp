@@ -0,0 +1,94 @@
+#ifndef CONTROL_FLOW_HPP
+#define CONTROL_FLOW_HPP
+
+#include "mathvm.h"
+#include "interpreter_code.hpp"
+#include "insn_list.hpp"
+
+#include <vector>
+
+#include <stdint.h>
+
+namespace mathvm {
+
+struct BasicBlock {
+  uint32_t begin;      // first instruction
+  uint32_t end;        // instruction after the last one
+  uint32_t stackDepth; // operand stack depth at block entry
+  bool isReachable;
+  std::vector<uint32_t> preds;
+  std::vector<uint32_t> succs;
+
+  BasicBlock(uint32_t begin, uint32_t end)
+    : begin(begin), 
+      end(end), 
+      stackDepth(0), 
+      isReachable(false) {}
+};
+
+/*
+ * Natural loop: header dominates latch, latch jumps back 
+ * to header, body is header and blocks reaching latch 
+ * not through header.
+ */
+struct Loop {
+  uint32_t header;
+  uint32_t latch;
+  std::vector<bool> body; // indexed by block
+
+  Loop(uint32_t header, uint32_t latch, size_t blocksNumber)
+    : header(header), 
+      latch(latch), 
+      body(blocksNumber, false) {}
+};
+
+/*
+ * Blocks are split at branch destinations and after
+ * branches and terminators. Block 0 is entry block.
+ * Unreachable blocks are kept, but have no edges.
+ */
+class ControlFlowGraph {
+  std::vector<BasicBlock> blocks_;
+  std::vector<uint32_t> blockByInsn_;
+  std::vector<uint32_t> order_;
+  std::vector<uint32_t> idoms_;
+  bool isConsistent_;
+
+public:
+  ControlFlowGraph(const InsnList& insns, 
+                   InterpreterFunction* function, 
+                   InterpreterCodeImpl* code);
+
+  // False if operand stack depth differs on some edges, 
+  // code falls off the end or underflows the stack
+  bool isConsistent() const { return isConsistent_; }
+
+  size_t size() const { return blocks_.size(); }
+
+  const BasicBlock& block(uint32_t index) const { return blocks_[index]; }
+
+  uint32_t blockOf(uint32_t insn) const { return blockByInsn_[insn]; }
+
+  // Reachable blocks in reverse postorder
+  const std::vector<uint32_t>& order() const { return order_; }
+
+  // Every path from entry to reachable block goes through dominator
+  bool dominates(uint32_t dominator, uint32_t block) const;
+
+  // Loops with single back edge, ordered by header, 
+  // so outer loops go before nested ones
+  void findLoops(std::vector<Loop>& loops) const;
+
+private:
+  void split(const InsnList& insns);
+  void link(const InsnList& insns);
+  void computeStackDepths(const InsnList& insns, 
+                          InterpreterFunction* function, 
+                          InterpreterCodeImpl* code);
+  void computeOrder();
+  void computeDominators();
+};
+
+} // namespace mathvm
+
+#endif
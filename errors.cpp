@@ -29,6 +29,16 @@ std::string errorMessage(const char* program, const Status* status) {
   return errorMessage(program, status->getError().c_str(), status->getPosition());
 }
 
+std::string errorMessage(const InterpreterException& e) {
+  std::string message = e.what();
+
+  for (size_t i = 0; i < e.callStack().size(); ++i) {
+    message += "\n  in " + e.callStack()[i];
+  }
+
+  return message;
+}
+
 TranslationException::TranslationException(const AstNode* at, const char* format, ...) {
     assert(at != 0);
     position_ = at->position();
@@ -4,6 +4,8 @@
 #include "ast.h"
 
 #include <exception>
+#include <string>
+#include <vector>
 
 namespace mathvm {
 
@@ -45,15 +47,28 @@ public:
 
 class InterpreterException : public std::exception {
   char message_[constant::MAX_ERROR_MSG_LEN];
+  std::vector<std::string> callStack_; // innermost function first
 
 public:
   InterpreterException(const char* format, ...);
+  virtual ~InterpreterException() throw() {}
 
   virtual const char* what() const throw() {
     return message_;
   }
+
+  const std::vector<std::string>& callStack() const {
+    return callStack_;
+  }
+
+  void setCallStack(const std::vector<std::string>& callStack) {
+    callStack_ = callStack;
+  }
 };
 
+// Message with call stack, if exception has it
+std::string errorMessage(const InterpreterException& e);
+
 } // namespace mathvm
 
 #endif
\ No newline at end of file
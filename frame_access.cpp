@@ -0,0 +1,72 @@
+#include "frame_access.hpp"
+
+#include <algorithm>
+
+namespace mathvm {
+
+FrameAccess::FrameAccess(InterpreterCodeImpl* code) {
+  std::vector<InsnList> bodies;
+  std::vector<uint32_t> deepness;
+  Code::FunctionIterator it(code);
+
+  while (it.hasNext()) {
+    InterpreterFunction* function = static_cast<InterpreterFunction*>(it.next());
+
+    if (function->id() >= bodies.size()) {
+      bodies.resize(function->id() + 1);
+      deepness.resize(function->id() + 1, 0);
+      reach_.resize(function->id() + 1, 0);
+    }
+
+    deepness[function->id()] = function->deepness();
+
+    // unknown bytecode may access any frame
+    if (!decode(function->bytecode(), bodies[function->id()])) {
+      reach_[function->id()] = function->deepness();
+    }
+  }
+
+  // reach of called function is counted from its own frame:
+  // with parentHops == h it is reach - 1 + h from caller's frame
+  bool isChanged = true;
+
+  while (isChanged) {
+    isChanged = false;
+
+    for (size_t id = 0; id < bodies.size(); ++id) {
+      const InsnList& insns = bodies[id];
+      uint32_t reach = reach_[id];
+
+      for (size_t i = 0; i < insns.size(); ++i) {
+        switch (static_cast<uint8_t>(insns[i].insn)) {
+          case BC_LOADCTXIVAR: 
+          case BC_LOADCTXDVAR:
+          case BC_STORECTXIVAR: 
+          case BC_STORECTXDVAR:
+            reach = std::max<uint32_t>(reach, insns[i].context);
+            break;
+
+          case BC_CALLCTX:
+          case BC_TAILCALL:
+            if (reach_[insns[i].id] + insns[i].context > 1) {
+              reach = std::max<uint32_t>(reach, reach_[insns[i].id] + insns[i].context - 1);
+            }
+            break;
+
+          default:
+            break;
+        }
+      }
+
+      // there are no frames above top level one
+      reach = std::min(reach, deepness[id]);
+
+      if (reach != reach_[id]) {
+        reach_[id] = reach;
+        isChanged = true;
+      }
+    }
+  }
+}
+
+} // namespace mathvm
@@ -0,0 +1,35 @@
+#ifndef FRAME_ACCESS_HPP
+#define FRAME_ACCESS_HPP
+
+#include "mathvm.h"
+#include "interpreter_code.hpp"
+#include "insn_list.hpp"
+
+#include <vector>
+
+#include <stdint.h>
+
+namespace mathvm {
+
+/*
+ * For every function: how far up the chain of parent frames 
+ * it or functions it calls may read or write variables 
+ * (1 - variables of its parent, 2 - of parent's parent and so on).
+ * Call with parentHops == 0 needs caller's local variables 
+ * in memory only if called function reaches its parent.
+ */
+class FrameAccess {
+  std::vector<uint32_t> reach_;
+
+public:
+  explicit FrameAccess(InterpreterCodeImpl* code);
+
+  // Called function may access local variables of caller
+  bool isCallerAccessed(const Insn& call) const {
+    return call.context == 0 && reach_[call.id] > 0;
+  }
+};
+
+} // namespace mathvm
+
+#endif
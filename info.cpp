@@ -32,7 +32,12 @@ void setType(CustomDataHolder* dataHolder, VarType type) {
       throw InternalException("Unknown type %s", typeToName(type));
   }
 
-  dataHolder->setInfo(info);
+  // Nodes of inlined function are typed by every generator inlining it,
+  // always with the same type; when generators run in parallel, nodes
+  // are typed before (see TypeAnalyzer), so they only read it
+  if (dataHolder->info() != info) {
+    dataHolder->setInfo(info);
+  }
 }
 
 VarType typeOf(const CustomDataHolder* dataHolder) {
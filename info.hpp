@@ -31,6 +31,35 @@ public:
   uint16_t localId() const { return localId_; }
 };
 
+class FunctionInfo {
+  uint16_t functionId_;
+  uint16_t deepness_;
+  uint32_t inlineSize_;
+  bool hasInlineSize_;
+
+public:
+  FunctionInfo(uint16_t functionId, uint16_t deepness)
+    : functionId_(functionId),
+      deepness_(deepness),
+      inlineSize_(0),
+      hasInlineSize_(false) {}
+
+  uint16_t functionId() const { return functionId_; }
+
+  uint16_t deepness() const { return deepness_; }
+
+  // 0 if function can't be inlined (see InlineAnalyzer)
+  uint32_t inlineSize() const { return inlineSize_; }
+
+  // Analysis runs on first call site, so functions never called cost nothing
+  bool hasInlineSize() const { return hasInlineSize_; }
+
+  void setInlineSize(uint32_t inlineSize) { 
+    inlineSize_ = inlineSize; 
+    hasInlineSize_ = true;
+  }
+};
+
 template<typename InfoT>
 InfoT* getInfo(const CustomDataHolder* dataHolder) {
   return static_cast<InfoT*>(dataHolder->info());
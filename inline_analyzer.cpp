@@ -0,0 +1,64 @@
+#include "inline_analyzer.hpp"
+
+namespace mathvm {
+
+InlineAnalyzer::InlineAnalyzer(AstFunction* function) 
+  : function_(function),
+    nodesNumber_(0),
+    isInlinable_(true) 
+{
+  BlockNode* body = function->node()->body();
+  uint32_t statements = body->nodes();
+
+  if (statements == 0 || !body->nodeAt(statements - 1)->isReturnNode()) {
+    isInlinable_ = false;
+    return;
+  }
+
+  checkScope(function->scope());
+  body->visit(this);
+}
+
+void InlineAnalyzer::checkScope(const Scope* scope) {
+  scopes_.insert(scope);
+
+  if (scope->functionsCount() != 0) {
+    isInlinable_ = false;
+  }
+}
+
+void InlineAnalyzer::checkVar(const AstVar* var) {
+  if (scopes_.find(var->owner()) == scopes_.end()) {
+    isInlinable_ = false;
+  }
+}
+
+void InlineAnalyzer::check(BlockNode* node) {
+  checkScope(node->scope());
+}
+
+void InlineAnalyzer::check(LoadNode* node) {
+  checkVar(node->var());
+}
+
+void InlineAnalyzer::check(StoreNode* node) {
+  checkVar(node->var());
+}
+
+void InlineAnalyzer::check(ForNode* node) {
+  checkVar(node->var());
+}
+
+void InlineAnalyzer::check(CallNode* node) {
+  // function has no nested functions, 
+  // so its own name can only refer to itself
+  if (node->name() == function_->name()) {
+    isInlinable_ = false;
+  }
+}
+
+void InlineAnalyzer::check(NativeCallNode* node) {
+  isInlinable_ = false;
+}
+
+} // namespace mathvm
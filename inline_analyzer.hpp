@@ -0,0 +1,60 @@
+#ifndef INLINE_ANALYZER_HPP
+#define INLINE_ANALYZER_HPP
+
+#include "ast.h"
+#include "mathvm.h"
+#include "visitors.h"
+
+#include <set>
+
+#include <stdint.h>
+
+namespace mathvm {
+
+/*
+ * Decides whether function body can be spliced into caller.
+ * Function can be inlined if it:
+ *   - is not native and doesn't call itself,
+ *   - doesn't declare nested functions,
+ *   - doesn't use variables of outer scopes,
+ *   - ends with return (so control never falls off its body).
+ */
+class InlineAnalyzer : public AstVisitor {
+  AstFunction* function_;
+  std::set<const Scope*> scopes_;
+  uint32_t nodesNumber_;
+  bool isInlinable_;
+
+public:
+  InlineAnalyzer(AstFunction* function);
+
+  // Number of ast nodes in function body if it can be inlined, 0 otherwise
+  uint32_t inlineSize() const {
+    return isInlinable_ ? nodesNumber_ : 0;
+  }
+
+#define VISITOR_FUNCTION(type, name)     \
+  virtual void visit##type(type* node) { \
+    ++nodesNumber_;                      \
+    check(node);                         \
+    node->visitChildren(this);           \
+  }
+
+  FOR_NODES(VISITOR_FUNCTION)
+#undef VISITOR_FUNCTION
+
+private:
+  void check(AstNode* node) {}
+  void check(BlockNode* node);
+  void check(LoadNode* node);
+  void check(StoreNode* node);
+  void check(ForNode* node);
+  void check(CallNode* node);
+  void check(NativeCallNode* node);
+  void checkScope(const Scope* scope);
+  void checkVar(const AstVar* var);
+};
+
+} // namespace mathvm
+
+#endif
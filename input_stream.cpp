@@ -0,0 +1,211 @@
+#include "input_stream.hpp"
+#include "errors.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace mathvm {
+
+static bool hasExtension(const std::string& path, const char* extension) {
+  size_t length = strlen(extension);
+  return path.size() >= length && path.compare(path.size() - length, length, extension) == 0;
+}
+
+InputStream::InputStream(const char* path)
+  : data_(0),
+    size_(0),
+    isText_(hasExtension(path, ".csv") || hasExtension(path, ".txt")),
+    position_(0),
+    released_(0)
+{
+  int fd = open(path, O_RDONLY);
+  struct stat status;
+
+  if (fd < 0 || fstat(fd, &status) != 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    throw InterpreterException("Could not open input %s", path);
+  }
+
+  size_ = status.st_size;
+
+  if (!isText_ && size_ % sizeof(int64_t) != 0) {
+    close(fd);
+    throw InterpreterException("Size of binary input %s is not a multiple of %d",
+                               path, (int) sizeof(int64_t));
+  }
+
+  // mapping of empty file fails, and there's nothing to map
+  if (size_ > 0) {
+    void* data = mmap(0, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (data == MAP_FAILED) {
+      close(fd);
+      throw InterpreterException("Could not map input %s", path);
+    }
+
+    data_ = static_cast<const char*>(data);
+    madvise(data, size_, MADV_SEQUENTIAL);
+  }
+
+  close(fd);
+}
+
+InputStream::~InputStream() {
+  if (data_) {
+    munmap(const_cast<char*>(data_), size_);
+  }
+}
+
+bool InputStream::hasNext() {
+  if (isText_) {
+    size_t position = position_;
+    while (position < size_ && isSeparator(data_[position])) {
+      ++position;
+    }
+    advance(position);
+  }
+
+  return position_ < size_;
+}
+
+int64_t InputStream::nextInt() {
+  if (!isText_) {
+    return intAt(nextIndex());
+  }
+
+  size_t length;
+  size_t start = token(&length);
+  const char* digits = data_ + start;
+  bool isNegative = digits[0] == '-';
+  size_t i = (digits[0] == '-' || digits[0] == '+') ? 1 : 0;
+  uint64_t limit = isNegative ? static_cast<uint64_t>(INT64_MAX) + 1 : INT64_MAX;
+  uint64_t value = 0;
+
+  if (i == length) {
+    throw InterpreterException("Input at byte %lu is not int", (unsigned long) start);
+  }
+
+  for (; i < length; ++i) {
+    uint64_t digit = digits[i] - '0';
+
+    if (digits[i] < '0' || digits[i] > '9') {
+      throw InterpreterException("Input at byte %lu is not int", (unsigned long) start);
+    }
+
+    if (value > (limit - digit) / 10) {
+      throw InterpreterException("Int at byte %lu of input is too big", (unsigned long) start);
+    }
+
+    value = value * 10 + digit;
+  }
+
+  advance(start + length);
+  return isNegative ? static_cast<int64_t>(0 - value) : static_cast<int64_t>(value);
+}
+
+/*
+ * strtod needs terminated string, and number may end
+ * right at the end of mapping, so number is copied.
+ */
+double InputStream::nextDouble() {
+  if (!isText_) {
+    return doubleAt(nextIndex());
+  }
+
+  size_t length;
+  size_t start = token(&length);
+  char number[constants::MAX_NUMBER_LENGTH + 1];
+
+  if (length > constants::MAX_NUMBER_LENGTH) {
+    throw InterpreterException("Input at byte %lu is too long for number", (unsigned long) start);
+  }
+
+  memcpy(number, data_ + start, length);
+  number[length] = '\0';
+
+  char* end;
+  double value = strtod(number, &end);
+
+  if (end != number + length) {
+    throw InterpreterException("Input at byte %lu is not a number", (unsigned long) start);
+  }
+
+  advance(start + length);
+  return value;
+}
+
+int64_t InputStream::length() const {
+  if (isText_) {
+    throw InterpreterException("Text input can't be read by index");
+  }
+
+  return size_ / sizeof(int64_t);
+}
+
+int64_t InputStream::intAt(int64_t index) const {
+  int64_t value;
+  memcpy(&value, binaryAt(index), sizeof(value));
+  return value;
+}
+
+double InputStream::doubleAt(int64_t index) const {
+  double value;
+  memcpy(&value, binaryAt(index), sizeof(value));
+  return value;
+}
+
+const char* InputStream::binaryAt(int64_t index) const {
+  int64_t values = length();
+
+  if (static_cast<uint64_t>(index) >= static_cast<uint64_t>(values)) {
+    throw InterpreterException("Index %ld is out of bounds of input of %ld values",
+                               (long) index, (long) values);
+  }
+
+  return data_ + index * sizeof(int64_t);
+}
+
+int64_t InputStream::nextIndex() {
+  if (position_ == size_) {
+    throw InterpreterException("End of input");
+  }
+
+  int64_t index = position_ / sizeof(int64_t);
+  advance(position_ + sizeof(int64_t));
+  return index;
+}
+
+size_t InputStream::token(size_t* length) {
+  if (!hasNext()) {
+    throw InterpreterException("End of input");
+  }
+
+  size_t end = position_;
+  while (end < size_ && !isSeparator(data_[end])) {
+    ++end;
+  }
+
+  *length = end - position_;
+  return position_;
+}
+
+void InputStream::advance(size_t position) {
+  position_ = position;
+
+  if (position_ - released_ >= constants::INPUT_RELEASE_SIZE) {
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t end = position_ / pageSize * pageSize;
+    madvise(const_cast<char*>(data_ + released_), end - released_, MADV_DONTNEED);
+    released_ = end;
+  }
+}
+
+} // namespace mathvm
@@ -0,0 +1,70 @@
+#ifndef INPUT_STREAM_HPP
+#define INPUT_STREAM_HPP
+
+#include "mathvm.h"
+
+#include <cstddef>
+
+#include <stdint.h>
+
+namespace mathvm {
+
+namespace constants {
+  // pages of input read sequentially are given back to OS
+  // every time this many bytes are consumed
+  const size_t INPUT_RELEASE_SIZE = 64 << 20;
+  // longest number of text input
+  const size_t MAX_NUMBER_LENGTH = 64;
+}
+
+/*
+ * File program reads numbers from, mapped into memory, so numbers
+ * are parsed right where they are, with no read buffers.
+ * File with .csv or .txt extension is text: numbers separated
+ * by commas, semicolons or whitespace. Any other file is binary:
+ * 8-byte values in byte order of the machine, which can also be
+ * read by index. Value of binary input is int or double as it is read.
+ * Pages consumed by sequential reading are dropped every
+ * INPUT_RELEASE_SIZE bytes, so files much bigger than memory stream
+ * through with bounded resident size.
+ * Methods throw InterpreterException, e.g. at the end of input.
+ */
+class InputStream {
+  const char* data_;
+  size_t size_;
+  bool isText_;
+  size_t position_;  // of next value
+  size_t released_;  // bytes before it are dropped
+
+public:
+  explicit InputStream(const char* path);
+  ~InputStream();
+
+  bool hasNext();
+  int64_t nextInt();
+  double nextDouble();
+
+  // Binary input only
+  int64_t length() const;
+  int64_t intAt(int64_t index) const;
+  double doubleAt(int64_t index) const;
+
+private:
+  InputStream(const InputStream&);
+  InputStream& operator=(const InputStream&);
+
+  bool isSeparator(char c) const {
+    return c == ',' || c == ';' || c == ' ' || c == '\t' || c == '\n' || c == '\r';
+  }
+
+  // Start and length of next number of text input
+  size_t token(size_t* length);
+  const char* binaryAt(int64_t index) const;
+  // Index of next value of binary input, which is consumed
+  int64_t nextIndex();
+  void advance(size_t position);
+};
+
+} // namespace mathvm
+
+#endif
@@ -0,0 +1,582 @@
+#include "insn_list.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+namespace mathvm {
+
+bool isBranch(Instruction insn) {
+  return insn == BC_JA || isConditionalBranch(insn);
+}
+
+bool isConditionalBranch(Instruction insn) {
+  switch (static_cast<uint8_t>(insn)) {
+    case BC_IFICMPNE:
+    case BC_IFICMPE:
+    case BC_IFICMPG:
+    case BC_IFICMPGE:
+    case BC_IFICMPL:
+    case BC_IFICMPLE:
+    case BC_IFDCMPNE:
+    case BC_IFDCMPE:
+    case BC_IFDCMPG:
+    case BC_IFDCMPGE:
+    case BC_IFDCMPL:
+    case BC_IFDCMPLE:
+    case BC_IFORPREP:
+    case BC_IFORLOOP:
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool isTerminator(Instruction insn) {
+  return insn == BC_JA 
+         || insn == BC_RETURN 
+         || insn == BC_STOP 
+         || insn == BC_TAILCALL;
+}
+
+bool isSideEffectFree(Instruction insn) {
+  switch (static_cast<uint8_t>(insn)) {
+    case BC_ILOAD: case BC_DLOAD: case BC_SLOAD:
+    case BC_ILOAD0: case BC_ILOAD1: case BC_ILOADM1: 
+    case BC_DLOAD0: case BC_DLOAD1: case BC_DLOADM1:
+    case BC_LOADIVAR: case BC_LOADDVAR:
+    case BC_LOADCTXIVAR: case BC_LOADCTXDVAR:
+    case BC_DADD: case BC_IADD: case BC_DSUB: case BC_ISUB:
+    case BC_DMUL: case BC_IMUL: case BC_DDIV: case BC_IDIV: 
+    case BC_IMOD: case BC_DNEG: case BC_INEG: 
+    case BC_IAOR: case BC_IAAND: case BC_IAXOR:
+    case BC_I2D: case BC_D2I: case BC_DCMP: case BC_ICMP: 
+    case BC_IDIVPOW2: case BC_IMODPOW2:
+    case BC_DSQRT: case BC_DSIN: case BC_DCOS: case BC_DEXP: case BC_DLOG:
+    case BC_DFLOOR: case BC_DPOW: case BC_IABS: case BC_DABS:
+    case BC_IMIN: case BC_DMIN: case BC_IMAX: case BC_DMAX:
+    case BC_SWAP: case BC_POP:
+      return true;
+    default:
+      return false;
+  }
+}
+
+void stackEffect(const Insn& insn, InterpreterCodeImpl* code, 
+                 uint32_t& popped, uint32_t& pushed) {
+  popped = 0;
+  pushed = 0;
+
+  switch (static_cast<uint8_t>(insn.insn)) {
+    case BC_ILOAD: case BC_DLOAD: case BC_SLOAD:
+    case BC_ILOAD0: case BC_ILOAD1: case BC_ILOADM1: 
+    case BC_DLOAD0: case BC_DLOAD1: case BC_DLOADM1:
+    case BC_LOADIVAR: case BC_LOADDVAR:
+    case BC_LOADCTXIVAR: case BC_LOADCTXDVAR:
+      pushed = 1;
+      break;
+
+    case BC_DADD: case BC_IADD: case BC_DSUB: case BC_ISUB:
+    case BC_DMUL: case BC_IMUL: case BC_DDIV: case BC_IDIV: 
+    case BC_IMOD: case BC_IAOR: case BC_IAAND: case BC_IAXOR:
+    case BC_DCMP: case BC_ICMP: 
+    case BC_DPOW: case BC_IMIN: case BC_DMIN: case BC_IMAX: case BC_DMAX:
+      popped = 2;
+      pushed = 1;
+      break;
+
+    case BC_DNEG: case BC_INEG: case BC_I2D: case BC_D2I:
+    case BC_IDIVPOW2: case BC_IMODPOW2:
+    case BC_DSQRT: case BC_DSIN: case BC_DCOS: case BC_DEXP: case BC_DLOG:
+    case BC_DFLOOR: case BC_IABS: case BC_DABS:
+      popped = 1;
+      pushed = 1;
+      break;
+
+    case BC_SWAP:
+      popped = 2;
+      pushed = 2;
+      break;
+
+    case BC_POP: 
+    case BC_IPRINT: case BC_DPRINT: case BC_SPRINT:
+    case BC_STOREIVAR: case BC_STOREDVAR:
+    case BC_STORECTXIVAR: case BC_STORECTXDVAR:
+    case BC_IFORPREP:
+    case BC_RETURN:
+      popped = 1;
+      break;
+
+    case BC_IFICMPNE: case BC_IFICMPE: case BC_IFICMPG:
+    case BC_IFICMPGE: case BC_IFICMPL: case BC_IFICMPLE:
+    case BC_IFDCMPNE: case BC_IFDCMPE: case BC_IFDCMPG:
+    case BC_IFDCMPGE: case BC_IFDCMPL: case BC_IFDCMPLE:
+      popped = 2;
+      break;
+
+    case BC_CALLCTX:
+      popped = code->functionById(insn.id)->parametersNumber();
+      pushed = 1;
+      break;
+
+    case BC_TAILCALL:
+      popped = code->functionById(insn.id)->parametersNumber();
+      break;
+
+    default:
+      break;
+  }
+}
+
+static int32_t branchOffset(Bytecode* bytecode, uint32_t bci, uint32_t offsetSize) {
+  return offsetSize == sizeof(int32_t) ? bytecode->getInt32(bci) : bytecode->getInt16(bci);
+}
+
+// Instruction encode writes for insn
+static Instruction encodedInsn(const Insn& insn, bool isLong) {
+  Instruction shortVar = shortVarInsn(insn.insn, insn.id);
+
+  if (shortVar != BC_INVALID) {
+    return shortVar;
+  }
+
+  if (insn.insn == BC_ILOAD) {
+    return intLoadInsn(insn.intValue);
+  }
+
+  return isLong ? longBranch(insn.insn) : insn.insn;
+}
+
+Insn intConstant(int64_t value) {
+  Insn insn(BC_ILOAD);
+
+  switch (value) {
+    case 0:  insn.insn = BC_ILOAD0;  break;
+    case 1:  insn.insn = BC_ILOAD1;  break;
+    case -1: insn.insn = BC_ILOADM1; break;
+    default: break;
+  }
+
+  insn.intValue = value;
+  return insn;
+}
+
+Insn doubleConstant(double value) {
+  Insn insn(BC_DLOAD);
+
+  // compare bits, so -0.0 is not loaded as 0.0
+  if (memcmp(&value, "\0\0\0\0\0\0\0\0", sizeof(double)) == 0) {
+    insn.insn = BC_DLOAD0;
+  } else if (value == 1) {
+    insn.insn = BC_DLOAD1;
+  } else if (value == -1) {
+    insn.insn = BC_DLOADM1;
+  }
+
+  insn.doubleValue = value;
+  return insn;
+}
+
+/*
+ * Compact forms (LOADIVAR0, ILOAD8, long branches and the like) 
+ * are decoded as instructions they stand for, so nothing but 
+ * encode has to know about them.
+ */
+bool decode(Bytecode* bytecode, InsnList& insns, std::vector<uint32_t>* offsets) {
+  std::vector<uint32_t> indexByBci(bytecode->length() + 1, UINT32_MAX);
+  std::vector<uint32_t> targetBcis;
+  uint32_t bci = 0;
+
+  insns.clear();
+  if (offsets) {
+    offsets->clear();
+  }
+
+  while (bci < bytecode->length()) {
+    Instruction encoded = bytecode->getInsn(bci);
+    Insn insn(shortBranch(encoded));
+    uint32_t start = bci;
+    uint32_t offsetSize = isLongBranch(encoded) ? sizeof(int32_t) : sizeof(int16_t);
+    indexByBci[bci] = insns.size();
+    ++bci;
+
+    switch (static_cast<uint8_t>(encoded)) {
+      case BC_ILOAD0:  insn.intValue = 0;  break;
+      case BC_ILOAD1:  insn.intValue = 1;  break;
+      case BC_ILOADM1: insn.intValue = -1; break;
+      case BC_DLOAD0:  insn.doubleValue = 0;  break;
+      case BC_DLOAD1:  insn.doubleValue = 1;  break;
+      case BC_DLOADM1: insn.doubleValue = -1; break;
+
+      case BC_ILOAD:
+        insn.intValue = bytecode->getInt64(bci);
+        bci += sizeof(int64_t);
+        break;
+      case BC_ILOAD8:
+        insn.insn = BC_ILOAD;
+        insn.intValue = static_cast<int8_t>(bytecode->get(bci));
+        bci += sizeof(int8_t);
+        break;
+      case BC_ILOAD16:
+        insn.insn = BC_ILOAD;
+        insn.intValue = bytecode->getInt16(bci);
+        bci += sizeof(int16_t);
+        break;
+      case BC_DLOAD:
+        insn.doubleValue = bytecode->getDouble(bci);
+        bci += sizeof(double);
+        break;
+
+      case BC_SLOAD:
+      case BC_LOADIVAR:
+      case BC_LOADDVAR:
+      case BC_STOREIVAR:
+      case BC_STOREDVAR:
+      case BC_IDIVPOW2:
+      case BC_IMODPOW2:
+        insn.id = bytecode->getUInt16(bci);
+        bci += sizeof(uint16_t);
+        break;
+
+      case BC_LOADIVAR0: case BC_LOADIVAR1: case BC_LOADIVAR2: case BC_LOADIVAR3:
+      case BC_LOADDVAR0: case BC_LOADDVAR1: case BC_LOADDVAR2: case BC_LOADDVAR3:
+      case BC_STOREIVAR0: case BC_STOREIVAR1: case BC_STOREIVAR2: case BC_STOREIVAR3:
+      case BC_STOREDVAR0: case BC_STOREDVAR1: case BC_STOREDVAR2: case BC_STOREDVAR3:
+        isShortVarInsn(encoded, &insn.insn, &insn.id);
+        break;
+
+      case BC_LOADCTXIVAR:
+      case BC_LOADCTXDVAR:
+      case BC_STORECTXIVAR:
+      case BC_STORECTXDVAR:
+        insn.context = bytecode->getUInt16(bci);
+        insn.id = bytecode->getUInt16(bci + sizeof(uint16_t));
+        bci += 2 * sizeof(uint16_t);
+        break;
+
+      case BC_CALLCTX:
+      case BC_TAILCALL:
+        insn.id = bytecode->getUInt16(bci);
+        insn.context = bytecode->getUInt16(bci + sizeof(uint16_t));
+        bci += 2 * sizeof(uint16_t);
+        break;
+
+      case BC_JA:
+      case BC_IFICMPNE:
+      case BC_IFICMPE:
+      case BC_IFICMPG:
+      case BC_IFICMPGE:
+      case BC_IFICMPL:
+      case BC_IFICMPLE:
+      case BC_IFDCMPNE:
+      case BC_IFDCMPE:
+      case BC_IFDCMPG:
+      case BC_IFDCMPGE:
+      case BC_IFDCMPL:
+      case BC_IFDCMPLE:
+      case BC_LJA:
+      case BC_LIFICMPNE:
+      case BC_LIFICMPE:
+      case BC_LIFICMPG:
+      case BC_LIFICMPGE:
+      case BC_LIFICMPL:
+      case BC_LIFICMPLE:
+      case BC_LIFDCMPNE:
+      case BC_LIFDCMPE:
+      case BC_LIFDCMPG:
+      case BC_LIFDCMPGE:
+      case BC_LIFDCMPL:
+      case BC_LIFDCMPLE:
+        targetBcis.push_back(bci + branchOffset(bytecode, bci, offsetSize));
+        insn.target = targetBcis.size() - 1;
+        bci += offsetSize;
+        break;
+
+      case BC_IFORPREP:
+      case BC_IFORLOOP:
+      case BC_LIFORPREP:
+      case BC_LIFORLOOP:
+        targetBcis.push_back(bci + branchOffset(bytecode, bci, offsetSize));
+        insn.target = targetBcis.size() - 1;
+        insn.id = bytecode->getUInt16(bci + offsetSize);
+        insn.limitId = bytecode->getUInt16(bci + offsetSize + sizeof(uint16_t));
+        bci += offsetSize + 2 * sizeof(uint16_t);
+        break;
+
+      case BC_DADD: case BC_IADD: case BC_DSUB: case BC_ISUB:
+      case BC_DMUL: case BC_IMUL: case BC_DDIV: case BC_IDIV: 
+      case BC_IMOD: case BC_DNEG: case BC_INEG: 
+      case BC_IAOR: case BC_IAAND: case BC_IAXOR:
+      case BC_IPRINT: case BC_DPRINT: case BC_SPRINT:
+      case BC_I2D: case BC_D2I: case BC_SWAP: case BC_POP:
+      case BC_DCMP: case BC_ICMP: 
+      case BC_DSQRT: case BC_DSIN: case BC_DCOS: case BC_DEXP: case BC_DLOG:
+      case BC_DFLOOR: case BC_DPOW: case BC_IABS: case BC_DABS:
+      case BC_IMIN: case BC_DMIN: case BC_IMAX: case BC_DMAX:
+      case BC_STOP: case BC_RETURN:
+        break;
+
+      default:
+        return false;
+    }
+
+    assert(bci - start == instructionLength(encoded));
+    insns.push_back(insn);
+    if (offsets) {
+      offsets->push_back(start);
+    }
+  }
+
+  indexByBci[bci] = insns.size();
+
+  for (size_t i = 0; i < insns.size(); ++i) {
+    if (isBranch(insns[i].insn)) {
+      uint32_t target = indexByBci[targetBcis[insns[i].target]];
+
+      if (target == UINT32_MAX) {
+        return false;
+      }
+
+      insns[i].target = target;
+    }
+  }
+
+  return true;
+}
+
+/*
+ * Every instruction takes its shortest form. Branch gets long form
+ * when its offset doesn't fit into int16_t; that makes code longer
+ * and may push other branches out of reach, so lengths are computed
+ * again until no branch has to grow.
+ */
+void encode(const InsnList& insns, Bytecode* bytecode, std::vector<uint32_t>* offsets) {
+  std::vector<uint32_t> bciByIndex(insns.size() + 1, 0);
+  std::vector<bool> isLong(insns.size(), false);
+  bool isGrown = true;
+
+  while (isGrown) {
+    isGrown = false;
+
+    for (size_t i = 0; i < insns.size(); ++i) {
+      bciByIndex[i + 1] = bciByIndex[i] + instructionLength(encodedInsn(insns[i], isLong[i]));
+    }
+
+    for (size_t i = 0; i < insns.size(); ++i) {
+      int32_t offset = bciByIndex[insns[i].target] - (bciByIndex[i] + 1);
+
+      if (isBranch(insns[i].insn) && !isLong[i] && offset != static_cast<int16_t>(offset)) {
+        isLong[i] = true;
+        isGrown = true;
+      }
+    }
+  }
+
+  if (offsets) {
+    offsets->assign(bciByIndex.begin(), bciByIndex.end());
+  }
+
+  for (size_t i = 0; i < insns.size(); ++i) {
+    const Insn& insn = insns[i];
+    Instruction encoded = encodedInsn(insn, isLong[i]);
+    bytecode->addInsn(encoded);
+
+    switch (static_cast<uint8_t>(encoded)) {
+      case BC_ILOAD: 
+        bytecode->addInt64(insn.intValue); 
+        break;
+      case BC_ILOAD8: 
+        bytecode->add(static_cast<uint8_t>(insn.intValue)); 
+        break;
+      case BC_ILOAD16: 
+        bytecode->addInt16(static_cast<int16_t>(insn.intValue)); 
+        break;
+      case BC_DLOAD: 
+        bytecode->addDouble(insn.doubleValue); 
+        break;
+
+      case BC_SLOAD:
+      case BC_LOADIVAR:
+      case BC_LOADDVAR:
+      case BC_STOREIVAR:
+      case BC_STOREDVAR:
+      case BC_IDIVPOW2:
+      case BC_IMODPOW2:
+        bytecode->addUInt16(insn.id);
+        break;
+
+      case BC_LOADCTXIVAR:
+      case BC_LOADCTXDVAR:
+      case BC_STORECTXIVAR:
+      case BC_STORECTXDVAR:
+        bytecode->addUInt16(insn.context);
+        bytecode->addUInt16(insn.id);
+        break;
+
+      case BC_CALLCTX:
+      case BC_TAILCALL:
+        bytecode->addUInt16(insn.id);
+        bytecode->addUInt16(insn.context);
+        break;
+
+      default:
+        break;
+    }
+
+    if (isBranch(insn.insn)) {
+      int32_t offset = bciByIndex[insn.target] - (bciByIndex[i] + 1);
+
+      if (isLong[i]) {
+        bytecode->addInt32(offset);
+      } else {
+        bytecode->addInt16(static_cast<int16_t>(offset));
+      }
+
+      if (insn.insn == BC_IFORPREP || insn.insn == BC_IFORLOOP) {
+        bytecode->addUInt16(insn.id);
+        bytecode->addUInt16(insn.limitId);
+      }
+    }
+  }
+}
+
+void compact(InsnList& insns) {
+  std::vector<uint32_t> newIndex(insns.size() + 1, 0);
+  uint32_t kept = insns.size();
+  newIndex[insns.size()] = kept;
+
+  // removed instruction is mapped to next kept one
+  for (size_t i = insns.size(); i > 0; --i) {
+    if (!insns[i - 1].removed) {
+      --kept;
+    }
+    newIndex[i - 1] = kept;
+  }
+
+  uint32_t removedNumber = kept;
+  InsnList result;
+  result.reserve(insns.size() - removedNumber);
+
+  for (size_t i = 0; i < insns.size(); ++i) {
+    if (insns[i].removed) {
+      continue;
+    }
+
+    Insn insn = insns[i];
+    if (isBranch(insn.insn)) {
+      insn.target = newIndex[insn.target] - removedNumber;
+    }
+    result.push_back(insn);
+  }
+
+  insns.swap(result);
+}
+
+void insert(InsnList& insns, const std::vector<Insertion>& insertions) {
+  std::vector<std::vector<const Insertion*> > before(insns.size() + 1);
+  std::vector<uint32_t> inserted(insns.size() + 1, 0);
+  std::vector<uint32_t> newIndex(insns.size() + 1, 0);
+  std::vector<bool> isBypassing(insns.size(), false);
+  InsnList result;
+
+  for (size_t i = 0; i < insertions.size(); ++i) {
+    const Insertion& insertion = insertions[i];
+    before[insertion.before].push_back(&insertion);
+
+    for (size_t j = 0; j < insertion.bypassing.size(); ++j) {
+      isBypassing[insertion.bypassing[j]] = true;
+    }
+  }
+
+  for (size_t i = 0; i <= insns.size(); ++i) {
+    inserted[i] = result.size();
+
+    for (size_t j = 0; j < before[i].size(); ++j) {
+      const InsnList& code = before[i][j]->code;
+      result.insert(result.end(), code.begin(), code.end());
+    }
+
+    newIndex[i] = result.size();
+
+    if (i < insns.size()) {
+      result.push_back(insns[i]);
+    }
+  }
+
+  for (size_t i = 0; i < insns.size(); ++i) {
+    Insn& insn = result[newIndex[i]];
+
+    if (isBranch(insn.insn)) {
+      insn.target = isBypassing[i] ? newIndex[insn.target] : inserted[insn.target];
+    }
+  }
+
+  insns.swap(result);
+}
+
+void replace(InsnList& insns, uint32_t index, const Insn& by) {
+  uint32_t inlined = insns[index].inlined;
+  insns[index] = by;
+  insns[index].inlined = inlined;
+}
+
+/*
+ * Body nested in another one is recorded before it, so going
+ * through bodies in order tags instruction with innermost one.
+ */
+void markInlined(InsnList& insns, const std::vector<uint32_t>& offsets,
+                 const std::vector<InlinedBody>& bodies) {
+  for (size_t i = 0; i < bodies.size(); ++i) {
+    size_t j = std::lower_bound(offsets.begin(), offsets.end(), bodies[i].start) - offsets.begin();
+
+    for (; j < insns.size() && offsets[j] < bodies[i].end; ++j) {
+      if (insns[j].inlined == constants::NOT_INLINED) {
+        insns[j].inlined = i;
+      }
+    }
+  }
+}
+
+/*
+ * Instruction is from its body and every body that one is nested in.
+ * Moved code may split body, then every piece becomes body of its own;
+ * pieces of nested body still come before pieces enclosing them.
+ * offsets has offset of end of code after the last instruction.
+ */
+std::vector<InlinedBody> inlinedBodies(const InsnList& insns, const std::vector<uint32_t>& offsets,
+                                       const std::vector<InlinedBody>& bodies) {
+  std::vector<uint32_t> parents(bodies.size(), constants::NOT_INLINED);
+
+  for (size_t i = 0; i < bodies.size(); ++i) {
+    for (size_t j = i + 1; j < bodies.size(); ++j) {
+      if (bodies[j].start <= bodies[i].start && bodies[i].end <= bodies[j].end) {
+        parents[i] = j;
+        break;
+      }
+    }
+  }
+
+  std::vector<std::vector<InlinedBody> > pieces(bodies.size());
+
+  for (size_t i = 0; i < insns.size(); ++i) {
+    for (uint32_t body = insns[i].inlined; body != constants::NOT_INLINED; body = parents[body]) {
+      std::vector<InlinedBody>& bodyPieces = pieces[body];
+
+      if (!bodyPieces.empty() && bodyPieces.back().end == offsets[i]) {
+        bodyPieces.back().end = offsets[i + 1];
+      } else {
+        bodyPieces.push_back(InlinedBody(offsets[i], offsets[i + 1], bodies[body].function));
+      }
+    }
+  }
+
+  std::vector<InlinedBody> result;
+
+  for (size_t i = 0; i < pieces.size(); ++i) {
+    result.insert(result.end(), pieces[i].begin(), pieces[i].end());
+  }
+
+  return result;
+}
+
+} // namespace mathvm
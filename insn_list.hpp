@@ -0,0 +1,94 @@
+#ifndef INSN_LIST_HPP
+#define INSN_LIST_HPP
+
+#include "mathvm.h"
+#include "instructions.hpp"
+#include "interpreter_code.hpp"
+
+#include <vector>
+
+#include <stdint.h>
+
+namespace mathvm {
+
+namespace constants {
+  const uint32_t NOT_INLINED = UINT32_MAX;
+}
+
+/*
+ * Decoded instruction. Branch destinations are 
+ * indices of instructions instead of offsets, 
+ * so instructions can be removed and replaced freely.
+ */
+struct Insn {
+  Instruction insn;
+  uint16_t id;       // variable, function or string constant id, shift of IDIVPOW2
+  uint16_t context;  // variable context or parent hops of call
+  uint16_t limitId;  // limit variable of IFORPREP/IFORLOOP
+  int64_t intValue;
+  double doubleValue;
+  uint32_t target;   // index of branch destination
+  uint32_t inlined;  // innermost inlined body instruction is from
+  bool removed;
+
+  explicit Insn(Instruction insn = BC_INVALID)
+    : insn(insn), 
+      id(0), 
+      context(0), 
+      limitId(0), 
+      intValue(0), 
+      doubleValue(0), 
+      target(0), 
+      inlined(constants::NOT_INLINED),
+      removed(false) {}
+};
+
+typedef std::vector<Insn> InsnList;
+
+/*
+ * Code to insert before instruction. Branches to that instruction
+ * go to inserted code, except bypassing ones, which still go 
+ * to the instruction itself. Inserted code has no branches.
+ */
+struct Insertion {
+  uint32_t before;
+  InsnList code;
+  std::vector<uint32_t> bypassing; // indices of branches
+
+  explicit Insertion(uint32_t before) : before(before) {}
+};
+
+// Return false if bytecode has instructions optimizer doesn't know about.
+// offsets, if given, get bytecode offset of every instruction
+bool decode(Bytecode* bytecode, InsnList& insns, std::vector<uint32_t>* offsets = 0);
+void encode(const InsnList& insns, Bytecode* bytecode, std::vector<uint32_t>* offsets = 0);
+// Drops removed instructions; branches to removed
+// instruction are redirected to next kept one
+void compact(InsnList& insns);
+void insert(InsnList& insns, const std::vector<Insertion>& insertions);
+// Replaces instruction, which stays in its inlined body
+void replace(InsnList& insns, uint32_t index, const Insn& by);
+
+// Tags decoded instructions with inlined bodies they are from
+void markInlined(InsnList& insns, const std::vector<uint32_t>& offsets,
+                 const std::vector<InlinedBody>& bodies);
+// Bodies of tagged instructions encoded at offsets
+std::vector<InlinedBody> inlinedBodies(const InsnList& insns, const std::vector<uint32_t>& offsets,
+                                       const std::vector<InlinedBody>& bodies);
+
+Insn intConstant(int64_t value);
+Insn doubleConstant(double value);
+
+bool isBranch(Instruction insn);
+bool isConditionalBranch(Instruction insn);
+// Control never goes to next instruction
+bool isTerminator(Instruction insn);
+// Instruction doesn't change anything but operand stack
+bool isSideEffectFree(Instruction insn);
+// Number of operand stack values instruction pops and pushes
+void stackEffect(const Insn& insn, InterpreterCodeImpl* code, 
+                 uint32_t& popped, uint32_t& pushed);
+
+} // namespace mathvm
+
+#endif
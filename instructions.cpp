@@ -0,0 +1,135 @@
+#include "instructions.hpp"
+
+#include <cassert>
+
+namespace mathvm {
+
+static const char* extNames[] = {
+#define EXT_NAME(b, d, l) #b,
+  FOR_EXT_BYTECODES(EXT_NAME)
+#undef EXT_NAME
+};
+
+static const size_t extLengths[] = {
+#define EXT_LENGTH(b, d, l) l,
+  FOR_EXT_BYTECODES(EXT_LENGTH)
+#undef EXT_LENGTH
+};
+
+const char* instructionName(Instruction insn, size_t* length) {
+  if (insn < BC_LAST) {
+    return bytecodeName(insn, length);
+  }
+
+  int code = insn;
+  assert(code > BCX_FIRST && code < BCX_LAST);
+  size_t index = code - BCX_FIRST - 1;
+
+  if (length) {
+    *length = extLengths[index];
+  }
+
+  return extNames[index];
+}
+
+size_t instructionLength(Instruction insn) {
+  size_t length = 0;
+  instructionName(insn, &length);
+  return length;
+}
+
+static const Instruction branchForms[][2] = {
+  { BC_JA, BC_LJA },
+  { BC_IFICMPNE, BC_LIFICMPNE },
+  { BC_IFICMPE, BC_LIFICMPE },
+  { BC_IFICMPG, BC_LIFICMPG },
+  { BC_IFICMPGE, BC_LIFICMPGE },
+  { BC_IFICMPL, BC_LIFICMPL },
+  { BC_IFICMPLE, BC_LIFICMPLE },
+  { BC_IFDCMPNE, BC_LIFDCMPNE },
+  { BC_IFDCMPE, BC_LIFDCMPE },
+  { BC_IFDCMPG, BC_LIFDCMPG },
+  { BC_IFDCMPGE, BC_LIFDCMPGE },
+  { BC_IFDCMPL, BC_LIFDCMPL },
+  { BC_IFDCMPLE, BC_LIFDCMPLE },
+  { BC_IFORPREP, BC_LIFORPREP },
+  { BC_IFORLOOP, BC_LIFORLOOP }
+};
+
+static const size_t BRANCHES_NUMBER = sizeof(branchForms) / sizeof(branchForms[0]);
+
+Instruction longBranch(Instruction insn) {
+  for (size_t i = 0; i < BRANCHES_NUMBER; ++i) {
+    if (branchForms[i][0] == insn) {
+      return branchForms[i][1];
+    }
+  }
+
+  return insn;
+}
+
+Instruction shortBranch(Instruction insn) {
+  for (size_t i = 0; i < BRANCHES_NUMBER; ++i) {
+    if (branchForms[i][1] == insn) {
+      return branchForms[i][0];
+    }
+  }
+
+  return insn;
+}
+
+bool isLongBranch(Instruction insn) {
+  return shortBranch(insn) != insn;
+}
+
+// one-byte forms go in fours in mathvm instruction set
+static const Instruction varForms[][2] = {
+  { BC_LOADDVAR, BC_LOADDVAR0 },
+  { BC_LOADIVAR, BC_LOADIVAR0 },
+  { BC_STOREDVAR, BC_STOREDVAR0 },
+  { BC_STOREIVAR, BC_STOREIVAR0 }
+};
+
+static const size_t VAR_INSNS_NUMBER = sizeof(varForms) / sizeof(varForms[0]);
+static const uint16_t SHORT_VARS_NUMBER = 4;
+
+Instruction shortVarInsn(Instruction insn, uint16_t id) {
+  for (size_t i = 0; i < VAR_INSNS_NUMBER && id < SHORT_VARS_NUMBER; ++i) {
+    if (varForms[i][0] == insn) {
+      return static_cast<Instruction>(varForms[i][1] + id);
+    }
+  }
+
+  return BC_INVALID;
+}
+
+bool isShortVarInsn(Instruction shortInsn, Instruction* insn, uint16_t* id) {
+  for (size_t i = 0; i < VAR_INSNS_NUMBER; ++i) {
+    int32_t var = shortInsn - varForms[i][1];
+
+    if (var >= 0 && var < SHORT_VARS_NUMBER) {
+      *insn = varForms[i][0];
+      *id = var;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+Instruction intLoadInsn(int64_t value) {
+  switch (value) {
+    case 0:  return BC_ILOAD0;
+    case 1:  return BC_ILOAD1;
+    case -1: return BC_ILOADM1;
+    default: break;
+  }
+
+  if (value == static_cast<int8_t>(value)) {
+    return BC_ILOAD8;
+  }
+
+  return value == static_cast<int16_t>(value) ? BC_ILOAD16 : BC_ILOAD;
+}
+
+} // namespace mathvm
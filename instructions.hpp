@@ -0,0 +1,141 @@
+#ifndef INSTRUCTIONS_HPP
+#define INSTRUCTIONS_HPP
+
+#include "mathvm.h"
+
+#include <cstddef>
+
+#include <stdint.h>
+
+namespace mathvm {
+
+/*
+ * Instructions of this translator, which are not part 
+ * of mathvm instruction set. They are numbered right after BC_LAST,
+ * so they fit in one byte. Numbers past 127 are beyond the enumerators
+ * of Instruction, but within int, its underlying type, so switches
+ * go over static_cast<uint8_t>(insn).
+ */
+#define FOR_EXT_BYTECODES(DO)                                                        \
+  DO(CALLCTX, "Call function, next two bytes - unsigned function id, "                \
+              "next two bytes - number of parent links to its parent frame.", 5)       \
+  DO(TAILCALL, "Call function in place of current frame, next two bytes - unsigned "  \
+               "function id, next two bytes - number of parent links to its parent frame.", 5) \
+  DO(IFORPREP, "Pop TOS and store to int loop limit variable, jump if int loop counter "    \
+               "variable > limit, next two bytes - signed offset of jump destination, "      \
+               "next two bytes - counter id, next two bytes - limit id.", 7)                 \
+  DO(IFORLOOP, "Increment int loop counter variable, jump if counter <= int loop limit "    \
+               "variable, next two bytes - signed offset of jump destination, "              \
+               "next two bytes - counter id, next two bytes - limit id.", 7)                 \
+  DO(IDIVPOW2, "Divide int on TOS by 2^k rounding toward zero, "                           \
+               "next two bytes - unsigned k.", 3)                                           \
+  DO(IMODPOW2, "Remainder of division of int on TOS by 2^k, with sign of TOS, "            \
+               "next two bytes - unsigned k.", 3)                                           \
+  DO(GENERATE, "Generate bytecode of current function and run it from the beginning. "      \
+               "Only body of interpreter stub for function which body is deferred.", 1)    \
+  DO(NEWARRAY, "Pop int length, push handle of new zeroed array, "                         \
+               "next two bytes - element type, VT_INT or VT_DOUBLE.", 3)                    \
+  DO(ALENGTH, "Pop array handle and push its length.", 1)                                  \
+  DO(AILOAD, "Pop int index and array handle, push int element.", 1)                      \
+  DO(ADLOAD, "Pop int index and array handle, push double element.", 1)                   \
+  DO(AISTORE, "Pop int value, int index and array handle, store element.", 1)             \
+  DO(ADSTORE, "Pop double value, int index and array handle, store element.", 1)          \
+  DO(AILOADNC, "Same as AILOAD, but index and handle are known to be valid.", 1)          \
+  DO(ADLOADNC, "Same as ADLOAD, but index and handle are known to be valid.", 1)          \
+  DO(AISTORENC, "Same as AISTORE, but index and handle are known to be valid.", 1)        \
+  DO(ADSTORENC, "Same as ADSTORE, but index and handle are known to be valid.", 1)        \
+  DO(ARRAYOP, "Bulk operation over arrays: pop its arguments, push result if it has one, " \
+              "next two bytes - ArrayOp.", 3)                                              \
+  DO(READ, "Push next value of input, next two bytes - its type, VT_INT or VT_DOUBLE.", 3) \
+  DO(HASINPUT, "Push 1 if input has next value, 0 otherwise.", 1)                          \
+  DO(READARRAY, "Pop array handle, fill array with next values of input, "                 \
+                "push number of values read.", 1)                                           \
+  DO(INPUTAT, "Pop int index, push value of binary input at index, "                       \
+              "next two bytes - its type, VT_INT or VT_DOUBLE.", 3)                         \
+  DO(INPUTLENGTH, "Push number of values of binary input.", 1)                             \
+  DO(DSQRT, "Replace double on TOS with its square root.", 1)                              \
+  DO(DSIN, "Replace double on TOS with its sine.", 1)                                      \
+  DO(DCOS, "Replace double on TOS with its cosine.", 1)                                    \
+  DO(DEXP, "Replace double on TOS with e raised to it.", 1)                                \
+  DO(DLOG, "Replace double on TOS with its natural logarithm.", 1)                         \
+  DO(DFLOOR, "Replace double on TOS with the largest integral double not above it.", 1)   \
+  DO(DPOW, "Pop double exponent and double base, push base raised to exponent.", 1)        \
+  DO(IABS, "Replace int on TOS with its absolute value.", 1)                               \
+  DO(DABS, "Replace double on TOS with its absolute value.", 1)                            \
+  DO(IMIN, "Pop two ints, push the smaller one.", 1)                                       \
+  DO(DMIN, "Pop two doubles, push the smaller one, the other one if one is NaN.", 1)       \
+  DO(IMAX, "Pop two ints, push the bigger one.", 1)                                        \
+  DO(DMAX, "Pop two doubles, push the bigger one, the other one if one is NaN.", 1)       \
+  DO(IFDCMPNE, "Compare two topmost doubles and jump if upper != lower or one is NaN, "    \
+               "next two bytes - signed offset of jump destination.", 3)                  \
+  DO(IFDCMPE, "Compare two topmost doubles and jump if upper == lower, "                  \
+              "next two bytes - signed offset of jump destination.", 3)                   \
+  DO(IFDCMPG, "Compare two topmost doubles and jump if upper > lower, "                   \
+              "next two bytes - signed offset of jump destination.", 3)                   \
+  DO(IFDCMPGE, "Compare two topmost doubles and jump if upper >= lower, "                 \
+               "next two bytes - signed offset of jump destination.", 3)                  \
+  DO(IFDCMPL, "Compare two topmost doubles and jump if upper < lower, "                   \
+              "next two bytes - signed offset of jump destination.", 3)                   \
+  DO(IFDCMPLE, "Compare two topmost doubles and jump if upper <= lower, "                 \
+               "next two bytes - signed offset of jump destination.", 3)                  \
+  DO(ILOAD8, "Load int on TOS, next byte - its signed value.", 2)                          \
+  DO(ILOAD16, "Load int on TOS, next two bytes - its signed value.", 3)                    \
+  DO(LJA, "Same as JA, but offset takes four bytes.", 5)                                   \
+  DO(LIFICMPNE, "Same as IFICMPNE, but offset takes four bytes.", 5)                       \
+  DO(LIFICMPE, "Same as IFICMPE, but offset takes four bytes.", 5)                         \
+  DO(LIFICMPG, "Same as IFICMPG, but offset takes four bytes.", 5)                         \
+  DO(LIFICMPGE, "Same as IFICMPGE, but offset takes four bytes.", 5)                       \
+  DO(LIFICMPL, "Same as IFICMPL, but offset takes four bytes.", 5)                         \
+  DO(LIFICMPLE, "Same as IFICMPLE, but offset takes four bytes.", 5)                       \
+  DO(LIFDCMPNE, "Same as IFDCMPNE, but offset takes four bytes.", 5)                       \
+  DO(LIFDCMPE, "Same as IFDCMPE, but offset takes four bytes.", 5)                         \
+  DO(LIFDCMPG, "Same as IFDCMPG, but offset takes four bytes.", 5)                         \
+  DO(LIFDCMPGE, "Same as IFDCMPGE, but offset takes four bytes.", 5)                       \
+  DO(LIFDCMPL, "Same as IFDCMPL, but offset takes four bytes.", 5)                         \
+  DO(LIFDCMPLE, "Same as IFDCMPLE, but offset takes four bytes.", 5)                       \
+  DO(LIFORPREP, "Same as IFORPREP, but offset takes four bytes.", 9)                       \
+  DO(LIFORLOOP, "Same as IFORLOOP, but offset takes four bytes.", 9)
+
+enum ExtInstruction {
+  BCX_FIRST = BC_LAST,
+#define EXT_ENUM_ELEM(b, d, l) BCX_##b,
+  FOR_EXT_BYTECODES(EXT_ENUM_ELEM)
+#undef EXT_ENUM_ELEM
+  BCX_LAST
+};
+
+#define EXT_INSN_CONST(b, d, l) \
+  const Instruction BC_##b = static_cast<Instruction>(BCX_##b);
+FOR_EXT_BYTECODES(EXT_INSN_CONST)
+#undef EXT_INSN_CONST
+
+// Same as bytecodeName, but knows about extended instructions too
+const char* instructionName(Instruction insn, size_t* length = 0);
+size_t instructionLength(Instruction insn);
+
+/*
+ * Branches come in two forms: with two-byte offset and with 
+ * four-byte one (L-prefixed), which functions longer than 
+ * int16_t offset reaches need. Given branch of either form,
+ * these return the other one, or the same branch.
+ */
+Instruction longBranch(Instruction insn);
+Instruction shortBranch(Instruction insn);
+bool isLongBranch(Instruction insn);
+
+/*
+ * Variables 0-3 have one-byte forms of LOADIVAR, LOADDVAR, STOREIVAR
+ * and STOREDVAR. shortVarInsn returns such form for variable id, 
+ * BC_INVALID if there is none; isShortVarInsn gives back instruction
+ * and variable of the form.
+ */
+Instruction shortVarInsn(Instruction insn, uint16_t id);
+bool isShortVarInsn(Instruction shortInsn, Instruction* insn, uint16_t* id);
+
+// Shortest instruction loading int value: ILOAD0 and the like,
+// ILOAD8, ILOAD16 or ILOAD
+Instruction intLoadInsn(int64_t value);
+
+} // namespace mathvm
+
+#endif
@@ -6,39 +6,109 @@
 #include <map>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include <stdint.h>
 
 namespace mathvm {
 
+/*
+ * Call of function inlined into body of another one: its code
+ * is [start, end) of the body. Bodies of calls inlined into
+ * inlined function come before body of that call.
+ */
+struct InlinedBody {
+  uint32_t start;
+  uint32_t end;
+  uint16_t function;
+
+  InlinedBody(uint32_t start, uint32_t end, uint16_t function)
+    : start(start),
+      end(end),
+      function(function) {}
+};
+
 class InterpreterFunction : public BytecodeFunction {
   uint16_t deepness_; // how deep is function in ast (0 for top)
+  bool isGenerated_;  // false while body is deferred
+  std::vector<InlinedBody> inlined_; // call stack shows them
 
 public:
   InterpreterFunction(AstFunction* function, uint16_t deepness) 
     : BytecodeFunction(function),
-      deepness_(deepness) {}
+      deepness_(deepness),
+      isGenerated_(false) {}
 
   virtual ~InterpreterFunction() {}
 
   uint16_t deepness() const { return deepness_; }
+
+  bool isGenerated() const { return isGenerated_; }
+
+  void setGenerated() { isGenerated_ = true; }
+
+  const std::vector<InlinedBody>& inlined() const { return inlined_; }
+
+  void addInlined(const InlinedBody& body) { inlined_.push_back(body); }
+
+  // Bytecode is rewritten together with them
+  void setInlined(const std::vector<InlinedBody>& inlined) { inlined_ = inlined; }
+};
+
+/*
+ * Generates bytecode of function which body was deferred 
+ * until it is needed (see BytecodeGenerator).
+ */
+class BodyGenerator {
+public:
+  virtual ~BodyGenerator() {}
+  virtual void generate(uint16_t id) = 0;
+  virtual void generateAll() = 0;
 };
 
 class InterpreterCodeImpl : public Code {
+  BodyGenerator* generator_; // 0 when all bodies are generated
+
   public:
-    InterpreterCodeImpl() {}
-    virtual ~InterpreterCodeImpl() {}
+    InterpreterCodeImpl() : generator_(0) {}
+
+    virtual ~InterpreterCodeImpl() {
+      delete generator_;
+    }
 
     virtual Status* execute(vector<Var*>& vars) {
       return Status::Error("Not implemented InterpreterCodeImpl::execute");
     }
 
+    // Only InterpreterFunction instances are ever added to this code,
+    // so static downcast is safe here
     InterpreterFunction* functionByName(const string& name) {
-      return dynamic_cast<InterpreterFunction*>(Code::functionByName(name));
+      return static_cast<InterpreterFunction*>(Code::functionByName(name));
     }
 
     InterpreterFunction* functionById(uint16_t id) {
-      return dynamic_cast<InterpreterFunction*>(Code::functionById(id));
+      return static_cast<InterpreterFunction*>(Code::functionById(id));
+    }
+
+    // Code takes ownership of generator
+    void setGenerator(BodyGenerator* generator) {
+      delete generator_;
+      generator_ = generator;
+    }
+
+    // May throw TranslationException, as body is generated only now
+    void generate(uint16_t id) {
+      if (!functionById(id)->isGenerated()) {
+        generator_->generate(id);
+      }
+    }
+
+    // For users of whole program: optimizer, native compilers
+    void generateAll() {
+      if (generator_) {
+        generator_->generateAll();
+        setGenerator(0);
+      }
     }
 };
 
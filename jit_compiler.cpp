@@ -0,0 +1,1493 @@
+#include "jit_compiler.hpp"
+#include "control_flow.hpp"
+#include "errors.hpp"
+#include "insn_list.hpp"
+#include "linear_scan.hpp"
+#include "ssa.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace mathvm {
+
+namespace {
+
+typedef std::vector<VarType> TypeStack;
+
+// Registers values live in; rax, rdx, r11, xmm14 and xmm15 are scratch,
+// rdi holds arguments until they are loaded
+const Register GPR_POOL[] = {
+  RBX, RBP, R12, R13, R14, R15, // preserved by calls
+  RCX, RSI, R8, R9, R10
+};
+const uint32_t GPR_PRESERVED = 6;
+const XmmRegister XMM_POOL[] = {
+  XMM0, XMM1, XMM2, XMM3, XMM4, XMM5, XMM6,
+  XMM7, XMM8, XMM9, XMM10, XMM11, XMM12, XMM13
+};
+const int32_t WORD = sizeof(int64_t);
+
+bool isNumeric(VarType type) {
+  return type == VT_INT || type == VT_DOUBLE;
+}
+
+// Void functions leave int 0 on caller's stack
+VarType returnedType(TranslatedFunction* function) {
+  return function->returnType() == VT_DOUBLE ? VT_DOUBLE : VT_INT;
+}
+
+bool hasNumericSignature(TranslatedFunction* function) {
+  if (function->returnType() != VT_VOID && !isNumeric(function->returnType())) {
+    return false;
+  }
+
+  for (uint16_t i = 0; i < function->parametersNumber(); ++i) {
+    if (!isNumeric(function->parameterType(i))) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// Type of values instruction pops, VT_INVALID if it is not arithmetic
+VarType operandType(Instruction insn) {
+  switch (static_cast<uint8_t>(insn)) {
+    case BC_IADD: case BC_ISUB: case BC_IMUL: case BC_IDIV: case BC_IMOD:
+    case BC_IAOR: case BC_IAAND: case BC_IAXOR: case BC_ICMP:
+    case BC_INEG: case BC_I2D: case BC_IDIVPOW2: case BC_IMODPOW2:
+    case BC_STOREIVAR: case BC_IFORPREP:
+    case BC_IFICMPNE: case BC_IFICMPE: case BC_IFICMPG:
+    case BC_IFICMPGE: case BC_IFICMPL: case BC_IFICMPLE:
+      return VT_INT;
+
+    case BC_DADD: case BC_DSUB: case BC_DMUL: case BC_DDIV: case BC_DCMP:
+    case BC_DNEG: case BC_D2I: case BC_STOREDVAR:
+    case BC_IFDCMPNE: case BC_IFDCMPE: case BC_IFDCMPG:
+    case BC_IFDCMPGE: case BC_IFDCMPL: case BC_IFDCMPLE:
+      return VT_DOUBLE;
+
+    default:
+      return VT_INVALID;
+  }
+}
+
+bool popType(TypeStack& stack, VarType type) {
+  if (stack.empty() || stack.back() != type) {
+    return false;
+  }
+
+  stack.pop_back();
+  return true;
+}
+
+// False if instruction is not supported or gets operands of wrong type
+bool transfer(const Insn& insn,
+              TranslatedFunction* function,
+              InterpreterCodeImpl* code,
+              TypeStack& stack) {
+  switch (static_cast<uint8_t>(insn.insn)) {
+    case BC_SWAP:
+      std::swap(stack[stack.size() - 1], stack[stack.size() - 2]);
+      return true;
+
+    case BC_POP:
+      stack.pop_back();
+      return true;
+
+    case BC_JA:
+    case BC_IFORLOOP:
+      return true;
+
+    case BC_LOADCTXIVAR: case BC_LOADCTXDVAR:
+      return false;
+
+    case BC_CALLCTX:
+    case BC_TAILCALL: {
+      TranslatedFunction* callee = code->functionById(insn.id);
+      if (!hasNumericSignature(callee)) {
+        return false;
+      }
+
+      for (int32_t i = callee->parametersNumber() - 1; i >= 0; --i) {
+        if (!popType(stack, callee->parameterType(i))) {
+          return false;
+        }
+      }
+
+      if (insn.insn == BC_CALLCTX) {
+        stack.push_back(returnedType(callee));
+      }
+      return true;
+    }
+
+    case BC_RETURN:
+      return popType(stack, returnedType(function));
+
+    default: {
+      VarType operand = operandType(insn.insn);
+      VarType result = resultType(insn.insn);
+      uint32_t popped;
+      uint32_t pushed;
+
+      if (operand == VT_INVALID && !isNumeric(result)) {
+        return false;
+      }
+
+      stackEffect(insn, code, popped, pushed);
+
+      for (uint32_t i = 0; i < popped; ++i) {
+        if (!popType(stack, operand)) {
+          return false;
+        }
+      }
+
+      if (pushed > 0) {
+        stack.push_back(result);
+      }
+      return true;
+    }
+  }
+}
+
+// Types of operand stack values on entry of every reachable block
+bool inferTypes(const InsnList& insns,
+                const ControlFlowGraph& cfg,
+                TranslatedFunction* function,
+                InterpreterCodeImpl* code,
+                std::vector<TypeStack>& entryTypes) {
+  std::vector<bool> isKnown(cfg.size(), false);
+  entryTypes.assign(cfg.size(), TypeStack());
+
+  for (uint16_t i = 0; i < function->parametersNumber(); ++i) {
+    entryTypes[0].push_back(function->parameterType(i));
+  }
+  isKnown[0] = true;
+
+  // in reverse postorder some predecessor of block goes before it
+  const std::vector<uint32_t>& order = cfg.order();
+
+  for (size_t k = 0; k < order.size(); ++k) {
+    const BasicBlock& block = cfg.block(order[k]);
+    TypeStack stack = entryTypes[order[k]];
+    assert(isKnown[order[k]]);
+
+    for (uint32_t i = block.begin; i < block.end; ++i) {
+      if (!transfer(insns[i], function, code, stack)) {
+        return false;
+      }
+    }
+
+    for (size_t j = 0; j < block.succs.size(); ++j) {
+      uint32_t succ = block.succs[j];
+
+      if (!isKnown[succ]) {
+        entryTypes[succ] = stack;
+        isKnown[succ] = true;
+      } else if (entryTypes[succ] != stack) {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+Condition branchCondition(Instruction insn) {
+  switch (static_cast<uint8_t>(insn)) {
+    case BC_IFICMPNE: return CC_NE;
+    case BC_IFICMPE:  return CC_E;
+    case BC_IFICMPG:  return CC_G;
+    case BC_IFICMPGE: return CC_GE;
+    case BC_IFICMPL:  return CC_L;
+    case BC_IFICMPLE: return CC_LE;
+    // unsigned conditions, as ucomisd sets flags (see doubleBranch)
+    case BC_IFDCMPNE: return CC_NE;
+    case BC_IFDCMPE:  return CC_E;
+    case BC_IFDCMPG:  return CC_A;
+    case BC_IFDCMPGE: return CC_AE;
+    case BC_IFDCMPL:  return CC_B;
+    case BC_IFDCMPLE: return CC_BE;
+    default:
+      assert(false);
+      return CC_E;
+  }
+}
+
+/*
+ * Builds register form of function. Operand stack is tracked
+ * abstractly: its values are virtual registers of locals they
+ * were loaded from or of temporaries holding results, so loads
+ * and stores cost nothing. At block boundaries stack values are moved
+ * to registers fixed for their depth and type, which successors expect.
+ */
+class LirBuilder {
+  const InsnList& insns_;
+  const ControlFlowGraph& cfg_;
+  const std::vector<TypeStack>& entryTypes_;
+  InterpreterFunction* function_;
+  InterpreterCodeImpl* code_;
+  LirFunction& lir_;
+  std::vector<uint32_t> stack_;
+  uint32_t localsNumber_;
+  uint32_t slotsNumber_;
+
+public:
+  LirBuilder(const InsnList& insns,
+             const ControlFlowGraph& cfg,
+             const std::vector<TypeStack>& entryTypes,
+             InterpreterFunction* function,
+             InterpreterCodeImpl* code,
+             LirFunction& lir)
+    : insns_(insns),
+      cfg_(cfg),
+      entryTypes_(entryTypes),
+      function_(function),
+      code_(code),
+      lir_(lir),
+      localsNumber_(function->localsNumber()),
+      slotsNumber_(0) {}
+
+  void build();
+
+private:
+  uint32_t local(uint16_t id, bool isDouble) const {
+    return 2 * id + isDouble;
+  }
+
+  uint32_t slot(uint32_t depth, bool isDouble) const {
+    return 2 * (localsNumber_ + depth) + isDouble;
+  }
+
+  bool isSlot(uint32_t vreg) const {
+    return vreg >= 2 * localsNumber_ && vreg < 2 * (localsNumber_ + slotsNumber_);
+  }
+
+  uint32_t depthOf(uint32_t slot) const {
+    return slot / 2 - localsNumber_;
+  }
+
+  bool isTemp(uint32_t vreg) const {
+    return vreg >= 2 * (localsNumber_ + slotsNumber_);
+  }
+
+  uint32_t temp(bool isDouble) {
+    lir_.isDouble.push_back(isDouble);
+    return lir_.isDouble.size() - 1;
+  }
+
+  LirInsn& add(LirOp op) {
+    lir_.insns.push_back(LirInsn(op));
+    return lir_.insns.back();
+  }
+
+  uint32_t pop() {
+    uint32_t vreg = stack_.back();
+    stack_.pop_back();
+    return vreg;
+  }
+
+  void move(uint32_t dst, uint32_t src);
+  uint32_t constant(bool isDouble, int64_t bits);
+  uint32_t copy(uint32_t vreg);
+  void block(uint32_t index);
+  void translate(const Insn& insn);
+  void store(uint32_t local, uint32_t value);
+  uint32_t call(const Insn& insn, LirOp op);
+  void detach(uint32_t local);
+  void flush(uint32_t* upper = 0, uint32_t* lower = 0);
+  void branch(Condition cc, uint32_t left, uint32_t right, uint32_t target);
+};
+
+void LirBuilder::build() {
+  for (size_t i = 0; i < cfg_.size(); ++i) {
+    slotsNumber_ = std::max<uint32_t>(slotsNumber_, entryTypes_[i].size());
+  }
+
+  lir_.isDouble.clear();
+  for (uint32_t i = 0; i < localsNumber_ + slotsNumber_; ++i) {
+    lir_.isDouble.push_back(false);
+    lir_.isDouble.push_back(true);
+  }
+  lir_.labelsNumber = cfg_.size();
+
+  // before entry block label: it may be a loop header
+  for (uint16_t i = 0; i < function_->parametersNumber(); ++i) {
+    LirInsn& arg = add(LIR_ARG);
+    arg.dst = slot(i, function_->parameterType(i) == VT_DOUBLE);
+    arg.value = i;
+  }
+
+  for (uint32_t i = 0; i < cfg_.size(); ++i) {
+    if (cfg_.block(i).isReachable) {
+      block(i);
+    }
+  }
+}
+
+void LirBuilder::block(uint32_t index) {
+  const BasicBlock& block = cfg_.block(index);
+  add(LIR_LABEL).label = index;
+
+  stack_.clear();
+  for (size_t depth = 0; depth < entryTypes_[index].size(); ++depth) {
+    stack_.push_back(slot(depth, entryTypes_[index][depth] == VT_DOUBLE));
+  }
+
+  for (uint32_t i = block.begin; i < block.end; ++i) {
+    translate(insns_[i]);
+  }
+
+  Instruction last = insns_[block.end - 1].insn;
+  if (!isBranch(last) && !isTerminator(last)) {
+    flush();
+  }
+}
+
+void LirBuilder::move(uint32_t dst, uint32_t src) {
+  if (dst != src) {
+    LirInsn& insn = add(LIR_MOVE);
+    insn.dst = dst;
+    insn.src1 = src;
+  }
+}
+
+uint32_t LirBuilder::constant(bool isDouble, int64_t bits) {
+  uint32_t vreg = temp(isDouble);
+  LirInsn& insn = add(LIR_CONST);
+  insn.dst = vreg;
+  insn.value = bits;
+  return vreg;
+}
+
+uint32_t LirBuilder::copy(uint32_t vreg) {
+  uint32_t copied = temp(lir_.isDouble[vreg]);
+  move(copied, vreg);
+  return copied;
+}
+
+void LirBuilder::translate(const Insn& insn) {
+  switch (static_cast<uint8_t>(insn.insn)) {
+    case BC_ILOAD:   stack_.push_back(constant(false, insn.intValue)); break;
+    case BC_ILOAD0:  stack_.push_back(constant(false, 0)); break;
+    case BC_ILOAD1:  stack_.push_back(constant(false, 1)); break;
+    case BC_ILOADM1: stack_.push_back(constant(false, -1)); break;
+
+    case BC_DLOAD: case BC_DLOAD0: case BC_DLOAD1: case BC_DLOADM1: {
+      double value = insn.insn == BC_DLOAD ? insn.doubleValue
+                     : insn.insn == BC_DLOAD0 ? 0.0
+                     : insn.insn == BC_DLOAD1 ? 1.0 : -1.0;
+      int64_t bits;
+      memcpy(&bits, &value, sizeof(bits));
+      stack_.push_back(constant(true, bits));
+      break;
+    }
+
+    case BC_LOADIVAR: stack_.push_back(local(insn.id, false)); break;
+    case BC_LOADDVAR: stack_.push_back(local(insn.id, true)); break;
+    case BC_STOREIVAR: store(local(insn.id, false), pop()); break;
+    case BC_STOREDVAR: store(local(insn.id, true), pop()); break;
+
+    case BC_SWAP: std::swap(stack_[stack_.size() - 1], stack_[stack_.size() - 2]); break;
+    case BC_POP: pop(); break;
+
+    case BC_INEG: case BC_DNEG: case BC_I2D: case BC_D2I:
+    case BC_IDIVPOW2: case BC_IMODPOW2: {
+      uint32_t operand = pop();
+      uint32_t result = temp(resultType(insn.insn) == VT_DOUBLE);
+      LirInsn& unary = add(LIR_UNARY);
+      unary.insn = insn.insn;
+      unary.dst = result;
+      unary.src1 = operand;
+      unary.value = insn.id;
+      stack_.push_back(result);
+      break;
+    }
+
+    case BC_JA:
+      flush();
+      add(LIR_JUMP).label = cfg_.blockOf(insn.target);
+      break;
+
+    case BC_IFICMPNE: case BC_IFICMPE: case BC_IFICMPG:
+    case BC_IFICMPGE: case BC_IFICMPL: case BC_IFICMPLE:
+    case BC_IFDCMPNE: case BC_IFDCMPE: case BC_IFDCMPG:
+    case BC_IFDCMPGE: case BC_IFDCMPL: case BC_IFDCMPLE: {
+      uint32_t upper = pop();
+      uint32_t lower = pop();
+      flush(&upper, &lower);
+      branch(branchCondition(insn.insn), upper, lower, insn.target);
+      break;
+    }
+
+    case BC_IFORPREP:
+      store(local(insn.limitId, false), pop());
+      flush();
+      branch(CC_G, local(insn.id, false), local(insn.limitId, false), insn.target);
+      break;
+
+    case BC_IFORLOOP: {
+      uint32_t counter = local(insn.id, false);
+      detach(counter);
+      uint32_t one = constant(false, 1);
+      LirInsn& increment = add(LIR_BINARY);
+      increment.insn = BC_IADD;
+      increment.dst = counter;
+      increment.src1 = counter;
+      increment.src2 = one;
+      flush();
+      branch(CC_LE, counter, local(insn.limitId, false), insn.target);
+      break;
+    }
+
+    case BC_CALLCTX:
+      stack_.push_back(call(insn, LIR_CALL));
+      break;
+
+    case BC_TAILCALL:
+      call(insn, LIR_TAILCALL);
+      break;
+
+    case BC_RETURN:
+      add(LIR_RETURN).src1 = pop();
+      break;
+
+    default: {
+      // binary arithmetic and comparisons
+      uint32_t upper = pop();
+      uint32_t lower = pop();
+      uint32_t result = temp(resultType(insn.insn) == VT_DOUBLE);
+      LirInsn& binary = add(LIR_BINARY);
+      binary.insn = insn.insn;
+      binary.dst = result;
+      binary.src1 = upper;
+      binary.src2 = lower;
+      stack_.push_back(result);
+      break;
+    }
+  }
+}
+
+// Temporary just computed is renamed instead of moved:
+// it is used only by this store
+void LirBuilder::store(uint32_t local, uint32_t value) {
+  detach(local);
+
+  if (isTemp(value) && !lir_.insns.empty() && lir_.insns.back().dst == value) {
+    lir_.insns.back().dst = local;
+  } else {
+    move(local, value);
+  }
+}
+
+// Result of tail call is NO_VREG
+uint32_t LirBuilder::call(const Insn& insn, LirOp op) {
+  TranslatedFunction* callee = code_->functionById(insn.id);
+  uint32_t argsNumber = callee->parametersNumber();
+  std::vector<uint32_t> args(stack_.end() - argsNumber, stack_.end());
+  stack_.resize(stack_.size() - argsNumber);
+
+  LirInsn& call = add(op);
+  call.value = insn.id;
+  call.args.swap(args);
+
+  if (op == LIR_CALL) {
+    call.dst = temp(callee->returnType() == VT_DOUBLE);
+    lir_.maxArgs = std::max(lir_.maxArgs, argsNumber);
+  }
+  return call.dst;
+}
+
+// Stack values loaded from local must keep old value when it is changed
+void LirBuilder::detach(uint32_t local) {
+  for (size_t i = 0; i < stack_.size(); ++i) {
+    if (stack_[i] == local) {
+      stack_[i] = copy(local);
+    }
+  }
+}
+
+/*
+ * Moves stack values to depth registers. Value already in
+ * depth register of another depth (after SWAP) and branch operands
+ * in depth registers being overwritten are copied first.
+ */
+void LirBuilder::flush(uint32_t* upper, uint32_t* lower) {
+  uint32_t* operands[] = { upper, lower };
+
+  for (size_t i = 0; i < 2; ++i) {
+    if (operands[i] && isSlot(*operands[i]) && depthOf(*operands[i]) < stack_.size()) {
+      *operands[i] = copy(*operands[i]);
+    }
+  }
+
+  for (size_t depth = 0; depth < stack_.size(); ++depth) {
+    if (isSlot(stack_[depth]) && depthOf(stack_[depth]) != depth) {
+      stack_[depth] = copy(stack_[depth]);
+    }
+  }
+
+  for (size_t depth = 0; depth < stack_.size(); ++depth) {
+    move(slot(depth, lir_.isDouble[stack_[depth]]), stack_[depth]);
+  }
+}
+
+void LirBuilder::branch(Condition cc, uint32_t left, uint32_t right, uint32_t target) {
+  LirInsn& branch = add(LIR_BRANCH);
+  branch.cc = cc;
+  branch.src1 = left;
+  branch.src2 = right;
+  branch.label = cfg_.blockOf(target);
+}
+
+/*
+ * Allocates registers for register form of function and emits its code.
+ * Frame: saved preserved registers, then spill slots above outgoing
+ * arguments at rsp. Values in caller saved registers live across
+ * a call are stored to their slots before it and loaded after.
+ */
+class CodeGenerator {
+  const LirFunction& lir_;
+  NativeFunction* entries_;
+  int64_t* tailArgs_;
+  NativeStack* stack_;
+  X86Assembler& masm_;
+  std::vector<LiveInterval> intervals_; // by virtual register
+  std::vector<int32_t> slots_;          // by virtual register, -1 if none
+  std::vector<uint32_t> calls_;         // positions of calls
+  std::vector<uint32_t> labels_;
+  std::vector<Register> preserved_;
+  uint32_t epilogue_;
+  uint32_t divisionByZero_;
+  uint32_t divisionOverflow_;
+  int32_t frameSize_;
+
+public:
+  CodeGenerator(const LirFunction& lir, 
+                NativeFunction* entries, 
+                int64_t* tailArgs, 
+                NativeStack* stack,
+                X86Assembler& masm)
+    : lir_(lir),
+      entries_(entries),
+      tailArgs_(tailArgs),
+      stack_(stack),
+      masm_(masm),
+      epilogue_(0),
+      divisionByZero_(0),
+      divisionOverflow_(0),
+      frameSize_(0) {}
+
+  void generate();
+
+private:
+  void computeIntervals();
+  void allocate();
+  void extend(uint32_t vreg, uint32_t position);
+  void emit(const LirInsn& insn, uint32_t position);
+  void unary(const LirInsn& insn);
+  void binary(const LirInsn& insn);
+  void doubleBranch(const LirInsn& insn);
+  void call(const LirInsn& insn, uint32_t position);
+  void tailCall(const LirInsn& insn);
+  void leave();
+  void fault(uint32_t label, NativeFault kind);
+
+  bool isLive(uint32_t vreg) const {
+    return intervals_[vreg].start <= intervals_[vreg].end;
+  }
+
+  bool inRegister(uint32_t vreg) const {
+    return intervals_[vreg].reg != constants::NO_REGISTER;
+  }
+
+  int32_t slotOffset(uint32_t vreg) const {
+    return WORD * (lir_.maxArgs + slots_[vreg]);
+  }
+
+  // Register with value of vreg, loaded to scratch if it is spilled
+  Register use(uint32_t vreg, Register scratch) {
+    if (inRegister(vreg)) return GPR_POOL[intervals_[vreg].reg];
+    masm_.load(scratch, RSP, slotOffset(vreg));
+    return scratch;
+  }
+
+  XmmRegister use(uint32_t vreg, XmmRegister scratch) {
+    if (inRegister(vreg)) return XMM_POOL[intervals_[vreg].reg];
+    masm_.loadsd(scratch, RSP, slotOffset(vreg));
+    return scratch;
+  }
+
+  // Register to compute value of vreg in
+  Register target(uint32_t vreg, Register scratch) const {
+    return inRegister(vreg) ? GPR_POOL[intervals_[vreg].reg] : scratch;
+  }
+
+  XmmRegister target(uint32_t vreg, XmmRegister scratch) const {
+    return inRegister(vreg) ? XMM_POOL[intervals_[vreg].reg] : scratch;
+  }
+
+  void define(uint32_t vreg, Register value) {
+    if (inRegister(vreg)) masm_.mov(GPR_POOL[intervals_[vreg].reg], value);
+    else masm_.store(RSP, slotOffset(vreg), value);
+  }
+
+  void define(uint32_t vreg, XmmRegister value) {
+    if (inRegister(vreg)) masm_.movsd(XMM_POOL[intervals_[vreg].reg], value);
+    else masm_.storesd(RSP, slotOffset(vreg), value);
+  }
+};
+
+void CodeGenerator::generate() {
+  computeIntervals();
+  allocate();
+
+  labels_.clear();
+  for (uint32_t i = 0; i < lir_.labelsNumber; ++i) {
+    labels_.push_back(masm_.newLabel());
+  }
+  epilogue_ = masm_.newLabel();
+  divisionByZero_ = masm_.newLabel();
+  divisionOverflow_ = masm_.newLabel();
+  uint32_t overflow = masm_.newLabel();
+
+  for (size_t i = 0; i < preserved_.size(); ++i) {
+    masm_.push(preserved_[i]);
+  }
+  if (frameSize_ > 0) {
+    masm_.subImm(RSP, frameSize_);
+  }
+
+  // pushes above go to reserve below limit
+  masm_.mov(R11, reinterpret_cast<int64_t>(&stack_->limit));
+  masm_.load(R11, R11, 0);
+  masm_.cmp(RSP, R11);
+  masm_.jcc(CC_B, overflow);
+
+  for (size_t i = 0; i < lir_.insns.size(); ++i) {
+    emit(lir_.insns[i], i);
+  }
+
+  masm_.bind(epilogue_);
+  leave();
+  masm_.ret();
+
+  fault(overflow, NF_STACK_OVERFLOW);
+  fault(divisionByZero_, NF_DIVISION_BY_ZERO);
+  fault(divisionOverflow_, NF_DIVISION_OVERFLOW);
+}
+
+void CodeGenerator::fault(uint32_t label, NativeFault kind) {
+  masm_.bind(label);
+  masm_.mov(RAX, kind);
+  masm_.mov(R11, reinterpret_cast<int64_t>(&stack_->faultExit));
+  masm_.jumpIndirect(R11);
+}
+
+// Frees frame and restores preserved registers
+void CodeGenerator::leave() {
+  if (frameSize_ > 0) {
+    masm_.addImm(RSP, frameSize_);
+  }
+  for (size_t i = preserved_.size(); i > 0; --i) {
+    masm_.pop(preserved_[i - 1]);
+  }
+}
+
+void CodeGenerator::extend(uint32_t vreg, uint32_t position) {
+  intervals_[vreg].start = std::min(intervals_[vreg].start, position);
+  intervals_[vreg].end = std::max(intervals_[vreg].end, position);
+}
+
+/*
+ * Liveness by blocks (between labels), then every virtual register
+ * gets interval from its first to its last live position.
+ */
+void CodeGenerator::computeIntervals() {
+  const std::vector<LirInsn>& insns = lir_.insns;
+  size_t vregsNumber = lir_.isDouble.size();
+
+  std::vector<uint32_t> firsts;
+  std::vector<uint32_t> blockByLabel(lir_.labelsNumber, 0);
+
+  for (size_t i = 0; i < insns.size(); ++i) {
+    if (i == 0 || insns[i].op == LIR_LABEL) {
+      firsts.push_back(i);
+    }
+    if (insns[i].op == LIR_LABEL) {
+      blockByLabel[insns[i].label] = firsts.size() - 1;
+    }
+    if (insns[i].op == LIR_CALL) {
+      calls_.push_back(i);
+    }
+  }
+  firsts.push_back(insns.size());
+  size_t blocksNumber = firsts.size() - 1;
+
+  std::vector<std::vector<uint32_t> > succs(blocksNumber);
+  std::vector<std::vector<bool> > uses(blocksNumber, std::vector<bool>(vregsNumber, false));
+  std::vector<std::vector<bool> > defs(blocksNumber, std::vector<bool>(vregsNumber, false));
+
+  for (size_t b = 0; b < blocksNumber; ++b) {
+    for (uint32_t i = firsts[b]; i < firsts[b + 1]; ++i) {
+      const LirInsn& insn = insns[i];
+      uint32_t sources[] = { insn.src1, insn.src2 };
+
+      for (size_t k = 0; k < 2; ++k) {
+        if (sources[k] != constants::NO_VREG && !defs[b][sources[k]]) {
+          uses[b][sources[k]] = true;
+        }
+      }
+      for (size_t k = 0; k < insn.args.size(); ++k) {
+        if (!defs[b][insn.args[k]]) {
+          uses[b][insn.args[k]] = true;
+        }
+      }
+      if (insn.dst != constants::NO_VREG) {
+        defs[b][insn.dst] = true;
+      }
+
+      if (insn.op == LIR_BRANCH || insn.op == LIR_JUMP) {
+        succs[b].push_back(blockByLabel[insn.label]);
+      }
+    }
+
+    LirOp last = insns[firsts[b + 1] - 1].op;
+    if (last != LIR_JUMP && last != LIR_RETURN && last != LIR_TAILCALL && b + 1 < blocksNumber) {
+      succs[b].push_back(b + 1);
+    }
+  }
+
+  std::vector<std::vector<bool> > liveIn(blocksNumber, std::vector<bool>(vregsNumber, false));
+  std::vector<std::vector<bool> > liveOut(blocksNumber, std::vector<bool>(vregsNumber, false));
+  bool isChanged = true;
+
+  while (isChanged) {
+    isChanged = false;
+
+    for (size_t b = blocksNumber; b > 0; --b) {
+      std::vector<bool>& out = liveOut[b - 1];
+      std::vector<bool>& in = liveIn[b - 1];
+
+      for (size_t k = 0; k < succs[b - 1].size(); ++k) {
+        const std::vector<bool>& succIn = liveIn[succs[b - 1][k]];
+        for (size_t v = 0; v < vregsNumber; ++v) {
+          if (succIn[v] && !out[v]) {
+            out[v] = true;
+          }
+        }
+      }
+
+      for (size_t v = 0; v < vregsNumber; ++v) {
+        bool live = uses[b - 1][v] || (out[v] && !defs[b - 1][v]);
+        if (live && !in[v]) {
+          in[v] = true;
+          isChanged = true;
+        }
+      }
+    }
+  }
+
+  intervals_.clear();
+  for (size_t v = 0; v < vregsNumber; ++v) {
+    intervals_.push_back(LiveInterval(v, 0));
+    intervals_.back().start = insns.size();
+  }
+
+  for (size_t b = 0; b < blocksNumber; ++b) {
+    uint32_t first = firsts[b];
+    uint32_t last = firsts[b + 1] - 1;
+
+    for (size_t v = 0; v < vregsNumber; ++v) {
+      if (liveIn[b][v]) extend(v, first);
+      if (liveOut[b][v]) extend(v, last);
+    }
+
+    for (uint32_t i = first; i <= last; ++i) {
+      const LirInsn& insn = insns[i];
+      if (insn.src1 != constants::NO_VREG) extend(insn.src1, i);
+      if (insn.src2 != constants::NO_VREG) extend(insn.src2, i);
+      if (insn.dst != constants::NO_VREG) extend(insn.dst, i);
+      for (size_t k = 0; k < insn.args.size(); ++k) {
+        extend(insn.args[k], i);
+      }
+    }
+  }
+
+  for (size_t v = 0; v < vregsNumber; ++v) {
+    LiveInterval& interval = intervals_[v];
+    std::vector<uint32_t>::const_iterator call =
+      std::upper_bound(calls_.begin(), calls_.end(), interval.start);
+    interval.crossesCall = call != calls_.end() && *call < interval.end;
+  }
+}
+
+void CodeGenerator::allocate() {
+  std::vector<LiveInterval*> gprs;
+  std::vector<LiveInterval*> xmms;
+
+  for (size_t v = 0; v < intervals_.size(); ++v) {
+    if (isLive(v)) {
+      (lir_.isDouble[v] ? xmms : gprs).push_back(&intervals_[v]);
+    }
+  }
+
+  allocateRegisters(gprs, sizeof(GPR_POOL) / sizeof(GPR_POOL[0]), GPR_PRESERVED);
+  allocateRegisters(xmms, sizeof(XMM_POOL) / sizeof(XMM_POOL[0]), 0);
+
+  std::vector<bool> isPreservedUsed(GPR_PRESERVED, false);
+  int32_t slotsNumber = 0;
+  slots_.assign(intervals_.size(), -1);
+
+  for (size_t v = 0; v < intervals_.size(); ++v) {
+    const LiveInterval& interval = intervals_[v];
+    if (!isLive(v)) continue;
+
+    bool isPreserved = !lir_.isDouble[v]
+                       && interval.reg != constants::NO_REGISTER
+                       && static_cast<uint32_t>(interval.reg) < GPR_PRESERVED;
+    if (isPreserved) {
+      isPreservedUsed[interval.reg] = true;
+    }
+
+    if (interval.reg == constants::NO_REGISTER || (interval.crossesCall && !isPreserved)) {
+      slots_[v] = slotsNumber++;
+    }
+  }
+
+  preserved_.clear();
+  for (uint32_t i = 0; i < GPR_PRESERVED; ++i) {
+    if (isPreservedUsed[i]) {
+      preserved_.push_back(GPR_POOL[i]);
+    }
+  }
+
+  // rsp is 16-byte aligned at calls: return address and pushes
+  // take 8 * (preserved + 1) bytes
+  frameSize_ = WORD * (lir_.maxArgs + slotsNumber);
+  if (!calls_.empty() && (frameSize_ + WORD * (preserved_.size() + 1)) % 16 != 0) {
+    frameSize_ += WORD;
+  }
+}
+
+void CodeGenerator::emit(const LirInsn& insn, uint32_t position) {
+  bool isDouble = insn.dst != constants::NO_VREG && lir_.isDouble[insn.dst];
+
+  switch (insn.op) {
+    case LIR_LABEL:
+      masm_.bind(labels_[insn.label]);
+      break;
+
+    case LIR_ARG:
+      if (isDouble) {
+        XmmRegister value = target(insn.dst, XMM14);
+        masm_.loadsd(value, RDI, WORD * insn.value);
+        define(insn.dst, value);
+      } else {
+        Register value = target(insn.dst, RAX);
+        masm_.load(value, RDI, WORD * insn.value);
+        define(insn.dst, value);
+      }
+      break;
+
+    case LIR_CONST:
+      if (isDouble) {
+        XmmRegister value = target(insn.dst, XMM14);
+        masm_.mov(RAX, insn.value);
+        masm_.movq(value, RAX);
+        define(insn.dst, value);
+      } else {
+        Register value = target(insn.dst, RAX);
+        masm_.mov(value, insn.value);
+        define(insn.dst, value);
+      }
+      break;
+
+    case LIR_MOVE:
+      if (isDouble) {
+        define(insn.dst, use(insn.src1, XMM14));
+      } else {
+        define(insn.dst, use(insn.src1, RAX));
+      }
+      break;
+
+    case LIR_UNARY:
+      unary(insn);
+      break;
+
+    case LIR_BINARY:
+      binary(insn);
+      break;
+
+    case LIR_BRANCH: {
+      if (lir_.isDouble[insn.src1]) {
+        doubleBranch(insn);
+        break;
+      }
+
+      Register right = use(insn.src2, R11);
+      Register left = use(insn.src1, RAX);
+      masm_.cmp(left, right);
+      masm_.jcc(insn.cc, labels_[insn.label]);
+      break;
+    }
+
+    case LIR_JUMP:
+      masm_.jmp(labels_[insn.label]);
+      break;
+
+    case LIR_CALL:
+      call(insn, position);
+      break;
+
+    case LIR_TAILCALL:
+      tailCall(insn);
+      break;
+
+    case LIR_RETURN:
+      if (lir_.isDouble[insn.src1]) {
+        masm_.movq(RAX, use(insn.src1, XMM14));
+      } else {
+        masm_.mov(RAX, use(insn.src1, RAX));
+      }
+      if (position + 1 < lir_.insns.size()) {
+        masm_.jmp(epilogue_);
+      }
+      break;
+  }
+}
+
+/*
+ * ucomisd sets ZF, PF and CF if an operand is NaN, so ordered 
+ * comparisons test "above" of operands in the order it's false for NaN,
+ * and equality checks parity too.
+ */
+void CodeGenerator::doubleBranch(const LirInsn& insn) {
+  XmmRegister right = use(insn.src2, XMM15);
+  XmmRegister left = use(insn.src1, XMM14);
+  uint32_t label = labels_[insn.label];
+
+  switch (insn.cc) {
+    case CC_A: case CC_AE:
+      masm_.ucomisd(left, right);
+      masm_.jcc(insn.cc, label);
+      break;
+
+    case CC_B: case CC_BE:
+      masm_.ucomisd(right, left);
+      masm_.jcc(insn.cc == CC_B ? CC_A : CC_AE, label);
+      break;
+
+    case CC_NE:
+      masm_.ucomisd(left, right);
+      masm_.jcc(CC_NE, label);
+      masm_.jcc(CC_P, label);
+      break;
+
+    case CC_E: {
+      uint32_t unordered = masm_.newLabel();
+      masm_.ucomisd(left, right);
+      masm_.jcc(CC_P, unordered);
+      masm_.jcc(CC_E, label);
+      masm_.bind(unordered);
+      break;
+    }
+
+    default:
+      assert(false);
+  }
+}
+
+void CodeGenerator::unary(const LirInsn& insn) {
+  uint16_t shift = insn.value;
+
+  switch (static_cast<uint8_t>(insn.insn)) {
+    case BC_INEG: {
+      Register operand = use(insn.src1, RAX);
+      Register result = target(insn.dst, RAX);
+      masm_.mov(result, operand);
+      masm_.neg(result);
+      define(insn.dst, result);
+      break;
+    }
+
+    // flips sign bit, as negation of double does
+    case BC_DNEG: {
+      XmmRegister result = target(insn.dst, XMM14);
+      masm_.movq(RAX, use(insn.src1, XMM14));
+      masm_.mov(R11, static_cast<int64_t>(0x8000000000000000ULL));
+      masm_.xor_(RAX, R11);
+      masm_.movq(result, RAX);
+      define(insn.dst, result);
+      break;
+    }
+
+    case BC_I2D: {
+      Register operand = use(insn.src1, RAX);
+      XmmRegister result = target(insn.dst, XMM14);
+      masm_.cvtsi2sd(result, operand);
+      define(insn.dst, result);
+      break;
+    }
+
+    case BC_D2I: {
+      XmmRegister operand = use(insn.src1, XMM14);
+      Register result = target(insn.dst, RAX);
+      masm_.cvttsd2si(result, operand);
+      define(insn.dst, result);
+      break;
+    }
+
+    // same shifts and masks as BytecodeInterpreter::divideByPowerOfTwo:
+    // bias = value < 0 ? 2^k - 1 : 0
+    case BC_IDIVPOW2: {
+      Register operand = use(insn.src1, R11);
+      if (shift == 0) {
+        define(insn.dst, operand);
+        break;
+      }
+      masm_.mov(RAX, operand);
+      masm_.sar(RAX, 63);
+      masm_.shr(RAX, 64 - shift);
+      masm_.add(RAX, operand);
+      masm_.sar(RAX, shift);
+      define(insn.dst, RAX);
+      break;
+    }
+
+    // (value + bias) & (2^k - 1) - bias
+    case BC_IMODPOW2: {
+      Register operand = use(insn.src1, R11);
+      if (shift == 0) {
+        masm_.mov(RAX, static_cast<int64_t>(0));
+        define(insn.dst, RAX);
+        break;
+      }
+      masm_.mov(RAX, operand);
+      masm_.sar(RAX, 63);
+      masm_.shr(RAX, 64 - shift);
+      masm_.mov(RDX, operand);
+      masm_.add(RDX, RAX);
+      masm_.mov(R11, static_cast<int64_t>((static_cast<uint64_t>(1) << shift) - 1));
+      masm_.and_(RDX, R11);
+      masm_.sub(RDX, RAX);
+      define(insn.dst, RDX);
+      break;
+    }
+
+    default:
+      assert(false);
+  }
+}
+
+void CodeGenerator::binary(const LirInsn& insn) {
+  Instruction op = insn.insn;
+
+  switch (static_cast<uint8_t>(op)) {
+    case BC_IADD: case BC_ISUB: case BC_IMUL:
+    case BC_IAOR: case BC_IAAND: case BC_IAXOR: {
+      Register lower = use(insn.src2, R11);
+      Register upper = use(insn.src1, RAX);
+      Register result = target(insn.dst, RAX);
+
+      // result register may be the one of lower operand
+      if (result == lower && result != upper) {
+        if (op == BC_ISUB) {
+          masm_.mov(RAX, upper);
+          result = RAX;
+        } else {
+          lower = upper;
+        }
+      } else {
+        masm_.mov(result, upper);
+      }
+
+      switch (static_cast<uint8_t>(op)) {
+        case BC_IADD: masm_.add(result, lower); break;
+        case BC_ISUB: masm_.sub(result, lower); break;
+        case BC_IMUL: masm_.imul(result, lower); break;
+        case BC_IAOR: masm_.or_(result, lower); break;
+        case BC_IAAND: masm_.and_(result, lower); break;
+        case BC_IAXOR: masm_.xor_(result, lower); break;
+      }
+      define(insn.dst, result);
+      break;
+    }
+
+    // zero divisor and INT64_MIN / -1 stop code, as they stop interpreter
+    case BC_IDIV: case BC_IMOD: {
+      uint32_t divide = masm_.newLabel();
+      Register lower = use(insn.src2, R11);
+      masm_.mov(RAX, use(insn.src1, RAX));
+      masm_.mov(RDX, 0);
+      masm_.cmp(lower, RDX);
+      masm_.jcc(CC_E, divisionByZero_);
+      masm_.mov(RDX, -1);
+      masm_.cmp(lower, RDX);
+      masm_.jcc(CC_NE, divide);
+      masm_.mov(RDX, INT64_MIN);
+      masm_.cmp(RAX, RDX);
+      masm_.jcc(CC_E, divisionOverflow_);
+      masm_.bind(divide);
+      masm_.cqo();
+      masm_.idiv(lower);
+      define(insn.dst, op == BC_IDIV ? RAX : RDX);
+      break;
+    }
+
+    // (upper > lower) - (upper < lower)
+    case BC_ICMP: {
+      Register lower = use(insn.src2, R11);
+      Register upper = use(insn.src1, RAX);
+      masm_.cmp(upper, lower);
+      masm_.setcc(CC_G, RAX);
+      masm_.setcc(CC_L, RDX);
+      masm_.movzxb(RAX, RAX);
+      masm_.movzxb(RDX, RDX);
+      masm_.sub(RAX, RDX);
+      define(insn.dst, RAX);
+      break;
+    }
+
+    // 1 - (upper == lower) - 2 * (upper < lower): unordered gives 1
+    case BC_DCMP: {
+      XmmRegister lower = use(insn.src2, XMM15);
+      XmmRegister upper = use(insn.src1, XMM14);
+      masm_.ucomisd(upper, lower);
+      masm_.setcc(CC_E, RAX);
+      masm_.setcc(CC_NP, RDX);
+      masm_.movzxb(RAX, RAX);
+      masm_.movzxb(RDX, RDX);
+      masm_.and_(RAX, RDX);
+      masm_.ucomisd(lower, upper);
+      masm_.setcc(CC_A, RDX);
+      masm_.movzxb(RDX, RDX);
+      masm_.neg(RAX);
+      masm_.sub(RAX, RDX);
+      masm_.sub(RAX, RDX);
+      masm_.addImm(RAX, 1);
+      define(insn.dst, RAX);
+      break;
+    }
+
+    case BC_DADD: case BC_DSUB: case BC_DMUL: case BC_DDIV: {
+      XmmRegister lower = use(insn.src2, XMM15);
+      XmmRegister upper = use(insn.src1, XMM14);
+      XmmRegister result = target(insn.dst, XMM14);
+
+      if (result == lower && result != upper) {
+        if (op == BC_DSUB || op == BC_DDIV) {
+          masm_.movsd(XMM14, upper);
+          result = XMM14;
+        } else {
+          lower = upper;
+        }
+      } else {
+        masm_.movsd(result, upper);
+      }
+
+      switch (static_cast<uint8_t>(op)) {
+        case BC_DADD: masm_.addsd(result, lower); break;
+        case BC_DSUB: masm_.subsd(result, lower); break;
+        case BC_DMUL: masm_.mulsd(result, lower); break;
+        case BC_DDIV: masm_.divsd(result, lower); break;
+      }
+      define(insn.dst, result);
+      break;
+    }
+
+    default:
+      assert(false);
+  }
+}
+
+void CodeGenerator::call(const LirInsn& insn, uint32_t position) {
+  std::vector<uint32_t> saved;
+
+  for (size_t v = 0; v < intervals_.size(); ++v) {
+    const LiveInterval& interval = intervals_[v];
+    if (isLive(v) && inRegister(v) && slots_[v] >= 0
+        && interval.start < position && position < interval.end) {
+      saved.push_back(v);
+    }
+  }
+
+  for (size_t i = 0; i < saved.size(); ++i) {
+    if (lir_.isDouble[saved[i]]) {
+      masm_.storesd(RSP, slotOffset(saved[i]), XMM_POOL[intervals_[saved[i]].reg]);
+    } else {
+      masm_.store(RSP, slotOffset(saved[i]), GPR_POOL[intervals_[saved[i]].reg]);
+    }
+  }
+
+  for (size_t i = 0; i < insn.args.size(); ++i) {
+    if (lir_.isDouble[insn.args[i]]) {
+      masm_.storesd(RSP, WORD * i, use(insn.args[i], XMM14));
+    } else {
+      masm_.store(RSP, WORD * i, use(insn.args[i], RAX));
+    }
+  }
+
+  masm_.mov(RDI, RSP);
+  masm_.mov(R11, reinterpret_cast<int64_t>(entries_ + insn.value));
+  masm_.callIndirect(R11);
+
+  for (size_t i = 0; i < saved.size(); ++i) {
+    if (lir_.isDouble[saved[i]]) {
+      masm_.loadsd(XMM_POOL[intervals_[saved[i]].reg], RSP, slotOffset(saved[i]));
+    } else {
+      masm_.load(GPR_POOL[intervals_[saved[i]].reg], RSP, slotOffset(saved[i]));
+    }
+  }
+
+  if (lir_.isDouble[insn.dst]) {
+    XmmRegister result = target(insn.dst, XMM14);
+    masm_.movq(result, RAX);
+    define(insn.dst, result);
+  } else {
+    define(insn.dst, RAX);
+  }
+}
+
+void CodeGenerator::tailCall(const LirInsn& insn) {
+  masm_.mov(R11, reinterpret_cast<int64_t>(tailArgs_));
+
+  for (size_t i = 0; i < insn.args.size(); ++i) {
+    if (lir_.isDouble[insn.args[i]]) {
+      masm_.storesd(R11, WORD * i, use(insn.args[i], XMM14));
+    } else {
+      masm_.store(R11, WORD * i, use(insn.args[i], RAX));
+    }
+  }
+
+  leave();
+  masm_.mov(RDI, R11);
+  masm_.mov(R11, reinterpret_cast<int64_t>(entries_ + insn.value));
+  masm_.jumpIndirect(R11);
+}
+
+} // namespace
+
+// Eligibility depends on all functions function may call
+JitCompiler::JitCompiler(InterpreterCodeImpl* code, size_t stackSize) 
+  : code_(code),
+    stackMemory_(0),
+    stackSize_(stackSize),
+    run_(0)
+{
+  // pages are committed on first touch, as pages of interpreter stack
+  stackMemory_ = mmap(0, stackSize_, PROT_READ | PROT_WRITE, 
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (stackMemory_ == MAP_FAILED) {
+    throw InterpreterException("Could not allocate native stack of %lu bytes",
+                               (unsigned long) stackSize_);
+  }
+
+  uint64_t bottom = reinterpret_cast<uint64_t>(stackMemory_);
+  stack_.limit = bottom + constants::NATIVE_STACK_RESERVE;
+  stack_.top = (bottom + stackSize_) & ~static_cast<uint64_t>(15);
+  stack_.savedRsp = 0;
+  stack_.fault = NF_NONE;
+  stack_.faultExit = 0;
+
+  emitRun();
+  code_->generateAll();
+  findEligible();
+}
+
+JitCompiler::~JitCompiler() {
+  for (size_t i = 0; i < memory_.size(); ++i) {
+    munmap(memory_[i].first, memory_[i].second);
+  }
+  munmap(stackMemory_, stackSize_);
+}
+
+/*
+ * Registers preserved by calls are saved on caller's stack and 
+ * restored from there whether native code returns or jumps to 
+ * faultExit, so frames left on native stack are just dropped.
+ */
+void JitCompiler::emitRun() {
+  static const Register SAVED[] = { RBX, RBP, R12, R13, R14, R15 };
+  const size_t savedNumber = sizeof(SAVED) / sizeof(SAVED[0]);
+  X86Assembler masm;
+  uint32_t exit = masm.newLabel();
+
+  for (size_t i = 0; i < savedNumber; ++i) {
+    masm.push(SAVED[i]);
+  }
+  masm.mov(R11, reinterpret_cast<int64_t>(&stack_));
+  masm.store(R11, offsetof(NativeStack, savedRsp), RSP);
+  masm.load(RSP, R11, offsetof(NativeStack, top));
+  masm.callIndirect(RSI);
+  masm.jmp(exit);
+
+  uint32_t faultExit = masm.position();
+  masm.mov(R11, reinterpret_cast<int64_t>(&stack_));
+  masm.store(R11, offsetof(NativeStack, fault), RAX);
+
+  masm.bind(exit);
+  masm.mov(R11, reinterpret_cast<int64_t>(&stack_));
+  masm.load(RSP, R11, offsetof(NativeStack, savedRsp));
+  for (size_t i = savedNumber; i > 0; --i) {
+    masm.pop(SAVED[i - 1]);
+  }
+  masm.ret();
+
+  uint8_t* code = static_cast<uint8_t*>(install(masm.finish()));
+  run_ = reinterpret_cast<NativeRun>(code);
+  stack_.faultExit = reinterpret_cast<uint64_t>(code + faultExit);
+}
+
+NativeFault JitCompiler::run(uint16_t id, const int64_t* args, int64_t* result) {
+  assert(entries_[id] != 0);
+  stack_.fault = NF_NONE;
+  *result = run_(args, &entries_[id]);
+  return static_cast<NativeFault>(stack_.fault);
+}
+
+bool JitCompiler::isSupported() {
+#if defined(__x86_64__)
+  return true;
+#else
+  return false;
+#endif
+}
+
+/*
+ * Function is eligible if JIT supports all its instructions and
+ * operand types are known at every point, and all functions
+ * it calls are eligible too.
+ */
+void JitCompiler::findEligible() {
+  std::vector<std::vector<uint16_t> > callees;
+  Code::FunctionIterator it(code_);
+
+  while (it.hasNext()) {
+    InterpreterFunction* function = static_cast<InterpreterFunction*>(it.next());
+    uint16_t id = function->id();
+
+    if (id >= isEligible_.size()) {
+      isEligible_.resize(id + 1, false);
+      entries_.resize(id + 1, 0);
+      callees.resize(id + 1);
+    }
+
+    if (function->parametersNumber() >= tailArgs_.size()) {
+      tailArgs_.resize(function->parametersNumber() + 1, 0);
+    }
+
+    InsnList insns;
+    std::vector<TypeStack> types;
+
+    if (!hasNumericSignature(function) || !decode(function->bytecode(), insns)) {
+      continue;
+    }
+
+    ControlFlowGraph cfg(insns, function, code_);
+    if (!cfg.isConsistent() || !inferTypes(insns, cfg, function, code_, types)) {
+      continue;
+    }
+
+    isEligible_[id] = true;
+    for (size_t i = 0; i < insns.size(); ++i) {
+      if (insns[i].insn == BC_CALLCTX || insns[i].insn == BC_TAILCALL) {
+        callees[id].push_back(insns[i].id);
+      }
+    }
+  }
+
+  bool isChanged = true;
+
+  while (isChanged) {
+    isChanged = false;
+
+    for (size_t id = 0; id < callees.size(); ++id) {
+      for (size_t i = 0; i < callees[id].size() && isEligible_[id]; ++i) {
+        if (!isEligible_[callees[id][i]]) {
+          isEligible_[id] = false;
+          isChanged = true;
+        }
+      }
+    }
+  }
+}
+
+NativeFunction JitCompiler::compile(uint16_t id) {
+  if (!isEligible_[id] || entries_[id]) {
+    return entries_[id];
+  }
+
+  // function and its callees not compiled yet go to one code buffer
+  std::vector<uint16_t> group(1, id);
+  std::vector<bool> isQueued(entries_.size(), false);
+  std::vector<uint32_t> starts;
+  X86Assembler masm;
+  isQueued[id] = true;
+
+  for (size_t k = 0; k < group.size(); ++k) {
+    InterpreterFunction* function = code_->functionById(group[k]);
+    InsnList insns;
+    std::vector<TypeStack> types;
+    LirFunction lir;
+
+    decode(function->bytecode(), insns);
+    ControlFlowGraph cfg(insns, function, code_);
+    inferTypes(insns, cfg, function, code_, types);
+    LirBuilder(insns, cfg, types, function, code_, lir).build();
+
+    starts.push_back(masm.position());
+    CodeGenerator(lir, &entries_[0], &tailArgs_[0], &stack_, masm).generate();
+
+    for (size_t i = 0; i < lir.insns.size(); ++i) {
+      const LirInsn& insn = lir.insns[i];
+      uint16_t callee = insn.value;
+      bool isCall = insn.op == LIR_CALL || insn.op == LIR_TAILCALL;
+
+      if (isCall && !entries_[callee] && !isQueued[callee]) {
+        group.push_back(callee);
+        isQueued[callee] = true;
+      }
+    }
+  }
+
+  install(masm.finish(), group, starts);
+  return entries_[id];
+}
+
+void JitCompiler::install(const std::vector<uint8_t>& code,
+                          const std::vector<uint16_t>& ids,
+                          const std::vector<uint32_t>& starts) {
+  void* memory = install(code);
+
+  for (size_t i = 0; i < ids.size(); ++i) {
+    entries_[ids[i]] = reinterpret_cast<NativeFunction>(static_cast<uint8_t*>(memory) + starts[i]);
+  }
+}
+
+// Returns executable copy of code
+void* JitCompiler::install(const std::vector<uint8_t>& code) {
+  size_t pageSize = sysconf(_SC_PAGESIZE);
+  size_t size = (code.size() + pageSize - 1) / pageSize * pageSize;
+
+  void* memory = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    throw InterpreterException("Could not allocate %lu bytes for native code",
+                               (unsigned long) size);
+  }
+
+  memcpy(memory, &code[0], code.size());
+  if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(memory, size);
+    throw InterpreterException("Could not make native code executable");
+  }
+  memory_.push_back(std::make_pair(memory, size));
+  return memory;
+}
+
+} // namespace mathvm
@@ -0,0 +1,151 @@
+#ifndef JIT_COMPILER_HPP
+#define JIT_COMPILER_HPP
+
+#include "mathvm.h"
+#include "interpreter_code.hpp"
+#include "x86_assembler.hpp"
+
+#include <vector>
+
+#include <stdint.h>
+
+namespace mathvm {
+
+// Arguments are operand stack values of the call, first argument first;
+// returns bits of int or double result
+typedef int64_t (*NativeFunction)(const int64_t* args);
+
+namespace constants {
+  const uint32_t NO_VREG = 0xFFFFFFFF;
+  // bottom of native stack left for pushes of prologue,
+  // which run before stack is checked
+  const size_t NATIVE_STACK_RESERVE = 4096;
+}
+
+// Why native code stopped before returning
+enum NativeFault {
+  NF_NONE,
+  NF_STACK_OVERFLOW,
+  NF_DIVISION_BY_ZERO,
+  NF_DIVISION_OVERFLOW  // INT64_MIN / -1
+};
+
+/*
+ * Stack native code runs on, shared by the code and JitCompiler::run.
+ * Code checks rsp against limit on entry to every function and 
+ * divisors before idiv, and jumps to faultExit with NativeFault in rax
+ * if stack is over or idiv would fault.
+ */
+struct NativeStack {
+  uint64_t limit;
+  uint64_t top;          // 16-byte aligned
+  uint64_t savedRsp;     // of caller of run
+  uint64_t fault;        // NativeFault
+  uint64_t faultExit;    // address in code of run
+};
+
+// Code of run: switches to native stack and calls *entry
+typedef int64_t (*NativeRun)(const int64_t* args, NativeFunction* entry);
+
+enum LirOp {
+  LIR_LABEL,    // start of block, label
+  LIR_ARG,      // dst = args[value]
+  LIR_CONST,    // dst = bits in value
+  LIR_MOVE,     // dst = src1
+  LIR_UNARY,    // dst = insn src1, value is shift of IDIVPOW2/IMODPOW2
+  LIR_BINARY,   // dst = src1 insn src2
+  LIR_BRANCH,   // jump to label if src1 cc src2 (as ints or as doubles)
+  LIR_JUMP,     // jump to label
+  LIR_CALL,     // dst = function value (args)
+  LIR_TAILCALL, // return function value (args)
+  LIR_RETURN    // return src1
+};
+
+/*
+ * Instruction of register form of function: operand stack values
+ * and local variables are virtual registers of int or double class.
+ */
+struct LirInsn {
+  LirOp op;
+  Instruction insn;
+  Condition cc;
+  uint32_t dst;
+  uint32_t src1; // upper operand of bytecode instruction
+  uint32_t src2;
+  int64_t value;
+  uint32_t label;
+  std::vector<uint32_t> args;
+
+  explicit LirInsn(LirOp op)
+    : op(op),
+      insn(BC_INVALID),
+      cc(CC_E),
+      dst(constants::NO_VREG),
+      src1(constants::NO_VREG),
+      src2(constants::NO_VREG),
+      value(0),
+      label(0) {}
+};
+
+struct LirFunction {
+  std::vector<LirInsn> insns;
+  std::vector<bool> isDouble; // by virtual register
+  uint32_t labelsNumber;
+  uint32_t maxArgs;           // of calls
+
+  LirFunction() : labelsNumber(0), maxArgs(0) {}
+};
+
+/*
+ * Optimizing tier of interpreter: translates functions working
+ * only with numbers and their own locals (no context variables,
+ * no prints, no strings) to x86-64 code, with values
+ * in registers allocated by linear scan.
+ * Compiled functions call each other directly through table of entries.
+ * Tail calls drop caller's frame and pass arguments in shared buffer:
+ * functions load their arguments before anything else.
+ * Native code runs on its own stack as big as stack of interpreter,
+ * so recursion goes about as deep as in bytecode.
+ */
+class JitCompiler {
+  InterpreterCodeImpl* code_;
+  std::vector<bool> isEligible_;
+  std::vector<NativeFunction> entries_; // by function id, 0 if not compiled
+  std::vector<int64_t> tailArgs_;
+  std::vector<std::pair<void*, size_t> > memory_;
+  void* stackMemory_;
+  size_t stackSize_;
+  NativeStack stack_;
+  NativeRun run_;
+
+public:
+  JitCompiler(InterpreterCodeImpl* code, size_t stackSize);
+  ~JitCompiler();
+
+  // Generated code runs on this machine
+  static bool isSupported();
+
+  // Compiles function and all functions it may call;
+  // 0 if function can't be compiled
+  NativeFunction compile(uint16_t id);
+
+  NativeFunction entry(uint16_t id) const { return entries_[id]; }
+
+  // Runs compiled function; NF_NONE unless it stopped on fault
+  NativeFault run(uint16_t id, const int64_t* args, int64_t* result);
+
+private:
+  JitCompiler(const JitCompiler&);
+  JitCompiler& operator=(const JitCompiler&);
+
+  void findEligible();
+  void emitRun();
+  void* install(const std::vector<uint8_t>& code);
+  void install(const std::vector<uint8_t>& code, 
+               const std::vector<uint16_t>& ids, 
+               const std::vector<uint32_t>& starts);
+};
+
+} // namespace mathvm
+
+#endif
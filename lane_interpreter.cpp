@@ -0,0 +1,389 @@
+#include "lane_interpreter.hpp"
+#include "control_flow.hpp"
+#include "errors.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+
+// run is also built for AVX-512 and AVX2, and the version
+// for the processor is picked when program is loaded;
+// its helpers are inlined into every version
+#if defined(__x86_64__) && defined(__GNUC__)
+#define LANE_TARGETS __attribute__((target_clones("avx512f", "avx2", "default")))
+#define LANE_INLINE inline __attribute__((always_inline))
+#else
+#define LANE_TARGETS
+#define LANE_INLINE inline
+#endif
+
+#define INT_OP(op) {                         \
+  IntLanes upper = stack[--sp];              \
+  IntLanes lower = stack[sp - 1];            \
+  put(&stack[sp - 1], upper op lower);       \
+}
+
+#define DOUBLE_OP(op) {                                  \
+  DoubleLanes upper = (DoubleLanes) stack[--sp];         \
+  DoubleLanes lower = (DoubleLanes) stack[sp - 1];       \
+  put(&stack[sp - 1], (IntLanes) (upper op lower));      \
+}
+
+// Divisor of lanes out of group is 1, so they don't fault;
+// run gives up if division of lane in group would
+#define DIV_OP(op) {                                     \
+  IntLanes upper = stack[--sp];                          \
+  IntLanes lower = (stack[sp - 1] & active_) | (ONE & ~active_); \
+  if (isFaulting(upper, lower)) {                        \
+    return false;                                        \
+  }                                                      \
+  put(&stack[sp - 1], upper op lower);                   \
+}
+
+// Same result as CMP of BytecodeInterpreter: 0, -1 if upper < lower, 1 otherwise
+#define CMP(type) {                                      \
+  type upper = (type) stack[--sp];                       \
+  type lower = (type) stack[sp - 1];                     \
+  IntLanes isLess = (IntLanes) (upper < lower);          \
+  IntLanes isEqual = (IntLanes) (upper == lower);        \
+  put(&stack[sp - 1], isLess | (~(isLess | isEqual) & ONE)); \
+}
+
+#define CMP_OP(op) {                                     \
+  IntLanes upper = stack[--sp];                          \
+  IntLanes lower = stack[--sp];                          \
+  pc = branch((IntLanes) (upper op lower), insn.target, pc, sp); \
+}
+
+#define DOUBLE_CMP_OP(op) {                              \
+  DoubleLanes upper = (DoubleLanes) stack[--sp];         \
+  DoubleLanes lower = (DoubleLanes) stack[--sp];         \
+  pc = branch((IntLanes) (upper op lower), insn.target, pc, sp); \
+}
+
+namespace mathvm {
+
+namespace {
+
+const IntLanes ONE = IntLanes() + 1;
+
+bool isLaneInstruction(const Insn& insn) {
+  switch (static_cast<uint8_t>(insn.insn)) {
+    case BC_ILOAD0: case BC_ILOAD1: case BC_ILOADM1: case BC_ILOAD:
+    case BC_DLOAD0: case BC_DLOAD1: case BC_DLOADM1: case BC_DLOAD:
+    case BC_DADD: case BC_DSUB: case BC_DMUL: case BC_DDIV: case BC_DNEG:
+    case BC_IADD: case BC_ISUB: case BC_IMUL: case BC_IDIV: case BC_IMOD: case BC_INEG:
+    case BC_IAOR: case BC_IAAND: case BC_IAXOR:
+    case BC_DCMP: case BC_ICMP: case BC_I2D: case BC_D2I:
+    case BC_JA:
+    case BC_IFICMPNE: case BC_IFICMPE: case BC_IFICMPG:
+    case BC_IFICMPGE: case BC_IFICMPL: case BC_IFICMPLE:
+    case BC_IFDCMPNE: case BC_IFDCMPE: case BC_IFDCMPG:
+    case BC_IFDCMPGE: case BC_IFDCMPL: case BC_IFDCMPLE:
+    case BC_LOADIVAR: case BC_LOADDVAR: case BC_STOREIVAR: case BC_STOREDVAR:
+    case BC_IFORPREP: case BC_IFORLOOP: case BC_IDIVPOW2: case BC_IMODPOW2:
+    case BC_SWAP: case BC_POP: case BC_RETURN:
+      return true;
+
+    case BC_LOADCTXIVAR: case BC_LOADCTXDVAR:
+    case BC_STORECTXIVAR: case BC_STORECTXDVAR:
+      return insn.context == 0;
+
+    default:
+      return false;
+  }
+}
+
+} // namespace
+
+LaneInterpreter* LaneInterpreter::create(InterpreterCodeImpl* code, uint16_t id) {
+  InterpreterFunction* function = code->functionById(id);
+  code->generate(id);
+
+  InsnList insns;
+  if (!decode(function->bytecode(), insns)) {
+    return 0;
+  }
+
+  // same operand stack depth at every instruction is what lanes
+  // of different instructions share stack slots by
+  ControlFlowGraph cfg(insns, function, code);
+  if (!cfg.isConsistent()) {
+    return 0;
+  }
+
+  for (size_t i = 0; i < insns.size(); ++i) {
+    if (cfg.block(cfg.blockOf(i)).isReachable && !isLaneInstruction(insns[i])) {
+      return 0;
+    }
+  }
+
+  return new LaneInterpreter(function, insns);
+}
+
+LaneInterpreter::LaneInterpreter(InterpreterFunction* function, const InsnList& insns)
+  : insns_(insns),
+    parametersNumber_(function->parametersNumber()),
+    localsNumber_(function->localsNumber()),
+    slots_(0),
+    live_(0),
+    group_(0),
+    isDiverged_(false),
+    waitingPc_(UINT32_MAX),
+    groupSp_(0)
+{
+  // every instruction pushes at most one value
+  size_t size = sizeof(IntLanes) * (localsNumber_ + parametersNumber_ + insns_.size() + 1);
+  void* slots = 0;
+
+  if (posix_memalign(&slots, sizeof(IntLanes), size) != 0) {
+    throw InterpreterException("Could not allocate %lu bytes", (unsigned long) size);
+  }
+  slots_ = static_cast<IntLanes*>(slots);
+}
+
+LaneInterpreter::~LaneInterpreter() {
+  free(slots_);
+}
+
+LANE_INLINE void LaneInterpreter::park(uint32_t pc, uint32_t sp, uint32_t lanes) {
+  for (uint32_t lane = 0; lane < constants::LANES; ++lane) {
+    if (lanes & (1u << lane)) {
+      pcs_[lane] = pc;
+      sps_[lane] = sp;
+    }
+  }
+}
+
+/*
+ * Live lanes at the lowest instruction become the group.
+ * Loops jump back and joins are after branches, so lanes left behind
+ * catch up with waiting ones instead of passing them.
+ */
+LANE_INLINE uint32_t LaneInterpreter::schedule() {
+  uint32_t lowest = UINT32_MAX;
+
+  for (uint32_t lane = 0; lane < constants::LANES; ++lane) {
+    if (live_ & (1u << lane)) {
+      lowest = std::min(lowest, pcs_[lane]);
+    }
+  }
+
+  uint32_t group = 0;
+  waitingPc_ = UINT32_MAX;
+
+  for (uint32_t lane = 0; lane < constants::LANES; ++lane) {
+    if (!(live_ & (1u << lane))) {
+      continue;
+    }
+
+    if (pcs_[lane] == lowest) {
+      group |= 1u << lane;
+      groupSp_ = sps_[lane];
+    } else {
+      waitingPc_ = std::min(waitingPc_, pcs_[lane]);
+    }
+  }
+
+  setGroup(group);
+  return lowest;
+}
+
+LANE_INLINE void LaneInterpreter::setGroup(uint32_t lanes) {
+  group_ = lanes;
+
+  for (uint32_t lane = 0; lane < constants::LANES; ++lane) {
+    active_[lane] = -static_cast<int64_t>((lanes >> lane) & 1);
+  }
+  isDiverged_ = group_ != live_;
+}
+
+/*
+ * Returns instruction group goes on with (next is that after branch).
+ * When lanes go different ways, those going to the lower instruction
+ * go on and the others wait, so group stays at the lowest one.
+ */
+LANE_INLINE uint32_t LaneInterpreter::branch(const IntLanes& isTaken, uint32_t target, uint32_t next, uint32_t sp) {
+  uint32_t taken = 0;
+
+  for (uint32_t lane = 0; lane < constants::LANES; ++lane) {
+    taken |= (isTaken[lane] & 1) << lane;
+  }
+
+  taken &= group_;
+
+  if (taken == group_ || target == next) {
+    return target;
+  }
+
+  if (taken == 0) {
+    return next;
+  }
+
+  bool isBack = target < next;
+  uint32_t waiting = isBack ? group_ & ~taken : taken;
+  uint32_t waitingPc = isBack ? next : target;
+
+  park(waitingPc, sp, waiting);
+  waitingPc_ = std::min(waitingPc_, waitingPc);
+  setGroup(group_ & ~waiting);
+  return isBack ? target : next;
+}
+
+// idiv faults on zero divisor and INT64_MIN / -1
+static LANE_INLINE bool isFaulting(const IntLanes& upper, const IntLanes& lower) {
+  IntLanes isFault = (lower == 0) | ((lower == -1) & (upper == INT64_MIN));
+
+  for (uint32_t lane = 0; lane < constants::LANES; ++lane) {
+    if (isFault[lane]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+LANE_TARGETS
+bool LaneInterpreter::run(const uint64_t* args, uint32_t lanes, uint64_t* results) {
+  assert(lanes > 0 && lanes <= constants::LANES);
+  IntLanes* locals = slots_;
+  IntLanes* stack = slots_ + localsNumber_;
+  memset(locals, 0, sizeof(IntLanes) * localsNumber_);
+
+  // arguments are on operand stack as at call;
+  // lanes without input compute the last one again
+  for (uint16_t i = 0; i < parametersNumber_; ++i) {
+    for (uint32_t lane = 0; lane < constants::LANES; ++lane) {
+      stack[i][lane] = args[std::min(lane, lanes - 1) * parametersNumber_ + i];
+    }
+  }
+
+  live_ = (1u << lanes) - 1;
+  setGroup(live_);
+  waitingPc_ = UINT32_MAX;
+  uint32_t pc = 0;
+  uint32_t sp = parametersNumber_;
+
+  while (live_) {
+    if (pc >= waitingPc_) {
+      park(pc, sp, group_);
+      pc = schedule();
+      sp = groupSp_;
+    }
+
+    const Insn& insn = insns_[pc++];
+
+    switch (static_cast<uint8_t>(insn.insn)) {
+      case BC_ILOAD0: case BC_ILOAD1: case BC_ILOADM1: case BC_ILOAD:
+        put(&stack[sp++], IntLanes() + insn.intValue);
+        break;
+      case BC_DLOAD0: case BC_DLOAD1: case BC_DLOADM1: case BC_DLOAD:
+        put(&stack[sp++], (IntLanes) (DoubleLanes() + insn.doubleValue));
+        break;
+
+      case BC_DADD: DOUBLE_OP(+); break;
+      case BC_DSUB: DOUBLE_OP(-); break;
+      case BC_DMUL: DOUBLE_OP(*); break;
+      case BC_DDIV: DOUBLE_OP(/); break;
+
+      case BC_IADD: INT_OP(+); break;
+      case BC_ISUB: INT_OP(-); break;
+      case BC_IMUL: INT_OP(*); break;
+      case BC_IDIV: DIV_OP(/); break;
+      case BC_IMOD: DIV_OP(%); break;
+      case BC_IAOR: INT_OP(|); break;
+      case BC_IAAND: INT_OP(&); break;
+      case BC_IAXOR: INT_OP(^); break;
+
+      case BC_DCMP: CMP(DoubleLanes); break;
+      case BC_ICMP: CMP(IntLanes); break;
+
+      case BC_I2D:
+        put(&stack[sp - 1], (IntLanes) __builtin_convertvector(stack[sp - 1], DoubleLanes));
+        break;
+      case BC_D2I:
+        put(&stack[sp - 1], __builtin_convertvector((DoubleLanes) stack[sp - 1], IntLanes));
+        break;
+
+      case BC_DNEG: put(&stack[sp - 1], (IntLanes) -(DoubleLanes) stack[sp - 1]); break;
+      case BC_INEG: put(&stack[sp - 1], -stack[sp - 1]); break;
+
+      case BC_JA: pc = insn.target; break;
+      case BC_IFICMPNE: CMP_OP(!=); break;
+      case BC_IFICMPE:  CMP_OP(==); break;
+      case BC_IFICMPG:  CMP_OP(>);  break;
+      case BC_IFICMPGE: CMP_OP(>=); break;
+      case BC_IFICMPL:  CMP_OP(<);  break;
+      case BC_IFICMPLE: CMP_OP(<=); break;
+      case BC_IFDCMPNE: DOUBLE_CMP_OP(!=); break;
+      case BC_IFDCMPE:  DOUBLE_CMP_OP(==); break;
+      case BC_IFDCMPG:  DOUBLE_CMP_OP(>);  break;
+      case BC_IFDCMPGE: DOUBLE_CMP_OP(>=); break;
+      case BC_IFDCMPL:  DOUBLE_CMP_OP(<);  break;
+      case BC_IFDCMPLE: DOUBLE_CMP_OP(<=); break;
+
+      case BC_LOADIVAR: case BC_LOADDVAR:
+      case BC_LOADCTXIVAR: case BC_LOADCTXDVAR:
+        put(&stack[sp++], locals[insn.id]);
+        break;
+      case BC_STOREIVAR: case BC_STOREDVAR:
+      case BC_STORECTXIVAR: case BC_STORECTXDVAR:
+        put(&locals[insn.id], stack[--sp]);
+        break;
+
+      case BC_IFORPREP:
+        put(&locals[insn.limitId], stack[--sp]);
+        pc = branch((IntLanes) (locals[insn.id] > locals[insn.limitId]), insn.target, pc, sp);
+        break;
+      case BC_IFORLOOP:
+        put(&locals[insn.id], locals[insn.id] + 1);
+        pc = branch((IntLanes) (locals[insn.id] <= locals[insn.limitId]), insn.target, pc, sp);
+        break;
+
+      case BC_IDIVPOW2: {
+        IntLanes value = stack[sp - 1];
+        int64_t mask = (static_cast<int64_t>(1) << insn.id) - 1;
+        put(&stack[sp - 1], (value + ((value >> 63) & mask)) >> insn.id);
+        break;
+      }
+      case BC_IMODPOW2: {
+        IntLanes value = stack[sp - 1];
+        int64_t mask = (static_cast<int64_t>(1) << insn.id) - 1;
+        IntLanes remainder = value & mask;
+        IntLanes isSigned = (IntLanes) (value < 0) & (IntLanes) (remainder != 0);
+        put(&stack[sp - 1], remainder | (isSigned & ~mask));
+        break;
+      }
+
+      case BC_SWAP: {
+        IntLanes upper = stack[sp - 1];
+        put(&stack[sp - 1], stack[sp - 2]);
+        put(&stack[sp - 2], upper);
+        break;
+      }
+      case BC_POP: --sp; break;
+
+      case BC_RETURN:
+        for (uint32_t lane = 0; lane < constants::LANES; ++lane) {
+          if (group_ & (1u << lane)) {
+            results[lane] = stack[sp - 1][lane];
+          }
+        }
+
+        live_ &= ~group_;
+        if (live_) {
+          pc = schedule();
+          sp = groupSp_;
+        }
+        break;
+
+      default:
+        assert(false);
+        throw InterpreterException("Not implemented instruction in lanes");
+    }
+  } // while
+
+  return true;
+}
+
+} // namespace mathvm
@@ -0,0 +1,76 @@
+#ifndef LANE_INTERPRETER_HPP
+#define LANE_INTERPRETER_HPP
+
+#include "mathvm.h"
+#include "insn_list.hpp"
+#include "interpreter_code.hpp"
+
+#include <stdint.h>
+
+namespace mathvm {
+
+namespace constants {
+  // inputs run at once: 8 64-bit lanes fill AVX-512 register, two AVX2 ones
+  const uint32_t LANES = 8;
+}
+
+typedef int64_t IntLanes __attribute__((vector_size(constants::LANES * sizeof(int64_t))));
+typedef double DoubleLanes __attribute__((vector_size(constants::LANES * sizeof(double))));
+
+/*
+ * Runs numeric function over LANES inputs at once (SPMD): every operand
+ * stack slot and local is a vector of lanes, so arithmetic instructions
+ * are vector operations. Lanes which go different ways at conditional
+ * branch get their own instructions; lanes at the lowest instruction
+ * run as a group with stores masked, the others wait. Group reaching
+ * instruction waiting lanes are at merges with them, so lanes
+ * reconverge at joins and after loops, and run unmasked again.
+ * Loop runs for as many iterations as its longest lane needs, so rows
+ * which loop very different numbers of times gain little or lose.
+ * Only functions which don't call, print, use variables of other frames
+ * or stop program can run in lanes (see create); natives, JIT and fuel
+ * don't apply. Runs decoded instructions, not bytecode.
+ */
+class LaneInterpreter {
+  InsnList insns_;
+  uint16_t parametersNumber_;
+  uint32_t localsNumber_;
+  IntLanes* slots_;  // locals, then operand stack
+  uint32_t pcs_[constants::LANES];
+  uint32_t sps_[constants::LANES];
+  uint32_t live_;    // bits of lanes which haven't returned yet
+  uint32_t group_;   // bits of lanes running together
+  IntLanes active_;  // all ones in lanes of group
+  bool isDiverged_;  // some live lanes wait, so stores are masked
+  uint32_t waitingPc_; // lowest instruction of waiting lanes
+  uint32_t groupSp_;   // operand stack depth of group
+
+public:
+  // 0 if function can't run in lanes; generates its body if it is deferred
+  static LaneInterpreter* create(InterpreterCodeImpl* code, uint16_t id);
+  ~LaneInterpreter();
+
+  // args has parametersNumber words for each of lanes inputs (at most LANES),
+  // results gets word of result for each; false if integer division
+  // of some input would fault, then results are undefined
+  bool run(const uint64_t* args, uint32_t lanes, uint64_t* results);
+
+private:
+  LaneInterpreter(InterpreterFunction* function, const InsnList& insns);
+  LaneInterpreter(const LaneInterpreter&);
+  LaneInterpreter& operator=(const LaneInterpreter&);
+
+  void park(uint32_t pc, uint32_t sp, uint32_t lanes);
+  uint32_t schedule();
+  void setGroup(uint32_t lanes);
+  uint32_t branch(const IntLanes& isTaken, uint32_t target, uint32_t next, uint32_t sp);
+
+  // Store to slot of lanes of group
+  void put(IntLanes* slot, const IntLanes& value) {
+    *slot = isDiverged_ ? (value & active_) | (*slot & ~active_) : value;
+  }
+};
+
+} // namespace mathvm
+
+#endif
@@ -0,0 +1,74 @@
+#include "linear_scan.hpp"
+
+#include <algorithm>
+
+namespace mathvm {
+
+static bool startsEarlier(const LiveInterval* a, const LiveInterval* b) {
+  if (a->start != b->start) return a->start < b->start;
+  return a->vreg < b->vreg;
+}
+
+static bool endsEarlier(const LiveInterval* a, const LiveInterval* b) {
+  return a->end < b->end;
+}
+
+static int32_t freeRegister(const std::vector<bool>& isFree,
+                            uint32_t preservedNumber,
+                            bool crossesCall) {
+  int32_t found = constants::NO_REGISTER;
+
+  for (size_t reg = 0; reg < isFree.size(); ++reg) {
+    if (!isFree[reg]) continue;
+
+    bool isPreserved = reg < preservedNumber;
+    if (isPreserved == crossesCall) {
+      return reg;
+    }
+
+    if (found == constants::NO_REGISTER) {
+      found = reg;
+    }
+  }
+
+  return found;
+}
+
+void allocateRegisters(std::vector<LiveInterval*>& intervals,
+                       uint32_t registersNumber,
+                       uint32_t preservedNumber) {
+  std::sort(intervals.begin(), intervals.end(), startsEarlier);
+
+  std::vector<bool> isFree(registersNumber, true);
+  std::vector<LiveInterval*> active; // ordered by end
+
+  for (size_t i = 0; i < intervals.size(); ++i) {
+    LiveInterval* current = intervals[i];
+
+    size_t expired = 0;
+    while (expired < active.size() && active[expired]->end <= current->start) {
+      isFree[active[expired]->reg] = true;
+      ++expired;
+    }
+    active.erase(active.begin(), active.begin() + expired);
+
+    current->reg = freeRegister(isFree, preservedNumber, current->crossesCall);
+
+    if (current->reg == constants::NO_REGISTER) {
+      if (active.empty() || active.back()->end <= current->end) {
+        continue;
+      }
+
+      LiveInterval* spilled = active.back();
+      active.pop_back();
+      current->reg = spilled->reg;
+      spilled->reg = constants::NO_REGISTER;
+    }
+
+    isFree[current->reg] = false;
+    active.insert(std::upper_bound(active.begin(), active.end(), current, endsEarlier),
+                  current);
+  }
+}
+
+} // namespace mathvm
@@ -0,0 +1,46 @@
+#ifndef LINEAR_SCAN_HPP
+#define LINEAR_SCAN_HPP
+
+#include <vector>
+
+#include <stdint.h>
+
+namespace mathvm {
+
+namespace constants {
+  const int32_t NO_REGISTER = -1;
+}
+
+/*
+ * Positions of instructions where virtual register is live,
+ * as one interval from first definition to last use (holes are not tracked).
+ */
+struct LiveInterval {
+  uint32_t vreg;
+  uint32_t start;
+  uint32_t end;
+  bool crossesCall; // some call is strictly inside the interval
+  int32_t reg;      // index in register pool or NO_REGISTER if spilled
+
+  LiveInterval(uint32_t vreg, uint32_t position)
+    : vreg(vreg),
+      start(position),
+      end(position),
+      crossesCall(false),
+      reg(constants::NO_REGISTER) {}
+};
+
+/*
+ * Linear scan allocation (Poletto, Sarkar): intervals are visited by start,
+ * those ended by then release their registers, and when no register is free
+ * the interval ending last is spilled. Interval may get register of one
+ * ending where it starts. Registers [0, preservedNumber) of the pool
+ * survive calls, intervals crossing calls prefer them, others avoid them.
+ */
+void allocateRegisters(std::vector<LiveInterval*>& intervals,
+                       uint32_t registersNumber,
+                       uint32_t preservedNumber);
+
+} // namespace mathvm
+
+#endif
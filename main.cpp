@@ -1,7 +1,10 @@
 #include "bytecode_generator.hpp"
 #include "bytecode_interpreter.hpp"
+#include "c_generator.hpp"
 #include "errors.hpp"
 #include "mathvm.h"
+#include "profile.hpp"
+#include "scheduler.hpp"
 
 #include <cstdio>
 #include <cstdlib>
@@ -10,7 +13,9 @@
 
 #include <exception>
 #include <iostream>
+#include <sstream>
 #include <string>
+#include <vector>
 
 using namespace mathvm;
 using namespace std;
@@ -25,6 +30,12 @@ Translator* Translator::create(const string& impl) {
 
 int main(int argc, char** argv) {
   string program;
+  string nativePath;
+  string recordPath;
+  bool isMemoStats = false;
+  uint32_t greenThreads = 0;
+  Profile profile;
+  InterpreterOptions interpreterOptions;
 
   for (int i = 0; i < argc; ++i) {
     string arg = argv[i];
@@ -34,17 +45,126 @@ int main(int argc, char** argv) {
         continue;
     }
 
+    if (arg == "-inline" && i + 1 < argc) {
+        GeneratorOptions::global().inlineThreshold = atoi(argv[++i]);
+        continue;
+    }
+
+    if (arg == "-j" && i + 1 < argc) {
+        GeneratorOptions::global().threadsNumber = atoi(argv[++i]);
+        continue;
+    }
+
+    if (arg == "-jit" && i + 1 < argc) {
+        interpreterOptions.jitThreshold = atoi(argv[++i]);
+        continue;
+    }
+
+    if (arg == "-memo" && i + 1 < argc) {
+        interpreterOptions.memoCapacity = atoi(argv[++i]);
+        continue;
+    }
+
+    if (arg == "-memo-stats") {
+        isMemoStats = true;
+        continue;
+    }
+
+    if (arg == "-fuel" && i + 1 < argc) {
+        interpreterOptions.fuel = strtoull(argv[++i], 0, 10);
+        continue;
+    }
+
+    if (arg == "-timeout" && i + 1 < argc) {
+        interpreterOptions.timeLimit = atoi(argv[++i]);
+        continue;
+    }
+
+    if (arg == "-input" && i + 1 < argc) {
+        interpreterOptions.input = argv[++i];
+        continue;
+    }
+
+    if (arg == "-green" && i + 1 < argc) {
+        greenThreads = atoi(argv[++i]);
+        continue;
+    }
+
+    if (arg == "-aot" && i + 1 < argc) {
+        nativePath = argv[++i];
+        continue;
+    }
+
+    if (arg == "-record-profile" && i + 1 < argc) {
+        recordPath = argv[++i];
+        continue;
+    }
+
+    if (arg == "-profile" && i + 1 < argc) {
+        try {
+          profile.load(argv[++i]);
+        } catch (InternalException& e) {
+          cerr << e.what() << endl;
+          return EXIT_FAILURE;
+        }
+        GeneratorOptions::global().profile = &profile;
+        continue;
+    }
+
+    if (arg.size() >= 2 && arg.compare(0, 2, "-O") == 0) {
+        GeneratorOptions::global().optimizationLevel = 
+          arg.size() == 2 ? 1 : atoi(arg.c_str() + 2);
+        continue;
+    }
+
     program = loadFile(arg.c_str());
   }
 
   if (program.empty()) { 
     cerr << "Could not load program\n"
     << "Usage:\n"
-    << "mvm PATH_TO_SOURCE\n"
-    << "mvm -e SCRIPT" << endl; 
+    << "mvm [OPTIONS] PATH_TO_SOURCE\n"
+    << "mvm [OPTIONS] -e SCRIPT\n"
+    << "Options:\n"
+    << "  -inline N   max size (in ast nodes) of inlined function, 0 disables inlining\n"
+    << "  -O[LEVEL]   optimize generated bytecode: -O0 (default) - no, -O or -O1 - yes,\n"
+    << "              -O2 - also optimize loops\n"
+    << "  -j N        threads generating bytecode when whole program is needed\n"
+    << "              (-O, -jit, -memo, -aot), 0 (default) - one per processor\n"
+    << "  -jit N      compile numeric functions to native code after N calls,\n"
+    << "              0 (default) - never; ignored with -fuel and -timeout\n"
+    << "  -memo N     cache up to N results of every pure numeric function,\n"
+    << "              0 (default) - no caching\n"
+    << "  -memo-stats print cache hits and misses of pure functions to stderr\n"
+    << "  -fuel N     stop program after it runs about N bytes of bytecode,\n"
+    << "              0 (default) - never\n"
+    << "  -timeout MS stop program after MS milliseconds, 0 (default) - never\n"
+    << "  -input PATH file program reads numbers from: text for PATH ending with\n"
+    << "              .csv or .txt, 8-byte ints or doubles otherwise\n"
+    << "  -green N    run N instances of program interleaved on one thread,\n"
+    << "              then print their outputs one after another\n"
+    << "  -aot PATH   compile program to C and build executable at PATH instead of\n"
+    << "              running it: shared object exporting mvm_main for PATH ending\n"
+    << "              with .so, only C source for PATH ending with .c; programs\n"
+    << "              using array or input builtins are not supported\n"
+    << "  -record-profile PATH\n"
+    << "              run program as generated, without -O, -jit, -memo and -profile, and\n"
+    << "              write counts of its branches, loops and calls to PATH\n"
+    << "  -profile PATH\n"
+    << "              use profile recorded to PATH: inline hot calls and, with -O,\n"
+    << "              lay out hot paths as fall-through" << endl; 
     return EXIT_FAILURE;
   }    
 
+  // recorded offsets are those of code generator emits by default
+  if (!recordPath.empty()) {
+    GeneratorOptions::global().optimizationLevel = 0;
+    GeneratorOptions::global().profile = 0;
+    interpreterOptions.jitThreshold = 0;
+    interpreterOptions.memoCapacity = 0;
+    interpreterOptions.isProfiling = true;
+  }
+
   Translator* translator = Translator::create("bytecode_translator");
 
   if (!translator) { 
@@ -70,13 +190,79 @@ int main(int argc, char** argv) {
     return EXIT_FAILURE;
   }
 
-  try {
-    BytecodeInterpreter vm(code);
-    vm.execute();
-  } catch (InterpreterException& e) {
-    cerr << e.what() << endl;
-    return EXIT_FAILURE;
-  } 
+  if (!nativePath.empty()) {
+    try {
+      compileToNative(static_cast<InterpreterCodeImpl*>(code), nativePath);
+    } catch (TranslationException& e) {
+      cerr << errorMessage(program.c_str(), e.what(), e.position()) << endl;
+      return EXIT_FAILURE;
+    } catch (InternalException& e) {
+      cerr << e.what() << endl;
+      return EXIT_FAILURE;
+    }
+  } else if (greenThreads > 0) {
+    Scheduler scheduler;
+    vector<ostringstream*> outputs;
+    interpreterOptions.stackSize = constants::GREEN_STACK_SIZE;
+
+    for (uint32_t i = 0; i < greenThreads; ++i) {
+      outputs.push_back(new ostringstream());
+      interpreterOptions.out = outputs.back();
+
+      try {
+        scheduler.spawn(new BytecodeInterpreter(code, interpreterOptions));
+      } catch (TranslationException& e) {
+        cerr << errorMessage(program.c_str(), e.what(), e.position()) << endl;
+        return EXIT_FAILURE;
+      } catch (InterpreterException& e) {
+        cerr << errorMessage(e) << endl;
+        return EXIT_FAILURE;
+      }
+    }
+
+    scheduler.run();
+    bool isFailed = false;
+
+    for (uint32_t i = 0; i < greenThreads; ++i) {
+      cout << outputs[i]->str();
+      delete outputs[i];
+
+      if (!scheduler.error(i).empty()) {
+        cerr << "Instance " << i << ": " << scheduler.error(i) << endl;
+        isFailed = true;
+      }
+    }
+
+    if (isFailed) {
+      return EXIT_FAILURE;
+    }
+  } else {
+    // bodies of functions are generated on first call,
+    // so translation errors may come while running
+    try {
+      BytecodeInterpreter vm(code, interpreterOptions);
+      vm.execute();
+
+      if (isMemoStats) {
+        vm.printMemoStats(cerr);
+      }
+
+      if (!recordPath.empty()) {
+        Profile recorded;
+        vm.collectProfile(&recorded);
+        recorded.save(recordPath);
+      }
+    } catch (TranslationException& e) {
+      cerr << errorMessage(program.c_str(), e.what(), e.position()) << endl;
+      return EXIT_FAILURE;
+    } catch (InterpreterException& e) {
+      cerr << errorMessage(e) << endl;
+      return EXIT_FAILURE;
+    } catch (InternalException& e) {
+      cerr << e.what() << endl;
+      return EXIT_FAILURE;
+    } 
+  }
 
   if (code) {
     delete code;
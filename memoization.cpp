@@ -0,0 +1,166 @@
+#include "memoization.hpp"
+#include "insn_list.hpp"
+#include "control_flow.hpp"
+
+#include <cstring>
+
+namespace mathvm {
+
+namespace {
+
+bool isNumeric(VarType type) {
+  return type == VT_INT || type == VT_DOUBLE;
+}
+
+bool hasNumericSignature(InterpreterFunction* function) {
+  if (!isNumeric(function->returnType()) || function->parametersNumber() == 0) {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < function->parametersNumber(); ++i) {
+    if (!isNumeric(function->parameterType(i))) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+} // namespace
+
+PureFunctions::PureFunctions(InterpreterCodeImpl* code) {
+  std::vector<InsnList> bodies;
+  Code::FunctionIterator it(code);
+
+  while (it.hasNext()) {
+    InterpreterFunction* function = static_cast<InterpreterFunction*>(it.next());
+    uint16_t id = function->id();
+
+    if (id >= bodies.size()) {
+      bodies.resize(id + 1);
+      isPure_.resize(id + 1, false);
+      isMemoizable_.resize(id + 1, false);
+    }
+
+    // unknown bytecode may do anything
+    if (!hasNumericSignature(function) || !decode(function->bytecode(), bodies[id])) {
+      continue;
+    }
+
+    const InsnList& insns = bodies[id];
+    // generator ends every body with STOP, which is fine if unreachable
+    ControlFlowGraph cfg(insns, function, code);
+    bool isPure = cfg.isConsistent();
+
+    for (size_t i = 0; i < insns.size() && isPure; ++i) {
+      if (!cfg.block(cfg.blockOf(i)).isReachable) {
+        continue;
+      }
+
+      switch (static_cast<uint8_t>(insns[i].insn)) {
+        case BC_IPRINT:
+        case BC_DPRINT:
+        case BC_SPRINT:
+        case BC_CALLNATIVE:
+        case BC_STOP:
+          isPure = false;
+          break;
+
+        case BC_LOADCTXIVAR: 
+        case BC_LOADCTXDVAR:
+        case BC_STORECTXIVAR: 
+        case BC_STORECTXDVAR:
+          isPure = insns[i].context == 0;
+          break;
+
+        case BC_CALLCTX:
+        case BC_TAILCALL:
+          isMemoizable_[id] = true;
+          break;
+
+        default:
+          if (isBranch(insns[i].insn) && insns[i].target <= i) {
+            isMemoizable_[id] = true;
+          }
+          break;
+      }
+    }
+
+    isPure_[id] = isPure;
+  }
+
+  // functions calling impure ones are impure
+  bool isChanged = true;
+
+  while (isChanged) {
+    isChanged = false;
+
+    for (size_t id = 0; id < bodies.size(); ++id) {
+      const InsnList& insns = bodies[id];
+
+      for (size_t i = 0; i < insns.size() && isPure_[id]; ++i) {
+        Instruction insn = insns[i].insn;
+
+        if ((insn == BC_CALLCTX || insn == BC_TAILCALL) && !isPure_[insns[i].id]) {
+          isPure_[id] = false;
+          isChanged = true;
+        }
+      }
+    }
+  }
+
+  for (size_t id = 0; id < bodies.size(); ++id) {
+    isMemoizable_[id] = isMemoizable_[id] && isPure_[id];
+  }
+}
+
+MemoCache::MemoCache(uint32_t arity, uint32_t capacity)
+  : arity_(arity),
+    mask_(0),
+    hits_(0),
+    misses_(0) {
+  uint32_t size = 1;
+  while (size < capacity) {
+    size *= 2;
+  }
+
+  mask_ = size - 1;
+  words_.resize(size * (arity + 1));
+  isUsed_.resize(size, false);
+}
+
+bool MemoCache::find(const uint64_t* args, uint64_t* result) {
+  uint32_t index = slot(args);
+  const uint64_t* entry = &words_[index * (arity_ + 1)];
+
+  if (!isUsed_[index] || memcmp(entry, args, arity_ * sizeof(uint64_t)) != 0) {
+    ++misses_;
+    return false;
+  }
+
+  ++hits_;
+  *result = entry[arity_];
+  return true;
+}
+
+void MemoCache::insert(const uint64_t* args, uint64_t result) {
+  uint32_t index = slot(args);
+  uint64_t* entry = &words_[index * (arity_ + 1)];
+
+  memcpy(entry, args, arity_ * sizeof(uint64_t));
+  entry[arity_] = result;
+  isUsed_[index] = true;
+}
+
+uint32_t MemoCache::slot(const uint64_t* args) const {
+  uint64_t hash = arity_;
+
+  for (uint32_t i = 0; i < arity_; ++i) {
+    hash = (hash ^ args[i]) * 0x9E3779B97F4A7C15ULL;
+    hash ^= hash >> 29;
+  }
+
+  return static_cast<uint32_t>(hash) & mask_;
+}
+
+} // namespace mathvm
@@ -0,0 +1,62 @@
+#ifndef MEMOIZATION_HPP
+#define MEMOIZATION_HPP
+
+#include "mathvm.h"
+#include "interpreter_code.hpp"
+
+#include <vector>
+
+#include <stdint.h>
+
+namespace mathvm {
+
+/*
+ * Function is pure if its result depends only on its arguments 
+ * and it has no side effects: it doesn't print, doesn't read or write
+ * variables of other frames, doesn't call natives or stop program,
+ * and it calls only pure functions. Arguments and result of pure
+ * function are ints or doubles, so they can key and fill a cache.
+ * Pure function is worth memoizing if it calls functions or loops.
+ * Indexed by function id.
+ */
+class PureFunctions {
+  std::vector<bool> isPure_;
+  std::vector<bool> isMemoizable_;
+
+public:
+  explicit PureFunctions(InterpreterCodeImpl* code);
+
+  bool isPure(uint16_t id) const { return isPure_[id]; }
+  bool isMemoizable(uint16_t id) const { return isMemoizable_[id]; }
+};
+
+/*
+ * Direct-mapped cache of results of pure function: entry
+ * is found by hash of argument values (as raw 64-bit words),
+ * and newer entry replaces older one in the same slot.
+ */
+class MemoCache {
+  uint32_t arity_;
+  uint32_t mask_;
+  std::vector<uint64_t> words_; // arguments and result of each entry
+  std::vector<bool> isUsed_;
+  uint64_t hits_;
+  uint64_t misses_;
+
+public:
+  // Capacity is rounded up to power of two
+  MemoCache(uint32_t arity, uint32_t capacity);
+
+  bool find(const uint64_t* args, uint64_t* result);
+  void insert(const uint64_t* args, uint64_t result);
+
+  uint64_t hits() const { return hits_; }
+  uint64_t misses() const { return misses_; }
+
+private:
+  uint32_t slot(const uint64_t* args) const;
+};
+
+} // namespace mathvm
+
+#endif
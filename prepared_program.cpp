@@ -0,0 +1,187 @@
+#include "prepared_program.hpp"
+#include "errors.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace mathvm {
+
+Status* PreparedProgram::prepare(const std::string& source, PreparedProgram** result,
+                                 const InterpreterOptions& options) {
+  *result = 0;
+  Code* code = 0;
+  BytecodeTranslatorImpl translator;
+  Status* status = translator.translate(source, &code);
+
+  if (status->isError()) {
+    return status;
+  }
+
+  BytecodeInterpreter* vm = 0;
+
+  try {
+    vm = new BytecodeInterpreter(code, options);
+    vm->execute();
+  } catch (...) {
+    delete vm;
+    delete code;
+    delete status;
+    throw;
+  }
+
+  bool isMetered = options.fuel > 0 || options.timeLimit > 0;
+  *result = new PreparedProgram(static_cast<InterpreterCodeImpl*>(code), vm, isMetered);
+  return status;
+}
+
+PreparedProgram::~PreparedProgram() {
+  std::map<uint16_t, LaneInterpreter*>::iterator it = lanes_.begin();
+  for (; it != lanes_.end(); ++it) {
+    delete it->second;
+  }
+
+  delete vm_;
+  delete code_;
+}
+
+uint16_t PreparedProgram::functionId(const std::string& name) const {
+  InterpreterFunction* function = code_->functionByName(name);
+
+  if (!function || function->deepness() != 1) {
+    throw InterpreterException("No function %s at top level of program", name.c_str());
+  }
+
+  return callable(function->id())->id();
+}
+
+Value PreparedProgram::call(const std::string& name, const std::vector<Value>& args) {
+  uint16_t id = functionId(name);
+
+  if (args.size() != code_->functionById(id)->parametersNumber()) {
+    throw InterpreterException("Function %s takes %d arguments, not %d", name.c_str(),
+                               (int) code_->functionById(id)->parametersNumber(),
+                               (int) args.size());
+  }
+
+  return call(id, args.empty() ? 0 : &args[0]);
+}
+
+Value PreparedProgram::call(uint16_t id, const Value* args) {
+  const InterpreterFunction* function = callable(id);
+  return result(function, vm_->call(id, words(function, args)));
+}
+
+void PreparedProgram::callBatch(uint16_t id, const Value* args, size_t calls, Value* results) {
+  const InterpreterFunction* function = callable(id);
+  uint16_t parametersNumber = function->parametersNumber();
+  LaneInterpreter* laneVm = lanes(id);
+
+  if (laneVm) {
+    std::vector<uint64_t> laneArgs(constants::LANES * parametersNumber);
+    uint64_t laneResults[constants::LANES];
+
+    for (size_t first = 0; first < calls; first += constants::LANES) {
+      uint32_t rows = std::min<size_t>(constants::LANES, calls - first);
+
+      for (uint32_t row = 0; row < rows; ++row) {
+        const uint64_t* rowWords = words(function, args + (first + row) * parametersNumber);
+        std::copy(rowWords, rowWords + parametersNumber, laneArgs.begin() + row * parametersNumber);
+      }
+
+      // interpreter reports fault of division with call stack
+      if (!laneVm->run(laneArgs.empty() ? 0 : &laneArgs[0], rows, laneResults)) {
+        for (uint32_t row = 0; row < rows; ++row) {
+          const uint64_t* rowWords = words(function, args + (first + row) * parametersNumber);
+          laneResults[row] = vm_->call(id, rowWords);
+        }
+      }
+
+      for (uint32_t row = 0; row < rows; ++row) {
+        results[first + row] = result(function, laneResults[row]);
+      }
+    }
+    return;
+  }
+
+  for (size_t i = 0; i < calls; ++i) {
+    const uint64_t* callWords = words(function, args + i * parametersNumber);
+    results[i] = result(function, vm_->call(id, callWords));
+  }
+}
+
+InterpreterFunction* PreparedProgram::callable(uint16_t id) const {
+  InterpreterFunction* function = code_->functionById(id);
+
+  if (!function || function->deepness() != 1) {
+    throw InterpreterException("Function %d is not declared at top level of program", (int) id);
+  }
+
+  if (function->returnType() == VT_STRING) {
+    throw InterpreterException("Function %s returns string", function->name().c_str());
+  }
+
+  for (uint16_t i = 0; i < function->parametersNumber(); ++i) {
+    if (function->parameterType(i) == VT_STRING) {
+      throw InterpreterException("Parameter %s of function %s is string",
+                                 function->parameterName(i).c_str(), function->name().c_str());
+    }
+  }
+
+  return function;
+}
+
+LaneInterpreter* PreparedProgram::lanes(uint16_t id) {
+  if (isMetered_) {
+    return 0;
+  }
+
+  std::map<uint16_t, LaneInterpreter*>::iterator it = lanes_.find(id);
+  if (it == lanes_.end()) {
+    it = lanes_.insert(std::make_pair(id, LaneInterpreter::create(code_, id))).first;
+  }
+
+  return it->second;
+}
+
+const uint64_t* PreparedProgram::words(const InterpreterFunction* function, const Value* args) {
+  words_.resize(function->parametersNumber());
+
+  for (uint16_t i = 0; i < function->parametersNumber(); ++i) {
+    const Value& arg = args[i];
+    VarType type = function->parameterType(i);
+
+    if (type == VT_INT && arg.type == VT_INT) {
+      memcpy(&words_[i], &arg.intValue, sizeof(uint64_t));
+    } else if (type == VT_DOUBLE && arg.type == VT_DOUBLE) {
+      memcpy(&words_[i], &arg.doubleValue, sizeof(uint64_t));
+    } else if (type == VT_DOUBLE && arg.type == VT_INT) {
+      double value = arg.intValue;
+      memcpy(&words_[i], &value, sizeof(uint64_t));
+    } else {
+      throw InterpreterException("Parameter %s of function %s is %s, not %s",
+                                 function->parameterName(i).c_str(), function->name().c_str(),
+                                 typeToName(type), typeToName(arg.type));
+    }
+  }
+
+  return words_.empty() ? 0 : &words_[0];
+}
+
+Value PreparedProgram::result(const InterpreterFunction* function, uint64_t word) const {
+  switch (function->returnType()) {
+    case VT_INT: {
+      int64_t value;
+      memcpy(&value, &word, sizeof(value));
+      return Value(value);
+    }
+    case VT_DOUBLE: {
+      double value;
+      memcpy(&value, &word, sizeof(value));
+      return Value(value);
+    }
+    default:
+      return Value();
+  }
+}
+
+} // namespace mathvm
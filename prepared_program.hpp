@@ -0,0 +1,92 @@
+#ifndef PREPARED_PROGRAM_HPP
+#define PREPARED_PROGRAM_HPP
+
+#include "mathvm.h"
+#include "bytecode_interpreter.hpp"
+#include "interpreter_code.hpp"
+#include "lane_interpreter.hpp"
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+namespace mathvm {
+
+/*
+ * Argument or result of function called through PreparedProgram.
+ * Result of void function has type VT_VOID.
+ */
+struct Value {
+  VarType type;
+  union {
+    int64_t intValue;
+    double doubleValue;
+  };
+
+  Value() : type(VT_VOID), intValue(0) {}
+  Value(int value) : type(VT_INT), intValue(value) {}
+  Value(int64_t value) : type(VT_INT), intValue(value) {}
+  Value(double value) : type(VT_DOUBLE), doubleValue(value) {}
+};
+
+/*
+ * Program translated once and run by one interpreter, which is kept
+ * to call functions declared at top level of program any number
+ * of times: embedding applications use it instead of main.
+ * Top level code runs when program is prepared, so functions see
+ * globals it has set, and its output goes where options say.
+ * Int arguments are converted to double parameters, other
+ * mismatches of types and string parameters and results are errors.
+ * Calls throw InterpreterException (with call stack if program
+ * failed) or TranslationException (body is generated on first call),
+ * after which program can be called again; fuel and time limit
+ * of options are for all calls together though, and turn JIT off.
+ * Calls must not be concurrent: prepare program per thread for that.
+ */
+class PreparedProgram {
+  InterpreterCodeImpl* code_;
+  BytecodeInterpreter* vm_;
+  bool isMetered_;              // fuel or time is limited
+  std::vector<uint64_t> words_; // arguments of call being made
+  std::map<uint16_t, LaneInterpreter*> lanes_; // 0 if function can't run in lanes
+
+public:
+  // *result is 0 if status is error; running top level code
+  // may throw as interpreter does
+  static Status* prepare(const std::string& source, PreparedProgram** result,
+                         const InterpreterOptions& options = InterpreterOptions());
+  ~PreparedProgram();
+
+  // Throws InterpreterException if there's no such function at top level
+  // or it can't be called with int and double values
+  uint16_t functionId(const std::string& name) const;
+
+  Value call(const std::string& name, const std::vector<Value>& args);
+  // args has parametersNumber values
+  Value call(uint16_t id, const Value* args);
+  // Calls function for every row of args: row i is arguments
+  // of call i, and results[i] is its result. Function is looked up and
+  // checked once, and interpreter is reused, so call costs little more
+  // than running the function. Numeric function which doesn't call
+  // or print runs over LANES rows at once (see LaneInterpreter),
+  // unless fuel or time is limited
+  void callBatch(uint16_t id, const Value* args, size_t calls, Value* results);
+
+private:
+  PreparedProgram(InterpreterCodeImpl* code, BytecodeInterpreter* vm, bool isMetered)
+    : code_(code), vm_(vm), isMetered_(isMetered) {}
+  PreparedProgram(const PreparedProgram&);
+  PreparedProgram& operator=(const PreparedProgram&);
+
+  // Throws unless function can be called through PreparedProgram
+  InterpreterFunction* callable(uint16_t id) const;
+  LaneInterpreter* lanes(uint16_t id);
+  const uint64_t* words(const InterpreterFunction* function, const Value* args);
+  Value result(const InterpreterFunction* function, uint64_t word) const;
+};
+
+} // namespace mathvm
+
+#endif
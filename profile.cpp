@@ -0,0 +1,180 @@
+#include "profile.hpp"
+#include "errors.hpp"
+#include "instructions.hpp"
+
+#include <cassert>
+#include <fstream>
+#include <sstream>
+
+namespace mathvm {
+
+namespace {
+
+const char* const HEADER = "mvm-profile";
+const uint32_t VERSION = 1;
+
+} // namespace
+
+void Profile::load(const std::string& path) {
+  std::ifstream in(path.c_str());
+  std::string kind;
+  uint32_t version = 0;
+
+  if (!(in >> kind >> version) || kind != HEADER || version != VERSION) {
+    throw InternalException("Could not load profile %s", path.c_str());
+  }
+
+  std::string line;
+  std::getline(in, line);
+
+  while (std::getline(in, line)) {
+    std::istringstream record(line);
+    uint32_t function = 0;
+    uint32_t offset = 0;
+
+    if (!(record >> kind) || kind.empty()) {
+      continue;
+    }
+
+    if (kind == "function" && record >> function >> offset && function <= UINT16_MAX) {
+      addFunction(function, offset);
+      continue;
+    }
+
+    uint64_t first = 0;
+    uint64_t second = 0;
+
+    if (kind == "branch" && record >> function >> offset >> first >> second
+        && function <= UINT16_MAX) {
+      addBranch(function, offset, BranchCounts(first, second));
+      continue;
+    }
+
+    if (kind == "call" && record >> function >> offset >> first >> second
+        && function <= UINT16_MAX && first <= UINT16_MAX) {
+      addCall(function, offset, CallCounts(first, second));
+      continue;
+    }
+
+    throw InternalException("Bad record in profile %s: %s", path.c_str(), line.c_str());
+  }
+}
+
+void Profile::save(const std::string& path) const {
+  std::ofstream out(path.c_str());
+  out << HEADER << " " << VERSION << "\n";
+
+  for (size_t id = 0; id < functions_.size(); ++id) {
+    const FunctionProfile& function = functions_[id];
+    if (function.length == 0) {
+      continue;
+    }
+
+    out << "function " << id << " " << function.length << "\n";
+
+    std::map<uint32_t, BranchCounts>::const_iterator branch = function.branches.begin();
+    for (; branch != function.branches.end(); ++branch) {
+      out << "branch " << id << " " << branch->first << " "
+          << branch->second.taken << " " << branch->second.notTaken << "\n";
+    }
+
+    std::map<uint32_t, CallCounts>::const_iterator call = function.calls.begin();
+    for (; call != function.calls.end(); ++call) {
+      out << "call " << id << " " << call->first << " "
+          << call->second.callee << " " << call->second.calls << "\n";
+    }
+  }
+
+  out.close();
+  if (!out) {
+    throw InternalException("Could not write profile %s", path.c_str());
+  }
+}
+
+void Profile::addFunction(uint16_t function, uint32_t length) {
+  functionProfile(function).length = length;
+}
+
+void Profile::addBranch(uint16_t function, uint32_t offset, const BranchCounts& counts) {
+  functionProfile(function).branches[offset] = counts;
+}
+
+void Profile::addCall(uint16_t function, uint32_t offset, const CallCounts& counts) {
+  CallCounts& calls = functionProfile(function).calls[offset];
+  calls_ += counts.calls - calls.calls;
+  calls = counts;
+}
+
+const BranchCounts* Profile::branch(uint16_t function, uint32_t offset) const {
+  if (function >= functions_.size()) {
+    return 0;
+  }
+
+  const std::map<uint32_t, BranchCounts>& branches = functions_[function].branches;
+  std::map<uint32_t, BranchCounts>::const_iterator it = branches.find(offset);
+  return it == branches.end() ? 0 : &it->second;
+}
+
+bool Profile::isHotCall(uint16_t function, uint32_t offset, uint16_t callee) const {
+  if (function >= functions_.size()) {
+    return false;
+  }
+
+  const std::map<uint32_t, CallCounts>& calls = functions_[function].calls;
+  std::map<uint32_t, CallCounts>::const_iterator it = calls.find(offset);
+
+  return it != calls.end()
+         && it->second.callee == callee
+         && it->second.calls * constants::HOT_CALL_SHARE >= calls_;
+}
+
+void Profile::addInlinedCall(uint16_t function, uint32_t offset, uint32_t length) {
+  // hot calls are only in recorded functions, so vector isn't resized
+  assert(function < functions_.size());
+  functions_[function].inlined.push_back(InlinedCall(offset, length));
+}
+
+uint32_t Profile::baselineOffset(uint16_t function, uint32_t offset) const {
+  if (function >= functions_.size()) {
+    return offset;
+  }
+
+  const std::vector<InlinedCall>& inlined = functions_[function].inlined;
+  uint32_t callLength = instructionLength(BC_CALLCTX);
+  uint32_t baseline = offset;
+
+  for (size_t i = 0; i < inlined.size() && inlined[i].offset < offset; ++i) {
+    baseline -= inlined[i].length - callLength;
+  }
+
+  return baseline;
+}
+
+bool Profile::isApplicable(uint16_t function, uint32_t length) const {
+  return function < functions_.size()
+         && functions_[function].length != 0
+         && functions_[function].length == baselineOffset(function, length);
+}
+
+bool Profile::baselineOffset(uint16_t function, uint32_t offset, uint32_t& baseline) const {
+  const std::vector<InlinedCall>& inlined = functions_[function].inlined;
+
+  for (size_t i = 0; i < inlined.size(); ++i) {
+    if (offset >= inlined[i].offset && offset < inlined[i].offset + inlined[i].length) {
+      return false;
+    }
+  }
+
+  baseline = baselineOffset(function, offset);
+  return true;
+}
+
+Profile::FunctionProfile& Profile::functionProfile(uint16_t function) {
+  if (function >= functions_.size()) {
+    functions_.resize(function + 1);
+  }
+
+  return functions_[function];
+}
+
+} // namespace mathvm
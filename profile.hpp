@@ -0,0 +1,116 @@
+#ifndef PROFILE_HPP
+#define PROFILE_HPP
+
+#include "mathvm.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+namespace mathvm {
+
+namespace constants {
+  // call site is hot if it makes at least 1/HOT_CALL_SHARE of all calls
+  const uint64_t HOT_CALL_SHARE = 100;
+  // max size (in ast nodes) of function inlined into hot call site
+  const uint32_t HOT_INLINE_THRESHOLD = 96;
+}
+
+/*
+ * How many times conditional branch jumped and how many times
+ * it went to next instruction. For IFORLOOP these are loop iterations
+ * and loop exits, so trip count of loop is taken / notTaken + 1.
+ */
+struct BranchCounts {
+  uint64_t taken;
+  uint64_t notTaken;
+
+  BranchCounts(uint64_t taken = 0, uint64_t notTaken = 0)
+    : taken(taken),
+      notTaken(notTaken) {}
+};
+
+struct CallCounts {
+  uint16_t callee;
+  uint64_t calls;
+
+  CallCounts(uint16_t callee = 0, uint64_t calls = 0)
+    : callee(callee),
+      calls(calls) {}
+};
+
+/*
+ * Execution profile of program: counts of conditional branches
+ * (IFICMP*, IFORPREP, IFORLOOP) and of calls by function id and
+ * bytecode offset. Offsets are those of bytecode generated without
+ * profile and not optimized (baseline), which is what runs
+ * while profile is recorded.
+ * Generator using profile inlines hot calls and records where,
+ * so offsets of its bytecode are mapped back to baseline ones.
+ * Text format, one record per line:
+ *   mvm-profile 1
+ *   function ID BASELINE_LENGTH
+ *   branch ID OFFSET TAKEN NOT_TAKEN
+ *   call ID OFFSET CALLEE CALLS
+ */
+class Profile {
+  // CALLCTX replaced with inlined body of length bytes
+  struct InlinedCall {
+    uint32_t offset;
+    uint32_t length;
+
+    InlinedCall(uint32_t offset, uint32_t length)
+      : offset(offset),
+        length(length) {}
+  };
+
+  struct FunctionProfile {
+    uint32_t length; // 0 if function wasn't recorded
+    std::map<uint32_t, BranchCounts> branches;
+    std::map<uint32_t, CallCounts> calls;
+    std::vector<InlinedCall> inlined;
+
+    FunctionProfile() : length(0) {}
+  };
+
+  std::vector<FunctionProfile> functions_;
+  uint64_t calls_;
+
+public:
+  Profile() : calls_(0) {}
+
+  // Throw InternalException if file can't be read or written
+  void load(const std::string& path);
+  void save(const std::string& path) const;
+
+  void addFunction(uint16_t function, uint32_t length);
+  void addBranch(uint16_t function, uint32_t offset, const BranchCounts& counts);
+  void addCall(uint16_t function, uint32_t offset, const CallCounts& counts);
+
+  // 0 if branch was never executed
+  const BranchCounts* branch(uint16_t function, uint32_t offset) const;
+  bool isHotCall(uint16_t function, uint32_t offset, uint16_t callee) const;
+
+  /*
+   * Generator of function body records its inlined hot calls,
+   * and asks for baseline offset of the code it emits at offset.
+   * Bodies of different functions may be generated in parallel.
+   */
+  void addInlinedCall(uint16_t function, uint32_t offset, uint32_t length);
+  uint32_t baselineOffset(uint16_t function, uint32_t offset) const;
+
+  // False if function of given generated length wasn't recorded
+  // with this code: source or generator options differ
+  bool isApplicable(uint16_t function, uint32_t length) const;
+  // False if instruction at offset is in inlined hot call
+  bool baselineOffset(uint16_t function, uint32_t offset, uint32_t& baseline) const;
+
+private:
+  FunctionProfile& functionProfile(uint16_t function);
+};
+
+} // namespace mathvm
+
+#endif
@@ -0,0 +1,51 @@
+#include "scheduler.hpp"
+#include "errors.hpp"
+
+#include <deque>
+
+namespace mathvm {
+
+Scheduler::~Scheduler() {
+  for (size_t i = 0; i < tasks_.size(); ++i) {
+    delete tasks_[i].vm;
+  }
+}
+
+size_t Scheduler::spawn(BytecodeInterpreter* vm) {
+  tasks_.push_back(Task(vm));
+  return tasks_.size() - 1;
+}
+
+void Scheduler::run() {
+  std::deque<size_t> ready;
+
+  for (size_t i = 0; i < tasks_.size(); ++i) {
+    if (tasks_[i].vm) {
+      ready.push_back(i);
+    }
+  }
+
+  while (!ready.empty()) {
+    Task& task = tasks_[ready.front()];
+    bool isDone = true;
+
+    try {
+      isDone = task.vm->execute(quantum_);
+    } catch (TranslationException& e) {
+      task.error = e.what();
+    } catch (InterpreterException& e) {
+      task.error = errorMessage(e);
+    }
+
+    if (isDone) {
+      delete task.vm;
+      task.vm = 0;
+    } else {
+      ready.push_back(ready.front());
+    }
+
+    ready.pop_front();
+  }
+}
+
+} // namespace mathvm
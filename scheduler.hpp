@@ -0,0 +1,58 @@
+#ifndef SCHEDULER_HPP
+#define SCHEDULER_HPP
+
+#include "bytecode_interpreter.hpp"
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+namespace mathvm {
+
+namespace constants {
+  const uint64_t DEFAULT_QUANTUM = 10000;
+  // address space, not memory: stack is committed as it is used
+  const mem_t GREEN_STACK_SIZE = 8*1024*1024;
+}
+
+/*
+ * Cooperative round-robin scheduler of many interpreters 
+ * (green threads) on one OS thread: every ready interpreter in turn
+ * runs for quantum of fuel (see BytecodeInterpreter::execute) and is put back to the end
+ * of the queue unless its program has stopped or failed.
+ * Interpreter is destroyed as soon as it is done, releasing its stack.
+ * Native code of JIT would run to completion within a quantum,
+ * so interpreters don't call it under scheduler.
+ */
+class Scheduler {
+  struct Task {
+    BytecodeInterpreter* vm;
+    std::string error;
+
+    explicit Task(BytecodeInterpreter* vm) : vm(vm) {}
+  };
+
+  std::vector<Task> tasks_;
+  uint64_t quantum_;
+
+public:
+  explicit Scheduler(uint64_t quantum = constants::DEFAULT_QUANTUM)
+    : quantum_(quantum) {}
+  ~Scheduler();
+
+  // Takes ownership of interpreter, returns number of task
+  size_t spawn(BytecodeInterpreter* vm);
+  // Runs until all tasks are done
+  void run();
+  // Message of exception task failed with, empty if its program stopped
+  const std::string& error(size_t task) const { return tasks_[task].error; }
+
+private:
+  Scheduler(const Scheduler&);
+  Scheduler& operator=(const Scheduler&);
+};
+
+} // namespace mathvm
+
+#endif
@@ -0,0 +1,721 @@
+#include "ssa.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <functional>
+
+namespace mathvm {
+
+static bool isCommutative(Instruction op) {
+  switch (static_cast<uint8_t>(op)) {
+    case BC_IADD: case BC_DADD: 
+    case BC_IMUL: case BC_DMUL:
+    case BC_IAOR: case BC_IAAND: case BC_IAXOR:
+    case BC_IMIN: case BC_IMAX:
+      return true;
+    default:
+      return false;
+  }
+}
+
+VarType resultType(Instruction insn) {
+  switch (static_cast<uint8_t>(insn)) {
+    case BC_ILOAD: case BC_ILOAD0: case BC_ILOAD1: case BC_ILOADM1: 
+    case BC_LOADIVAR: case BC_LOADCTXIVAR:
+    case BC_IADD: case BC_ISUB: case BC_IMUL: case BC_IDIV: case BC_IMOD: 
+    case BC_INEG: case BC_IAOR: case BC_IAAND: case BC_IAXOR:
+    case BC_ICMP: case BC_DCMP: case BC_D2I: 
+    case BC_IDIVPOW2: case BC_IMODPOW2:
+    case BC_IABS: case BC_IMIN: case BC_IMAX:
+      return VT_INT;
+
+    case BC_DLOAD: case BC_DLOAD0: case BC_DLOAD1: case BC_DLOADM1:
+    case BC_LOADDVAR: case BC_LOADCTXDVAR:
+    case BC_DADD: case BC_DSUB: case BC_DMUL: case BC_DDIV: 
+    case BC_DNEG: case BC_I2D:
+    case BC_DSQRT: case BC_DSIN: case BC_DCOS: case BC_DEXP: case BC_DLOG:
+    case BC_DFLOOR: case BC_DPOW: case BC_DABS: case BC_DMIN: case BC_DMAX:
+      return VT_DOUBLE;
+
+    case BC_SLOAD:
+      return VT_STRING;
+
+    default:
+      return VT_INVALID;
+  }
+}
+
+bool SsaFunction::ValueKey::operator<(const ValueKey& other) const {
+  if (kind != other.kind) return kind < other.kind;
+  if (op != other.op) return op < other.op;
+  if (type != other.type) return type < other.type;
+  if (bits != other.bits) return bits < other.bits;
+  if (upper != other.upper) return std::less<SsaValue*>()(upper, other.upper);
+  return std::less<SsaValue*>()(lower, other.lower);
+}
+
+SsaFunction::SsaFunction(const InsnList& insns, 
+                         const ControlFlowGraph& cfg, 
+                         const FrameAccess& frames,
+                         InterpreterFunction* function, 
+                         InterpreterCodeImpl* code)
+  : insns_(insns), 
+    cfg_(cfg), 
+    frames_(frames),
+    function_(function), 
+    code_(code) {
+  assert(cfg.isConsistent());
+  build();
+}
+
+SsaFunction::~SsaFunction() {
+  for (size_t i = 0; i < values_.size(); ++i) {
+    delete values_[i];
+  }
+}
+
+SsaValue* SsaFunction::resolve(SsaValue* value) {
+  while (value->replacement) {
+    value = value->replacement;
+  }
+  return value;
+}
+
+void SsaFunction::build() {
+  effects_.resize(insns_.size());
+  entries_.resize(cfg_.size());
+  exits_.resize(cfg_.size());
+  isVisited_.resize(cfg_.size(), false);
+  hasIncompletePhis_.resize(cfg_.size(), false);
+
+  initial_.locals.resize(function_->localsNumber());
+  for (size_t i = 0; i < initial_.locals.size(); ++i) {
+    initial_.locals[i] = unknown(VT_INVALID);
+  }
+
+  // first argument is the deepest one
+  for (uint16_t i = 0; i < function_->parametersNumber(); ++i) {
+    initial_.stack.push_back(unknown(function_->parameterType(i)));
+  }
+
+  const std::vector<uint32_t>& order = cfg_.order();
+  for (size_t i = 0; i < order.size(); ++i) {
+    visit(order[i]);
+  }
+
+  removeRedundantValues();
+  inferPhiTypes();
+}
+
+void SsaFunction::incoming(uint32_t block, std::vector<const State*>& states) const {
+  const std::vector<uint32_t>& preds = cfg_.block(block).preds;
+
+  // entry block may be loop header too
+  if (block == 0) {
+    states.push_back(&initial_);
+  }
+
+  for (size_t i = 0; i < preds.size(); ++i) {
+    states.push_back(isVisited_[preds[i]] ? &exits_[preds[i]] : 0);
+  }
+}
+
+void SsaFunction::visit(uint32_t block) {
+  const BasicBlock& bb = cfg_.block(block);
+  std::vector<const State*> states;
+  bool isComplete = true;
+
+  incoming(block, states);
+  for (size_t i = 0; i < states.size(); ++i) {
+    isComplete = isComplete && states[i] != 0;
+  }
+
+  State state;
+  state.locals.resize(function_->localsNumber());
+  state.stack.resize(bb.stackDepth);
+
+  std::vector<SsaValue*> values(states.size());
+
+  for (size_t i = 0; i < state.locals.size(); ++i) {
+    if (isComplete) {
+      for (size_t j = 0; j < states.size(); ++j) {
+        values[j] = states[j]->locals[i];
+      }
+      state.locals[i] = merge(block, values);
+    } else {
+      state.locals[i] = phi(block);
+    }
+  }
+
+  for (size_t i = 0; i < state.stack.size(); ++i) {
+    if (isComplete) {
+      for (size_t j = 0; j < states.size(); ++j) {
+        values[j] = states[j]->stack[i];
+      }
+      state.stack[i] = merge(block, values);
+    } else {
+      state.stack[i] = phi(block);
+    }
+  }
+
+  hasIncompletePhis_[block] = !isComplete;
+  entries_[block] = state;
+
+  for (uint32_t i = bb.begin; i < bb.end; ++i) {
+    execute(i, state);
+  }
+
+  exits_[block].locals.swap(state.locals);
+  exits_[block].stack.swap(state.stack);
+  isVisited_[block] = true;
+
+  for (size_t i = 0; i < bb.succs.size(); ++i) {
+    uint32_t succ = bb.succs[i];
+
+    if (!hasIncompletePhis_[succ]) {
+      continue;
+    }
+
+    std::vector<const State*> succStates;
+    bool isComplete = true;
+
+    incoming(succ, succStates);
+    for (size_t j = 0; j < succStates.size(); ++j) {
+      isComplete = isComplete && succStates[j] != 0;
+    }
+
+    if (isComplete) {
+      completePhis(succ);
+    }
+  }
+}
+
+void SsaFunction::completePhis(uint32_t block) {
+  std::vector<const State*> states;
+  State& entry = entries_[block];
+
+  incoming(block, states);
+
+  for (size_t i = 0; i < entry.locals.size(); ++i) {
+    for (size_t j = 0; j < states.size(); ++j) {
+      entry.locals[i]->operands.push_back(states[j]->locals[i]);
+    }
+  }
+
+  for (size_t i = 0; i < entry.stack.size(); ++i) {
+    for (size_t j = 0; j < states.size(); ++j) {
+      entry.stack[i]->operands.push_back(states[j]->stack[i]);
+    }
+  }
+
+  hasIncompletePhis_[block] = false;
+}
+
+SsaValue* SsaFunction::pop(State& state, InsnEffect& effect) {
+  assert(!state.stack.empty());
+  SsaValue* value = state.stack.back();
+  state.stack.pop_back();
+  effect.popped.push_back(value);
+  return value;
+}
+
+void SsaFunction::push(State& state, InsnEffect& effect, SsaValue* value) {
+  state.stack.push_back(value);
+  effect.pushed = value;
+}
+
+void SsaFunction::define(State& state, InsnEffect& effect, uint16_t id, SsaValue* value) {
+  state.locals[id] = value;
+  effect.defined.push_back(std::make_pair(id, value));
+}
+
+void SsaFunction::execute(uint32_t index, State& state) {
+  const Insn& insn = insns_[index];
+  InsnEffect& effect = effects_[index];
+  VarType type = resultType(insn.insn);
+
+  switch (static_cast<uint8_t>(insn.insn)) {
+    case BC_ILOAD: case BC_ILOAD0: case BC_ILOAD1: case BC_ILOADM1:
+      push(state, effect, intConstant(insn.intValue));
+      break;
+
+    case BC_DLOAD: case BC_DLOAD0: case BC_DLOAD1: case BC_DLOADM1:
+      push(state, effect, doubleConstant(insn.doubleValue));
+      break;
+
+    case BC_SLOAD:
+      push(state, effect, stringConstant(insn.id));
+      break;
+
+    case BC_LOADIVAR: 
+    case BC_LOADDVAR: {
+      SsaValue* value = resolve(state.locals[insn.id]);
+      bool isPending = value->kind == SsaValue::PHI && value->type == VT_VOID;
+
+      // slot is reused by variable of other type or isn't initialized
+      if (value->type != type && !isPending) {
+        value = unknown(type);
+        define(state, effect, insn.id, value);
+      }
+
+      push(state, effect, value);
+      break;
+    }
+
+    case BC_STOREIVAR: 
+    case BC_STOREDVAR:
+      define(state, effect, insn.id, pop(state, effect));
+      break;
+
+    case BC_LOADCTXIVAR: 
+    case BC_LOADCTXDVAR:
+      push(state, effect, unknown(type));
+      break;
+
+    case BC_DADD: case BC_IADD: case BC_DSUB: case BC_ISUB:
+    case BC_DMUL: case BC_IMUL: case BC_DDIV: case BC_IDIV: 
+    case BC_IMOD: case BC_IAOR: case BC_IAAND: case BC_IAXOR:
+    case BC_DCMP: case BC_ICMP: 
+    case BC_DPOW: case BC_IMIN: case BC_DMIN: case BC_IMAX: case BC_DMAX: {
+      SsaValue* upper = pop(state, effect);
+      SsaValue* lower = pop(state, effect);
+      push(state, effect, operation(insn.insn, type, upper, lower));
+      break;
+    }
+
+    case BC_DNEG: case BC_INEG: case BC_I2D: case BC_D2I:
+    case BC_DSQRT: case BC_DSIN: case BC_DCOS: case BC_DEXP: case BC_DLOG:
+    case BC_DFLOOR: case BC_IABS: case BC_DABS:
+      push(state, effect, operation(insn.insn, type, pop(state, effect)));
+      break;
+
+    // numbered as division by constant, so they are
+    // equal to divisions they are made of
+    case BC_IDIVPOW2:
+    case BC_IMODPOW2: {
+      Instruction op = insn.insn == BC_IDIVPOW2 ? BC_IDIV : BC_IMOD;
+      SsaValue* divisor = intConstant(static_cast<int64_t>(1) << insn.id);
+      push(state, effect, operation(op, type, pop(state, effect), divisor));
+      break;
+    }
+
+    case BC_SWAP: {
+      SsaValue* upper = pop(state, effect);
+      SsaValue* lower = pop(state, effect);
+      state.stack.push_back(upper);
+      state.stack.push_back(lower);
+      break;
+    }
+
+    case BC_IFORPREP:
+      define(state, effect, insn.limitId, pop(state, effect));
+      break;
+
+    case BC_IFORLOOP: {
+      SsaValue* counter = resolve(state.locals[insn.id]);
+      define(state, effect, insn.id, operation(BC_IADD, VT_INT, counter, intConstant(1)));
+      break;
+    }
+
+    case BC_CALLCTX: 
+    case BC_TAILCALL: {
+      uint16_t parametersNumber = code_->functionById(insn.id)->parametersNumber();
+
+      for (uint16_t i = 0; i < parametersNumber; ++i) {
+        pop(state, effect);
+      }
+
+      if (insn.insn == BC_TAILCALL) {
+        break;
+      }
+
+      // nested function may change any local variable
+      if (frames_.isCallerAccessed(insn)) {
+        for (size_t i = 0; i < state.locals.size(); ++i) {
+          define(state, effect, i, unknown(VT_INVALID));
+        }
+      }
+
+      push(state, effect, unknown(VT_INVALID));
+      break;
+    }
+
+    default: {
+      uint32_t popped;
+      uint32_t pushed;
+      stackEffect(insn, code_, popped, pushed);
+      assert(pushed == 0);
+
+      for (uint32_t i = 0; i < popped; ++i) {
+        pop(state, effect);
+      }
+      break;
+    }
+  }
+}
+
+/*
+ * Trivial phi (all operands are the same value or phi itself) 
+ * is replaced with that value. Operations which operands are replaced
+ * are folded and numbered again, which can make more phis trivial.
+ */
+void SsaFunction::removeRedundantValues() {
+  bool isChanged = true;
+
+  while (isChanged) {
+    isChanged = false;
+
+    for (size_t i = 0; i < phis_.size(); ++i) {
+      SsaValue* phi = phis_[i];
+      SsaValue* same = 0;
+      bool isTrivial = true;
+
+      if (phi->replacement) {
+        continue;
+      }
+
+      for (size_t j = 0; j < phi->operands.size() && isTrivial; ++j) {
+        SsaValue* operand = resolve(phi->operands[j]);
+
+        if (operand == phi || operand == same) {
+          continue;
+        }
+
+        isTrivial = same == 0;
+        same = operand;
+      }
+
+      if (isTrivial && same) {
+        phi->replacement = same;
+        isChanged = true;
+      }
+    }
+
+    size_t valuesNumber = values_.size();
+
+    for (size_t i = 0; i < valuesNumber; ++i) {
+      SsaValue* value = values_[i];
+
+      if (value->kind != SsaValue::OPERATION || value->replacement) {
+        continue;
+      }
+
+      SsaValue* lower = value->operands.size() > 1 ? value->operands[1] : 0;
+      SsaValue* numbered = operation(value->op, value->type, value->operands[0], lower);
+
+      if (numbered != value) {
+        value->replacement = numbered;
+        isChanged = true;
+      }
+    }
+  }
+}
+
+/*
+ * Phi has type of its operands if they all have the same type.
+ * VT_VOID is used as "not known yet".
+ */
+void SsaFunction::inferPhiTypes() {
+  bool isChanged = true;
+
+  for (size_t i = 0; i < phis_.size(); ++i) {
+    phis_[i]->type = VT_VOID;
+  }
+
+  while (isChanged) {
+    isChanged = false;
+
+    for (size_t i = 0; i < phis_.size(); ++i) {
+      SsaValue* phi = phis_[i];
+      VarType type = VT_VOID;
+
+      if (phi->replacement) {
+        continue;
+      }
+
+      for (size_t j = 0; j < phi->operands.size(); ++j) {
+        VarType operandType = resolve(phi->operands[j])->type;
+
+        if (operandType == VT_VOID || operandType == type) {
+          continue;
+        }
+
+        type = type == VT_VOID ? operandType : VT_INVALID;
+      }
+
+      if (type != phi->type) {
+        phi->type = type;
+        isChanged = true;
+      }
+    }
+  }
+
+  for (size_t i = 0; i < phis_.size(); ++i) {
+    if (phis_[i]->type == VT_VOID) {
+      phis_[i]->type = VT_INVALID;
+    }
+  }
+}
+
+SsaValue* SsaFunction::newValue(SsaValue::Kind kind, VarType type) {
+  SsaValue* value = new SsaValue(kind, type);
+  values_.push_back(value);
+  return value;
+}
+
+SsaValue* SsaFunction::unknown(VarType type) {
+  return newValue(SsaValue::UNKNOWN, type);
+}
+
+SsaValue* SsaFunction::phi(uint32_t block) {
+  SsaValue* value = newValue(SsaValue::PHI, VT_VOID);
+  value->block = block;
+  phis_.push_back(value);
+  return value;
+}
+
+SsaValue* SsaFunction::merge(uint32_t block, const std::vector<SsaValue*>& values) {
+  SsaValue* same = resolve(values[0]);
+
+  for (size_t i = 1; i < values.size(); ++i) {
+    if (resolve(values[i]) != same) {
+      SsaValue* value = phi(block);
+      value->operands = values;
+      return value;
+    }
+  }
+
+  return same;
+}
+
+SsaValue* SsaFunction::number(const ValueKey& key, SsaValue* value) {
+  std::map<ValueKey, SsaValue*>::iterator it = numbers_.find(key);
+
+  if (it != numbers_.end()) {
+    return resolve(it->second);
+  }
+
+  numbers_[key] = value;
+  values_.push_back(value);
+  return value;
+}
+
+SsaValue* SsaFunction::intConstant(int64_t value) {
+  ValueKey key = { SsaValue::CONSTANT, BC_INVALID, VT_INT, value, 0, 0 };
+  std::map<ValueKey, SsaValue*>::iterator it = numbers_.find(key);
+
+  if (it != numbers_.end()) {
+    return it->second;
+  }
+
+  SsaValue* constant = new SsaValue(SsaValue::CONSTANT, VT_INT);
+  constant->intValue = value;
+  return number(key, constant);
+}
+
+SsaValue* SsaFunction::doubleConstant(double value) {
+  int64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+
+  ValueKey key = { SsaValue::CONSTANT, BC_INVALID, VT_DOUBLE, bits, 0, 0 };
+  std::map<ValueKey, SsaValue*>::iterator it = numbers_.find(key);
+
+  if (it != numbers_.end()) {
+    return it->second;
+  }
+
+  SsaValue* constant = new SsaValue(SsaValue::CONSTANT, VT_DOUBLE);
+  constant->doubleValue = value;
+  return number(key, constant);
+}
+
+SsaValue* SsaFunction::stringConstant(uint16_t id) {
+  ValueKey key = { SsaValue::CONSTANT, BC_INVALID, VT_STRING, id, 0, 0 };
+  std::map<ValueKey, SsaValue*>::iterator it = numbers_.find(key);
+
+  if (it != numbers_.end()) {
+    return it->second;
+  }
+
+  SsaValue* constant = new SsaValue(SsaValue::CONSTANT, VT_STRING);
+  constant->intValue = id;
+  return number(key, constant);
+}
+
+SsaValue* SsaFunction::operation(Instruction op, VarType type, 
+                                 SsaValue* upper, SsaValue* lower) {
+  upper = resolve(upper);
+  lower = lower ? resolve(lower) : 0;
+
+  if (SsaValue* folded = fold(op, upper, lower)) {
+    return folded;
+  }
+
+  if (SsaValue* simplified = simplify(op, upper, lower)) {
+    return simplified;
+  }
+
+  ValueKey key = { SsaValue::OPERATION, op, type, 0, upper, lower };
+
+  if (lower && isCommutative(op) && std::less<SsaValue*>()(lower, upper)) {
+    std::swap(key.upper, key.lower);
+  }
+
+  std::map<ValueKey, SsaValue*>::iterator it = numbers_.find(key);
+
+  if (it != numbers_.end()) {
+    return resolve(it->second);
+  }
+
+  SsaValue* value = new SsaValue(SsaValue::OPERATION, type);
+  value->op = op;
+  value->operands.push_back(upper);
+
+  if (lower) {
+    value->operands.push_back(lower);
+  }
+
+  return number(key, value);
+}
+
+template<typename T>
+static int64_t compare(T upper, T lower) {
+  // the same as BytecodeInterpreter does
+  if (upper == lower) return 0;
+  if (upper < lower) return -1;
+  return 1;
+}
+
+/*
+ * Integer arithmetic wraps around as it does in interpreter.
+ * Division which would trap is left for run time.
+ */
+SsaValue* SsaFunction::fold(Instruction op, SsaValue* upper, SsaValue* lower) {
+  if (!upper->isConstant() || (lower && !lower->isConstant())) {
+    return 0;
+  }
+
+  VarType operandType = upper->type;
+  if (lower && lower->type != operandType) {
+    return 0;
+  }
+
+  if (operandType == VT_INT) {
+    uint64_t a = upper->intValue;
+    uint64_t b = lower ? lower->intValue : 0;
+    int64_t sa = upper->intValue;
+    int64_t sb = lower ? lower->intValue : 0;
+    bool isDivisionSafe = sb != 0 && !(sa == INT64_MIN && sb == -1);
+
+    switch (static_cast<uint8_t>(op)) {
+      case BC_IADD:  return intConstant(a + b);
+      case BC_ISUB:  return intConstant(a - b);
+      case BC_IMUL:  return intConstant(a * b);
+      case BC_IDIV:  return isDivisionSafe ? intConstant(sa / sb) : 0;
+      case BC_IMOD:  return isDivisionSafe ? intConstant(sa % sb) : 0;
+      case BC_IAOR:  return intConstant(a | b);
+      case BC_IAAND: return intConstant(a & b);
+      case BC_IAXOR: return intConstant(a ^ b);
+      case BC_ICMP:  return intConstant(compare(sa, sb));
+      case BC_INEG:  return intConstant(0 - a);
+      case BC_I2D:   return doubleConstant(static_cast<double>(sa));
+      case BC_IABS:  return intConstant(sa < 0 ? 0 - a : a);
+      case BC_IMIN:  return intConstant(std::min(sa, sb));
+      case BC_IMAX:  return intConstant(std::max(sa, sb));
+      default:       return 0;
+    }
+  }
+
+  if (operandType == VT_DOUBLE) {
+    double a = upper->doubleValue;
+    double b = lower ? lower->doubleValue : 0;
+    // conversion of out of range value is undefined
+    bool isConvertible = a == a && a > -9223372036854775808.0 && a < 9223372036854775808.0;
+
+    switch (static_cast<uint8_t>(op)) {
+      case BC_DADD: return doubleConstant(a + b);
+      case BC_DSUB: return doubleConstant(a - b);
+      case BC_DMUL: return doubleConstant(a * b);
+      case BC_DDIV: return doubleConstant(a / b);
+      case BC_DCMP: return intConstant(compare(a, b));
+      case BC_DNEG: return doubleConstant(-a);
+      case BC_D2I:  return isConvertible ? intConstant(static_cast<int64_t>(a)) : 0;
+      // the same library functions as BytecodeInterpreter calls
+      case BC_DSQRT:  return doubleConstant(std::sqrt(a));
+      case BC_DSIN:   return doubleConstant(std::sin(a));
+      case BC_DCOS:   return doubleConstant(std::cos(a));
+      case BC_DEXP:   return doubleConstant(std::exp(a));
+      case BC_DLOG:   return doubleConstant(std::log(a));
+      case BC_DFLOOR: return doubleConstant(std::floor(a));
+      case BC_DABS:   return doubleConstant(std::fabs(a));
+      case BC_DPOW:   return doubleConstant(std::pow(b, a));
+      case BC_DMIN:   return doubleConstant(std::fmin(a, b));
+      case BC_DMAX:   return doubleConstant(std::fmax(a, b));
+      default:      return 0;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Algebraic identities of integer operations. Double ones
+ * mostly don't hold because of -0.0 and NaN.
+ */
+SsaValue* SsaFunction::simplify(Instruction op, SsaValue* upper, SsaValue* lower) {
+  switch (static_cast<uint8_t>(op)) {
+    case BC_IADD:
+      if (upper->isIntConstant(0)) return lower;
+      if (lower->isIntConstant(0)) return upper;
+      return 0;
+
+    case BC_ISUB:
+      if (lower->isIntConstant(0)) return upper;
+      if (upper == lower) return intConstant(0);
+      return 0;
+
+    case BC_IMUL:
+      if (upper->isIntConstant(1)) return lower;
+      if (lower->isIntConstant(1)) return upper;
+      if (upper->isIntConstant(0) || lower->isIntConstant(0)) return intConstant(0);
+      return 0;
+
+    case BC_IDIV:
+      if (lower->isIntConstant(1)) return upper;
+      return 0;
+
+    case BC_IAOR:
+      if (upper->isIntConstant(0) || upper == lower) return lower;
+      if (lower->isIntConstant(0)) return upper;
+      return 0;
+
+    case BC_IAAND:
+      if (upper->isIntConstant(-1) || upper == lower) return lower;
+      if (lower->isIntConstant(-1)) return upper;
+      if (upper->isIntConstant(0) || lower->isIntConstant(0)) return intConstant(0);
+      return 0;
+
+    case BC_IAXOR:
+      if (upper->isIntConstant(0)) return lower;
+      if (lower->isIntConstant(0)) return upper;
+      if (upper == lower) return intConstant(0);
+      return 0;
+
+    case BC_ICMP:
+      if (upper == lower) return intConstant(0);
+      return 0;
+
+    case BC_INEG:
+      if (upper->kind == SsaValue::OPERATION && upper->op == BC_INEG) {
+        return resolve(upper->operands[0]);
+      }
+      return 0;
+
+    default:
+      return 0;
+  }
+}
+
+} // namespace mathvm
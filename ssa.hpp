@@ -0,0 +1,169 @@
+#ifndef SSA_HPP
+#define SSA_HPP
+
+#include "mathvm.h"
+#include "interpreter_code.hpp"
+#include "insn_list.hpp"
+#include "control_flow.hpp"
+#include "frame_access.hpp"
+
+#include <map>
+#include <utility>
+#include <vector>
+
+#include <stdint.h>
+
+namespace mathvm {
+
+/*
+ * Value computed by function. Values are numbered while ssa form 
+ * is being built: equal constants and operations with equal operands 
+ * are the same SsaValue, so two values are equal iff their pointers are.
+ */
+struct SsaValue {
+  enum Kind {
+    CONSTANT,  // intValue keeps string constant id for strings
+    OPERATION, // pure operation op on operands
+    PHI,       // merge of values of variable on block entry
+    UNKNOWN    // call result, context variable, argument etc.
+  };
+
+  Kind kind;
+  VarType type; // VT_INVALID if value has no single type
+  Instruction op;
+  int64_t intValue;
+  double doubleValue;
+  uint32_t block; // block of phi
+  // first operand of operation is upper value of the stack,
+  // operands of phi are in order of block predecessors
+  std::vector<SsaValue*> operands;
+  // set when phi turns out to be equal to other value
+  SsaValue* replacement;
+
+  SsaValue(Kind kind, VarType type)
+    : kind(kind), 
+      type(type), 
+      op(BC_INVALID),
+      intValue(0), 
+      doubleValue(0), 
+      block(0), 
+      replacement(0) {}
+
+  bool isConstant() const { return kind == CONSTANT; }
+
+  bool isIntConstant(int64_t value) const {
+    return kind == CONSTANT && type == VT_INT && intValue == value;
+  }
+};
+
+// Values which instruction consumes and produces
+struct InsnEffect {
+  std::vector<SsaValue*> popped; // top of stack first
+  SsaValue* pushed;              // 0 if instruction pushes nothing
+  // local variables with new values after instruction
+  std::vector<std::pair<uint16_t, SsaValue*> > defined;
+
+  InsnEffect() : pushed(0) {}
+};
+
+/*
+ * Ssa form of function bytecode. Variables are local variables of 
+ * function frame and operand stack slots at block boundaries.
+ * Construction follows Braun et al., "Simple and Efficient Construction 
+ * of Static Single Assignment Form": blocks are visited in reverse 
+ * postorder, loop headers get phis for every variable, which 
+ * are completed when last predecessor is visited and 
+ * removed afterwards if they turn out to be trivial.
+ *
+ * Local variables of function are not visible to other functions,
+ * except nested ones: call with parentHops == 0 may read 
+ * and change any of them (see FrameAccess).
+ */
+class SsaFunction {
+  struct State {
+    std::vector<SsaValue*> locals;
+    std::vector<SsaValue*> stack;
+  };
+
+  struct ValueKey {
+    SsaValue::Kind kind;
+    Instruction op;
+    VarType type;
+    int64_t bits;
+    SsaValue* upper;
+    SsaValue* lower;
+
+    bool operator<(const ValueKey& other) const;
+  };
+
+  const InsnList& insns_;
+  const ControlFlowGraph& cfg_;
+  const FrameAccess& frames_;
+  InterpreterFunction* function_;
+  InterpreterCodeImpl* code_;
+  std::vector<SsaValue*> values_;
+  std::vector<SsaValue*> phis_;
+  std::map<ValueKey, SsaValue*> numbers_;
+  std::vector<InsnEffect> effects_;
+  State initial_; // state on function entry
+  std::vector<State> entries_;
+  std::vector<State> exits_;
+  std::vector<bool> isVisited_;
+  std::vector<bool> hasIncompletePhis_;
+
+public:
+  SsaFunction(const InsnList& insns, 
+              const ControlFlowGraph& cfg, 
+              const FrameAccess& frames,
+              InterpreterFunction* function, 
+              InterpreterCodeImpl* code);
+  ~SsaFunction();
+
+  static SsaValue* resolve(SsaValue* value);
+
+  const InsnEffect& effect(uint32_t insn) const { return effects_[insn]; }
+
+  // Value of local variable on entry of reachable block
+  SsaValue* localOnEntry(uint32_t block, uint16_t id) const {
+    return resolve(entries_[block].locals[id]);
+  }
+
+  // Value of local variable on exit of reachable block
+  SsaValue* localOnExit(uint32_t block, uint16_t id) const {
+    return resolve(exits_[block].locals[id]);
+  }
+
+private:
+  void build();
+  void visit(uint32_t block);
+  void execute(uint32_t insn, State& state);
+  void completePhis(uint32_t block);
+  void removeRedundantValues();
+  void inferPhiTypes();
+  void incoming(uint32_t block, std::vector<const State*>& states) const;
+
+  SsaValue* pop(State& state, InsnEffect& effect);
+  void push(State& state, InsnEffect& effect, SsaValue* value);
+  void define(State& state, InsnEffect& effect, uint16_t id, SsaValue* value);
+
+  SsaValue* newValue(SsaValue::Kind kind, VarType type);
+  SsaValue* unknown(VarType type);
+  SsaValue* phi(uint32_t block);
+  SsaValue* merge(uint32_t block, const std::vector<SsaValue*>& values);
+  SsaValue* number(const ValueKey& key, SsaValue* value);
+
+  SsaValue* intConstant(int64_t value);
+  SsaValue* doubleConstant(double value);
+  SsaValue* stringConstant(uint16_t id);
+  SsaValue* operation(Instruction op, VarType type, 
+                      SsaValue* upper, SsaValue* lower = 0);
+  SsaValue* fold(Instruction op, SsaValue* upper, SsaValue* lower);
+  SsaValue* simplify(Instruction op, SsaValue* upper, SsaValue* lower);
+};
+
+// Type of value instruction pushes, VT_INVALID for call results
+VarType resultType(Instruction insn);
+
+} // namespace mathvm
+
+#endif
@@ -1,6 +1,7 @@
 #include "translation_utils.hpp"
 #include "errors.hpp"
 #include "info.hpp"
+#include "instructions.hpp"
 
 namespace mathvm {
 
@@ -32,6 +33,10 @@ bool isTopLevel(FunctionNode* function) {
   return function->name() == AstFunction::top_name;
 }
 
+bool isTopLevel(InterpreterFunction* function) {
+  return function->deepness() == 0;
+}
+
 bool isNumeric(VarType type) {
   return type == VT_INT || type == VT_DOUBLE;
 }
@@ -46,8 +51,23 @@ bool hasNonEmptyStack(const AstNode* node) {
          || node->isCallNode();
 }
 
+bool isComparison(AstNode* node) {
+  if (!node->isBinaryOpNode()) {
+    return false;
+  }
+
+  switch (node->asBinaryOpNode()->kind()) {
+    case tEQ: case tNEQ: 
+    case tGT: case tGE: 
+    case tLT: case tLE:
+      return true;
+    default:
+      return false;
+  }
+}
+
 void readVarInfo(const AstVar* var, uint16_t& localId, uint16_t& localContext, Context* ctx) {
-  VarInfo* info = getInfo<VarInfo>(var);
+  VarInfo* info = ctx->varInfo(var);
   uint16_t varFunctionId = info->functionId();
   uint16_t curFunctionId = ctx->currentFunctionId();
   localId = info->localId();
@@ -72,7 +92,15 @@ void loadVar(VarType type, uint16_t localId, uint16_t context, Bytecode* bc) {
     bc->addInsn(isInt ? BC_LOADCTXIVAR : BC_LOADCTXDVAR);
     bc->addUInt16(context);
   } else {
-    bc->addInsn(isInt ? BC_LOADIVAR : BC_LOADDVAR);
+    Instruction insn = isInt ? BC_LOADIVAR : BC_LOADDVAR;
+    Instruction shortInsn = shortVarInsn(insn, localId);
+
+    if (shortInsn != BC_INVALID) {
+      bc->addInsn(shortInsn);
+      return;
+    }
+
+    bc->addInsn(insn);
   }
   
   bc->addUInt16(localId);
@@ -109,12 +137,32 @@ void storeVar(VarType type, uint16_t localId, uint16_t localContext, TokenKind o
     bc->addInsn(isInt ? BC_STORECTXIVAR : BC_STORECTXDVAR);
     bc->addUInt16(localContext);
   } else {
-    bc->addInsn(isInt ? BC_STOREIVAR : BC_STOREDVAR);
+    Instruction insn = isInt ? BC_STOREIVAR : BC_STOREDVAR;
+    Instruction shortInsn = shortVarInsn(insn, localId);
+
+    if (shortInsn != BC_INVALID) {
+      bc->addInsn(shortInsn);
+      return;
+    }
+
+    bc->addInsn(insn);
   }
 
   bc->addUInt16(localId);
 }
 
+void loadInt(int64_t value, Bytecode* bc) {
+  Instruction insn = intLoadInsn(value);
+  bc->addInsn(insn);
+
+  switch (static_cast<uint8_t>(insn)) {
+    case BC_ILOAD8:  bc->add(static_cast<uint8_t>(value)); break;
+    case BC_ILOAD16: bc->addInt16(static_cast<int16_t>(value)); break;
+    case BC_ILOAD:   bc->addInt64(value); break;
+    default: break;
+  }
+}
+
 static void castImpl(VarType from, VarType to, Bytecode* bc, AstNode* node);
 
 void cast(AstNode* expr, VarType to, Bytecode* bc) {
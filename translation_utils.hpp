@@ -14,14 +14,18 @@ AstFunction* findFunction(const std::string& name, Scope* scope, AstNode* at);
 
 bool isTopLevel(AstFunction* function);
 bool isTopLevel(FunctionNode* function);
+bool isTopLevel(InterpreterFunction* function);
 bool isNumeric(VarType type);
 bool hasNonEmptyStack(const AstNode* node);
+bool isComparison(AstNode* node);
 
 void readVarInfo(const AstVar* var, uint16_t& localId, uint16_t& localContext, Context* ctx);
 void loadVar(VarType type, uint16_t localId, uint16_t context, Bytecode* bc);
 void loadVar(LoadNode* node, uint16_t localId, uint16_t context, Bytecode* bc);
 void loadVar(StoreNode* node, uint16_t localId, uint16_t context, Bytecode* bc);
 void storeVar(VarType type, uint16_t localId, uint16_t localContext, TokenKind op, Bytecode* bc);
+// Loads value with the shortest of ILOAD instructions
+void loadInt(int64_t value, Bytecode* bc);
 void cast(AstNode* expr, VarType to, Bytecode* bc);
 
 } // namespace mathvm
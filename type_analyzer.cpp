@@ -0,0 +1,108 @@
+#include "type_analyzer.hpp"
+#include "builtins.hpp"
+#include "info.hpp"
+#include "translation_utils.hpp"
+
+namespace mathvm {
+
+TypeAnalyzer::TypeAnalyzer(AstFunction* function) 
+  : scope_(function->scope()) 
+{
+  function->node()->body()->visit(this);
+}
+
+Scope* TypeAnalyzer::enter(BlockNode* node) {
+  Scope* scope = scope_;
+  scope_ = node->scope();
+  return scope;
+}
+
+VarType TypeAnalyzer::typeOrInvalid(AstNode* node) {
+  return node->info() ? typeOf(node) : VT_INVALID;
+}
+
+// Same cases as visit(BinaryOpNode) of BytecodeGenerator
+void TypeAnalyzer::check(BinaryOpNode* node) {
+  VarType left = typeOrInvalid(node->left());
+  VarType right = typeOrInvalid(node->right());
+  bool isInt = left == VT_INT && right == VT_INT;
+  bool isNumber = isNumeric(left) && isNumeric(right);
+
+  switch (node->kind()) {
+    case tOR: case tAND:
+    case tAOR: case tAAND: case tAXOR:
+    case tMOD:
+      if (isInt) {
+        setType(node, VT_INT);
+      }
+      break;
+
+    case tEQ: case tNEQ: case tGT: case tGE: case tLT: case tLE:
+      if (isNumber) {
+        setType(node, VT_INT);
+      }
+      break;
+
+    case tADD: case tSUB: case tDIV: case tMUL:
+      if (isNumber) {
+        setType(node, isInt ? VT_INT : VT_DOUBLE);
+      }
+      break;
+
+    default:
+      break;
+  }
+}
+
+void TypeAnalyzer::check(UnaryOpNode* node) {
+  VarType operand = typeOrInvalid(node->operand());
+
+  if (node->kind() == tSUB && isNumeric(operand)) {
+    setType(node, operand);
+  } else if (node->kind() == tNOT && operand == VT_INT) {
+    setType(node, VT_INT);
+  }
+}
+
+void TypeAnalyzer::check(StringLiteralNode* node) {
+  setType(node, VT_STRING);
+}
+
+void TypeAnalyzer::check(DoubleLiteralNode* node) {
+  setType(node, VT_DOUBLE);
+}
+
+void TypeAnalyzer::check(IntLiteralNode* node) {
+  setType(node, VT_INT);
+}
+
+void TypeAnalyzer::check(LoadNode* node) {
+  setType(node, node->var()->type());
+}
+
+// Builtin taking ints or doubles alike returns double for double argument
+void TypeAnalyzer::check(CallNode* node) {
+  const Builtin* builtin = findBuiltin(node->name(), scope_);
+
+  if (!builtin) {
+    AstFunction* function = scope_->lookupFunction(node->name());
+    if (function) {
+      setType(node, function->returnType());
+    }
+    return;
+  }
+
+  bool hasDoubleArgument = false;
+
+  for (uint32_t i = 0; i < node->parametersNumber() && i < builtin->parametersNumber; ++i) {
+    if (builtin->parameterTypes[i] == VT_INVALID 
+        && typeOrInvalid(node->parameterAt(i)) == VT_DOUBLE) {
+      hasDoubleArgument = true;
+    }
+  }
+
+  bool isDouble = builtin->doubleInsn != BC_INVALID && hasDoubleArgument;
+  setType(node, isDouble ? VT_DOUBLE : builtin->returnType);
+}
+
+} // namespace mathvm
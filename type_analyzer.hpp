@@ -0,0 +1,50 @@
+#ifndef TYPE_ANALYZER_HPP
+#define TYPE_ANALYZER_HPP
+
+#include "ast.h"
+#include "mathvm.h"
+#include "visitors.h"
+
+namespace mathvm {
+
+/*
+ * Types expression nodes of function as BytecodeGenerator does.
+ * Runs before generators work in parallel: they may inline the same
+ * function, and then only read types of its nodes, which are already
+ * the ones they compute. Nodes generator rejects may stay untyped.
+ */
+class TypeAnalyzer : public AstVisitor {
+  Scope* scope_;
+
+public:
+  explicit TypeAnalyzer(AstFunction* function);
+
+#define VISITOR_FUNCTION(type, name)     \
+  virtual void visit##type(type* node) { \
+    Scope* scope = enter(node);          \
+    node->visitChildren(this);           \
+    scope_ = scope;                      \
+    check(node);                         \
+  }
+
+  FOR_NODES(VISITOR_FUNCTION)
+#undef VISITOR_FUNCTION
+
+private:
+  // Returns scope to get back to after children
+  Scope* enter(AstNode* node) { return scope_; }
+  Scope* enter(BlockNode* node);
+  void check(AstNode* node) {}
+  void check(BinaryOpNode* node);
+  void check(UnaryOpNode* node);
+  void check(StringLiteralNode* node);
+  void check(DoubleLiteralNode* node);
+  void check(IntLiteralNode* node);
+  void check(LoadNode* node);
+  void check(CallNode* node);
+  static VarType typeOrInvalid(AstNode* node);
+};
+
+} // namespace mathvm
+
+#endif
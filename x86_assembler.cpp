@@ -0,0 +1,274 @@
+#include "x86_assembler.hpp"
+
+#include <cassert>
+#include <cstring>
+
+namespace mathvm {
+
+uint32_t X86Assembler::newLabel() {
+  labels_.push_back(-1);
+  return labels_.size() - 1;
+}
+
+void X86Assembler::bind(uint32_t label) {
+  assert(labels_[label] < 0);
+  labels_[label] = code_.size();
+}
+
+void X86Assembler::emit32(int32_t value) {
+  uint8_t bytes[sizeof(value)];
+  memcpy(bytes, &value, sizeof(value));
+  code_.insert(code_.end(), bytes, bytes + sizeof(value));
+}
+
+void X86Assembler::emit64(int64_t value) {
+  uint8_t bytes[sizeof(value)];
+  memcpy(bytes, &value, sizeof(value));
+  code_.insert(code_.end(), bytes, bytes + sizeof(value));
+}
+
+// REX prefix is omitted when it carries nothing
+void X86Assembler::rex(bool wide, uint8_t reg, uint8_t base) {
+  uint8_t prefix = 0x40 | (wide ? 8 : 0) | ((reg >> 3) << 2) | (base >> 3);
+  if (prefix != 0x40) {
+    emit(prefix);
+  }
+}
+
+void X86Assembler::modrm(uint8_t reg, uint8_t base) {
+  emit(0xC0 | ((reg & 7) << 3) | (base & 7));
+}
+
+// [base + disp32]; rsp and r12 as base need SIB byte
+void X86Assembler::memory(uint8_t reg, Register base, int32_t disp) {
+  emit(0x80 | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == RSP) {
+    emit(0x24);
+  }
+  emit32(disp);
+}
+
+// op r/m64, r64
+void X86Assembler::binary(uint8_t opcode, Register dst, Register src) {
+  rex(true, src, dst);
+  emit(opcode);
+  modrm(src, dst);
+}
+
+void X86Assembler::sse(uint8_t prefix, bool wide, uint8_t opcode, uint8_t reg, uint8_t rm) {
+  emit(prefix);
+  rex(wide, reg, rm);
+  emit(0x0F);
+  emit(opcode);
+  modrm(reg, rm);
+}
+
+void X86Assembler::sseMemory(uint8_t prefix, uint8_t opcode, uint8_t reg,
+                             Register base, int32_t disp) {
+  emit(prefix);
+  rex(false, reg, base);
+  emit(0x0F);
+  emit(opcode);
+  memory(reg, base, disp);
+}
+
+void X86Assembler::label32(uint32_t label) {
+  fixups_.push_back(std::make_pair(static_cast<uint32_t>(code_.size()), label));
+  emit32(0);
+}
+
+void X86Assembler::mov(Register dst, Register src) {
+  if (dst != src) {
+    binary(0x89, dst, src);
+  }
+}
+
+// Shortest form; never touches flags
+void X86Assembler::mov(Register dst, int64_t value) {
+  if (value >= 0 && value <= 0xFFFFFFFFLL) {
+    rex(false, 0, dst);
+    emit(0xB8 + (dst & 7));
+    emit32(static_cast<int32_t>(static_cast<uint32_t>(value)));
+  } else if (value >= -0x80000000LL && value <= 0x7FFFFFFFLL) {
+    rex(true, 0, dst);
+    emit(0xC7);
+    modrm(0, dst);
+    emit32(static_cast<int32_t>(value));
+  } else {
+    rex(true, 0, dst);
+    emit(0xB8 + (dst & 7));
+    emit64(value);
+  }
+}
+
+void X86Assembler::load(Register dst, Register base, int32_t disp) {
+  rex(true, dst, base);
+  emit(0x8B);
+  memory(dst, base, disp);
+}
+
+void X86Assembler::store(Register base, int32_t disp, Register src) {
+  rex(true, src, base);
+  emit(0x89);
+  memory(src, base, disp);
+}
+
+void X86Assembler::lea(Register dst, Register base, int32_t disp) {
+  rex(true, dst, base);
+  emit(0x8D);
+  memory(dst, base, disp);
+}
+
+void X86Assembler::add(Register dst, Register src) { binary(0x01, dst, src); }
+void X86Assembler::sub(Register dst, Register src) { binary(0x29, dst, src); }
+void X86Assembler::and_(Register dst, Register src) { binary(0x21, dst, src); }
+void X86Assembler::or_(Register dst, Register src) { binary(0x09, dst, src); }
+void X86Assembler::xor_(Register dst, Register src) { binary(0x31, dst, src); }
+void X86Assembler::cmp(Register left, Register right) { binary(0x39, left, right); }
+
+void X86Assembler::imul(Register dst, Register src) {
+  rex(true, dst, src);
+  emit(0x0F);
+  emit(0xAF);
+  modrm(dst, src);
+}
+
+void X86Assembler::addImm(Register dst, int32_t value) {
+  rex(true, 0, dst);
+  emit(0x81);
+  modrm(0, dst);
+  emit32(value);
+}
+
+void X86Assembler::subImm(Register dst, int32_t value) {
+  rex(true, 0, dst);
+  emit(0x81);
+  modrm(5, dst);
+  emit32(value);
+}
+
+void X86Assembler::neg(Register dst) {
+  rex(true, 0, dst);
+  emit(0xF7);
+  modrm(3, dst);
+}
+
+void X86Assembler::sar(Register dst, uint8_t shift) {
+  rex(true, 0, dst);
+  emit(0xC1);
+  modrm(7, dst);
+  emit(shift);
+}
+
+void X86Assembler::shr(Register dst, uint8_t shift) {
+  rex(true, 0, dst);
+  emit(0xC1);
+  modrm(5, dst);
+  emit(shift);
+}
+
+void X86Assembler::cqo() {
+  emit(0x48);
+  emit(0x99);
+}
+
+void X86Assembler::idiv(Register divisor) {
+  rex(true, 0, divisor);
+  emit(0xF7);
+  modrm(7, divisor);
+}
+
+void X86Assembler::setcc(Condition cc, Register dst) {
+  assert(dst <= RBX);
+  emit(0x0F);
+  emit(0x90 + cc);
+  modrm(0, dst);
+}
+
+void X86Assembler::movzxb(Register dst, Register src) {
+  assert(src <= RBX);
+  rex(false, dst, src);
+  emit(0x0F);
+  emit(0xB6);
+  modrm(dst, src);
+}
+
+void X86Assembler::movsd(XmmRegister dst, XmmRegister src) {
+  if (dst != src) {
+    sse(0xF2, false, 0x10, dst, src);
+  }
+}
+
+void X86Assembler::loadsd(XmmRegister dst, Register base, int32_t disp) {
+  sseMemory(0xF2, 0x10, dst, base, disp);
+}
+
+void X86Assembler::storesd(Register base, int32_t disp, XmmRegister src) {
+  sseMemory(0xF2, 0x11, src, base, disp);
+}
+
+void X86Assembler::movq(XmmRegister dst, Register src) { sse(0x66, true, 0x6E, dst, src); }
+void X86Assembler::movq(Register dst, XmmRegister src) { sse(0x66, true, 0x7E, src, dst); }
+void X86Assembler::addsd(XmmRegister dst, XmmRegister src) { sse(0xF2, false, 0x58, dst, src); }
+void X86Assembler::subsd(XmmRegister dst, XmmRegister src) { sse(0xF2, false, 0x5C, dst, src); }
+void X86Assembler::mulsd(XmmRegister dst, XmmRegister src) { sse(0xF2, false, 0x59, dst, src); }
+void X86Assembler::divsd(XmmRegister dst, XmmRegister src) { sse(0xF2, false, 0x5E, dst, src); }
+void X86Assembler::ucomisd(XmmRegister left, XmmRegister right) { sse(0x66, false, 0x2E, left, right); }
+void X86Assembler::cvtsi2sd(XmmRegister dst, Register src) { sse(0xF2, true, 0x2A, dst, src); }
+void X86Assembler::cvttsd2si(Register dst, XmmRegister src) { sse(0xF2, true, 0x2C, dst, src); }
+
+void X86Assembler::jmp(uint32_t label) {
+  emit(0xE9);
+  label32(label);
+}
+
+void X86Assembler::jcc(Condition cc, uint32_t label) {
+  emit(0x0F);
+  emit(0x80 + cc);
+  label32(label);
+}
+
+void X86Assembler::callIndirect(Register base) {
+  // [rsp], [rbp] and their extended twins need other encodings
+  assert((base & 7) != RSP && (base & 7) != RBP);
+  rex(false, 0, base);
+  emit(0xFF);
+  emit((2 << 3) | (base & 7));
+}
+
+void X86Assembler::jumpIndirect(Register base) {
+  assert((base & 7) != RSP && (base & 7) != RBP);
+  rex(false, 0, base);
+  emit(0xFF);
+  emit((4 << 3) | (base & 7));
+}
+
+void X86Assembler::push(Register src) {
+  rex(false, 0, src);
+  emit(0x50 + (src & 7));
+}
+
+void X86Assembler::pop(Register dst) {
+  rex(false, 0, dst);
+  emit(0x58 + (dst & 7));
+}
+
+void X86Assembler::ret() {
+  emit(0xC3);
+}
+
+const std::vector<uint8_t>& X86Assembler::finish() {
+  for (size_t i = 0; i < fixups_.size(); ++i) {
+    uint32_t position = fixups_[i].first;
+    int64_t target = labels_[fixups_[i].second];
+    assert(target >= 0);
+
+    int32_t offset = static_cast<int32_t>(target - (position + 4));
+    memcpy(&code_[position], &offset, sizeof(offset));
+  }
+
+  fixups_.clear();
+  return code_;
+}
+
+} // namespace mathvm
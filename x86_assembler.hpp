@@ -0,0 +1,110 @@
+#ifndef X86_ASSEMBLER_HPP
+#define X86_ASSEMBLER_HPP
+
+#include <vector>
+
+#include <stdint.h>
+
+namespace mathvm {
+
+enum Register {
+  RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+  R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+enum XmmRegister {
+  XMM0, XMM1, XMM2, XMM3, XMM4, XMM5, XMM6, XMM7,
+  XMM8, XMM9, XMM10, XMM11, XMM12, XMM13, XMM14, XMM15
+};
+
+// Condition codes in encoding order of jcc/setcc
+enum Condition {
+  CC_O, CC_NO, CC_B, CC_AE, CC_E, CC_NE, CC_BE, CC_A,
+  CC_S, CC_NS, CC_P, CC_NP, CC_L, CC_GE, CC_LE, CC_G
+};
+
+/*
+ * Emits x86-64 machine code into a byte buffer.
+ * Memory operands are always [base + disp32].
+ * Jumps go to labels, which may be bound after use;
+ * rel32 displacements are patched by finish.
+ */
+class X86Assembler {
+  std::vector<uint8_t> code_;
+  std::vector<int64_t> labels_; // position of bound label or -1
+  std::vector<std::pair<uint32_t, uint32_t> > fixups_; // rel32 position, label
+
+public:
+  uint32_t position() const { return code_.size(); }
+  uint32_t newLabel();
+  void bind(uint32_t label);
+
+  void mov(Register dst, Register src);
+  void mov(Register dst, int64_t value);
+  void load(Register dst, Register base, int32_t disp);
+  void store(Register base, int32_t disp, Register src);
+  void lea(Register dst, Register base, int32_t disp);
+
+  void add(Register dst, Register src);
+  void sub(Register dst, Register src);
+  void imul(Register dst, Register src);
+  void and_(Register dst, Register src);
+  void or_(Register dst, Register src);
+  void xor_(Register dst, Register src);
+  void cmp(Register left, Register right);
+  void addImm(Register dst, int32_t value);
+  void subImm(Register dst, int32_t value);
+  void neg(Register dst);
+  void sar(Register dst, uint8_t shift);
+  void shr(Register dst, uint8_t shift);
+  // rdx:rax = sign extension of rax
+  void cqo();
+  // rax = rdx:rax / divisor, rdx = remainder
+  void idiv(Register divisor);
+  // Low byte of dst = condition, only for RAX..RBX
+  void setcc(Condition cc, Register dst);
+  // dst = zero extended low byte of src, only for RAX..RBX
+  void movzxb(Register dst, Register src);
+
+  void movsd(XmmRegister dst, XmmRegister src);
+  void loadsd(XmmRegister dst, Register base, int32_t disp);
+  void storesd(Register base, int32_t disp, XmmRegister src);
+  void movq(XmmRegister dst, Register src);
+  void movq(Register dst, XmmRegister src);
+  void addsd(XmmRegister dst, XmmRegister src);
+  void subsd(XmmRegister dst, XmmRegister src);
+  void mulsd(XmmRegister dst, XmmRegister src);
+  void divsd(XmmRegister dst, XmmRegister src);
+  void ucomisd(XmmRegister left, XmmRegister right);
+  void cvtsi2sd(XmmRegister dst, Register src);
+  void cvttsd2si(Register dst, XmmRegister src);
+
+  void jmp(uint32_t label);
+  void jcc(Condition cc, uint32_t label);
+  // call [base]
+  void callIndirect(Register base);
+  // jmp [base]
+  void jumpIndirect(Register base);
+  void push(Register src);
+  void pop(Register dst);
+  void ret();
+
+  // Patches jumps, all used labels must be bound
+  const std::vector<uint8_t>& finish();
+
+private:
+  void emit(uint8_t byte) { code_.push_back(byte); }
+  void emit32(int32_t value);
+  void emit64(int64_t value);
+  void rex(bool wide, uint8_t reg, uint8_t base);
+  void modrm(uint8_t reg, uint8_t base);
+  void memory(uint8_t reg, Register base, int32_t disp);
+  void binary(uint8_t opcode, Register dst, Register src);
+  void sse(uint8_t prefix, bool wide, uint8_t opcode, uint8_t reg, uint8_t rm);
+  void sseMemory(uint8_t prefix, uint8_t opcode, uint8_t reg, Register base, int32_t disp);
+  void label32(uint32_t label);
+};
+
+} // namespace mathvm
+
+#endif